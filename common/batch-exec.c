@@ -0,0 +1,118 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "batch-exec.h"
+
+#define BATCH_EXEC_THREADS 8
+/* Don't bother the thread pool for small batches. */
+#define MIN_PARALLEL_ITEMS 16
+
+typedef struct Batch {
+    BatchItemFunc func;
+    void *user_data;
+    int n;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int next;
+    int running;
+} Batch;
+
+static GThreadPool *exec_pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void
+run_items (Batch *batch)
+{
+    int i;
+
+    while (1) {
+        pthread_mutex_lock (&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock (&batch->lock);
+
+        if (i >= batch->n)
+            break;
+        batch->func (batch->user_data, i);
+    }
+}
+
+static void
+exec_worker (void *data, void *user_data)
+{
+    Batch *batch = data;
+
+    run_items (batch);
+
+    pthread_mutex_lock (&batch->lock);
+    if (--batch->running == 0)
+        pthread_cond_signal (&batch->done_cond);
+    pthread_mutex_unlock (&batch->lock);
+}
+
+static void
+create_pool ()
+{
+    GError *error = NULL;
+
+    exec_pool = g_thread_pool_new (exec_worker, NULL,
+                                   BATCH_EXEC_THREADS, FALSE, &error);
+    if (error) {
+        g_warning ("Failed to create batch exec thread pool: %s.\n",
+                   error->message);
+        g_clear_error (&error);
+        exec_pool = NULL;
+    }
+}
+
+void
+batch_exec (BatchItemFunc func, void *user_data, int n)
+{
+    Batch batch;
+    int i, n_workers;
+    GError *error = NULL;
+
+    if (n < MIN_PARALLEL_ITEMS) {
+        for (i = 0; i < n; ++i)
+            func (user_data, i);
+        return;
+    }
+
+    pthread_once (&pool_once, create_pool);
+
+    memset (&batch, 0, sizeof(batch));
+    batch.func = func;
+    batch.user_data = user_data;
+    batch.n = n;
+    pthread_mutex_init (&batch.lock, NULL);
+    pthread_cond_init (&batch.done_cond, NULL);
+
+    n_workers = MIN (BATCH_EXEC_THREADS, n / MIN_PARALLEL_ITEMS);
+    for (i = 0; exec_pool && i < n_workers; ++i) {
+        pthread_mutex_lock (&batch.lock);
+        ++batch.running;
+        pthread_mutex_unlock (&batch.lock);
+
+        g_thread_pool_push (exec_pool, &batch, &error);
+        if (error) {
+            g_clear_error (&error);
+            pthread_mutex_lock (&batch.lock);
+            --batch.running;
+            pthread_mutex_unlock (&batch.lock);
+            break;
+        }
+    }
+
+    run_items (&batch);
+
+    pthread_mutex_lock (&batch.lock);
+    while (batch.running > 0)
+        pthread_cond_wait (&batch.done_cond, &batch.lock);
+    pthread_mutex_unlock (&batch.lock);
+
+    pthread_mutex_destroy (&batch.lock);
+    pthread_cond_destroy (&batch.done_cond);
+}
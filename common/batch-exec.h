@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef BATCH_EXEC_H
+#define BATCH_EXEC_H
+
+typedef void (*BatchItemFunc) (void *user_data, int i);
+
+/*
+ * Call @func (@user_data, i) for each i in [0, @n), using a thread pool
+ * shared by all callers. The calling thread also runs items, so this
+ * never waits on a busy pool. Returns when all items are done.
+ *
+ * Used by storage backends to overlap the latency of many small
+ * blocking operations, e.g. stat() of objects.
+ */
+void
+batch_exec (BatchItemFunc func, void *user_data, int n);
+
+#endif
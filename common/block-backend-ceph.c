@@ -9,9 +9,11 @@
 #include <event2/buffer.h>
 
 #include "utils.h"
+#include "batch-exec.h"
 
 #define CEPH_COMMIT_EA_NAME "commit"
 #define MAX_BUFFER_SIZE 1 << 20 /* Buffer 1MB data */
+#define MAX_AIO_REQUESTS 64
 
 struct _BHandle {
     char block_id[41];
@@ -182,6 +184,12 @@ block_backend_ceph_block_handle_free (BlockBackend *bend, BHandle *handle)
     g_free (handle);
 }
 
+const char *
+block_backend_ceph_get_block_id (BlockBackend *bend, BHandle *handle)
+{
+    return handle->block_id;
+}
+
 int
 block_backend_ceph_commit_block (BlockBackend *bend, BHandle *handle)
 {
@@ -280,6 +288,93 @@ block_backend_ceph_stat_block_by_handle (BlockBackend *bend,
     return block_backend_ceph_stat_block(bend, handle->block_id);
 }
 
+typedef struct ExistsBatch {
+    BlockBackend *bend;
+    const char  **block_ids;
+    gboolean     *exists;
+} ExistsBatch;
+
+static void
+check_block_exists (void *vbatch, int i)
+{
+    ExistsBatch *batch = vbatch;
+
+    batch->exists[i] = block_backend_ceph_block_exists (batch->bend,
+                                                        batch->block_ids[i]);
+}
+
+/*
+ * There is no async version of rados_getxattr(), so the checks are run
+ * in parallel from a thread pool instead.
+ */
+void
+block_backend_ceph_exists_many (BlockBackend *bend,
+                                const char **block_ids,
+                                int n_blocks,
+                                gboolean *exists)
+{
+    ExistsBatch batch = { bend, block_ids, exists };
+
+    batch_exec (check_block_exists, &batch, n_blocks);
+}
+
+/*
+ * Keep up to MAX_AIO_REQUESTS stat requests in flight.
+ */
+void
+block_backend_ceph_stat_many (BlockBackend *bend,
+                              const char **block_ids,
+                              int n_blocks,
+                              BMetadata **mds)
+{
+    CephPriv *priv = bend->be_priv;
+    rados_completion_t comps[MAX_AIO_REQUESTS];
+    uint64_t sizes[MAX_AIO_REQUESTS];
+    time_t mtimes[MAX_AIO_REQUESTS];
+    BMetadata *block_md;
+    int start, n, i, err;
+
+    for (start = 0; start < n_blocks; start += n) {
+        n = MIN (MAX_AIO_REQUESTS, n_blocks - start);
+
+        for (i = 0; i < n; ++i) {
+            mds[start + i] = NULL;
+            if (rados_aio_create_completion (NULL, NULL, NULL, &comps[i]) < 0) {
+                comps[i] = NULL;
+                continue;
+            }
+            err = rados_aio_stat (priv->io, block_ids[start + i], comps[i],
+                                  &sizes[i], &mtimes[i]);
+            if (err < 0) {
+                rados_aio_release (comps[i]);
+                comps[i] = NULL;
+            }
+        }
+
+        for (i = 0; i < n; ++i) {
+            if (!comps[i]) {
+                ccnet_warning ("[Block bend] Failed to stat block %s.\n",
+                               block_ids[start + i]);
+                continue;
+            }
+
+            rados_aio_wait_for_complete (comps[i]);
+            err = rados_aio_get_return_value (comps[i]);
+            rados_aio_release (comps[i]);
+            if (err < 0) {
+                ccnet_warning ("[Block bend] Failed to stat block %s.\n",
+                               block_ids[start + i]);
+                continue;
+            }
+
+            block_md = g_new0(BMetadata, 1);
+            memcpy (block_md->id, block_ids[start + i], 40);
+            block_md->size = (uint32_t)sizes[i];
+            mds[start + i] = block_md;
+        }
+    }
+}
+
 int
 block_backend_ceph_foreach_block (BlockBackend *bend,
                                   SeafBlockFunc process,
@@ -345,11 +440,14 @@ block_backend_ceph_new (const char *ceph_conf, const char *poolname)
     bend->read_block = block_backend_ceph_read_block;
     bend->write_block = block_backend_ceph_write_block;
     bend->commit_block = block_backend_ceph_commit_block;
+    bend->get_block_id = block_backend_ceph_get_block_id;
     bend->close_block = block_backend_ceph_close_block;
     bend->exists = block_backend_ceph_block_exists;
     bend->remove_block = block_backend_ceph_remove_block;
     bend->stat_block = block_backend_ceph_stat_block;
     bend->stat_block_by_handle = block_backend_ceph_stat_block_by_handle;
+    bend->exists_many = block_backend_ceph_exists_many;
+    bend->stat_many = block_backend_ceph_stat_many;
     bend->block_handle_free = block_backend_ceph_block_handle_free;
     bend->foreach_block = block_backend_ceph_foreach_block;
 
@@ -10,12 +10,15 @@
 
 #include "block-backend.h"
 #include "obj-store.h"
+#include "batch-exec.h"
 
 
 struct _BHandle {
     char    block_id[41];
     int     fd;
     int     rw_type;
+    /* Tmp file of a block being written, until it's committed. */
+    char   *tmp_path;
 };
 
 typedef struct {
@@ -35,6 +38,9 @@ get_tmp_file_path (BlockBackend *bend,
                    const char *basename,
                    char path[]);
 
+static int
+open_tmp_file (BlockBackend *bend, const char *block_id, char path[]);
+
 static BHandle *
 block_backend_fs_open_block (BlockBackend *bend,
                              const char *block_id,
@@ -52,8 +58,7 @@ block_backend_fs_open_block (BlockBackend *bend,
         get_block_path (bend, block_id, path);
         fd = g_open (path, O_RDONLY | O_BINARY, 0);
     } else {
-        get_tmp_file_path (bend, block_id, path);
-        fd = g_open (path, O_WRONLY | O_CREAT | O_BINARY, 0644);
+        fd = open_tmp_file (bend, block_id, path);
     }
 
     if (fd < 0) {
@@ -66,10 +71,27 @@ block_backend_fs_open_block (BlockBackend *bend,
     handle->fd = fd;
     memcpy (handle->block_id, block_id, 41);
     handle->rw_type = rw_type;
+    if (rw_type == BLOCK_WRITE)
+        handle->tmp_path = g_strdup (path);
 
     return handle;
 }
 
+static int
+block_backend_fs_open_block_fd (BlockBackend *bend, const char *block_id)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    get_block_path (bend, block_id, path);
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0)
+        ccnet_warning ("[block bend] failed to open block %s: %s, path is %s\n",
+                       block_id, strerror(errno), path);
+
+    return fd;
+}
+
 static int
 block_backend_fs_read_block (BlockBackend *bend,
                              BHandle *handle,
@@ -101,25 +123,38 @@ static void
 block_backend_fs_block_handle_free (BlockBackend *bend,
                                     BHandle *handle)
 {
+    /* Not committed, drop what was written. */
+    if (handle->tmp_path) {
+        g_unlink (handle->tmp_path);
+        g_free (handle->tmp_path);
+    }
     g_free (handle);
 }
 
+static const char *
+block_backend_fs_get_block_id (BlockBackend *bend,
+                               BHandle *handle)
+{
+    return handle->block_id;
+}
+
 static int
 block_backend_fs_commit_block (BlockBackend *bend,
                                BHandle *handle)
 {
-    char path[PATH_MAX], tmp_path[PATH_MAX];
+    char path[PATH_MAX];
 
     g_assert (handle->rw_type == BLOCK_WRITE);
 
     get_block_path (bend, handle->block_id, path);
-    get_tmp_file_path (bend, handle->block_id, tmp_path);
-    if (ccnet_rename (tmp_path, path) < 0) {
+    if (ccnet_rename (handle->tmp_path, path) < 0) {
         g_warning ("[block bend] failed to commit block %s: %s\n",
                    handle->block_id, strerror(errno));
         return -1;
     }
 
+    g_free (handle->tmp_path);
+    handle->tmp_path = NULL;
     return 0;
 }
     
@@ -184,6 +219,98 @@ block_backend_fs_stat_block_by_handle (BlockBackend *bend,
     return block_md;
 }
 
+typedef struct StatBatch {
+    BlockBackend *bend;
+    const char  **block_ids;
+    gboolean     *exists;
+    BMetadata   **mds;
+} StatBatch;
+
+static void
+check_block_exists (void *vbatch, int i)
+{
+    StatBatch *batch = vbatch;
+
+    batch->exists[i] = block_backend_fs_block_exists (batch->bend,
+                                                      batch->block_ids[i]);
+}
+
+static void
+stat_one_block (void *vbatch, int i)
+{
+    StatBatch *batch = vbatch;
+
+    batch->mds[i] = block_backend_fs_stat_block (batch->bend,
+                                                 batch->block_ids[i]);
+}
+
+static void
+block_backend_fs_exists_many (BlockBackend *bend,
+                              const char **block_ids,
+                              int n_blocks,
+                              gboolean *exists)
+{
+    StatBatch batch = { bend, block_ids, exists, NULL };
+
+    batch_exec (check_block_exists, &batch, n_blocks);
+}
+
+static void
+block_backend_fs_stat_many (BlockBackend *bend,
+                            const char **block_ids,
+                            int n_blocks,
+                            BMetadata **mds)
+{
+    StatBatch batch = { bend, block_ids, NULL, mds };
+
+    batch_exec (stat_one_block, &batch, n_blocks);
+}
+
+/*
+ * Blocks are written to tmp files and renamed into the block dir, the
+ * same way as open_block()/commit_block(), but without a handle per
+ * block.
+ */
+static int
+block_backend_fs_write_many (BlockBackend *bend,
+                             const char **block_ids,
+                             const void **bufs,
+                             const int *lens,
+                             int n_blocks)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    int fd;
+    int i;
+
+    for (i = 0; i < n_blocks; ++i) {
+        fd = open_tmp_file (bend, block_ids[i], tmp_path);
+        if (fd < 0) {
+            g_warning ("[block bend] failed to open block %s: %s\n",
+                       block_ids[i], strerror(errno));
+            return -1;
+        }
+
+        if (writen (fd, bufs[i], lens[i]) != lens[i]) {
+            g_warning ("[block bend] failed to write block %s: %s\n",
+                       block_ids[i], strerror(errno));
+            close (fd);
+            g_unlink (tmp_path);
+            return -1;
+        }
+        close (fd);
+
+        get_block_path (bend, block_ids[i], path);
+        if (ccnet_rename (tmp_path, path) < 0) {
+            g_warning ("[block bend] failed to commit block %s: %s\n",
+                       block_ids[i], strerror(errno));
+            g_unlink (tmp_path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int
 block_backend_fs_foreach_block (BlockBackend *bend,
                                 SeafBlockFunc process,
@@ -272,6 +399,28 @@ get_tmp_file_path (BlockBackend *bend,
     return path;
 }
 
+/*
+ * The same block may be written by several threads at the same time,
+ * e.g. by the CDC worker pool, so each writer gets its own tmp file.
+ */
+static int
+open_tmp_file (BlockBackend *bend, const char *block_id, char path[])
+{
+    int fd;
+
+    get_tmp_file_path (bend, block_id, path);
+    strcat (path, ".XXXXXX");
+
+    fd = g_mkstemp (path);
+#ifndef WIN32
+    /* mkstemp creates the file readable by the owner only. */
+    if (fd >= 0)
+        fchmod (fd, 0644);
+#endif
+
+    return fd;
+}
+
 static void
 init_block_dir (BlockBackend *bend)
 {
@@ -327,12 +476,17 @@ block_backend_fs_new (const char *block_dir, const char *tmp_dir)
     bend->read_block = block_backend_fs_read_block;
     bend->write_block = block_backend_fs_write_block;
     bend->commit_block = block_backend_fs_commit_block;
+    bend->get_block_id = block_backend_fs_get_block_id;
     bend->close_block = block_backend_fs_close_block;
     bend->exists = block_backend_fs_block_exists;
     bend->remove_block = block_backend_fs_remove_block;
     bend->stat_block = block_backend_fs_stat_block;
     bend->stat_block_by_handle = block_backend_fs_stat_block_by_handle;
+    bend->exists_many = block_backend_fs_exists_many;
+    bend->stat_many = block_backend_fs_stat_many;
     bend->block_handle_free = block_backend_fs_block_handle_free;
+    bend->open_block_fd = block_backend_fs_open_block_fd;
+    bend->write_many = block_backend_fs_write_many;
     bend->foreach_block = block_backend_fs_foreach_block;
 
     return bend;
@@ -27,8 +27,32 @@ struct BlockBackend {
     
     BMetadata* (*stat_block_by_handle) (BlockBackend *bend, BHandle *handle);
 
+    /* Batched versions of exists and stat_block. Results for @block_ids[i]
+     * are stored in @exists[i] or @mds[i] (NULL if the stat fails).
+     * Optional, the single block versions are called if NULL.
+     */
+    void     (*exists_many) (BlockBackend *bend, const char **block_ids,
+                             int n_blocks, gboolean *exists);
+
+    void     (*stat_many) (BlockBackend *bend, const char **block_ids,
+                           int n_blocks, BMetadata **mds);
+
+    /* Open a read-only file descriptor of the block, owned by the caller.
+     * Only set by backends that store blocks as plain files, so that
+     * block data can be sent with sendfile().
+     */
+    int      (*open_block_fd) (BlockBackend *bend, const char *block_id);
+
+    /* Write and commit @n_blocks blocks whose data are in memory.
+     * Optional, open/write/commit_block are called for each block if NULL.
+     */
+    int      (*write_many) (BlockBackend *bend, const char **block_ids,
+                            const void **bufs, const int *lens, int n_blocks);
+
     void     (*block_handle_free) (BlockBackend *bend, BHandle *handle);
 
+    const char* (*get_block_id) (BlockBackend *bend, BHandle *handle);
+
     int      (*foreach_block) (BlockBackend *bend, SeafBlockFunc process, void *user_data);
 
     void*    be_priv;           /* backend private field */
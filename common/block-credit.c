@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "block-credit.h"
+
+void *
+block_ack_packet_new (const uint32_t *acks, int n_acks, int credits,
+                      int *len)
+{
+    BlockAckPacket *pkt;
+
+    *len = sizeof(BlockAckPacket) + n_acks * sizeof(uint32_t);
+    pkt = g_malloc (*len);
+    pkt->n_acks = htonl ((uint32_t) n_acks);
+    pkt->credits = htonl ((uint32_t) credits);
+    if (n_acks > 0)
+        memcpy ((char *)pkt + sizeof(BlockAckPacket), acks,
+                n_acks * sizeof(uint32_t));
+
+    return pkt;
+}
+
+int
+block_ack_packet_parse (const BlockAckPacket *pkt, uint32_t *n_acks)
+{
+    int credits;
+
+    *n_acks = ntohl (pkt->n_acks);
+    credits = (int) ntohl (pkt->credits);
+    if (*n_acks > BLOCK_V3_WINDOW || credits < 0 || credits > BLOCK_V3_WINDOW)
+        return -1;
+
+    return credits;
+}
+
+gboolean
+block_acks_due (int n_pending, gboolean idle)
+{
+    return n_pending >= BLOCK_V3_ACK_BATCH || (n_pending > 0 && idle);
+}
+
+gboolean
+block_queue_refill_due (int n_pending)
+{
+    return n_pending <= BLOCK_V3_MAX_QUEUED / 2;
+}
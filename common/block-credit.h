@@ -0,0 +1,62 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_BLOCK_CREDIT_H
+#define SEAF_BLOCK_CREDIT_H
+
+#include <stdint.h>
+#include <glib.h>
+
+/*
+ * Credit window of block protocol v3 uploads, see
+ * processors/blocktx-common-impl-v2.h.
+ *
+ * The receiver grants BLOCK_V3_WINDOW credits when the connection is set
+ * up, and the sender spends one credit per block. Received blocks are
+ * acked in batches of up to BLOCK_V3_ACK_BATCH, or earlier when the
+ * connection goes idle. Each acked block returns a credit.
+ */
+#define BLOCK_V3_WINDOW         512
+#define BLOCK_V3_ACK_BATCH      32
+
+/* Blocks queued to one sender at most. The sender can't use more
+ * than the window, so it must not be larger. */
+#define BLOCK_V3_MAX_QUEUED     BLOCK_V3_WINDOW
+
+/* Followed by n_acks block indexes (uint32_t, network byte order). */
+typedef struct {
+    uint32_t n_acks;
+    uint32_t credits;
+} __attribute__((__packed__)) BlockAckPacket;
+
+/*
+ * Build the ack packet for @n_acks block indexes in network byte order,
+ * granting @credits. Returns the packet, to be freed with g_free(), and
+ * sets @len.
+ */
+void *
+block_ack_packet_new (const uint32_t *acks, int n_acks, int credits,
+                      int *len);
+
+/*
+ * Check the header of a received ack packet. Returns the credits it
+ * grants and sets @n_acks, or returns -1 if the header is not valid.
+ */
+int
+block_ack_packet_parse (const BlockAckPacket *pkt, uint32_t *n_acks);
+
+/*
+ * Whether the receiver should send the @n_pending acks it holds now.
+ * @idle is TRUE when there is no data to read.
+ */
+gboolean
+block_acks_due (int n_pending, gboolean idle);
+
+/*
+ * Whether more blocks should be queued to a sender which still has
+ * @n_pending blocks not acked. Refilling waits until half of the queue
+ * is free, scanning the block bitmap for every ack would cost too much.
+ */
+gboolean
+block_queue_refill_due (int n_pending);
+
+#endif
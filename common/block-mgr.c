@@ -14,12 +14,19 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
 #include "block-backend.h"
 
 #define SEAF_BLOCK_DIR "blocks"
 
+struct _SeafBlockManagerPriv {
+    /* Protects the journal fields below. */
+    pthread_mutex_t journal_lock;
+    int journal_fd;
+    gint64 journal_checked;
+};
 
 extern BlockBackend *
 block_backend_fs_new (const char *block_dir, const char *tmp_dir);
@@ -33,9 +40,19 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
 
     mgr = g_new0 (SeafBlockManager, 1);
     mgr->seaf = seaf;
+    mgr->priv = g_new0 (SeafBlockManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->journal_lock, NULL);
+    mgr->priv->journal_fd = -1;
 
 #ifdef SEAFILE_SERVER
     mgr->backend = load_block_backend(mgr->seaf->config);
+
+    char *gc_dir = g_build_filename (seaf_dir, GC_INDEX_DIR, NULL);
+    if (checkdir_with_mkdir (gc_dir) < 0)
+        g_warning ("[Block mgr] Failed to create gc dir %s.\n", gc_dir);
+    else
+        mgr->journal_path = g_build_filename (gc_dir, GC_BLOCK_JOURNAL, NULL);
+    g_free (gc_dir);
 #endif
     if (!mgr->backend) {
         char *block_dir;
@@ -51,6 +68,9 @@ seaf_block_manager_new (struct _SeafileSession *seaf,
     return mgr;
 
 onerror:
+    pthread_mutex_destroy (&mgr->priv->journal_lock);
+    g_free (mgr->priv);
+    g_free (mgr->journal_path);
     g_free (mgr);
 
     return NULL;
@@ -71,6 +91,22 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
     return mgr->backend->open_block (mgr->backend, block_id, rw_type);
 }
 
+gboolean
+seaf_block_manager_has_block_fd (SeafBlockManager *mgr)
+{
+    return (mgr->backend->open_block_fd != NULL);
+}
+
+int
+seaf_block_manager_open_block_fd (SeafBlockManager *mgr,
+                                  const char *block_id)
+{
+    if (!mgr->backend->open_block_fd)
+        return -1;
+
+    return mgr->backend->open_block_fd (mgr->backend, block_id);
+}
+
 int
 seaf_block_manager_read_block (SeafBlockManager *mgr,
                                BlockHandle *handle,
@@ -101,11 +137,138 @@ seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
     return mgr->backend->block_handle_free (mgr->backend, handle);
 }
 
+/*
+ * Make sure priv->journal_fd refers to the current journal. GC rotates
+ * the journal by renaming it, so the file is reopened if the path no
+ * longer refers to the open file. That's only checked every
+ * GC_JOURNAL_REOPEN_INTERVAL seconds, instead of opening the file
+ * on each write.
+ */
+static int
+get_journal_fd (SeafBlockManager *mgr)
+{
+    SeafBlockManagerPriv *priv = mgr->priv;
+    gint64 now = (gint64)time(NULL);
+    struct stat st, fd_st;
+
+    if (priv->journal_fd >= 0 &&
+        now - priv->journal_checked < GC_JOURNAL_REOPEN_INTERVAL)
+        return priv->journal_fd;
+    priv->journal_checked = now;
+
+    if (priv->journal_fd >= 0) {
+        if (g_stat (mgr->journal_path, &st) == 0 &&
+            fstat (priv->journal_fd, &fd_st) == 0 &&
+            st.st_ino == fd_st.st_ino && st.st_dev == fd_st.st_dev)
+            return priv->journal_fd;
+        close (priv->journal_fd);
+    }
+
+    priv->journal_fd = g_open (mgr->journal_path,
+                               O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0644);
+    if (priv->journal_fd < 0)
+        g_warning ("[Block mgr] Failed to open block journal: %s.\n",
+                   strerror(errno));
+
+    return priv->journal_fd;
+}
+
+/*
+ * Append the block id to the block journal, so that GC only checks
+ * blocks added since last run, instead of scanning the whole block store.
+ * A lost record only means a garbage block may not be collected.
+ */
+static void
+record_new_blocks (SeafBlockManager *mgr, const char **block_ids, int n_blocks)
+{
+    GString *buf = g_string_new (NULL);
+    gint64 now = (gint64)time(NULL);
+    int fd, i;
+
+    for (i = 0; i < n_blocks; ++i)
+        g_string_append_printf (buf, "%s %"G_GINT64_FORMAT"\n",
+                                block_ids[i], now);
+
+    pthread_mutex_lock (&mgr->priv->journal_lock);
+    fd = get_journal_fd (mgr);
+    if (fd >= 0 && writen (fd, buf->str, buf->len) != buf->len)
+        g_warning ("[Block mgr] Failed to record %d blocks.\n", n_blocks);
+    pthread_mutex_unlock (&mgr->priv->journal_lock);
+
+    g_string_free (buf, TRUE);
+}
+
+static void
+record_new_block (SeafBlockManager *mgr, const char *block_id)
+{
+    record_new_blocks (mgr, &block_id, 1);
+}
+
 int
 seaf_block_manager_commit_block (SeafBlockManager *mgr,
                                  BlockHandle *handle)
 {
-    return mgr->backend->commit_block (mgr->backend, handle);
+    int ret;
+
+    ret = mgr->backend->commit_block (mgr->backend, handle);
+    if (ret == 0 && mgr->journal_path)
+        record_new_block (mgr,
+                          mgr->backend->get_block_id (mgr->backend, handle));
+
+    return ret;
+}
+
+static int
+write_block_from_buf (SeafBlockManager *mgr,
+                      const char *block_id,
+                      const void *buf, int len)
+{
+    BlockBackend *bend = mgr->backend;
+    BlockHandle *handle;
+    int ret = -1;
+
+    handle = bend->open_block (bend, block_id, BLOCK_WRITE);
+    if (!handle)
+        return -1;
+
+    if (bend->write_block (bend, handle, buf, len) == len &&
+        bend->close_block (bend, handle) == 0) {
+        ret = bend->commit_block (bend, handle);
+    } else {
+        g_warning ("[Block mgr] Failed to write block %s.\n", block_id);
+        bend->close_block (bend, handle);
+    }
+
+    bend->block_handle_free (bend, handle);
+    return ret;
+}
+
+int
+seaf_block_manager_write_blocks (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 const void **bufs,
+                                 const int *lens,
+                                 int n_blocks)
+{
+    int i;
+
+    if (n_blocks == 0)
+        return 0;
+
+    if (mgr->backend->write_many) {
+        if (mgr->backend->write_many (mgr->backend, block_ids,
+                                      bufs, lens, n_blocks) < 0)
+            return -1;
+    } else {
+        for (i = 0; i < n_blocks; ++i)
+            if (write_block_from_buf (mgr, block_ids[i], bufs[i], lens[i]) < 0)
+                return -1;
+    }
+
+    if (mgr->journal_path)
+        record_new_blocks (mgr, block_ids, n_blocks);
+
+    return 0;
 }
     
 gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
@@ -114,6 +277,23 @@ gboolean seaf_block_manager_block_exists (SeafBlockManager *mgr,
     return mgr->backend->exists (mgr->backend, block_id);
 }
 
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists)
+{
+    int i;
+
+    if (mgr->backend->exists_many) {
+        mgr->backend->exists_many (mgr->backend, block_ids, n_blocks, exists);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+        exists[i] = mgr->backend->exists (mgr->backend, block_ids[i]);
+}
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *block_id)
@@ -135,6 +315,23 @@ seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
     return mgr->backend->stat_block_by_handle (mgr->backend, handle);
 }
 
+void
+seaf_block_manager_stat_blocks (SeafBlockManager *mgr,
+                                const char **block_ids,
+                                int n_blocks,
+                                BlockMetadata **mds)
+{
+    int i;
+
+    if (mgr->backend->stat_many) {
+        mgr->backend->stat_many (mgr->backend, block_ids, n_blocks, mds);
+        return;
+    }
+
+    for (i = 0; i < n_blocks; ++i)
+        mds[i] = mgr->backend->stat_block (mgr->backend, block_ids[i]);
+}
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
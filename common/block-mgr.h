@@ -13,10 +13,29 @@ struct _SeafileSession;
 
 typedef struct _SeafBlockManager SeafBlockManager;
 
+/* Dir for GC index files, relative to seafile data dir. */
+#define GC_INDEX_DIR "gc"
+/* Journal of newly committed blocks, in GC_INDEX_DIR.
+ * Each line is "<block id> <commit time>".
+ */
+#define GC_BLOCK_JOURNAL "block-journal"
+/* The journal stays open between writes. Writers check whether GC has
+ * rotated it at most this often (in seconds), so GC waits this long
+ * after rotating before reading the old journal.
+ */
+#define GC_JOURNAL_REOPEN_INTERVAL 2
+
+typedef struct _SeafBlockManagerPriv SeafBlockManagerPriv;
+
 struct _SeafBlockManager {
     struct _SeafileSession *seaf;
 
     struct BlockBackend *backend;
+
+    /* Path of GC_BLOCK_JOURNAL, NULL if new blocks are not recorded. */
+    char *journal_path;
+
+    SeafBlockManagerPriv *priv;
 };
 
 
@@ -36,6 +55,21 @@ seaf_block_manager_open_block (SeafBlockManager *mgr,
                                const char *block_id,
                                int rw_type);
 
+/*
+ * Whether blocks can be opened as plain file descriptors with
+ * seaf_block_manager_open_block_fd().
+ */
+gboolean
+seaf_block_manager_has_block_fd (SeafBlockManager *mgr);
+
+/*
+ * Open a read-only file descriptor of a block. The caller should close it.
+ * Returns -1 on error or if the backend doesn't support it.
+ */
+int
+seaf_block_manager_open_block_fd (SeafBlockManager *mgr,
+                                  const char *block_id);
+
 /*
  * Read data from a block.
  * The semantics is similar to readn.
@@ -93,10 +127,34 @@ void
 seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
                                       BlockHandle *handle);
 
+/*
+ * Write and commit @n_blocks blocks whose data are in memory, e.g. many
+ * small blocks received in a row. The backend may write them in a batch,
+ * which is much faster than writing the blocks one by one.
+ * Returns 0 if all the blocks are committed.
+ */
+int
+seaf_block_manager_write_blocks (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 const void **bufs,
+                                 const int *lens,
+                                 int n_blocks);
+
 gboolean 
 seaf_block_manager_block_exists (SeafBlockManager *mgr,
                                  const char *block_id);
 
+/*
+ * Check existence of @n_blocks blocks at once. Result for block_ids[i]
+ * is stored in exists[i]. This is much faster than checking blocks one
+ * by one on backends with high per-request latency.
+ */
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists);
+
 int
 seaf_block_manager_remove_block (SeafBlockManager *mgr,
                                  const char *block_id);
@@ -109,6 +167,16 @@ BlockMetadata *
 seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
                                          BlockHandle *handle);
 
+/*
+ * Stat @n_blocks blocks at once. mds[i] is set to NULL if block_ids[i]
+ * can't be stat'ed. Returned metadata should be freed by the caller.
+ */
+void
+seaf_block_manager_stat_blocks (SeafBlockManager *mgr,
+                                const char **block_ids,
+                                int n_blocks,
+                                BlockMetadata **mds);
+
 int
 seaf_block_manager_foreach_block (SeafBlockManager *mgr,
                                   SeafBlockFunc process,
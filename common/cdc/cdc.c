@@ -7,6 +7,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <glib/gstdio.h>
 
 #include "cdc.h"
@@ -31,7 +32,13 @@
 #endif
 #endif //HAVE_ADLER
 
-#define READ_SIZE 1024 * 4
+/* The read buffer holds 2 max-sized chunks, so that data is
+ * only moved to the buffer head once per block_max_sz bytes.
+ */
+#define READ_BUF_CHUNKS 2
+
+/* Upper bound of chunk data queued for the worker threads of one file. */
+#define MAX_PENDING_BYTES (64 * 1024 * 1024)
 
 #define BYTE_TO_HEX(b)  (((b)>=10)?('a'+b-10):('0'+b))
 
@@ -124,9 +131,11 @@ static int default_write_chunk (CDCDescriptor *chunk_descr)
     return ret;
 }
 
-static int init_cdc_file_descriptor (int fd, CDCFileDescriptor *file_descr)
+static int init_cdc_file_descriptor (int fd,
+                                     CDCFileDescriptor *file_descr,
+                                     uint64_t *file_size,
+                                     uint32_t *max_block_nr)
 {
-    int max_block_nr = 0;
     int block_min_sz = 0;
     struct stat sb;
 
@@ -146,109 +155,602 @@ static int init_cdc_file_descriptor (int fd, CDCFileDescriptor *file_descr)
         return -1;
     }
 
+    *file_size = sb.st_size;
     block_min_sz = file_descr->block_min_sz;
-    max_block_nr = ((sb.st_size + block_min_sz - 1) / block_min_sz);
+    *max_block_nr = ((sb.st_size + block_min_sz - 1) / block_min_sz) + 1;
     file_descr->blk_sha1s = (uint8_t *)calloc (sizeof(uint8_t),
-                                               max_block_nr * CHECKSUM_LENGTH);
+                                               *max_block_nr * CHECKSUM_LENGTH);
+    if (!file_descr->blk_sha1s)
+        return -1;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    return 0;
+}
+
+/*
+ * Boundary scanning.
+ *
+ * Each function returns the length of the next chunk in buf[0, len),
+ * where len is at most block_max_sz. A chunk is cut at block_max_sz if
+ * no boundary is found.
+ */
+
+#if defined HAVE_ADLER || defined HAVE_SRABIN
+static int
+find_boundary (const char *buf, int start, int len, int win_sz,
+               unsigned int mask, unsigned int value)
+{
+    unsigned int fingerprint;
+    int cur;
+
+    fingerprint = finger ((char *)buf + start - win_sz + 1, win_sz);
+    if ((fingerprint & mask) == value)
+        return start + 1;
+
+    for (cur = start + 1; cur < len; ++cur) {
+        fingerprint = rolling_finger (fingerprint, win_sz,
+                                      buf[cur - win_sz], buf[cur]);
+        if ((fingerprint & mask) == value)
+            return cur + 1;
+    }
+
+    return len;
+}
+#else
+#define find_boundary rabin_find_boundary
+#endif
+
+static int
+rabin_next_chunk (CDCFileDescriptor *file_descr, const char *buf, int len)
+{
+    uint32_t block_mask = file_descr->block_sz - 1;
+
+    if (len < file_descr->block_min_sz)
+        return len;
+
+    return find_boundary (buf, file_descr->block_min_sz - 1, len,
+                          BLOCK_WIN_SZ, block_mask, BREAK_VALUE & block_mask);
+}
+
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void
+init_gear_table ()
+{
+    /* splitmix64 with a fixed seed, so that the table never changes. */
+    uint64_t x = 0x5eaf11e5eaf11e00ULL;
+    uint64_t z;
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Gear hash only needs a shift, an add and a table lookup per byte.
+ * Bytes older than 64 positions are shifted out of the hash, so the
+ * boundaries only depend on the last 64 bytes, like a rolling window.
+ * The mask uses the high bits, which mix in the whole window.
+ */
+static int
+gear_next_chunk (CDCFileDescriptor *file_descr, const char *buf, int len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t fp = 0, mask;
+    int bits = 0, i;
+
+    if (len <= file_descr->block_min_sz)
+        return len;
+
+    while (((uint32_t)1 << (bits + 1)) <= file_descr->block_sz && bits < 31)
+        ++bits;
+    mask = (((uint64_t)1 << bits) - 1) << (64 - bits);
+
+    i = file_descr->block_min_sz - 64;
+    if (i < 0)
+        i = 0;
+    for (; i < file_descr->block_min_sz - 1; ++i)
+        fp = (fp << 1) + gear_table[p[i]];
+
+    for (; i < len; ++i) {
+        fp = (fp << 1) + gear_table[p[i]];
+        if (!(fp & mask))
+            return i + 1;
+    }
+
+    return len;
+}
+
+/*
+ * Worker pool for hashing, encrypting and writing chunks.
+ * The pool is shared by all files, chunks of one file are tracked by
+ * a ChunkPipeline.
+ */
+
+typedef struct ChunkPipeline {
+    CDCFileDescriptor   *file_descr;
+    struct SeafileCrypt *crypt;
+    gboolean             write_data;
+
+    pthread_mutex_t      lock;
+    pthread_cond_t       cond;
+    int                  n_pending;
+    uint64_t             pending_bytes;
+    gboolean             error;
+
+    /* ChunkTask's in file order. */
+    GPtrArray           *tasks;
+} ChunkPipeline;
+
+typedef struct ChunkTask {
+    ChunkPipeline *pipeline;
+    CDCDescriptor  chunk;
+} ChunkTask;
+
+static GThreadPool *chunk_tpool;
+static pthread_once_t chunk_tpool_once = PTHREAD_ONCE_INIT;
+
+static void
+chunk_worker (void *data, void *user_data)
+{
+    ChunkTask *task = data;
+    ChunkPipeline *pipeline = task->pipeline;
+    CDCFileDescriptor *file_descr = pipeline->file_descr;
+    int ret;
+
+    ret = file_descr->write_block (&task->chunk,
+                                   pipeline->crypt,
+                                   task->chunk.checksum,
+                                   pipeline->write_data);
+
+    free (task->chunk.block_buf);
+    task->chunk.block_buf = NULL;
+
+    pthread_mutex_lock (&pipeline->lock);
+    if (ret < 0)
+        pipeline->error = TRUE;
+    pipeline->n_pending--;
+    pipeline->pending_bytes -= task->chunk.len;
+    pthread_cond_signal (&pipeline->cond);
+    pthread_mutex_unlock (&pipeline->lock);
+}
+
+static void
+create_chunk_tpool ()
+{
+    GError *error = NULL;
+
+    chunk_tpool = g_thread_pool_new (chunk_worker, NULL,
+                                     CDC_DEFAULT_WORKERS, FALSE, &error);
+    if (error) {
+        g_warning ("Failed to create chunk thread pool: %s.\n", error->message);
+        g_clear_error (&error);
+        chunk_tpool = NULL;
+    }
+}
+
+static void
+pipeline_init (ChunkPipeline *pipeline,
+               CDCFileDescriptor *file_descr,
+               struct SeafileCrypt *crypt,
+               gboolean write_data)
+{
+    memset (pipeline, 0, sizeof(ChunkPipeline));
+    pipeline->file_descr = file_descr;
+    pipeline->crypt = crypt;
+    pipeline->write_data = write_data;
+    pthread_mutex_init (&pipeline->lock, NULL);
+    pthread_cond_init (&pipeline->cond, NULL);
+    pipeline->tasks = g_ptr_array_new_with_free_func (g_free);
+}
+
+static void
+pipeline_destroy (ChunkPipeline *pipeline)
+{
+    pthread_mutex_destroy (&pipeline->lock);
+    pthread_cond_destroy (&pipeline->cond);
+    g_ptr_array_free (pipeline->tasks, TRUE);
+}
+
+/* Returns -1 if any chunk failed. */
+static int
+pipeline_submit (ChunkPipeline *pipeline,
+                 const char *data,
+                 uint32_t len,
+                 uint64_t offset)
+{
+    CDCFileDescriptor *file_descr = pipeline->file_descr;
+    ChunkTask *task;
+    gboolean error;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (!pipeline->error &&
+           pipeline->n_pending > 0 &&
+           (pipeline->n_pending >= file_descr->n_workers ||
+            pipeline->pending_bytes + len > MAX_PENDING_BYTES))
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    error = pipeline->error;
+    if (!error) {
+        pipeline->n_pending++;
+        pipeline->pending_bytes += len;
+    }
+    pthread_mutex_unlock (&pipeline->lock);
+
+    if (error)
+        return -1;
+
+    task = g_new0 (ChunkTask, 1);
+    task->pipeline = pipeline;
+    task->chunk.offset = offset;
+    task->chunk.len = len;
+    task->chunk.user_data = file_descr->user_data;
+    task->chunk.block_buf = malloc (len > 0 ? len : 1);
+    memcpy (task->chunk.block_buf, data, len);
+    g_ptr_array_add (pipeline->tasks, task);
+
+    g_thread_pool_push (chunk_tpool, task, NULL);
 
     return 0;
 }
 
-#define WRITE_CDC_BLOCK(block_sz, write_data)                \
-do {                                                         \
-    int _block_sz = block_sz;                                \
-    chunk_descr.len = _block_sz;                             \
-    chunk_descr.offset = offset;                             \
-    ret = file_descr->write_block (&chunk_descr,             \
-            crypt, chunk_descr.checksum,                     \
-                                   (write_data));            \
-    if (ret < 0)                                             \
-        return -1;                                           \
-    memcpy (file_descr->blk_sha1s +                          \
-            file_descr->block_nr * CHECKSUM_LENGTH,          \
-            chunk_descr.checksum, CHECKSUM_LENGTH);          \
-    SHA1_Update (&file_ctx, chunk_descr.checksum, 20);       \
-    file_descr->block_nr++;                                  \
-    offset += _block_sz;                                     \
-                                                             \
-    memmove (buf, buf + _block_sz, tail - _block_sz +1);     \
-    tail = tail - _block_sz;                                 \
-    cur = 0;                                                 \
-    break;                                                   \
-}while(0);
-
-/* content-defined chunking */
+/* Wait for all chunks and collect checksums in file order. */
+static int
+pipeline_finish (ChunkPipeline *pipeline)
+{
+    CDCFileDescriptor *file_descr = pipeline->file_descr;
+    ChunkTask *task;
+    int i;
+
+    pthread_mutex_lock (&pipeline->lock);
+    while (pipeline->n_pending > 0)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+    pthread_mutex_unlock (&pipeline->lock);
+
+    if (pipeline->error)
+        return -1;
+
+    for (i = 0; i < pipeline->tasks->len; ++i) {
+        task = g_ptr_array_index (pipeline->tasks, i);
+        memcpy (file_descr->blk_sha1s + i * CHECKSUM_LENGTH,
+                task->chunk.checksum, CHECKSUM_LENGTH);
+    }
+
+    return 0;
+}
+
+static int
+add_block_checksum (CDCFileDescriptor *file_descr,
+                    uint32_t *max_block_nr,
+                    const uint8_t *checksum)
+{
+    uint8_t *new_sha1s;
+
+    /* The file may grow while being chunked. */
+    if (file_descr->block_nr >= *max_block_nr) {
+        new_sha1s = realloc (file_descr->blk_sha1s,
+                             *max_block_nr * 2 * CHECKSUM_LENGTH);
+        if (!new_sha1s)
+            return -1;
+        file_descr->blk_sha1s = new_sha1s;
+        *max_block_nr *= 2;
+    }
+
+    if (checksum)
+        memcpy (file_descr->blk_sha1s +
+                file_descr->block_nr * CHECKSUM_LENGTH,
+                checksum, CHECKSUM_LENGTH);
+    file_descr->block_nr++;
+
+    return 0;
+}
+
+/*
+ * content-defined chunking
+ *
+ * The file is read into a buffer of READ_BUF_CHUNKS * block_max_sz bytes.
+ * Chunks are cut from the buffer without moving data; remaining data is
+ * moved to the buffer head only when less than a max-sized chunk is left.
+ * Chunk boundaries don't depend on how the file is read.
+ *
+ * If n_workers is more than 1, write_block is called for several chunks in
+ * parallel in a thread pool, while this thread keeps reading and scanning.
+ * Checksums are still stored in blk_sha1s in file order.
+ */
 int file_chunk_cdc(int fd_src,
                    CDCFileDescriptor *file_descr,
                    SeafileCrypt *crypt,
                    gboolean write_data)
 {
-    char *buf;
+    char *buf = NULL;
     uint32_t buf_sz;
+    uint32_t max_block_nr = 0;
+    uint64_t file_size = 0;
     SHA_CTX file_ctx;
     CDCDescriptor chunk_descr;
-    SHA1_Init (&file_ctx);
-
-    init_cdc_file_descriptor (fd_src, file_descr);
-    uint32_t block_min_sz = file_descr->block_min_sz;
-    uint32_t block_mask = file_descr->block_sz - 1;
-
-    int fingerprint = 0;
-    int offset = 0;
-    int ret = 0;
-    int tail, cur, rsize;
+    ChunkPipeline pipeline;
+    gboolean parallel = FALSE;
+    gboolean eof = FALSE;
+    uint64_t offset = 0;
+    uint32_t head = 0, tail = 0, avail, len;
+    int n, ret = 0;
+
+    if (init_cdc_file_descriptor (fd_src, file_descr,
+                                  &file_size, &max_block_nr) < 0)
+        return -1;
 
-    buf_sz = file_descr->block_max_sz;
-    buf = chunk_descr.block_buf = malloc (buf_sz);
+    buf_sz = file_descr->block_max_sz * READ_BUF_CHUNKS;
+    buf = malloc (buf_sz);
     if (!buf)
         return -1;
 
-    tail = cur = 0;
+    /* Files of one chunk are not worth the thread switches. */
+    if (file_descr->n_workers > 1 && file_size > file_descr->block_max_sz) {
+        pthread_once (&chunk_tpool_once, create_chunk_tpool);
+        parallel = (chunk_tpool != NULL);
+    }
+    if (parallel)
+        pipeline_init (&pipeline, file_descr, crypt, write_data);
+
+    if (file_descr->algo == CDC_ALGO_GEAR)
+        pthread_once (&gear_once, init_gear_table);
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.user_data = file_descr->user_data;
+
     while (1) {
-        if (cur < block_min_sz) {
-            rsize = block_min_sz - cur + READ_SIZE;
-        } else {
-            rsize = (buf_sz - tail < READ_SIZE) ? (buf_sz - tail) : READ_SIZE;
-        }
-        ret = readn (fd_src, buf + tail, rsize);
-        if (ret < 0) {
-            free (buf);
-            return -1;
-        }
-        tail = tail + ret;
-        if (tail < block_min_sz || cur >= tail) {
-            if (tail > 0)
-                WRITE_CDC_BLOCK (tail, write_data);
-            break;
+        avail = tail - head;
+
+        /* Make sure a max-sized chunk can be scanned. */
+        if (!eof && avail < file_descr->block_max_sz) {
+            if (head > 0) {
+                memmove (buf, buf + head, avail);
+                head = 0;
+                tail = avail;
+            }
+            n = readn (fd_src, buf + tail, buf_sz - tail);
+            if (n < 0) {
+                ret = -1;
+                break;
+            }
+            if (n < buf_sz - tail)
+                eof = TRUE;
+            tail += n;
+            avail = tail - head;
         }
 
-        if (cur < block_min_sz - 1)
-            cur = block_min_sz - 1;
+        if (avail == 0)
+            break;
 
-        while (cur < tail) {
-            fingerprint = (cur == block_min_sz - 1) ?
-                finger(buf + cur - BLOCK_WIN_SZ + 1, BLOCK_WIN_SZ) :
-                rolling_finger (fingerprint, BLOCK_WIN_SZ, 
-                                *(buf+cur-BLOCK_WIN_SZ), *(buf + cur));
+        len = (avail < file_descr->block_max_sz) ? avail : file_descr->block_max_sz;
+        if (file_descr->algo == CDC_ALGO_GEAR)
+            len = gear_next_chunk (file_descr, buf + head, len);
+        else
+            len = rabin_next_chunk (file_descr, buf + head, len);
 
-            /* get a chunk, write block info to chunk file */
-            if (((fingerprint & block_mask) ==  ((BREAK_VALUE & block_mask)))
-                || cur + 1 >= file_descr->block_max_sz) {
-                WRITE_CDC_BLOCK (cur + 1, write_data);
+        if (parallel) {
+            if (pipeline_submit (&pipeline, buf + head, len, offset) < 0 ||
+                add_block_checksum (file_descr, &max_block_nr, NULL) < 0) {
+                ret = -1;
+                break;
+            }
+        } else {
+            chunk_descr.block_buf = buf + head;
+            chunk_descr.len = len;
+            chunk_descr.offset = offset;
+            if (file_descr->write_block (&chunk_descr, crypt,
+                                         chunk_descr.checksum,
+                                         write_data) < 0 ||
+                add_block_checksum (file_descr, &max_block_nr,
+                                    chunk_descr.checksum) < 0) {
+                ret = -1;
                 break;
-            } else {
-                cur ++;
             }
         }
+
+        offset += len;
+        head += len;
     }
 
-    SHA1_Final (file_descr->file_sum, &file_ctx);
+    if (parallel) {
+        if (pipeline_finish (&pipeline) < 0)
+            ret = -1;
+        pipeline_destroy (&pipeline);
+    }
 
     free (buf);
 
+    if (ret < 0)
+        return -1;
+
+    SHA1_Init (&file_ctx);
+    SHA1_Update (&file_ctx, file_descr->blk_sha1s,
+                 file_descr->block_nr * CHECKSUM_LENGTH);
+    SHA1_Final (file_descr->file_sum, &file_ctx);
+
     return 0;
 }
 
+/*
+ * Incremental chunking.
+ *
+ * Data is appended to a buffer of READ_BUF_CHUNKS * block_max_sz bytes.
+ * Like file_chunk_cdc(), a chunk is only cut when a max-sized chunk can
+ * be scanned or at the end of the file, so the boundaries are the same
+ * as chunking the whole file at once. write_block is called in the
+ * thread that feeds the data.
+ */
+struct _CDCStream {
+    CDCFileDescriptor   *file_descr;
+    struct SeafileCrypt *crypt;
+    gboolean             write_data;
+
+    char                *buf;
+    uint32_t             buf_sz;
+    uint32_t             head;
+    uint32_t             tail;
+
+    uint32_t             max_block_nr;
+    /* File offset of buf[head]. */
+    uint64_t             offset;
+};
+
+CDCStream *
+cdc_stream_new (CDCFileDescriptor *file_descr,
+                struct SeafileCrypt *crypt,
+                gboolean write_data,
+                uint64_t offset)
+{
+    CDCStream *stream;
+    uint8_t *sha1s;
+
+    if (file_descr->block_min_sz <= 0)
+        file_descr->block_min_sz = BLOCK_MIN_SZ;
+    if (file_descr->block_max_sz <= 0)
+        file_descr->block_max_sz = BLOCK_MAX_SZ;
+    if (file_descr->block_sz <= 0)
+        file_descr->block_sz = BLOCK_SZ;
+    if (file_descr->write_block == NULL)
+        file_descr->write_block = (WriteblockFunc)default_write_chunk;
+
+    stream = calloc (1, sizeof(CDCStream));
+    if (!stream)
+        return NULL;
+
+    /* Checksums of the chunks before @offset may already be filled in. */
+    stream->max_block_nr = file_descr->block_nr + 16;
+    sha1s = realloc (file_descr->blk_sha1s,
+                     stream->max_block_nr * CHECKSUM_LENGTH);
+    stream->buf_sz = file_descr->block_max_sz * READ_BUF_CHUNKS;
+    stream->buf = malloc (stream->buf_sz);
+    if (!sha1s || !stream->buf) {
+        if (sha1s)
+            file_descr->blk_sha1s = sha1s;
+        free (stream->buf);
+        free (stream);
+        return NULL;
+    }
+    file_descr->blk_sha1s = sha1s;
+
+    stream->file_descr = file_descr;
+    stream->crypt = crypt;
+    stream->write_data = write_data;
+    stream->offset = offset;
+
+    if (file_descr->algo == CDC_ALGO_GEAR)
+        pthread_once (&gear_once, init_gear_table);
+
+    return stream;
+}
+
+/* Cut one chunk from the head of the buffer. */
+static int
+stream_cut_chunk (CDCStream *stream)
+{
+    CDCFileDescriptor *file_descr = stream->file_descr;
+    CDCDescriptor chunk_descr;
+    uint32_t avail = stream->tail - stream->head, len;
+
+    len = (avail < file_descr->block_max_sz) ? avail : file_descr->block_max_sz;
+    if (file_descr->algo == CDC_ALGO_GEAR)
+        len = gear_next_chunk (file_descr, stream->buf + stream->head, len);
+    else
+        len = rabin_next_chunk (file_descr, stream->buf + stream->head, len);
+
+    memset (&chunk_descr, 0, sizeof(chunk_descr));
+    chunk_descr.block_buf = stream->buf + stream->head;
+    chunk_descr.len = len;
+    chunk_descr.offset = stream->offset;
+    chunk_descr.user_data = file_descr->user_data;
+    if (file_descr->write_block (&chunk_descr, stream->crypt,
+                                 chunk_descr.checksum,
+                                 stream->write_data) < 0 ||
+        add_block_checksum (file_descr, &stream->max_block_nr,
+                            chunk_descr.checksum) < 0)
+        return -1;
+
+    stream->head += len;
+    stream->offset += len;
+    return 0;
+}
+
+int
+cdc_stream_update (CDCStream *stream, const char *data, uint32_t len)
+{
+    uint32_t max_sz = stream->file_descr->block_max_sz;
+    uint32_t n;
+
+    while (len > 0) {
+        if (stream->tail == stream->buf_sz) {
+            memmove (stream->buf, stream->buf + stream->head,
+                     stream->tail - stream->head);
+            stream->tail -= stream->head;
+            stream->head = 0;
+        }
+
+        n = stream->buf_sz - stream->tail;
+        if (n > len)
+            n = len;
+        memcpy (stream->buf + stream->tail, data, n);
+        stream->tail += n;
+        data += n;
+        len -= n;
+
+        while (stream->tail - stream->head >= max_sz) {
+            if (stream_cut_chunk (stream) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t
+cdc_stream_get_offset (CDCStream *stream)
+{
+    return stream->offset;
+}
+
+const char *
+cdc_stream_get_pending (CDCStream *stream, uint32_t *len)
+{
+    *len = stream->tail - stream->head;
+    return stream->buf + stream->head;
+}
+
+int
+cdc_stream_finish (CDCStream *stream)
+{
+    CDCFileDescriptor *file_descr = stream->file_descr;
+    SHA_CTX file_ctx;
+
+    while (stream->tail > stream->head) {
+        if (stream_cut_chunk (stream) < 0)
+            return -1;
+    }
+
+    SHA1_Init (&file_ctx);
+    SHA1_Update (&file_ctx, file_descr->blk_sha1s,
+                 file_descr->block_nr * CHECKSUM_LENGTH);
+    SHA1_Final (file_descr->file_sum, &file_ctx);
+
+    return 0;
+}
+
+void
+cdc_stream_free (CDCStream *stream)
+{
+    free (stream->buf);
+    free (stream);
+}
+
 int filename_chunk_cdc(const char *filename,
                        CDCFileDescriptor *file_descr,
                        SeafileCrypt *crypt,
@@ -15,6 +15,17 @@
 
 #define BREAK_VALUE     0x0013    ///0x0513
 
+/* Max number of chunks of one file being hashed/written at the same time. */
+#define CDC_DEFAULT_WORKERS 4
+
+/* Chunking algorithms. */
+enum {
+    /* Rabin fingerprint, compatible with existing blocks. */
+    CDC_ALGO_RABIN = 0,
+    /* Gear hash, much faster but produces different chunk boundaries. */
+    CDC_ALGO_GEAR,
+};
+
 
 #ifdef HAVE_MD5
 #include "md5.h"
@@ -50,6 +61,19 @@ typedef struct _CDCFileDescriptor {
     uint8_t  file_sum[CHECKSUM_LENGTH];
 
     WriteblockFunc write_block;
+
+    /* CDC_ALGO_RABIN by default. */
+    int      algo;
+    /*
+     * Number of chunks processed by write_block in parallel.
+     * 0 or 1 calls write_block in the chunking thread. Callers opt in to
+     * parallelism with a larger value, usually CDC_DEFAULT_WORKERS;
+     * write_block must then be thread-safe.
+     */
+    int      n_workers;
+
+    /* Passed to write_block in CDCDescriptor.user_data. */
+    void    *user_data;
 } CDCFileDescriptor;
 
 typedef struct _CDCDescriptor {
@@ -57,6 +81,7 @@ typedef struct _CDCDescriptor {
     uint32_t len;
     uint8_t  checksum[CHECKSUM_LENGTH];
     char    *block_buf;
+    void    *user_data;
 } CDCDescriptor;
 
 
@@ -70,4 +95,38 @@ int filename_chunk_cdc(const char *filename,
                        struct SeafileCrypt *crypt,
                        gboolean write_data);
 
+/*
+ * Chunk a file whose content is fed piece by piece, e.g. received from
+ * network. The chunk boundaries are the same as file_chunk_cdc().
+ *
+ * Checksums are appended to file_descr->blk_sha1s, which may contain
+ * the checksums of the first file_descr->block_nr chunks when continuing
+ * from @offset. Blocks are written as soon as they're cut.
+ */
+typedef struct _CDCStream CDCStream;
+
+CDCStream *
+cdc_stream_new (CDCFileDescriptor *file_descr,
+                struct SeafileCrypt *crypt,
+                gboolean write_data,
+                uint64_t offset);
+
+int
+cdc_stream_update (CDCStream *stream, const char *data, uint32_t len);
+
+/* Data before the returned offset has been written to blocks. */
+uint64_t
+cdc_stream_get_offset (CDCStream *stream);
+
+/* Data received after cdc_stream_get_offset() but not chunked yet. */
+const char *
+cdc_stream_get_pending (CDCStream *stream, uint32_t *len);
+
+/* Chunk the remaining data and compute file_descr->file_sum. */
+int
+cdc_stream_finish (CDCStream *stream);
+
+void
+cdc_stream_free (CDCStream *stream);
+
 #endif
@@ -130,7 +130,7 @@ int polyirreducible(u_int64_t f)
  * rabin_checksum(X0, ..., Xn), X0, Xn+1 ----> rabin_checksum(X1, ..., Xn+1)
  * where csum is rabin_checksum(X0, ..., Xn), c1 is X0, c2 is Xn+1
  */
-static u_int64_t append8 (u_int64_t p, u_char m)
+static inline u_int64_t append8 (u_int64_t p, u_char m)
 {
     return ((p << 8) | m) ^ T[p >> shift];
 }
@@ -186,3 +186,31 @@ unsigned int rabin_rolling_checksum(unsigned int csum, int len,
 {
     return append8(csum ^ U[(unsigned char)c1], c2);
 }
+
+/*
+ * Find the first chunk boundary in buf[start, len).
+ * The first fingerprint is calculated over the window ending at @start.
+ * Same result as calling rabin_checksum() and then rabin_rolling_checksum()
+ * byte by byte, but the rolling step is inlined in the loop.
+ *
+ * Returns the length of the chunk, or @len if no boundary is found.
+ */
+int rabin_find_boundary(const char *buf, int start, int len, int win_sz,
+                        unsigned int mask, unsigned int value)
+{
+    unsigned int sum;
+    int i;
+
+    sum = rabin_checksum ((char *)buf + start - win_sz + 1, win_sz);
+    if ((sum & mask) == value)
+        return start + 1;
+
+    for (i = start + 1; i < len; ++i) {
+        sum = append8 (sum ^ U[(unsigned char)buf[i - win_sz]],
+                       (u_char)buf[i]);
+        if ((sum & mask) == value)
+            return i + 1;
+    }
+
+    return len;
+}
@@ -9,6 +9,9 @@ unsigned int rabin_checksum(char *buf, int len);
 
 unsigned int rabin_rolling_checksum(unsigned int csum, int len, char c1, char c2);
 
+int rabin_find_boundary(const char *buf, int start, int len, int win_sz,
+                        unsigned int mask, unsigned int value);
+
 #ifdef __cplusplus
 }
 #endif
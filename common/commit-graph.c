@@ -0,0 +1,468 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#ifndef WIN32
+    #include <arpa/inet.h>
+    #include <sys/file.h>
+#endif
+
+#include "utils.h"
+#include "commit-graph.h"
+
+#define GRAPH_MAGIC "SCGRAPH"
+#define GRAPH_MAGIC_LEN 7
+#define GRAPH_VERSION 2
+
+/* Number of records read from the file at a time. */
+#define READ_BATCH 256
+
+enum {
+    RECORD_HAS_PARENT        = 1 << 0,
+    RECORD_HAS_SECOND_PARENT = 1 << 1,
+};
+
+typedef struct GraphHeader {
+    char    magic[GRAPH_MAGIC_LEN];
+    guint8  version;
+} __attribute__((gcc_struct, __packed__)) GraphHeader;
+
+typedef struct GraphRecord {
+    unsigned char   commit_id[20];
+    unsigned char   root_id[20];
+    unsigned char   parent_id[20];
+    unsigned char   second_parent_id[20];
+    guint64         ctime;
+    guint32         generation;
+    guint32         flags;
+    /* crc32 of the fields above. */
+    guint32         checksum;
+} __attribute__((gcc_struct, __packed__)) GraphRecord;
+
+#define RECORD_CHECKSUM_LEN (sizeof(GraphRecord) - sizeof(guint32))
+
+struct CommitGraph {
+    int             ref;
+    pthread_mutex_t lock;
+    /* commit id -> CommitGraphNode */
+    GHashTable     *nodes;
+    char           *path;
+    int             fd;
+    /* Size of the part of the file that has been read in. */
+    gint64          offset;
+};
+
+#ifndef WIN32
+static void
+lock_graph_file (int fd)
+{
+    while (flock (fd, LOCK_EX) < 0 && errno == EINTR)
+        ;
+}
+
+static void
+unlock_graph_file (int fd)
+{
+    flock (fd, LOCK_UN);
+}
+#else
+/* The graph file is only used by the daemon process on Windows. */
+#define lock_graph_file(fd)
+#define unlock_graph_file(fd)
+#endif
+
+static guint32
+record_checksum (const GraphRecord *rec)
+{
+    return (guint32) crc32 (0, (const Bytef *)rec, RECORD_CHECKSUM_LEN);
+}
+
+static gboolean
+record_to_node (const GraphRecord *rec, CommitGraphNode *node)
+{
+    guint32 flags = ntohl (rec->flags);
+
+    /* Slots of records torn by a crash, or padding, are skipped. */
+    if (ntohl (rec->checksum) != record_checksum (rec))
+        return FALSE;
+
+    rawdata_to_hex (rec->commit_id, node->commit_id, 20);
+    rawdata_to_hex (rec->root_id, node->root_id, 20);
+
+    node->parent_id[0] = '\0';
+    if (flags & RECORD_HAS_PARENT)
+        rawdata_to_hex (rec->parent_id, node->parent_id, 20);
+
+    node->second_parent_id[0] = '\0';
+    if (flags & RECORD_HAS_SECOND_PARENT)
+        rawdata_to_hex (rec->second_parent_id, node->second_parent_id, 20);
+
+    node->ctime = ntoh64 (rec->ctime);
+    node->generation = ntohl (rec->generation);
+
+    return TRUE;
+}
+
+static void
+node_to_record (const CommitGraphNode *node, GraphRecord *rec)
+{
+    guint32 flags = 0;
+    guint32 generation = node->generation;
+
+    memset (rec, 0, sizeof(*rec));
+
+    hex_to_rawdata (node->commit_id, rec->commit_id, 20);
+    hex_to_rawdata (node->root_id, rec->root_id, 20);
+    if (node->parent_id[0] != '\0') {
+        hex_to_rawdata (node->parent_id, rec->parent_id, 20);
+        flags |= RECORD_HAS_PARENT;
+    }
+    if (node->second_parent_id[0] != '\0') {
+        hex_to_rawdata (node->second_parent_id, rec->second_parent_id, 20);
+        flags |= RECORD_HAS_SECOND_PARENT;
+    }
+
+    /* Missing ancestors may be synced later, so an infinite generation
+     * is recomputed by the next process that opens the graph.
+     */
+    if (generation == COMMIT_GEN_INFINITY)
+        generation = COMMIT_GEN_UNKNOWN;
+
+    rec->ctime = hton64 (node->ctime);
+    rec->generation = htonl (generation);
+    rec->flags = htonl (flags);
+    rec->checksum = htonl (record_checksum (rec));
+}
+
+/* Must be called with the lock held. */
+static void
+merge_record (CommitGraph *graph, const GraphRecord *rec)
+{
+    CommitGraphNode tmp, *node;
+
+    if (!record_to_node (rec, &tmp))
+        return;
+
+    node = g_hash_table_lookup (graph->nodes, tmp.commit_id);
+    if (!node) {
+        node = g_new (CommitGraphNode, 1);
+        memcpy (node, &tmp, sizeof(tmp));
+        g_hash_table_insert (graph->nodes, node->commit_id, node);
+    } else if (tmp.generation != COMMIT_GEN_UNKNOWN) {
+        node->generation = tmp.generation;
+    }
+}
+
+/* Read in records appended since the last read. Must be called with the lock held. */
+static void
+read_new_records (CommitGraph *graph)
+{
+    GraphRecord recs[READ_BATCH];
+    ssize_t n;
+    int i;
+
+    if (graph->fd < 0)
+        return;
+
+    if (lseek (graph->fd, graph->offset, SEEK_SET) < 0) {
+        g_warning ("[commit graph] Failed to seek %s: %s.\n",
+                   graph->path, strerror(errno));
+        return;
+    }
+
+    while (1) {
+        n = readn (graph->fd, recs, sizeof(recs));
+        if (n < 0) {
+            g_warning ("[commit graph] Failed to read %s: %s.\n",
+                       graph->path, strerror(errno));
+            return;
+        }
+
+        /* A record at the end may still be being written, it's read
+         * again next time.
+         */
+        n -= n % sizeof(GraphRecord);
+        if (n == 0)
+            return;
+
+        for (i = 0; i < n / sizeof(GraphRecord); ++i)
+            merge_record (graph, &recs[i]);
+        graph->offset += n;
+
+        if (n < sizeof(recs))
+            return;
+    }
+}
+
+/*
+ * A process that crashed while appending may have left part of a record
+ * at the end. Pad it to a whole slot, which fails the checksum, so that
+ * the records appended after it stay aligned.
+ * Must be called with the file locked.
+ */
+static int
+align_graph_file (int fd)
+{
+    static const char zeros[sizeof(GraphRecord)] = { 0 };
+    struct stat st;
+    gint64 rem;
+
+    if (fstat (fd, &st) < 0)
+        return -1;
+
+    rem = (st.st_size - sizeof(GraphHeader)) % sizeof(GraphRecord);
+    if (rem == 0)
+        return 0;
+
+    if (writen (fd, zeros, sizeof(GraphRecord) - rem) != sizeof(GraphRecord) - rem)
+        return -1;
+    return 0;
+}
+
+/* Must be called with the lock held. */
+static void
+append_record (CommitGraph *graph, CommitGraphNode *node)
+{
+    GraphRecord rec;
+
+    if (graph->fd < 0)
+        return;
+
+    node_to_record (node, &rec);
+
+    /* The file is opened with O_APPEND and locked while appending,
+     * so records written by different processes don't overwrite
+     * or interleave with each other.
+     */
+    lock_graph_file (graph->fd);
+    if (align_graph_file (graph->fd) < 0 ||
+        writen (graph->fd, &rec, sizeof(rec)) != sizeof(rec)) {
+        g_warning ("[commit graph] Failed to write %s: %s.\n",
+                   graph->path, strerror(errno));
+    }
+    unlock_graph_file (graph->fd);
+}
+
+static gboolean
+check_header (int fd)
+{
+    GraphHeader hdr;
+
+    if (lseek (fd, 0, SEEK_SET) < 0 ||
+        readn (fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        return FALSE;
+
+    return (memcmp (hdr.magic, GRAPH_MAGIC, GRAPH_MAGIC_LEN) == 0 &&
+            hdr.version == GRAPH_VERSION);
+}
+
+/*
+ * The file is never truncated or rewritten in place, other processes may
+ * be appending to it. A file in unknown format is removed and created
+ * again, the graph can always be rebuilt from the commits.
+ */
+static int
+open_graph_file (CommitGraph *graph)
+{
+    GraphHeader hdr;
+    struct stat st;
+    int fd, retry;
+
+    for (retry = 0; retry < 3; ++retry) {
+        fd = g_open (graph->path, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0644);
+        if (fd < 0) {
+            g_warning ("[commit graph] Failed to open %s: %s.\n",
+                       graph->path, strerror(errno));
+            return -1;
+        }
+
+        lock_graph_file (fd);
+
+        if (fstat (fd, &st) < 0)
+            goto error;
+
+        /* Removed by another process before we got the lock. */
+        if (st.st_nlink == 0) {
+            unlock_graph_file (fd);
+            close (fd);
+            continue;
+        }
+
+        if (st.st_size == 0) {
+            memcpy (hdr.magic, GRAPH_MAGIC, GRAPH_MAGIC_LEN);
+            hdr.version = GRAPH_VERSION;
+            if (writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+                goto error;
+        } else if (!check_header (fd)) {
+            if (g_unlink (graph->path) < 0)
+                goto error;
+            unlock_graph_file (fd);
+            close (fd);
+            continue;
+        }
+
+        unlock_graph_file (fd);
+        graph->fd = fd;
+        graph->offset = sizeof(hdr);
+        return 0;
+    }
+
+    g_warning ("[commit graph] Failed to init %s: file keeps being replaced.\n",
+               graph->path);
+    return -1;
+
+error:
+    g_warning ("[commit graph] Failed to init %s: %s.\n",
+               graph->path, strerror(errno));
+    unlock_graph_file (fd);
+    close (fd);
+    return -1;
+}
+
+CommitGraph *
+commit_graph_open (const char *path)
+{
+    CommitGraph *graph = g_new0 (CommitGraph, 1);
+
+    graph->ref = 1;
+    pthread_mutex_init (&graph->lock, NULL);
+    graph->nodes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          NULL, g_free);
+    graph->fd = -1;
+
+    if (path) {
+        graph->path = g_strdup (path);
+        if (open_graph_file (graph) == 0)
+            read_new_records (graph);
+    }
+
+    return graph;
+}
+
+void
+commit_graph_ref (CommitGraph *graph)
+{
+    g_atomic_int_inc (&graph->ref);
+}
+
+void
+commit_graph_unref (CommitGraph *graph)
+{
+    if (!graph)
+        return;
+
+    if (!g_atomic_int_dec_and_test (&graph->ref))
+        return;
+
+    if (graph->fd >= 0)
+        close (graph->fd);
+    g_hash_table_destroy (graph->nodes);
+    pthread_mutex_destroy (&graph->lock);
+    g_free (graph->path);
+    g_free (graph);
+}
+
+CommitGraphNode *
+commit_graph_lookup (CommitGraph *graph, const char *commit_id)
+{
+    CommitGraphNode *node;
+
+    pthread_mutex_lock (&graph->lock);
+
+    node = g_hash_table_lookup (graph->nodes, commit_id);
+    if (!node) {
+        read_new_records (graph);
+        node = g_hash_table_lookup (graph->nodes, commit_id);
+    }
+
+    pthread_mutex_unlock (&graph->lock);
+
+    return node;
+}
+
+/* Must be called with the lock held. */
+static guint32
+compute_generation (CommitGraph *graph, CommitGraphNode *node)
+{
+    const char *parents[2] = { node->parent_id, node->second_parent_id };
+    CommitGraphNode *p;
+    guint32 gen = 1;
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (parents[i][0] == '\0')
+            continue;
+
+        p = g_hash_table_lookup (graph->nodes, parents[i]);
+        if (!p || p->generation == COMMIT_GEN_UNKNOWN)
+            return COMMIT_GEN_UNKNOWN;
+        if (p->generation == COMMIT_GEN_INFINITY)
+            return COMMIT_GEN_INFINITY;
+        gen = MAX (gen, p->generation + 1);
+    }
+
+    return gen;
+}
+
+CommitGraphNode *
+commit_graph_add (CommitGraph *graph, SeafCommit *commit)
+{
+    CommitGraphNode *node;
+
+    pthread_mutex_lock (&graph->lock);
+
+    node = g_hash_table_lookup (graph->nodes, commit->commit_id);
+    if (node)
+        goto out;
+
+    node = g_new0 (CommitGraphNode, 1);
+    memcpy (node->commit_id, commit->commit_id, 41);
+    memcpy (node->root_id, commit->root_id, 41);
+    if (commit->parent_id)
+        g_strlcpy (node->parent_id, commit->parent_id, 41);
+    if (commit->second_parent_id)
+        g_strlcpy (node->second_parent_id, commit->second_parent_id, 41);
+    node->ctime = commit->ctime;
+    node->generation = compute_generation (graph, node);
+
+    g_hash_table_insert (graph->nodes, node->commit_id, node);
+    append_record (graph, node);
+
+out:
+    pthread_mutex_unlock (&graph->lock);
+    return node;
+}
+
+void
+commit_graph_set_generation (CommitGraph *graph,
+                             CommitGraphNode *node,
+                             guint32 generation)
+{
+    pthread_mutex_lock (&graph->lock);
+
+    if (node->generation != generation) {
+        node->generation = generation;
+        /* Infinite generations are only kept in memory. */
+        if (generation != COMMIT_GEN_INFINITY)
+            append_record (graph, node);
+    }
+
+    pthread_mutex_unlock (&graph->lock);
+}
+
+guint
+commit_graph_get_size (CommitGraph *graph)
+{
+    guint size;
+
+    pthread_mutex_lock (&graph->lock);
+    size = g_hash_table_size (graph->nodes);
+    pthread_mutex_unlock (&graph->lock);
+
+    return size;
+}
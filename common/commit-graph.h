@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_COMMIT_GRAPH_H
+#define SEAF_COMMIT_GRAPH_H
+
+#include "commit-mgr.h"
+
+/*
+ * Commit graph of a repo, kept in a side file with one fixed-width record
+ * per commit: parents, ctime, root id and generation number. History can be
+ * walked over the graph without loading and parsing full commit objects.
+ *
+ * The generation number of a commit without parents is 1, other commits
+ * have one more than the largest generation of their parents. So if A is
+ * an ancestor of B, gen(A) < gen(B).
+ *
+ * Records are only appended to the file, under an exclusive flock().
+ * A later record of a commit overrides earlier ones, which is how
+ * generation numbers are filled in. Each record has a checksum, records
+ * torn by a crash are skipped. Records appended by other processes are
+ * read in on lookup misses.
+ */
+
+/* Generation not computed yet. */
+#define COMMIT_GEN_UNKNOWN 0
+/* Generation can't be computed, e.g. some ancestors are missing.
+ * It's never written to the file, and recomputed once the graph is reopened.
+ */
+#define COMMIT_GEN_INFINITY 0xFFFFFFFF
+
+typedef struct CommitGraphNode {
+    char        commit_id[41];
+    char        root_id[41];
+    char        parent_id[41];          /* empty if there is no parent */
+    char        second_parent_id[41];   /* empty if not a merge */
+    guint64     ctime;
+    guint32     generation;
+} CommitGraphNode;
+
+typedef struct CommitGraph CommitGraph;
+
+/*
+ * Open or create the graph file at @path.
+ * If the file can't be used, the graph is only kept in memory.
+ */
+CommitGraph *
+commit_graph_open (const char *path);
+
+void
+commit_graph_ref (CommitGraph *graph);
+
+void
+commit_graph_unref (CommitGraph *graph);
+
+/*
+ * Returns NULL if the commit is not in the graph.
+ * Nodes are valid as long as the graph is referenced.
+ */
+CommitGraphNode *
+commit_graph_lookup (CommitGraph *graph, const char *commit_id);
+
+/*
+ * Add @commit to the graph, or return the existing node of it.
+ * The generation number is computed if the parents already have one.
+ */
+CommitGraphNode *
+commit_graph_add (CommitGraph *graph, SeafCommit *commit);
+
+void
+commit_graph_set_generation (CommitGraph *graph,
+                             CommitGraphNode *node,
+                             guint32 generation);
+
+/* Number of commits loaded in memory. */
+guint
+commit_graph_get_size (CommitGraph *graph);
+
+#endif
@@ -2,6 +2,10 @@
 
 #include "common.h"
 
+#ifndef WIN32
+    #include <arpa/inet.h>
+#endif
+
 #include <json-glib/json-glib.h>
 #include <openssl/sha.h>
 
@@ -12,16 +16,80 @@
 #include "seafile-session.h"
 #include "commit-mgr.h"
 #include "seaf-utils.h"
+#include "obj-cache.h"
+#include "commit-graph.h"
+
+#include <pthread.h>
 
-#define MAX_TIME_SKEW 259200    /* 3 days */
+/* Default size of decoded commit cache, in MB. */
+#define DEFAULT_COMMIT_CACHE_SIZE 16
+
+/* Max number of commit graphs kept open. */
+#define MAX_OPEN_GRAPHS 100
+/* Max number of commits kept in memory by the open graphs. */
+#define MAX_GRAPH_NODES 200000
+
+typedef struct OpenGraph {
+    CommitGraph *graph;
+    gint64       last_used;
+} OpenGraph;
 
 struct _SeafCommitManagerPriv {
-    /* GHashTable *commit_cache; */
-    /* JsonGenerator   *gen; */
-    /* JsonParser      *parser; */
-    int dummy;
+    /* Decoded commits, keyed by commit id. */
+    SeafObjCache *commit_cache;
+    /* Save new commits in binary format instead of json. */
+    gboolean binary_format;
+
+    /* repo id -> OpenGraph */
+    GHashTable *graphs;
+    pthread_mutex_t graph_lock;
+    char *graph_dir;
+};
+
+/*
+ * Binary commit format.
+ *
+ * Json commit objects always start with '{', binary ones start with
+ * COMMIT_BINARY_MAGIC followed by a version byte. Integers are in
+ * network byte order. The fixed header is followed by:
+ *
+ *   - parent id and second parent id (20 bytes each), if the
+ *     corresponding flags are set;
+ *   - magic (16 bytes) if enc_version >= 1;
+ *   - creator_name, desc, repo_name, repo_desc and repo_category, each
+ *     as a 32-bit length and the bytes of the string. A length of
+ *     COMMIT_NULL_STRING means the string is NULL.
+ *
+ * Commit ids are computed from the commit fields, so a commit has the
+ * same id in both formats. Commits are always sent to other peers in
+ * json, see seaf_commit_data_to_json().
+ */
+#define COMMIT_BINARY_MAGIC "\0SCB"
+#define COMMIT_BINARY_MAGIC_LEN 4
+#define COMMIT_BINARY_VERSION 1
+
+#define COMMIT_NULL_STRING 0xFFFFFFFF
+
+enum {
+    COMMIT_FLAG_PARENT        = 1 << 0,
+    COMMIT_FLAG_SECOND_PARENT = 1 << 1,
+    COMMIT_FLAG_ENCRYPTED     = 1 << 2,
+    COMMIT_FLAG_NO_HISTORY    = 1 << 3,
 };
 
+typedef struct CommitOndisk {
+    char            magic[COMMIT_BINARY_MAGIC_LEN];
+    guint8          version;
+    guint8          flags;
+    guint8          enc_version;
+    guint8          padding;
+    guint64         ctime;
+    unsigned char   repo_id[16];
+    unsigned char   root_id[20];
+    unsigned char   creator_id[20];
+    unsigned char   data[0];
+} __attribute__((gcc_struct, __packed__)) CommitOndisk;
+
 static SeafCommit *
 load_commit (SeafCommitManager *mgr, const char *commit_id);
 static int
@@ -118,14 +186,305 @@ seaf_commit_to_data (SeafCommit *commit, gsize *len)
     return json_data;
 }
 
+static gboolean
+is_binary_commit (const char *data, gsize len)
+{
+    return (len >= sizeof(CommitOndisk) &&
+            memcmp (data, COMMIT_BINARY_MAGIC, COMMIT_BINARY_MAGIC_LEN) == 0);
+}
+
+/* Only lower case hex ids can be stored as raw bytes and converted back. */
+static gboolean
+is_lower_hex (const char *str, int len)
+{
+    int i;
+
+    if (!str)
+        return FALSE;
+
+    for (i = 0; i < len; ++i) {
+        if (!((str[i] >= '0' && str[i] <= '9') ||
+              (str[i] >= 'a' && str[i] <= 'f')))
+            return FALSE;
+    }
+    return (str[len] == '\0');
+}
+
+/* Repo ids are uuids like "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx". */
+static const int uuid_groups[] = { 8, 4, 4, 4, 12 };
+
+static int
+uuid_to_rawdata (const char *uuid, unsigned char *raw)
+{
+    char hex[33];
+    const char *p = uuid;
+    int i, n = 0;
+
+    if (strlen(uuid) != 36)
+        return -1;
+
+    for (i = 0; i < 5; ++i) {
+        if (i > 0 && *p++ != '-')
+            return -1;
+        memcpy (hex + n, p, uuid_groups[i]);
+        hex[n + uuid_groups[i]] = '\0';
+        if (!is_lower_hex (hex + n, uuid_groups[i]))
+            return -1;
+        n += uuid_groups[i];
+        p += uuid_groups[i];
+    }
+    if (*p != '\0')
+        return -1;
+
+    return hex_to_rawdata (hex, raw, 16);
+}
+
+static void
+rawdata_to_uuid (const unsigned char *raw, char *uuid)
+{
+    char hex[33];
+    char *p = uuid;
+    int i, n = 0;
+
+    rawdata_to_hex (raw, hex, 16);
+    for (i = 0; i < 5; ++i) {
+        if (i > 0)
+            *p++ = '-';
+        memcpy (p, hex + n, uuid_groups[i]);
+        n += uuid_groups[i];
+        p += uuid_groups[i];
+    }
+    *p = '\0';
+}
+
+static void
+put_string (GByteArray *buf, const char *str)
+{
+    guint32 len, len_n;
+
+    len = str ? strlen(str) : COMMIT_NULL_STRING;
+    len_n = htonl (len);
+    g_byte_array_append (buf, (guint8 *)&len_n, sizeof(len_n));
+    if (str)
+        g_byte_array_append (buf, (guint8 *)str, len);
+}
+
+/* Returns NULL if the commit has fields that can't be stored in binary. */
+static char *
+commit_to_binary_data (SeafCommit *commit, gsize *len)
+{
+    CommitOndisk ondisk;
+    GByteArray *buf;
+    unsigned char raw[20];
+
+    memset (&ondisk, 0, sizeof(ondisk));
+    memcpy (ondisk.magic, COMMIT_BINARY_MAGIC, COMMIT_BINARY_MAGIC_LEN);
+    ondisk.version = COMMIT_BINARY_VERSION;
+
+    if (uuid_to_rawdata (commit->repo_id, ondisk.repo_id) < 0 ||
+        !is_lower_hex (commit->root_id, 40) ||
+        !is_lower_hex (commit->creator_id, 40) ||
+        (commit->parent_id && !is_lower_hex (commit->parent_id, 40)) ||
+        (commit->second_parent_id &&
+         !is_lower_hex (commit->second_parent_id, 40)))
+        return NULL;
+
+    if (commit->encrypted && commit->enc_version >= 1 &&
+        !is_lower_hex (commit->magic, 32))
+        return NULL;
+
+    hex_to_rawdata (commit->root_id, ondisk.root_id, 20);
+    hex_to_rawdata (commit->creator_id, ondisk.creator_id, 20);
+    ondisk.ctime = hton64 (commit->ctime);
+
+    if (commit->parent_id)
+        ondisk.flags |= COMMIT_FLAG_PARENT;
+    if (commit->second_parent_id)
+        ondisk.flags |= COMMIT_FLAG_SECOND_PARENT;
+    if (commit->encrypted) {
+        ondisk.flags |= COMMIT_FLAG_ENCRYPTED;
+        ondisk.enc_version = (guint8)commit->enc_version;
+    }
+    if (commit->no_local_history)
+        ondisk.flags |= COMMIT_FLAG_NO_HISTORY;
+
+    buf = g_byte_array_new ();
+    g_byte_array_append (buf, (guint8 *)&ondisk, sizeof(ondisk));
+
+    if (commit->parent_id) {
+        hex_to_rawdata (commit->parent_id, raw, 20);
+        g_byte_array_append (buf, raw, 20);
+    }
+    if (commit->second_parent_id) {
+        hex_to_rawdata (commit->second_parent_id, raw, 20);
+        g_byte_array_append (buf, raw, 20);
+    }
+    if (commit->encrypted && commit->enc_version >= 1) {
+        hex_to_rawdata (commit->magic, raw, 16);
+        g_byte_array_append (buf, raw, 16);
+    }
+
+    put_string (buf, commit->creator_name);
+    put_string (buf, commit->desc);
+    put_string (buf, commit->repo_name);
+    put_string (buf, commit->repo_desc);
+    put_string (buf, commit->repo_category);
+
+    *len = buf->len;
+    return (char *)g_byte_array_free (buf, FALSE);
+}
+
+static const unsigned char *
+get_bytes (const unsigned char **p, const unsigned char *end, gsize n)
+{
+    const unsigned char *ret = *p;
+
+    if (end - *p < n)
+        return NULL;
+    *p += n;
+    return ret;
+}
+
+/* Returns -1 if data is truncated. */
+static int
+get_string (const unsigned char **p, const unsigned char *end, char **str)
+{
+    const unsigned char *s;
+    guint32 len;
+
+    *str = NULL;
+
+    if (!(s = get_bytes (p, end, sizeof(len))))
+        return -1;
+    memcpy (&len, s, sizeof(len));
+    len = ntohl (len);
+
+    if (len == COMMIT_NULL_STRING)
+        return 0;
+
+    if (!(s = get_bytes (p, end, len)))
+        return -1;
+    *str = g_strndup ((const char *)s, len);
+    return 0;
+}
+
+static SeafCommit *
+commit_from_binary_data (const char *commit_id, const char *data, gsize len)
+{
+    const CommitOndisk *ondisk = (const CommitOndisk *)data;
+    const unsigned char *p = ondisk->data;
+    const unsigned char *end = (const unsigned char *)data + len;
+    const unsigned char *raw;
+    char repo_id[37], root_id[41], creator_id[41];
+    char parent_id[41], second_parent_id[41], magic[33];
+    char *creator_name = NULL, *desc = NULL, *repo_name = NULL;
+    char *repo_desc = NULL, *repo_category = NULL;
+    SeafCommit *commit = NULL;
+
+    if (ondisk->version != COMMIT_BINARY_VERSION) {
+        g_warning ("[commit mgr] Unknown version %d of commit %s.\n",
+                   ondisk->version, commit_id);
+        return NULL;
+    }
+
+    rawdata_to_uuid (ondisk->repo_id, repo_id);
+    rawdata_to_hex (ondisk->root_id, root_id, 20);
+    rawdata_to_hex (ondisk->creator_id, creator_id, 20);
+
+    if (ondisk->flags & COMMIT_FLAG_PARENT) {
+        if (!(raw = get_bytes (&p, end, 20)))
+            goto bad;
+        rawdata_to_hex (raw, parent_id, 20);
+    }
+    if (ondisk->flags & COMMIT_FLAG_SECOND_PARENT) {
+        if (!(raw = get_bytes (&p, end, 20)))
+            goto bad;
+        rawdata_to_hex (raw, second_parent_id, 20);
+    }
+    if ((ondisk->flags & COMMIT_FLAG_ENCRYPTED) && ondisk->enc_version >= 1) {
+        if (!(raw = get_bytes (&p, end, 16)))
+            goto bad;
+        rawdata_to_hex (raw, magic, 16);
+    }
+
+    if (get_string (&p, end, &creator_name) < 0 ||
+        get_string (&p, end, &desc) < 0 ||
+        get_string (&p, end, &repo_name) < 0 ||
+        get_string (&p, end, &repo_desc) < 0 ||
+        get_string (&p, end, &repo_category) < 0 ||
+        !desc)
+        goto bad;
+
+    commit = seaf_commit_new (commit_id, repo_id, root_id, creator_name,
+                              creator_id, desc, ntoh64 (ondisk->ctime));
+
+    if (ondisk->flags & COMMIT_FLAG_PARENT)
+        commit->parent_id = g_strdup (parent_id);
+    if (ondisk->flags & COMMIT_FLAG_SECOND_PARENT)
+        commit->second_parent_id = g_strdup (second_parent_id);
+
+    commit->repo_name = repo_name;
+    commit->repo_desc = repo_desc;
+    commit->repo_category = repo_category;
+    repo_name = repo_desc = repo_category = NULL;
+
+    if (ondisk->flags & COMMIT_FLAG_ENCRYPTED) {
+        commit->encrypted = TRUE;
+        commit->enc_version = ondisk->enc_version;
+        if (commit->enc_version >= 1)
+            commit->magic = g_strdup (magic);
+    }
+    if (ondisk->flags & COMMIT_FLAG_NO_HISTORY)
+        commit->no_local_history = TRUE;
+
+    goto out;
+
+bad:
+    g_warning ("[commit mgr] Corrupt commit %s.\n", commit_id);
+
+out:
+    g_free (creator_name);
+    g_free (desc);
+    g_free (repo_name);
+    g_free (repo_desc);
+    g_free (repo_category);
+    return commit;
+}
+
+char *
+seaf_commit_data_to_json (const char *id, const char *data, int len,
+                          int *json_len)
+{
+    SeafCommit *commit;
+    char *json_data;
+    gsize n;
+
+    if (!is_binary_commit (data, len))
+        return NULL;
+
+    commit = commit_from_binary_data (id, data, len);
+    if (!commit)
+        return NULL;
+
+    json_data = seaf_commit_to_data (commit, &n);
+    seaf_commit_unref (commit);
+
+    *json_len = (int)n;
+    return json_data;
+}
+
 SeafCommit *
 seaf_commit_from_data (const char *id, const char *data, gsize len)
 {
-    JsonParser *parser = json_parser_new ();
+    JsonParser *parser;
     JsonNode *root;
     SeafCommit *commit;
     GError *error = NULL;
 
+    if (is_binary_commit (data, len))
+        return commit_from_binary_data (id, data, len);
+
+    parser = json_parser_new ();
     if (!json_parser_load_from_data (parser, data, len, &error)) {
         g_warning ("Failed to parse commit data: %s.\n", error->message);
         g_object_unref (parser);
@@ -154,10 +513,11 @@ seaf_commit_free (SeafCommit *commit)
     g_free (commit);
 }
 
+/* Cached commits are shared by threads, so the ref count is atomic. */
 void
 seaf_commit_ref (SeafCommit *commit)
 {
-    commit->ref++;
+    g_atomic_int_inc (&commit->ref);
 }
 
 void
@@ -166,17 +526,102 @@ seaf_commit_unref (SeafCommit *commit)
     if (!commit)
         return;
 
-    if (--commit->ref <= 0)
+    if (g_atomic_int_dec_and_test (&commit->ref))
         seaf_commit_free (commit);
 }
 
+static void *
+cache_ref_commit (void *obj)
+{
+    seaf_commit_ref ((SeafCommit *)obj);
+    return obj;
+}
+
+static void
+cache_unref_commit (void *obj)
+{
+    seaf_commit_unref ((SeafCommit *)obj);
+}
+
+static guint32
+commit_mem_size (SeafCommit *commit)
+{
+    guint32 size = sizeof(SeafCommit);
+
+    if (commit->desc)
+        size += strlen(commit->desc) + 1;
+    if (commit->creator_name)
+        size += strlen(commit->creator_name) + 1;
+    if (commit->parent_id)
+        size += 41;
+    if (commit->second_parent_id)
+        size += 41;
+    if (commit->repo_name)
+        size += strlen(commit->repo_name) + 1;
+    if (commit->repo_desc)
+        size += strlen(commit->repo_desc) + 1;
+    if (commit->repo_category)
+        size += strlen(commit->repo_category) + 1;
+    if (commit->magic)
+        size += 33;
+
+    return size;
+}
+
+static void
+load_commit_config (SeafCommitManager *mgr, SeafileSession *seaf,
+                    gint64 *cache_size)
+{
+    *cache_size = DEFAULT_COMMIT_CACHE_SIZE;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+    int size;
+    gboolean binary;
+
+    /* Cache size in MB, 0 disables the cache. */
+    size = g_key_file_get_integer (seaf->config, "commit", "cache_size", &error);
+    if (!error && size >= 0)
+        *cache_size = size;
+    g_clear_error (&error);
+
+    binary = g_key_file_get_boolean (seaf->config, "commit",
+                                     "binary_format", &error);
+    if (!error)
+        mgr->priv->binary_format = binary;
+    g_clear_error (&error);
+#endif
+
+    *cache_size <<= 20;
+}
+
+static void
+free_open_graph (gpointer data)
+{
+    OpenGraph *og = data;
+
+    commit_graph_unref (og->graph);
+    g_free (og);
+}
+
 SeafCommitManager*
 seaf_commit_manager_new (SeafileSession *seaf)
 {
     SeafCommitManager *mgr = g_new0 (SeafCommitManager, 1);
+    gint64 cache_size;
 
     mgr->priv = g_new0 (SeafCommitManagerPriv, 1);
     mgr->seaf = seaf;
+
+    load_commit_config (mgr, seaf, &cache_size);
+    if (cache_size > 0)
+        mgr->priv->commit_cache = seaf_obj_cache_new (cache_size,
+                                                      cache_ref_commit,
+                                                      cache_unref_commit);
+
+    mgr->priv->graphs = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, free_open_graph);
+    pthread_mutex_init (&mgr->priv->graph_lock, NULL);
     return mgr;
 }
 
@@ -185,6 +630,16 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
 {
     mgr->obj_store = seaf_obj_store_new (mgr->seaf, "commits");
 
+    mgr->priv->graph_dir = g_build_filename (mgr->seaf->seaf_dir,
+                                             "commit-graph", NULL);
+    if (g_mkdir_with_parents (mgr->priv->graph_dir, 0777) < 0) {
+        g_warning ("[commit mgr] Failed to create %s, "
+                   "commit graphs are kept in memory.\n",
+                   mgr->priv->graph_dir);
+        g_free (mgr->priv->graph_dir);
+        mgr->priv->graph_dir = NULL;
+    }
+
 #if defined SEAFILE_MONITOR
     if (seaf_obj_store_init (mgr->obj_store, FALSE, NULL) < 0) {
         g_warning ("[commit mgr] Failed to init commit object store.\n");
@@ -210,33 +665,205 @@ seaf_commit_manager_init (SeafCommitManager *mgr)
     return 0;
 }
 
-#if 0
-inline static void
-add_commit_to_cache (SeafCommitManager *mgr, SeafCommit *commit)
+/*
+ * Close least recently used graphs, other than the one of @repo_id, until
+ * there's room for one more and the open graphs are below MAX_GRAPH_NODES.
+ * Must be called with graph_lock held.
+ */
+static void
+evict_graphs (SeafCommitManagerPriv *priv, const char *repo_id)
 {
-    g_hash_table_insert (mgr->priv->commit_cache,
-                         g_strdup(commit->commit_id),
-                         commit);
-    seaf_commit_ref (commit);
+    GHashTableIter iter;
+    gpointer key, value;
+    OpenGraph *og;
+    char *oldest;
+    gint64 oldest_time;
+    guint n_nodes;
+
+    while (1) {
+        oldest = NULL;
+        oldest_time = G_MAXINT64;
+        n_nodes = 0;
+
+        g_hash_table_iter_init (&iter, priv->graphs);
+        while (g_hash_table_iter_next (&iter, &key, &value)) {
+            og = value;
+            n_nodes += commit_graph_get_size (og->graph);
+            if (strcmp (key, repo_id) != 0 && og->last_used < oldest_time) {
+                oldest_time = og->last_used;
+                oldest = key;
+            }
+        }
+
+        if (!oldest ||
+            (g_hash_table_size (priv->graphs) < MAX_OPEN_GRAPHS &&
+             n_nodes < MAX_GRAPH_NODES))
+            break;
+
+        /* Graphs still in use are freed when the last reference is dropped. */
+        g_hash_table_remove (priv->graphs, oldest);
+    }
 }
 
-inline static void
-remove_commit_from_cache (SeafCommitManager *mgr, SeafCommit *commit)
+/* Returns a new reference to the commit graph of @repo_id. */
+static CommitGraph *
+get_repo_graph (SeafCommitManager *mgr, const char *repo_id)
 {
-    g_hash_table_remove (mgr->priv->commit_cache, commit->commit_id);
+    SeafCommitManagerPriv *priv = mgr->priv;
+    OpenGraph *og;
+    char *path = NULL;
+    CommitGraph *graph;
+
+    pthread_mutex_lock (&priv->graph_lock);
+
+    /* Graphs grow while being walked, so the limits are checked
+     * on every call, not only when a graph is opened.
+     */
+    evict_graphs (priv, repo_id);
+
+    og = g_hash_table_lookup (priv->graphs, repo_id);
+    if (og)
+        goto out;
+
+    if (priv->graph_dir)
+        path = g_build_filename (priv->graph_dir, repo_id, NULL);
+
+    og = g_new0 (OpenGraph, 1);
+    og->graph = commit_graph_open (path);
+    g_hash_table_insert (priv->graphs, g_strdup(repo_id), og);
+    g_free (path);
+
+out:
+    og->last_used = g_get_monotonic_time ();
+    graph = og->graph;
+    commit_graph_ref (graph);
+
+    pthread_mutex_unlock (&priv->graph_lock);
+
+    return graph;
+}
+
+/* Find a commit in the graph, add it from the commit object if not there. */
+static CommitGraphNode *
+get_graph_node (SeafCommitManager *mgr, CommitGraph *graph, const char *id)
+{
+    CommitGraphNode *node;
+    SeafCommit *commit;
+
+    node = commit_graph_lookup (graph, id);
+    if (node)
+        return node;
+
+    commit = seaf_commit_manager_get_commit (mgr, id);
+    if (!commit)
+        return NULL;
+
+    node = commit_graph_add (graph, commit);
     seaf_commit_unref (commit);
+
+    return node;
+}
+
+/*
+ * Commits reachable from a head may belong to other repos (e.g. forks),
+ * they're added to the graph of the repo that the head belongs to.
+ */
+static CommitGraph *
+get_head_graph (SeafCommitManager *mgr, const char *head,
+                CommitGraphNode **head_node)
+{
+    SeafCommit *commit;
+    CommitGraph *graph;
+
+    commit = seaf_commit_manager_get_commit (mgr, head);
+    if (!commit)
+        return NULL;
+
+    graph = get_repo_graph (mgr, commit->repo_id);
+    *head_node = commit_graph_add (graph, commit);
+    seaf_commit_unref (commit);
+
+    return graph;
+}
+
+/*
+ * Compute generation numbers of @node and those of its ancestors
+ * that are not computed yet. Loads the commits that are not in the graph.
+ */
+static guint32
+fill_generation (SeafCommitManager *mgr, CommitGraph *graph,
+                 CommitGraphNode *node)
+{
+    GPtrArray *stack;
+    CommitGraphNode *n, *p;
+    const char *parents[2];
+    guint32 gen;
+    gboolean pending;
+    int i;
+
+    if (node->generation != COMMIT_GEN_UNKNOWN)
+        return node->generation;
+
+    stack = g_ptr_array_new ();
+    g_ptr_array_add (stack, node);
+
+    while (stack->len > 0) {
+        n = g_ptr_array_index (stack, stack->len - 1);
+        if (n->generation != COMMIT_GEN_UNKNOWN) {
+            g_ptr_array_remove_index (stack, stack->len - 1);
+            continue;
+        }
+
+        parents[0] = n->parent_id;
+        parents[1] = n->second_parent_id;
+        gen = 1;
+        pending = FALSE;
+
+        for (i = 0; i < 2; ++i) {
+            if (parents[i][0] == '\0')
+                continue;
+
+            p = get_graph_node (mgr, graph, parents[i]);
+            if (!p || p->generation == COMMIT_GEN_INFINITY) {
+                /* Missing ancestors may come back later, so no
+                 * generation number can be trusted from here on.
+                 */
+                gen = COMMIT_GEN_INFINITY;
+            } else if (p->generation == COMMIT_GEN_UNKNOWN) {
+                g_ptr_array_add (stack, p);
+                pending = TRUE;
+            } else if (gen != COMMIT_GEN_INFINITY) {
+                gen = MAX (gen, p->generation + 1);
+            }
+        }
+
+        if (pending)
+            continue;
+
+        commit_graph_set_generation (graph, n, gen);
+        g_ptr_array_remove_index (stack, stack->len - 1);
+    }
+
+    g_ptr_array_free (stack, TRUE);
+    return node->generation;
 }
-#endif
 
 int
 seaf_commit_manager_add_commit (SeafCommitManager *mgr, SeafCommit *commit)
 {
+    CommitGraph *graph;
     int ret;
 
-    /* add_commit_to_cache (mgr, commit); */
     if ((ret = save_commit (mgr, commit)) < 0)
         return -1;
-    
+
+    /* Keep the commit graph up to date. Generation number of the commit
+     * is set here if its parents already have one.
+     */
+    graph = get_repo_graph (mgr, commit->repo_id);
+    commit_graph_add (graph, commit);
+    commit_graph_unref (graph);
+
     return 0;
 }
 
@@ -245,20 +872,8 @@ seaf_commit_manager_del_commit (SeafCommitManager *mgr, const char *id)
 {
     g_assert (id != NULL);
 
-#if 0
-    commit = g_hash_table_lookup(mgr->priv->commit_cache, id);
-    if (!commit)
-        goto delete;
-
-    /*
-     * Catch ref count bug here. We have bug in commit ref, the
-     * following assert can't pass. TODO: fix the commit ref bug
-     */
-    /* g_assert (commit->ref <= 1); */
-    remove_commit_from_cache (mgr, commit);
-
-delete:
-#endif
+    if (mgr->priv->commit_cache)
+        seaf_obj_cache_remove (mgr->priv->commit_cache, id);
 
     delete_commit (mgr, id);
 }
@@ -268,249 +883,317 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr, const char *id)
 {
     SeafCommit *commit;
 
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL) {
-        seaf_commit_ref (commit);
-        return commit;
+    if (mgr->priv->commit_cache && id && strlen(id) == 40) {
+        commit = seaf_obj_cache_lookup (mgr->priv->commit_cache, id);
+        if (commit)
+            return commit;
     }
-#endif
 
     commit = load_commit (mgr, id);
     if (!commit)
         return NULL;
 
-    /* add_commit_to_cache (mgr, commit); */
+    /* The cache takes over the extra reference. */
+    if (mgr->priv->commit_cache) {
+        seaf_commit_ref (commit);
+        seaf_obj_cache_insert (mgr->priv->commit_cache, id,
+                               commit, commit_mem_size (commit));
+    }
 
     return commit;
 }
 
-static gint
-compare_commit_by_time (gconstpointer a, gconstpointer b, gpointer unused)
-{
-    const SeafCommit *commit_a = a;
-    const SeafCommit *commit_b = b;
+/*
+ * A binary max-heap of graph nodes, latest commit on top. Commits with the
+ * same ctime are popped last-in first-out, the same order as a list kept
+ * with g_list_insert_sorted().
+ */
+typedef struct HeapItem {
+    CommitGraphNode *node;
+    guint64          seq;
+} HeapItem;
+
+typedef struct CommitHeap {
+    GArray  *items;
+    guint64  seq;
+} CommitHeap;
 
-    /* Latest commit comes first in the list. */
-    return (commit_b->ctime - commit_a->ctime);
+static void
+heap_init (CommitHeap *heap)
+{
+    heap->items = g_array_new (FALSE, FALSE, sizeof(HeapItem));
+    heap->seq = 0;
 }
 
-inline static int
-insert_parent_commit (GList **list, GHashTable *hash, const char *parent_id)
+static void
+heap_destroy (CommitHeap *heap)
 {
-    SeafCommit *p;
-    char *key;
+    g_array_free (heap->items, TRUE);
+}
 
-    if (g_hash_table_lookup (hash, parent_id) != NULL)
-        return 0;
+static inline gboolean
+heap_item_before (HeapItem *a, HeapItem *b)
+{
+    if (a->node->ctime != b->node->ctime)
+        return (a->node->ctime > b->node->ctime);
+    return (a->seq > b->seq);
+}
 
-    p = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                        parent_id);
-    if (!p) {
-        g_warning ("Failed to find commit %s\n", parent_id);
-        return -1;
+static void
+heap_push (CommitHeap *heap, CommitGraphNode *node)
+{
+    HeapItem item, *items;
+    guint i, parent;
+
+    item.node = node;
+    item.seq = heap->seq++;
+    g_array_append_val (heap->items, item);
+
+    items = (HeapItem *)heap->items->data;
+    i = heap->items->len - 1;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!heap_item_before (&item, &items[parent]))
+            break;
+        items[i] = items[parent];
+        i = parent;
     }
+    items[i] = item;
+}
 
-    *list = g_list_insert_sorted_with_data (*list, p,
-                                           compare_commit_by_time,
-                                           NULL);
+static CommitGraphNode *
+heap_pop (CommitHeap *heap)
+{
+    HeapItem *items = (HeapItem *)heap->items->data;
+    HeapItem last;
+    CommitGraphNode *top;
+    guint n, i, child;
 
-    key = g_strdup (parent_id);
-    g_hash_table_insert (hash, key, key);
+    if (heap->items->len == 0)
+        return NULL;
 
-    return 0;
+    top = items[0].node;
+    n = heap->items->len - 1;
+    last = items[n];
+    g_array_set_size (heap->items, n);
+
+    i = 0;
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && heap_item_before (&items[child + 1], &items[child]))
+            ++child;
+        if (!heap_item_before (&items[child], &last))
+            break;
+        items[i] = items[child];
+        i = child;
+    }
+    if (n > 0)
+        items[i] = last;
+
+    return top;
 }
 
-gboolean
-seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
-                                                     const char *head,
-                                                     CommitTraverseFunc func,
-                                                     int limit,
-                                                     void *data)
+/*
+ * Return FALSE to abort the traversal.
+ * Set *stop to TRUE to skip the parents of this commit.
+ */
+typedef gboolean (*GraphTraverseFunc) (CommitGraphNode *node,
+                                       void *data,
+                                       gboolean *stop);
+
+/*
+ * Walk commits reachable from @head over the commit graph, latest first.
+ * Commits not yet in the graph are loaded and added to it.
+ */
+static gboolean
+traverse_commit_graph (SeafCommitManager *mgr,
+                       CommitGraph *graph,
+                       CommitGraphNode *head,
+                       GraphTraverseFunc func,
+                       int limit,
+                       void *data)
 {
-    SeafCommit *commit;
-    GList *list = NULL;
-    GHashTable *commit_hash;
+    CommitHeap heap;
+    GHashTable *visited;
+    CommitGraphNode *node, *p;
+    const char *parents[2];
     gboolean ret = TRUE;
+    int count = 0;
+    int i;
 
-    /* A hash table for recording id of traversed commits. */
-    commit_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-    commit = seaf_commit_manager_get_commit (mgr, head);
-    if (!commit) {
-        g_warning ("Failed to find commit %s.\n", head);
-        return FALSE;
-    }
-
-    list = g_list_insert_sorted_with_data (list, commit,
-                                           compare_commit_by_time,
-                                           NULL);
+    heap_init (&heap);
+    visited = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-    char *key = g_strdup (commit->commit_id);
-    g_hash_table_insert (commit_hash, key, key);
+    heap_push (&heap, head);
+    g_hash_table_insert (visited, head, head);
 
-    int count = 0;
-    while (list) {
+    while ((node = heap_pop (&heap)) != NULL) {
         gboolean stop = FALSE;
-        commit = list->data;
-        list = g_list_delete_link (list, list);
 
-        if (!func (commit, data, &stop)) {
-            seaf_commit_unref (commit);
+        if (!func (node, data, &stop)) {
             ret = FALSE;
-            goto out;
+            break;
         }
 
-        /* Stop when limit is reached. If limit < 0, there is no limit; */
-        if (limit > 0 && ++count == limit) {
-            seaf_commit_unref (commit);
+        /* Stop when limit is reached. If limit <= 0, there is no limit. */
+        if (limit > 0 && ++count == limit)
             break;
-        }
-        
-        if (stop) {
-            seaf_commit_unref (commit);
-            /* stop traverse down from this commit,
-             * but not stop traversing the tree 
-             */
+
+        /* Don't traverse down from this commit, but go on with the others. */
+        if (stop)
             continue;
-        }
 
-        if (commit->parent_id) {
-            if (insert_parent_commit (&list, commit_hash, commit->parent_id) < 0) {
-                seaf_commit_unref (commit);
-                ret = FALSE;
-                goto out;
-            }
-        }
-        if (commit->second_parent_id) {
-            if (insert_parent_commit (&list, commit_hash, commit->second_parent_id) < 0) {
-                seaf_commit_unref (commit);
+        parents[0] = node->parent_id;
+        parents[1] = node->second_parent_id;
+        for (i = 0; i < 2; ++i) {
+            if (parents[i][0] == '\0')
+                continue;
+
+            p = get_graph_node (mgr, graph, parents[i]);
+            if (!p) {
+                g_warning ("[commit mgr] Failed to find commit %s.\n",
+                           parents[i]);
                 ret = FALSE;
                 goto out;
             }
+
+            if (g_hash_table_lookup (visited, p))
+                continue;
+            g_hash_table_insert (visited, p, p);
+            heap_push (&heap, p);
         }
-        seaf_commit_unref (commit);
     }
 
 out:
-    g_hash_table_destroy (commit_hash);
-    while (list) {
-        commit = list->data;
-        seaf_commit_unref (commit);
-        list = g_list_delete_link (list, list);
-    }
+    g_hash_table_destroy (visited);
+    heap_destroy (&heap);
     return ret;
 }
 
-gboolean
-seaf_commit_manager_traverse_commit_tree (SeafCommitManager *mgr,
-                                          const char *head,
-                                          CommitTraverseFunc func,
-                                          void *data)
+typedef struct TraverseData {
+    SeafCommitManager   *mgr;
+    CommitTraverseFunc   func;
+    void                *data;
+} TraverseData;
+
+static gboolean
+traverse_commit (CommitGraphNode *node, void *vdata, gboolean *stop)
 {
+    TraverseData *td = vdata;
     SeafCommit *commit;
-    GList *list = NULL;
-    GHashTable *commit_hash;
-    gboolean ret = TRUE;
+    gboolean ret;
 
-    commit = seaf_commit_manager_get_commit (mgr, head);
+    commit = seaf_commit_manager_get_commit (td->mgr, node->commit_id);
     if (!commit) {
-        g_warning ("Failed to find commit %s.\n", head);
+        g_warning ("[commit mgr] Failed to find commit %s.\n", node->commit_id);
         return FALSE;
     }
 
-    /* A hash table for recording id of traversed commits. */
-    commit_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-
-    list = g_list_insert_sorted_with_data (list, commit,
-                                           compare_commit_by_time,
-                                           NULL);
-
-    char *key = g_strdup (commit->commit_id);
-    g_hash_table_insert (commit_hash, key, key);
+    ret = td->func (commit, td->data, stop);
+    seaf_commit_unref (commit);
 
-    while (list) {
-        gboolean stop = FALSE;
-        commit = list->data;
-        list = g_list_delete_link (list, list);
+    return ret;
+}
 
-        if (!func (commit, data, &stop)) {
-            g_warning("[comit-mgr] CommitTraverseFunc failed\n");
-            seaf_commit_unref (commit);
-            ret = FALSE;
-            goto out;
-        }
-        if (stop) {
-            seaf_commit_unref (commit);
-            /* stop traverse down from this commit,
-             * but not stop traversing the tree 
-             */
-            continue;
-        }
+static gboolean
+traverse_commit_tree (SeafCommitManager *mgr,
+                      const char *head,
+                      CommitTraverseFunc func,
+                      int limit,
+                      void *data)
+{
+    CommitGraph *graph;
+    CommitGraphNode *head_node;
+    TraverseData td;
+    gboolean ret;
 
-        if (commit->parent_id) {
-            if (insert_parent_commit (&list, commit_hash, commit->parent_id) < 0) {
-                g_warning("[comit-mgr] insert parent commit failed\n");
-                seaf_commit_unref (commit);
-                ret = FALSE;
-                goto out;
-            }
-        }
-        if (commit->second_parent_id) {
-            if (insert_parent_commit (&list, commit_hash, commit->second_parent_id) < 0) {
-                g_warning("[comit-mgr]insert second parent commit failed\n");
-                seaf_commit_unref (commit);
-                ret = FALSE;
-                goto out;
-            }
-        }
-        seaf_commit_unref (commit);
+    graph = get_head_graph (mgr, head, &head_node);
+    if (!graph) {
+        g_warning ("Failed to find commit %s.\n", head);
+        return FALSE;
     }
 
-out:
-    g_hash_table_destroy (commit_hash);
-    while (list) {
-        commit = list->data;
-        seaf_commit_unref (commit);
-        list = g_list_delete_link (list, list);
-    }
+    td.mgr = mgr;
+    td.func = func;
+    td.data = data;
+    ret = traverse_commit_graph (mgr, graph, head_node,
+                                 traverse_commit, limit, &td);
+
+    commit_graph_unref (graph);
     return ret;
 }
 
+gboolean
+seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
+                                                     const char *head,
+                                                     CommitTraverseFunc func,
+                                                     int limit,
+                                                     void *data)
+{
+    return traverse_commit_tree (mgr, head, func, limit, data);
+}
+
+gboolean
+seaf_commit_manager_traverse_commit_tree (SeafCommitManager *mgr,
+                                          const char *head,
+                                          CommitTraverseFunc func,
+                                          void *data)
+{
+    return traverse_commit_tree (mgr, head, func, 0, data);
+}
+
 typedef struct FindingHelp {
-    SeafCommit *to_find;
+    CommitGraphNode *to_find;
     gboolean result;
 } FindingHelp;
 
 static gboolean
-find_commit(SeafCommit *commit, FindingHelp *f, gboolean *stop)
+find_commit (CommitGraphNode *node, void *vdata, gboolean *stop)
 {
-    if (f->result == TRUE) {
-        *stop = TRUE;
-        return TRUE;
-    }
+    FindingHelp *f = vdata;
+    guint32 gen = f->to_find->generation;
 
-    if (strcmp(commit->commit_id, f->to_find->commit_id) == 0) {
+    if (node == f->to_find) {
         f->result = TRUE;
-        *stop = TRUE;
-    } else {
-        if (commit->ctime < f->to_find->ctime - MAX_TIME_SKEW) {
-            /* searched deep enough */
-            f->result= FALSE;
-            *stop = TRUE;
-        } else
-            *stop = FALSE;
+        /* Found, no need to go on. */
+        return FALSE;
     }
 
+    /* A commit can only reach commits with smaller generation numbers. */
+    if (gen != COMMIT_GEN_INFINITY &&
+        node->generation != COMMIT_GEN_INFINITY &&
+        node->generation <= gen)
+        *stop = TRUE;
+
     return TRUE;
 }
 
+/* Returns TRUE if @ancestor can be reached from @head. */
+static gboolean
+is_ancestor (SeafCommitManager *mgr, CommitGraph *graph,
+             CommitGraphNode *head, CommitGraphNode *ancestor,
+             gboolean *error)
+{
+    FindingHelp f;
+
+    f.to_find = ancestor;
+    f.result = FALSE;
+
+    if (!traverse_commit_graph (mgr, graph, head, find_commit, 0, &f) &&
+        !f.result)
+        *error = TRUE;
+
+    return f.result;
+}
+
 int
 seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
                                     const char *commit1,
                                     const char *commit2)
 {
-    SeafCommit *c1, *c2;
+    CommitGraph *graph;
+    CommitGraphNode *c1, *c2;
+    guint32 gen1, gen2;
+    gboolean error = FALSE;
     int ret = 0;
 
     if (!commit1 || !commit2)
@@ -524,43 +1207,40 @@ seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
     if (strcmp(commit1, commit2) == 0)
         return 0;
 
-    c1 = seaf_commit_manager_get_commit (mgr, commit1);
-    if (!c1) {
+    graph = get_head_graph (mgr, commit1, &c1);
+    if (!graph) {
         g_warning ("Failed to find commit %s.\n", commit1);
         return -2;
     }
-    c2 = seaf_commit_manager_get_commit (mgr, commit2);
+    c2 = get_graph_node (mgr, graph, commit2);
     if (!c2) {
         g_warning ("Failed to find commit %s.\n", commit2);
+        commit_graph_unref (graph);
         return -2;
     }
 
-    if (c1->ctime > c2->ctime) {
-        FindingHelp f;
-        f.to_find = c2;
-        f.result = FALSE;
-        if (!seaf_commit_manager_traverse_commit_tree (
-                mgr, c1->commit_id, (CommitTraverseFunc)find_commit, &f))
-            ret = -2;
-        if (f.result == TRUE)
+    gen1 = fill_generation (mgr, graph, c1);
+    gen2 = fill_generation (mgr, graph, c2);
+
+    /* Only the commit with larger generation can be a descendant. Without
+     * generation numbers, search from both sides.
+     */
+    if (gen1 > gen2 || gen1 == COMMIT_GEN_INFINITY ||
+        gen2 == COMMIT_GEN_INFINITY) {
+        if (is_ancestor (mgr, graph, c1, c2, &error))
             ret = 1;
-        else
-            ret = 0;
-    } else {
-        FindingHelp f;
-        f.to_find = c1;
-        f.result = FALSE;
-        if (!seaf_commit_manager_traverse_commit_tree (
-                mgr, c2->commit_id, (CommitTraverseFunc)find_commit, &f))
-            ret = -2;
-        if (f.result == TRUE)
+    }
+    if (ret == 0 && !error &&
+        (gen2 > gen1 || gen1 == COMMIT_GEN_INFINITY ||
+         gen2 == COMMIT_GEN_INFINITY)) {
+        if (is_ancestor (mgr, graph, c2, c1, &error))
             ret = -1;
-        else
-            ret = 0;
     }
 
-    seaf_commit_unref (c1);
-    seaf_commit_unref (c2);
+    if (error)
+        ret = -2;
+
+    commit_graph_unref (graph);
     return ret;
 }
 
@@ -609,11 +1289,15 @@ end:
 gboolean
 seaf_commit_manager_commit_exists (SeafCommitManager *mgr, const char *id)
 {
-#if 0
-    commit = g_hash_table_lookup (mgr->priv->commit_cache, id);
-    if (commit != NULL)
-        return TRUE;
-#endif
+    SeafCommit *commit;
+
+    if (mgr->priv->commit_cache && id && strlen(id) == 40) {
+        commit = seaf_obj_cache_lookup (mgr->priv->commit_cache, id);
+        if (commit) {
+            seaf_commit_unref (commit);
+            return TRUE;
+        }
+    }
 
     return seaf_obj_store_obj_exists (mgr->obj_store, id);
 }
@@ -751,8 +1435,6 @@ load_commit (SeafCommitManager *mgr, const char *commit_id)
     char *data;
     int len;
     SeafCommit *commit = NULL;
-    JsonParser *parser;
-    GError *error = NULL;
 
     if (!commit_id || strlen(commit_id) != 40)
         return NULL;
@@ -760,25 +1442,10 @@ load_commit (SeafCommitManager *mgr, const char *commit_id)
     if (seaf_obj_store_read_obj (mgr->obj_store, commit_id, (void **)&data, &len) < 0)
         return NULL;
 
-    parser = json_parser_new ();
-    json_parser_load_from_data (parser, data, len, &error);
-    if (error) {
-        g_warning ("Unable to parse commit %s: %s\n", commit_id,
-                   error->message);
-        g_error_free (error);
-        goto out;
-    }
-
-    JsonNode *root;
-
-    root = json_parser_get_root (parser);
-
-    commit = commit_from_json_node (commit_id, root);
+    commit = seaf_commit_from_data (commit_id, data, len);
     if (commit)
         commit->manager = mgr;
 
-out:
-    g_object_unref (parser);
     g_free (data);
 
     return commit;
@@ -787,11 +1454,17 @@ out:
 static int
 save_commit (SeafCommitManager *manager, SeafCommit *commit)
 {
-    JsonGenerator *gen = json_generator_new ();
+    JsonGenerator *gen;
     JsonNode *root;
-    char *data;
+    char *data = NULL;
     gsize len;
 
+    if (manager->priv->binary_format)
+        data = commit_to_binary_data (commit, &len);
+    if (data)
+        goto write;
+
+    gen = json_generator_new ();
     root = commit_to_json_node (commit);
 
     json_generator_set_root (gen, root);
@@ -806,6 +1479,7 @@ save_commit (SeafCommitManager *manager, SeafCommit *commit)
     json_node_free (root);
     g_object_unref (gen);
 
+write:
     if (seaf_obj_store_write_obj (manager->obj_store, commit->commit_id,
                                   data, (int)len) < 0) {
         g_free (data);
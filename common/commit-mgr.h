@@ -57,6 +57,14 @@ seaf_commit_to_data (SeafCommit *commit, gsize *len);
 SeafCommit *
 seaf_commit_from_data (const char *id, const char *data, gsize len);
 
+/* Convert a commit object stored in binary format to json, for peers
+ * that only understand json commits.
+ * Returns NULL if @data is not a binary commit.
+ */
+char *
+seaf_commit_data_to_json (const char *id, const char *data, int len,
+                          int *json_len);
+
 void
 seaf_commit_ref (SeafCommit *commit);
 
@@ -117,6 +125,8 @@ seaf_commit_manager_get_commit (SeafCommitManager *mgr, const char *id);
 /**
  * Traverse the commits DAG start from head in topological order.
  * The ordering is based on commit time.
+ * Parents are found from the commit graph of the head's repo, full commit
+ * objects are only loaded when passed to @func.
  * return FALSE if some commits is missing, TRUE otherwise.
  */
 gboolean
@@ -142,6 +152,8 @@ seaf_commit_manager_traverse_commit_tree_with_limit (SeafCommitManager *mgr,
  *     1  if commit2 is ancestor of commit1
  *    -2  if error occured
  *     0  if commit1 is equal to commit2, or not comparable
+ *
+ * Generation numbers in the commit graph are used to limit the search.
  */
 int
 seaf_commit_manager_compare_commit (SeafCommitManager *mgr,
@@ -25,7 +25,12 @@
 #define CURRENT_ENC_VERSION 1
 
 #define DEFAULT_PROTO_VERSION 1
-#define CURRENT_PROTO_VERSION 3
+/*
+ * 4: pipelined block transfer (block protocol v3).
+ * 5: wire compression of objects and blocks.
+ * 6: pushed fs objects on upload.
+ */
+#define CURRENT_PROTO_VERSION 6
 
 #ifndef ccnet_warning
 #define ccnet_warning(fmt, ...) g_warning("%s(%d): " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #ifndef WIN32
     #include <arpa/inet.h>
@@ -23,6 +24,7 @@
 #include "utils.h"
 #include "seaf-utils.h"
 #include "log.h"
+#include "obj-cache.h"
 #include "../common/seafile-crypt.h"
 
 #ifndef SEAFILE_SERVER
@@ -34,8 +36,13 @@
 
 #define SEAF_TMP_EXT ".seaftmp~"
 
+/* Default size of decoded object cache, in MB. */
+#define DEFAULT_FS_CACHE_SIZE 32
+
 struct _SeafFSManagerPriv {
-    /* GHashTable      *seafile_cache; */
+    /* Caches for decoded objects, keyed by object id. */
+    SeafObjCache    *dir_cache;
+    SeafObjCache    *seafile_cache;
     GHashTable      *bl_cache;
 };
 
@@ -66,11 +73,40 @@ write_seafile (SeafFSManager *fs_mgr,
                CDCFileDescriptor *cdc);
 #endif  /* SEAFILE_SERVER */
 
+static void *
+cache_ref_seafile (void *obj);
+static void
+cache_unref_seafile (void *obj);
+static void *
+cache_ref_seafdir (void *obj);
+static void
+cache_unref_seafdir (void *obj);
+
+static gint64
+get_cache_size (SeafileSession *seaf)
+{
+    gint64 cache_size = DEFAULT_FS_CACHE_SIZE;
+
+#ifdef SEAFILE_SERVER
+    GError *error = NULL;
+    int size;
+
+    /* Cache size in MB, 0 disables the cache. */
+    size = g_key_file_get_integer (seaf->config, "fs", "cache_size", &error);
+    if (!error && size >= 0)
+        cache_size = size;
+    g_clear_error (&error);
+#endif
+
+    return cache_size << 20;
+}
+
 SeafFSManager *
 seaf_fs_manager_new (SeafileSession *seaf,
                      const char *seaf_dir)
 {
     SeafFSManager *mgr = g_new0 (SeafFSManager, 1);
+    gint64 cache_size;
 
     mgr->seaf = seaf;
 
@@ -81,6 +117,16 @@ seaf_fs_manager_new (SeafileSession *seaf,
     }
 
     mgr->priv = g_new0(SeafFSManagerPriv, 1);
+
+    cache_size = get_cache_size (seaf);
+    if (cache_size > 0) {
+        mgr->priv->dir_cache = seaf_obj_cache_new (cache_size / 2,
+                                                   cache_ref_seafdir,
+                                                   cache_unref_seafdir);
+        mgr->priv->seafile_cache = seaf_obj_cache_new (cache_size / 2,
+                                                       cache_ref_seafile,
+                                                       cache_unref_seafile);
+    }
     
     return mgr;
 }
@@ -114,17 +160,59 @@ seaf_fs_manager_init (SeafFSManager *mgr)
 }
 
 #ifndef SEAFILE_SERVER
+
+/*
+ * Blocks are read, decrypted and written in pieces of CHECKOUT_BUF_SIZE
+ * bytes, through a buffer kept per thread, instead of holding the whole
+ * block (and its decrypted copy) in memory.
+ */
+#define CHECKOUT_BUF_SIZE (64 * 1024)
+
+typedef struct CheckoutBuffer {
+    char in[CHECKOUT_BUF_SIZE];
+    /* Decryption may output one more cipher block than it takes in. */
+    char out[CHECKOUT_BUF_SIZE + ENCRYPT_BLK_SIZE];
+} CheckoutBuffer;
+
+static pthread_key_t checkout_buf_key;
+static pthread_once_t checkout_buf_once = PTHREAD_ONCE_INIT;
+
+static void
+create_checkout_buf_key ()
+{
+    pthread_key_create (&checkout_buf_key, g_free);
+}
+
+static CheckoutBuffer *
+get_checkout_buffer ()
+{
+    CheckoutBuffer *buf;
+
+    pthread_once (&checkout_buf_once, create_checkout_buf_key);
+
+    buf = pthread_getspecific (checkout_buf_key);
+    if (!buf) {
+        buf = g_new (CheckoutBuffer, 1);
+        pthread_setspecific (checkout_buf_key, buf);
+    }
+    return buf;
+}
+
+/* The number of bytes written to @wfd is added to @written. */
 static int
 checkout_block (const char *block_id,
                 int wfd,
-                SeafileCrypt *crypt)
+                SeafileCrypt *crypt,
+                guint64 *written)
 {
     SeafBlockManager *block_mgr = seaf->block_mgr;
+    CheckoutBuffer *buf = get_checkout_buffer ();
     BlockHandle *handle;
-    BlockMetadata *bmd;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
-    char *blk_content = NULL;
+    BlockMetadata *bmd = NULL;
+    EVP_CIPHER_CTX ctx;
+    gboolean ctx_inited = FALSE;
+    uint32_t remain;
+    int n, dec_out_len;
 
     handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
     if (!handle) {
@@ -140,23 +228,10 @@ checkout_block (const char *block_id,
     }
 
     /* empty file, skip it */
-    if (bmd->size == 0) {
-        seaf_block_manager_close_block (block_mgr, handle);
-        seaf_block_manager_block_handle_free (block_mgr, handle);
-        return 0;
-    }
+    if (bmd->size == 0)
+        goto out;
 
-    blk_content = (char *)malloc (bmd->size * sizeof(char));
-
-    /* read the block to prepare decryption */
-    if (seaf_block_manager_read_block (block_mgr, handle, 
-                                       blk_content, bmd->size) != bmd->size) {
-        g_warning ("Error when reading from block %s.\n", block_id);
-        goto checkout_blk_error;
-    }
-    
     if (crypt != NULL) {
-
         /* An encrypted block size must be a multiple of
            ENCRYPT_BLK_SIZE
         */
@@ -164,53 +239,72 @@ checkout_block (const char *block_id,
             g_warning ("Error: An invalid encrypted block, %s \n", block_id);
             goto checkout_blk_error;
         }
-        
-        /* decrypt the block */
-        int ret = seafile_decrypt (&dec_out,
-                                   &dec_out_len,
-                                   blk_content,
-                                   bmd->size, 
-                                   crypt);
 
-        if (ret != 0) {
+        if (seafile_decrypt_init (&ctx, crypt) < 0) {
             g_warning ("Decryt block %s failed. \n", block_id);
             goto checkout_blk_error;
         }
+        ctx_inited = TRUE;
+    }
 
-        /* write the decrypted content */
-        ret = writen (wfd, dec_out, dec_out_len);
-
-
-        if (ret !=  dec_out_len) {
-            g_warning ("Failed to write the decryted block %s.\n",
-                       block_id);
+    remain = bmd->size;
+    while (remain > 0) {
+        n = (remain < CHECKOUT_BUF_SIZE) ? remain : CHECKOUT_BUF_SIZE;
+        if (seaf_block_manager_read_block (block_mgr, handle,
+                                           buf->in, n) != n) {
+            g_warning ("Error when reading from block %s.\n", block_id);
             goto checkout_blk_error;
         }
+        remain -= n;
+
+        if (crypt != NULL) {
+            if (seafile_decrypt_update (&ctx, buf->out, &dec_out_len,
+                                        buf->in, n) < 0) {
+                /* The context is cleaned up on failure. */
+                ctx_inited = FALSE;
+                g_warning ("Decryt block %s failed. \n", block_id);
+                goto checkout_blk_error;
+            }
+            if (writen (wfd, buf->out, dec_out_len) != dec_out_len) {
+                g_warning ("Failed to write the decryted block %s.\n",
+                           block_id);
+                goto checkout_blk_error;
+            }
+            *written += dec_out_len;
+        } else {
+            if (writen (wfd, buf->in, n) != n) {
+                g_warning ("Failed to write the decryted block %s.\n",
+                           block_id);
+                goto checkout_blk_error;
+            }
+            *written += n;
+        }
+    }
 
-        g_free (blk_content);
-        g_free (dec_out);
-        
-    } else {
-        /* not an encrypted block */
-        if (writen(wfd, blk_content, bmd->size) != bmd->size) {
+    if (crypt != NULL) {
+        /* Strip the padding in the last cipher block. */
+        ctx_inited = FALSE;
+        if (seafile_decrypt_final (&ctx, buf->out, &dec_out_len) < 0) {
+            g_warning ("Decryt block %s failed. \n", block_id);
+            goto checkout_blk_error;
+        }
+        if (writen (wfd, buf->out, dec_out_len) != dec_out_len) {
             g_warning ("Failed to write the decryted block %s.\n",
                        block_id);
             goto checkout_blk_error;
         }
-        g_free (blk_content);
+        *written += dec_out_len;
     }
 
+out:
     g_free (bmd);
     seaf_block_manager_close_block (block_mgr, handle);
     seaf_block_manager_block_handle_free (block_mgr, handle);
     return 0;
 
 checkout_blk_error:
-    
-    if (blk_content)
-        free (blk_content);
-    if (dec_out)
-        g_free (dec_out);
+    if (ctx_inited)
+        EVP_CIPHER_CTX_cleanup (&ctx);
     if (bmd)
         g_free (bmd);
 
@@ -232,6 +326,7 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
     int wfd;
     int i;
     char *tmp_path;
+    guint64 written = 0;
 
     seafile = seaf_fs_manager_get_seafile (mgr, file_id);
     if (!seafile) {
@@ -248,12 +343,30 @@ seaf_fs_manager_checkout_file (SeafFSManager *mgr,
         goto bad;
     }
 
+#ifdef HAVE_POSIX_FALLOCATE
+    /* Allocate the space at once, so that the file is less fragmented
+     * and running out of space is found before writing anything.
+     * Not all file systems support it, so errors are ignored.
+     */
+    if (seafile->file_size > 0)
+        posix_fallocate (wfd, 0, (off_t)seafile->file_size);
+#endif
+
     for (i = 0; i < seafile->n_blocks; ++i) {
         blk_id = seafile->blk_sha1s[i];
-        if (checkout_block (blk_id, wfd, crypt) < 0)
+        if (checkout_block (blk_id, wfd, crypt, &written) < 0)
             goto bad;
     }
 
+#ifdef HAVE_POSIX_FALLOCATE
+    /* Don't leave preallocated space as file content if the blocks
+     * don't add up to the file size. */
+    if (written != seafile->file_size && ftruncate (wfd, (off_t)written) < 0) {
+        g_warning ("Failed to truncate %s: %s.\n", tmp_path, strerror(errno));
+        goto bad;
+    }
+#endif
+
     close (wfd);
     wfd = -1;
     if (ccnet_rename (tmp_path, file_path) < 0) {
@@ -360,6 +473,31 @@ do_write_chunk (uint8_t *checksum, const char *buf, int len)
     return 0;
 }
 
+/*
+ * Blocks of the previous version of a file being re-indexed.
+ * Chunks found here are not written again.
+ */
+typedef struct IndexBase {
+    /* raw block id -> raw block id */
+    GHashTable     *blocks;
+    unsigned char  *ids;
+    gint            n_reused;
+} IndexBase;
+
+/*
+ * The base is the version recorded in the index, and GC keeps blocks of
+ * files in the index, so its blocks don't have to be checked.
+ */
+static gboolean
+block_reusable (IndexBase *base, const uint8_t *checksum)
+{
+    if (!base || !g_hash_table_lookup (base->blocks, checksum))
+        return FALSE;
+
+    g_atomic_int_inc (&base->n_reused);
+    return TRUE;
+}
+
 /* write the chunk and store its checksum */
 int
 seafile_write_chunk (CDCDescriptor *chunk,
@@ -390,7 +528,7 @@ seafile_write_chunk (CDCDescriptor *chunk,
         SHA1_Update (&ctx, encrypted_buf, enc_len);
         SHA1_Final (checksum, &ctx);
 
-        if (write_data)
+        if (write_data && !block_reusable (chunk->user_data, checksum))
             ret = do_write_chunk (checksum, encrypted_buf, enc_len);
         g_free (encrypted_buf);
     } else {
@@ -399,7 +537,7 @@ seafile_write_chunk (CDCDescriptor *chunk,
         SHA1_Update (&ctx, chunk->block_buf, chunk->len);
         SHA1_Final (checksum, &ctx);
 
-        if (write_data)
+        if (write_data && !block_reusable (chunk->user_data, checksum))
             ret = do_write_chunk (checksum, chunk->block_buf, chunk->len);
     }
 
@@ -412,14 +550,56 @@ create_cdc_for_empty_file (CDCFileDescriptor *cdc)
     memset (cdc, 0, sizeof(CDCFileDescriptor));
 }
 
+static IndexBase *
+index_base_new (Seafile *base)
+{
+    IndexBase *ib = g_new0 (IndexBase, 1);
+    unsigned char *id;
+    int i;
+
+    ib->blocks = g_hash_table_new (ccnet_sha1_hash, ccnet_sha1_equal);
+    ib->ids = g_new (unsigned char, base->n_blocks * 20 + 1);
+    for (i = 0; i < base->n_blocks; ++i) {
+        id = ib->ids + i * 20;
+        hex_to_rawdata (base->blk_sha1s[i], id, 20);
+        g_hash_table_insert (ib->blocks, id, id);
+    }
+
+    return ib;
+}
+
+static void
+index_base_free (IndexBase *ib)
+{
+    if (!ib)
+        return;
+    g_hash_table_destroy (ib->blocks);
+    g_free (ib->ids);
+    g_free (ib);
+}
+
 int
 seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               const char *file_path,
                               unsigned char sha1[],
                               SeafileCrypt *crypt)
+{
+    return seaf_fs_manager_index_blocks_with_base (mgr, file_path, sha1,
+                                                   crypt, NULL);
+}
+
+int
+seaf_fs_manager_index_blocks_with_base (SeafFSManager *mgr,
+                                        const char *file_path,
+                                        unsigned char sha1[],
+                                        SeafileCrypt *crypt,
+                                        const char *base_file_id)
 {
     struct stat sb;
     CDCFileDescriptor cdc;
+    Seafile *base = NULL;
+    IndexBase *ib = NULL;
+    int ret = 0;
 
     if (g_lstat (file_path, &sb) < 0) {
         g_warning ("Bad file %s: %s.\n", file_path, strerror(errno));
@@ -428,6 +608,14 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
 
     g_assert (S_ISREG(sb.st_mode));
 
+    if (base_file_id && sb.st_size > 0 &&
+        memcmp (base_file_id, EMPTY_SHA1, 40) != 0) {
+        /* The previous version may be gone, then just index from scratch. */
+        base = seaf_fs_manager_get_seafile (mgr, base_file_id);
+        if (base && base->n_blocks > 0)
+            ib = index_base_new (base);
+    }
+
     if (sb.st_size == 0) {
         /* handle empty file. */
         memset (sha1, 0, 20);
@@ -438,24 +626,140 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
         cdc.block_min_sz = cdc.block_sz >> 2;
         cdc.block_max_sz = cdc.block_sz << 2;
         cdc.write_block = seafile_write_chunk;
+        cdc.n_workers = CDC_DEFAULT_WORKERS;
+        cdc.user_data = ib;
         if (filename_chunk_cdc (file_path, &cdc, crypt, TRUE) < 0) {
             g_warning ("Failed to chunk file with CDC.\n");
-            return -1;
+            ret = -1;
+            goto out;
         }
         memcpy (sha1, cdc.file_sum, 20);
     }
 
+    if (ib)
+        g_debug ("[fs mgr] Reused %d of %u blocks for %s.\n",
+                 ib->n_reused, cdc.block_nr, file_path);
+
     if (write_seafile (mgr, (uint64_t)sb.st_size, &cdc) < 0) {
         g_warning ("Failed to write seafile for %s.\n", file_path);
-        return -1;
+        ret = -1;
     }
 
+out:
     if (cdc.blk_sha1s)
         free (cdc.blk_sha1s);
+    index_base_free (ib);
+    if (base)
+        seafile_unref (base);
+    return ret;
+}
 
+struct _SeafIndexStream {
+    SeafFSManager      *mgr;
+    CDCFileDescriptor   cdc;
+    CDCStream          *stream;
+};
+
+SeafIndexStream *
+seaf_fs_manager_index_stream_new (SeafFSManager *mgr,
+                                  SeafileCrypt *crypt,
+                                  guint64 file_size,
+                                  guint64 offset,
+                                  const unsigned char *blk_sha1s,
+                                  int n_blocks)
+{
+    SeafIndexStream *is = g_new0 (SeafIndexStream, 1);
+
+    is->mgr = mgr;
+    is->cdc.block_sz = calculate_chunk_size (file_size);
+    is->cdc.block_min_sz = is->cdc.block_sz >> 2;
+    is->cdc.block_max_sz = is->cdc.block_sz << 2;
+    is->cdc.write_block = seafile_write_chunk;
+    if (n_blocks > 0) {
+        is->cdc.blk_sha1s = malloc (n_blocks * 20);
+        memcpy (is->cdc.blk_sha1s, blk_sha1s, n_blocks * 20);
+        is->cdc.block_nr = n_blocks;
+    }
+
+    is->stream = cdc_stream_new (&is->cdc, crypt, TRUE, offset);
+    if (!is->stream) {
+        g_warning ("[fs mgr] Failed to create cdc stream.\n");
+        free (is->cdc.blk_sha1s);
+        g_free (is);
+        return NULL;
+    }
+
+    return is;
+}
+
+int
+seaf_fs_manager_index_stream_write (SeafIndexStream *is,
+                                    const char *buf,
+                                    int len)
+{
+    if (cdc_stream_update (is->stream, buf, (uint32_t)len) < 0) {
+        g_warning ("[fs mgr] Failed to chunk file data.\n");
+        return -1;
+    }
     return 0;
 }
 
+guint64
+seaf_fs_manager_index_stream_get_blocks (SeafIndexStream *is,
+                                         const unsigned char **blk_sha1s,
+                                         int *n_blocks)
+{
+    *blk_sha1s = is->cdc.blk_sha1s;
+    *n_blocks = is->cdc.block_nr;
+    return cdc_stream_get_offset (is->stream);
+}
+
+const char *
+seaf_fs_manager_index_stream_get_pending (SeafIndexStream *is, int *len)
+{
+    uint32_t n;
+    const char *data = cdc_stream_get_pending (is->stream, &n);
+
+    *len = (int)n;
+    return data;
+}
+
+int
+seaf_fs_manager_index_stream_finish (SeafIndexStream *is,
+                                     unsigned char sha1[],
+                                     guint64 *file_size)
+{
+    if (cdc_stream_finish (is->stream) < 0) {
+        g_warning ("[fs mgr] Failed to chunk file data.\n");
+        return -1;
+    }
+
+    *file_size = cdc_stream_get_offset (is->stream);
+    if (*file_size == 0) {
+        /* handle empty file. */
+        free (is->cdc.blk_sha1s);
+        create_cdc_for_empty_file (&is->cdc);
+    }
+    memcpy (sha1, is->cdc.file_sum, 20);
+
+    if (write_seafile (is->mgr, *file_size, &is->cdc) < 0) {
+        g_warning ("[fs mgr] Failed to write seafile.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+seaf_fs_manager_index_stream_free (SeafIndexStream *is)
+{
+    if (!is)
+        return;
+    cdc_stream_free (is->stream);
+    free (is->cdc.blk_sha1s);
+    g_free (is);
+}
+
 Seafile *
 seafile_from_data (const char *id, const void *data, int len)
 {
@@ -510,7 +814,7 @@ seafile_to_data (Seafile *seafile, int *len)
 void
 seafile_ref (Seafile *seafile)
 {
-    ++seafile->ref_count;
+    g_atomic_int_inc (&seafile->ref_count);
 }
 
 static void
@@ -533,10 +837,29 @@ seafile_unref (Seafile *seafile)
     if (!seafile)
         return;
 
-    if (--seafile->ref_count <= 0)
+    if (g_atomic_int_dec_and_test (&seafile->ref_count))
         seafile_free (seafile);
 }
 
+static void *
+cache_ref_seafile (void *obj)
+{
+    seafile_ref ((Seafile *)obj);
+    return obj;
+}
+
+static void
+cache_unref_seafile (void *obj)
+{
+    seafile_unref ((Seafile *)obj);
+}
+
+static guint32
+seafile_mem_size (Seafile *seafile)
+{
+    return sizeof(Seafile) + seafile->n_blocks * (sizeof(char *) + 41);
+}
+
 Seafile *
 seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
 {
@@ -544,14 +867,6 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
     int len;
     Seafile *seafile;
 
-#if 0
-    seafile = g_hash_table_lookup (mgr->priv->seafile_cache, file_id);
-    if (seafile) {
-        seafile_ref (seafile);
-        return seafile;
-    }
-#endif
-
     if (memcmp (file_id, EMPTY_SHA1, 40) == 0) {
         seafile = g_new0 (Seafile, 1);
         memset (seafile->file_id, '0', 40);
@@ -559,6 +874,12 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
         return seafile;
     }
 
+    if (mgr->priv->seafile_cache) {
+        seafile = seaf_obj_cache_lookup (mgr->priv->seafile_cache, file_id);
+        if (seafile)
+            return seafile;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, file_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read file %s.\n", file_id);
         return NULL;
@@ -567,13 +888,14 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id)
     seafile = seafile_from_data (file_id, data, len);
     g_free (data);
 
-#if 0
     /*
      * Add to cache. Also increase ref count.
      */
-    seafile_ref (seafile);
-    g_hash_table_insert (mgr->priv->seafile_cache, g_strdup(file_id), seafile);
-#endif
+    if (seafile && mgr->priv->seafile_cache) {
+        seafile_ref (seafile);
+        seaf_obj_cache_insert (mgr->priv->seafile_cache, file_id,
+                               seafile, seafile_mem_size (seafile));
+    }
 
     return seafile;
 }
@@ -638,6 +960,58 @@ seaf_dir_free (SeafDir *dir)
     g_free(dir);
 }
 
+SeafDir *
+seaf_dir_dup (SeafDir *dir)
+{
+    SeafDir *ret;
+    GList *ptr;
+
+    ret = g_new0 (SeafDir, 1);
+    memcpy (ret->dir_id, dir->dir_id, 41);
+    for (ptr = dir->entries; ptr; ptr = ptr->next)
+        ret->entries = g_list_prepend (ret->entries, seaf_dirent_dup (ptr->data));
+    ret->entries = g_list_reverse (ret->entries);
+
+    return ret;
+}
+
+void
+seaf_dir_ref (SeafDir *dir)
+{
+    g_atomic_int_inc (&dir->ref_count);
+}
+
+void
+seaf_dir_unref (SeafDir *dir)
+{
+    if (!dir)
+        return;
+
+    if (g_atomic_int_dec_and_test (&dir->ref_count))
+        seaf_dir_free (dir);
+}
+
+static void *
+cache_ref_seafdir (void *obj)
+{
+    seaf_dir_ref ((SeafDir *)obj);
+    return obj;
+}
+
+static void
+cache_unref_seafdir (void *obj)
+{
+    seaf_dir_unref ((SeafDir *)obj);
+}
+
+/* Names are stored inline in SeafDirent, so they're counted in its size. */
+static guint32
+seafdir_mem_size (SeafDir *dir)
+{
+    return sizeof(SeafDir) +
+        g_list_length (dir->entries) * (sizeof(SeafDirent) + sizeof(GList));
+}
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len)
 {
@@ -768,20 +1142,25 @@ seaf_dir_save (SeafFSManager *fs_mgr, SeafDir *dir)
 }
 
 SeafDir *
-seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id)
+seaf_fs_manager_get_seafdir_shared (SeafFSManager *mgr, const char *dir_id)
 {
     void *data;
     int len;
     SeafDir *dir;
 
-    /* TODO: add hash cache */
-
     if (memcmp (dir_id, EMPTY_SHA1, 40) == 0) {
         dir = g_new0 (SeafDir, 1);
         memset (dir->dir_id, '0', 40);
+        dir->ref_count = 1;
         return dir;
     }
 
+    if (mgr->priv->dir_cache) {
+        dir = seaf_obj_cache_lookup (mgr->priv->dir_cache, dir_id);
+        if (dir)
+            return dir;
+    }
+
     if (seaf_obj_store_read_obj (mgr->obj_store, dir_id, &data, &len) < 0) {
         g_warning ("[fs mgr] Failed to read dir %s.\n", dir_id);
         return NULL;
@@ -789,6 +1168,32 @@ seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id)
 
     dir = seaf_dir_from_data (dir_id, data, len);
     g_free (data);
+    if (!dir)
+        return NULL;
+    dir->ref_count = 1;
+
+    /* The cache takes its own reference. */
+    if (mgr->priv->dir_cache) {
+        seaf_dir_ref (dir);
+        seaf_obj_cache_insert (mgr->priv->dir_cache, dir_id,
+                               dir, seafdir_mem_size (dir));
+    }
+
+    return dir;
+}
+
+SeafDir *
+seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id)
+{
+    SeafDir *shared, *dir;
+
+    shared = seaf_fs_manager_get_seafdir_shared (mgr, dir_id);
+    if (!shared || !mgr->priv->dir_cache)
+        return shared;
+
+    /* Callers may modify the dir, so they get a private copy. */
+    dir = seaf_dir_dup (shared);
+    seaf_dir_unref (shared);
 
     return dir;
 }
@@ -856,12 +1261,15 @@ seaf_dirent_dup (SeafDirent *dent)
     return g_memdup (dent, sizeof(SeafDirent));
 }
 
+#define ID_SET_INIT_SIZE 1024
+
 BlockList *
 block_list_new ()
 {
     BlockList *bl = g_new0 (BlockList, 1);
 
-    bl->block_hash = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    bl->set_size = ID_SET_INIT_SIZE;
+    bl->id_set = g_malloc0 (bl->set_size * 20);
     bl->block_ids = g_ptr_array_new_with_free_func (g_free);
 
     return bl;
@@ -870,14 +1278,85 @@ block_list_new ()
 void
 block_list_free (BlockList *bl)
 {
-    if (bl->block_hash)
-        g_hash_table_destroy (bl->block_hash);
+    g_free (bl->id_set);
     g_ptr_array_free (bl->block_ids, TRUE);
     if (bl->block_map.bits != NULL)
         BitfieldDestruct (&bl->block_map);
     g_free (bl);
 }
 
+static const unsigned char zero_id[20];
+
+/*
+ * Returns the slot of @id in @set, or the empty slot where it should be
+ * added. The IDs are SHA1 hashes, so the first bytes are well spread.
+ */
+static unsigned char *
+id_set_slot (unsigned char *set, uint32_t set_size, const unsigned char *id)
+{
+    uint32_t mask = set_size - 1;
+    uint32_t i;
+    unsigned char *slot;
+
+    memcpy (&i, id, sizeof(i));
+    for (i &= mask; ; i = (i + 1) & mask) {
+        slot = set + i * 20;
+        if (memcmp (slot, id, 20) == 0 || memcmp (slot, zero_id, 20) == 0)
+            return slot;
+    }
+}
+
+static void
+id_set_grow (BlockList *bl)
+{
+    uint32_t new_size = bl->set_size * 2;
+    unsigned char *new_set = g_malloc0 (new_size * 20);
+    unsigned char *old;
+    uint32_t i;
+
+    for (i = 0; i < bl->set_size; ++i) {
+        old = bl->id_set + i * 20;
+        if (memcmp (old, zero_id, 20) != 0)
+            memcpy (id_set_slot (new_set, new_size, old), old, 20);
+    }
+
+    g_free (bl->id_set);
+    bl->id_set = new_set;
+    bl->set_size = new_size;
+}
+
+static gboolean
+block_list_contains (BlockList *bl, const unsigned char *id)
+{
+    if (memcmp (id, zero_id, 20) == 0)
+        return bl->has_zero_id;
+    return (memcmp (id_set_slot (bl->id_set, bl->set_size, id), zero_id, 20) != 0);
+}
+
+/* Returns FALSE if @id is already in the set. */
+static gboolean
+block_list_add_id (BlockList *bl, const unsigned char *id)
+{
+    unsigned char *slot;
+
+    if (memcmp (id, zero_id, 20) == 0) {
+        if (bl->has_zero_id)
+            return FALSE;
+        bl->has_zero_id = TRUE;
+        return TRUE;
+    }
+
+    /* Keep the load factor under 1/2. */
+    if ((bl->n_blocks + 1) * 2 > bl->set_size)
+        id_set_grow (bl);
+
+    slot = id_set_slot (bl->id_set, bl->set_size, id);
+    if (memcmp (slot, zero_id, 20) != 0)
+        return FALSE;
+    memcpy (slot, id, 20);
+    return TRUE;
+}
+
 /** 
  * Determine which blocks exist in local.
  */
@@ -885,20 +1364,27 @@ void
 block_list_generate_bitmap (BlockList *bl)
 {
     SeafBlockManager *blk_mgr = seaf->block_mgr;
-    char *block_id;
+    gboolean *exists;
     size_t i = 0;
 
     BitfieldConstruct (&bl->block_map, bl->n_blocks);
+
+    exists = g_new0 (gboolean, bl->n_blocks);
+    seaf_block_manager_blocks_exist (blk_mgr,
+                                     (const char **)bl->block_ids->pdata,
+                                     bl->n_blocks, exists);
     for (i = 0; i < bl->n_blocks; ++i) {
-        block_id = g_ptr_array_index (bl->block_ids, i);
-        if (seaf_block_manager_block_exists (blk_mgr, block_id)) {
+        if (exists[i]) {
             BitfieldAdd (&bl->block_map, i);
             ++bl->n_valid_blocks;
         }
     }
+    g_free (exists);
 
-    g_hash_table_destroy (bl->block_hash);
-    bl->block_hash = NULL;
+    /* No more blocks will be added. */
+    g_free (bl->id_set);
+    bl->id_set = NULL;
+    bl->set_size = 0;
 }
 
 void
@@ -921,11 +1407,12 @@ block_list_serialize (BlockList *bl, uint8_t **buffer, uint32_t *len)
 void
 block_list_insert (BlockList *bl, const char *block_id)
 {
-    if (g_hash_table_lookup (bl->block_hash, block_id))
+    unsigned char id[20];
+
+    hex_to_rawdata (block_id, id, 20);
+    if (!block_list_add_id (bl, id))
         return;
 
-    char *key = g_strdup(block_id);
-    g_hash_table_insert (bl->block_hash, key, key);
     g_ptr_array_add (bl->block_ids, g_strdup(block_id));
     ++bl->n_blocks;
 }
@@ -936,15 +1423,14 @@ block_list_difference (BlockList *bl1, BlockList *bl2)
     BlockList *bl;
     int i;
     char *block_id;
-    char *key;
+    unsigned char id[20];
 
     bl = block_list_new ();
 
     for (i = 0; i < bl1->block_ids->len; ++i) {
         block_id = g_ptr_array_index (bl1->block_ids, i);
-        if (g_hash_table_lookup (bl2->block_hash, block_id) == NULL) {
-            key = g_strdup(block_id);
-            g_hash_table_insert (bl->block_hash, key, key);
+        hex_to_rawdata (block_id, id, 20);
+        if (!block_list_contains (bl2, id) && block_list_add_id (bl, id)) {
             g_ptr_array_add (bl->block_ids, g_strdup(block_id));
             ++bl->n_blocks;
         }
@@ -989,7 +1475,7 @@ traverse_dir (SeafFSManager *mgr,
     GList *p;
     SeafDirent *seaf_dent;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, id);
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, id);
     if (!dir) {
         g_warning ("[fs-mgr]get seafdir %s failed\n", id);
         return -1;
@@ -999,18 +1485,18 @@ traverse_dir (SeafFSManager *mgr,
 
         if (S_ISREG(seaf_dent->mode)) {
             if (traverse_file (mgr, seaf_dent->id, callback, user_data) < 0) {
-                seaf_dir_free (dir);
+                seaf_dir_unref (dir);
                 return -1;
             }
         } else if (S_ISDIR(seaf_dent->mode)) {
             if (traverse_dir (mgr, seaf_dent->id, callback, user_data) < 0) {
-                seaf_dir_free (dir);
+                seaf_dir_unref (dir);
                 return -1;
             }
         }
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
     return 0;
 }
 
@@ -1039,6 +1525,220 @@ seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                           bl);
 }
 
+static int
+diff_file_blocks (SeafFSManager *mgr,
+                  const char *id,
+                  const char *base_id,
+                  BlockList *bl)
+{
+    Seafile *seafile, *base;
+    BlockList *base_bl;
+    unsigned char raw[20];
+    int i;
+
+    if (memcmp (id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    seafile = seaf_fs_manager_get_seafile (mgr, id);
+    if (!seafile) {
+        g_warning ("[fs mgr] Failed to find file %s.\n", id);
+        return -1;
+    }
+
+    /* The base file is only used to filter the blocks, so it's fine
+     * if it can't be loaded.
+     */
+    base_bl = block_list_new ();
+    if (memcmp (base_id, EMPTY_SHA1, 40) != 0) {
+        base = seaf_fs_manager_get_seafile (mgr, base_id);
+        if (base) {
+            for (i = 0; i < base->n_blocks; ++i)
+                block_list_insert (base_bl, base->blk_sha1s[i]);
+            seafile_unref (base);
+        }
+    }
+
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        hex_to_rawdata (seafile->blk_sha1s[i], raw, 20);
+        if (!block_list_contains (base_bl, raw))
+            block_list_insert (bl, seafile->blk_sha1s[i]);
+    }
+
+    block_list_free (base_bl);
+    seafile_unref (seafile);
+
+    return 0;
+}
+
+static int
+diff_dir_blocks (SeafFSManager *mgr,
+                 const char *id,
+                 const char *base_id,
+                 BlockList *bl)
+{
+    SeafDir *dir, *base;
+    GHashTable *base_dents;
+    GList *p;
+    SeafDirent *dent, *base_dent;
+    int ret = 0;
+
+    if (strcmp (id, base_id) == 0)
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, id);
+    if (!dir) {
+        g_warning ("[fs mgr] Failed to find dir %s.\n", id);
+        return -1;
+    }
+
+    base = seaf_fs_manager_get_seafdir_shared (mgr, base_id);
+    if (!base) {
+        g_warning ("[fs mgr] Failed to find dir %s.\n", base_id);
+        seaf_dir_unref (dir);
+        return -1;
+    }
+
+    base_dents = g_hash_table_new (g_str_hash, g_str_equal);
+    for (p = base->entries; p; p = p->next) {
+        base_dent = p->data;
+        g_hash_table_insert (base_dents, base_dent->name, base_dent);
+    }
+
+    for (p = dir->entries; p && ret == 0; p = p->next) {
+        dent = p->data;
+        base_dent = g_hash_table_lookup (base_dents, dent->name);
+        if (base_dent && strcmp (dent->id, base_dent->id) == 0 &&
+            dent->mode == base_dent->mode)
+            continue;
+
+        if (S_ISREG(dent->mode)) {
+            if (base_dent && S_ISREG(base_dent->mode))
+                ret = diff_file_blocks (mgr, dent->id, base_dent->id, bl);
+            else
+                ret = traverse_file (mgr, dent->id,
+                                     (TraverseFSTreeCallback)block_list_insert,
+                                     bl);
+        } else if (S_ISDIR(dent->mode)) {
+            if (base_dent && S_ISDIR(base_dent->mode))
+                ret = diff_dir_blocks (mgr, dent->id, base_dent->id, bl);
+            else
+                ret = traverse_dir (mgr, dent->id,
+                                    (TraverseFSTreeCallback)block_list_insert,
+                                    bl);
+        }
+    }
+
+    g_hash_table_destroy (base_dents);
+    seaf_dir_unref (base);
+    seaf_dir_unref (dir);
+    return ret;
+}
+
+int
+seaf_fs_manager_populate_blocklist_diff (SeafFSManager *mgr,
+                                         const char *root_id,
+                                         const char *base_root_id,
+                                         BlockList *bl)
+{
+    return diff_dir_blocks (mgr, root_id, base_root_id, bl);
+}
+
+/* @base_id is NULL if there is no directory at the same path in the base. */
+static int
+diff_dir_objects (SeafFSManager *mgr,
+                  const char *id,
+                  const char *base_id,
+                  ObjectList *ol)
+{
+    SeafDir *dir, *base = NULL;
+    GHashTable *base_dents;
+    GList *p;
+    SeafDirent *dent, *base_dent;
+    int ret = 0;
+
+    if (strcmp (id, EMPTY_SHA1) == 0 ||
+        (base_id && strcmp (id, base_id) == 0))
+        return 0;
+
+    /* Already collected from another root. */
+    if (!object_list_insert (ol, id))
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, id);
+    if (!dir) {
+        g_warning ("[fs mgr] Failed to find dir %s.\n", id);
+        return -1;
+    }
+
+    base_dents = g_hash_table_new (g_str_hash, g_str_equal);
+    if (base_id) {
+        base = seaf_fs_manager_get_seafdir_shared (mgr, base_id);
+        if (!base) {
+            g_warning ("[fs mgr] Failed to find dir %s.\n", base_id);
+            ret = -1;
+            goto out;
+        }
+        for (p = base->entries; p; p = p->next) {
+            base_dent = p->data;
+            g_hash_table_insert (base_dents, base_dent->name, base_dent);
+        }
+    }
+
+    for (p = dir->entries; p && ret == 0; p = p->next) {
+        dent = p->data;
+        if (strcmp (dent->id, EMPTY_SHA1) == 0)
+            continue;
+
+        base_dent = g_hash_table_lookup (base_dents, dent->name);
+        if (base_dent && strcmp (dent->id, base_dent->id) == 0)
+            continue;
+
+        if (S_ISDIR(dent->mode)) {
+            if (base_dent && S_ISDIR(base_dent->mode))
+                ret = diff_dir_objects (mgr, dent->id, base_dent->id, ol);
+            else
+                ret = diff_dir_objects (mgr, dent->id, NULL, ol);
+        } else {
+            object_list_insert (ol, dent->id);
+        }
+    }
+
+out:
+    g_hash_table_destroy (base_dents);
+    seaf_dir_unref (base);
+    seaf_dir_unref (dir);
+    return ret;
+}
+
+int
+seaf_fs_manager_diff_fs_objects (SeafFSManager *mgr,
+                                 const char *root_id,
+                                 const char *base_root_id,
+                                 ObjectList *ol)
+{
+    return diff_dir_objects (mgr, root_id, base_root_id, ol);
+}
+
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafObjCacheStats *stats)
+{
+    SeafObjCacheStats file_stats;
+
+    memset (stats, 0, sizeof(SeafObjCacheStats));
+    if (!mgr->priv->dir_cache)
+        return;
+
+    seaf_obj_cache_get_stats (mgr->priv->dir_cache, stats);
+    seaf_obj_cache_get_stats (mgr->priv->seafile_cache, &file_stats);
+
+    stats->hits += file_stats.hits;
+    stats->misses += file_stats.misses;
+    stats->evictions += file_stats.evictions;
+    stats->n_objects += file_stats.n_objects;
+    stats->size += file_stats.size;
+    stats->capacity += file_stats.capacity;
+}
+
 gboolean
 seaf_fs_manager_object_exists (SeafFSManager *mgr, const char *id)
 {
@@ -1075,7 +1775,7 @@ get_dir_size (SeafFSManager *mgr, const char *id)
     int result;
     GList *p;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, id);
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, id);
     if (!dir)
         return -1;
 
@@ -1085,21 +1785,21 @@ get_dir_size (SeafFSManager *mgr, const char *id)
         if (S_ISREG(seaf_dent->mode)) {
             result = get_file_size (mgr, seaf_dent->id);
             if (result < 0) {
-                seaf_dir_free (dir);
+                seaf_dir_unref (dir);
                 return result;
             }
             size += result;
         } else if (S_ISDIR(seaf_dent->mode)) {
             result = get_dir_size (mgr, seaf_dent->id);
             if (result < 0) {
-                seaf_dir_free (dir);
+                seaf_dir_unref (dir);
                 return result;
             }
             size += result;
         }
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
     return size;
 }
 
@@ -1121,7 +1821,7 @@ count_dir_files (SeafFSManager *mgr, const char *id)
     int result;
     GList *p;
 
-    dir = seaf_fs_manager_get_seafdir (mgr, id);
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, id);
     if (!dir)
         return -1;
 
@@ -1133,14 +1833,14 @@ count_dir_files (SeafFSManager *mgr, const char *id)
         } else if (S_ISDIR(seaf_dent->mode)) {
             result = count_dir_files (mgr, seaf_dent->id);
             if (result < 0) {
-                seaf_dir_free (dir);
+                seaf_dir_unref (dir);
                 return result;
             }
             count += result;
         }
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
     return count;
 }
 
@@ -1154,10 +1854,10 @@ seaf_fs_manager_count_fs_files (SeafFSManager *mgr,
 }
 
 SeafDir *
-seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
-                                     const char *root_id,
-                                     const char *path,
-                                     GError **error)
+seaf_fs_manager_get_seafdir_by_path_shared (SeafFSManager *mgr,
+                                            const char *root_id,
+                                            const char *path,
+                                            GError **error)
 {
     SeafDir *dir;
     SeafDirent *dent;
@@ -1165,9 +1865,10 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
     char *name, *saveptr;
     char *tmp_path = g_strdup(path);
 
-    dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
+    dir = seaf_fs_manager_get_seafdir_shared (mgr, dir_id);
     if (!dir) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, "directory is missing");
+        g_free (tmp_path);
         return NULL;
     }
 
@@ -1186,14 +1887,15 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
         if (!l) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST,
                          "Path does not exists %s", path);
-            seaf_dir_free (dir);
+            seaf_dir_unref (dir);
             dir = NULL;
             break;
         }
 
+        /* dir_id points into prev, so only release it after the lookup. */
         SeafDir *prev = dir;
-        dir = seaf_fs_manager_get_seafdir (mgr, dir_id);
-        seaf_dir_free (prev);
+        dir = seaf_fs_manager_get_seafdir_shared (mgr, dir_id);
+        seaf_dir_unref (prev);
 
         if (!dir) {
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_DIR_MISSING, 
@@ -1208,6 +1910,26 @@ seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
     return dir;
 }
 
+SeafDir *
+seaf_fs_manager_get_seafdir_by_path (SeafFSManager *mgr,
+                                     const char *root_id,
+                                     const char *path,
+                                     GError **error)
+{
+    SeafDir *shared, *dir;
+
+    shared = seaf_fs_manager_get_seafdir_by_path_shared (mgr, root_id,
+                                                         path, error);
+    if (!shared || !mgr->priv->dir_cache)
+        return shared;
+
+    /* Only copy the last dir, callers may modify it. */
+    dir = seaf_dir_dup (shared);
+    seaf_dir_unref (shared);
+
+    return dir;
+}
+
 char *
 seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
                                  const char *root_id,
@@ -1228,7 +1950,7 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
 
     slash = strrchr (copy, '/');
     if (!slash) {
-        base_dir = seaf_fs_manager_get_seafdir (mgr, root_id);
+        base_dir = seaf_fs_manager_get_seafdir_shared (mgr, root_id);
         if (!base_dir) {
             g_warning ("Failed to find root dir %s.\n", root_id);
             g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL, " ");
@@ -1239,10 +1961,10 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
         *slash = 0;
         name = slash + 1;
         GError *tmp_error = NULL;
-        base_dir = seaf_fs_manager_get_seafdir_by_path (mgr,
-                                                        root_id,
-                                                        copy,
-                                                        &tmp_error);
+        base_dir = seaf_fs_manager_get_seafdir_by_path_shared (mgr,
+                                                               root_id,
+                                                               copy,
+                                                               &tmp_error);
         if (tmp_error &&
             !g_error_matches(tmp_error,
                              SEAFILE_DOMAIN,
@@ -1270,7 +1992,7 @@ seaf_fs_manager_path_to_obj_id (SeafFSManager *mgr,
 
 out:
     if (base_dir)
-        seaf_dir_free (base_dir);
+        seaf_dir_unref (base_dir);
     g_free (copy);
     return file_id;
 }
@@ -5,10 +5,12 @@
 
 #include <glib.h>
 #include "bitfield.h"
+#include "object-list.h"
 
 #include "seafile-object.h"
 
 #include "obj-store.h"
+#include "obj-cache.h"
 
 #include "cdc/cdc.h"
 #include "../common/seafile-crypt.h"
@@ -52,6 +54,8 @@ struct _SeafDirent {
 struct _SeafDir {
     char   dir_id[41];
     GList *entries;
+    /* Only used by shared dirs, see seaf_fs_manager_get_seafdir_shared(). */
+    int    ref_count;
 };
 
 SeafDir *
@@ -60,6 +64,17 @@ seaf_dir_new (const char *id, GList *entries, gint64 ctime);
 void 
 seaf_dir_free (SeafDir *dir);
 
+/* Deep copy of @dir and its entries. */
+SeafDir *
+seaf_dir_dup (SeafDir *dir);
+
+void
+seaf_dir_ref (SeafDir *dir);
+
+/* Release a dir returned by seaf_fs_manager_get_seafdir_shared(). */
+void
+seaf_dir_unref (SeafDir *dir);
+
 SeafDir *
 seaf_dir_from_data (const char *dir_id, const uint8_t *data, int len);
 
@@ -76,8 +91,14 @@ SeafDirent *
 seaf_dirent_dup (SeafDirent *dent);
 
 typedef struct {
-    /* TODO: GHashTable may be inefficient when we have large number of IDs. */
-    GHashTable  *block_hash;
+    /*
+     * Binary IDs of the blocks in an open-addressed hash table, used to
+     * skip duplicates while the list is built. A slot of all zeros is
+     * empty, so the zero ID is recorded by @has_zero_id.
+     */
+    unsigned char *id_set;
+    uint32_t     set_size;      /* number of slots, a power of 2 */
+    gboolean     has_zero_id;
     GPtrArray   *block_ids;
     Bitfield     block_map;
     uint32_t     n_blocks;
@@ -155,6 +176,64 @@ seaf_fs_manager_index_blocks (SeafFSManager *mgr,
                               unsigned char sha1[],
                               SeafileCrypt *crypt);
 
+/*
+ * Like seaf_fs_manager_index_blocks(), for a file whose previous version
+ * is @base_file_id. The file is still chunked and hashed as a whole, but
+ * chunks which are blocks of the previous version are not written again.
+ * Since chunk boundaries are content defined, they resync shortly after
+ * a changed region, so only blocks around the changes are written.
+ * @base_file_id can be NULL.
+ */
+int
+seaf_fs_manager_index_blocks_with_base (SeafFSManager *mgr,
+                                        const char *file_path,
+                                        unsigned char sha1[],
+                                        SeafileCrypt *crypt,
+                                        const char *base_file_id);
+
+/*
+ * Index a file whose content is received piece by piece. Blocks are
+ * written while the data is fed, the seafile object is written by
+ * seaf_fs_manager_index_stream_finish().
+ *
+ * @file_size is the expected size of the file, which decides the
+ * chunk size. To continue an interrupted stream, pass the offset and
+ * block list returned by seaf_fs_manager_index_stream_get_blocks(),
+ * then feed the pending data and the data after it.
+ */
+typedef struct _SeafIndexStream SeafIndexStream;
+
+SeafIndexStream *
+seaf_fs_manager_index_stream_new (SeafFSManager *mgr,
+                                  SeafileCrypt *crypt,
+                                  guint64 file_size,
+                                  guint64 offset,
+                                  const unsigned char *blk_sha1s,
+                                  int n_blocks);
+
+int
+seaf_fs_manager_index_stream_write (SeafIndexStream *is,
+                                    const char *buf,
+                                    int len);
+
+/* Returns the offset up to which data has been written to blocks. */
+guint64
+seaf_fs_manager_index_stream_get_blocks (SeafIndexStream *is,
+                                         const unsigned char **blk_sha1s,
+                                         int *n_blocks);
+
+/* Data after the offset returned above, which is not in blocks yet. */
+const char *
+seaf_fs_manager_index_stream_get_pending (SeafIndexStream *is, int *len);
+
+int
+seaf_fs_manager_index_stream_finish (SeafIndexStream *is,
+                                     unsigned char sha1[],
+                                     guint64 *file_size);
+
+void
+seaf_fs_manager_index_stream_free (SeafIndexStream *is);
+
 uint32_t
 seaf_fs_manager_get_type (SeafFSManager *mgr, const char *id);
 
@@ -164,6 +243,14 @@ seaf_fs_manager_get_seafile (SeafFSManager *mgr, const char *file_id);
 SeafDir *
 seaf_fs_manager_get_seafdir (SeafFSManager *mgr, const char *dir_id);
 
+/*
+ * Same as seaf_fs_manager_get_seafdir(), but the returned dir may be
+ * shared with the object cache and other threads, so it's not copied.
+ * It must not be modified, and should be released with seaf_dir_unref().
+ */
+SeafDir *
+seaf_fs_manager_get_seafdir_shared (SeafFSManager *mgr, const char *dir_id);
+
 /* Make sure entries in the returned dir is sorted in descending order.
  */
 SeafDir *
@@ -174,6 +261,29 @@ seaf_fs_manager_populate_blocklist (SeafFSManager *mgr,
                                     const char *root_id,
                                     BlockList *bl);
 
+/*
+ * Add the blocks of the files in @root_id which are not in @base_root_id
+ * at the same path. Sub-trees with the same ID in both trees are skipped
+ * without being loaded. For a changed file, blocks also found in the old
+ * version of the file are not added.
+ */
+int
+seaf_fs_manager_populate_blocklist_diff (SeafFSManager *mgr,
+                                         const char *root_id,
+                                         const char *base_root_id,
+                                         BlockList *bl);
+
+/*
+ * Add to @ol the IDs of the fs objects under @root_id (and @root_id itself)
+ * which are not in @base_root_id at the same path. Sub-trees with the same
+ * ID in both trees are skipped without being loaded.
+ */
+int
+seaf_fs_manager_diff_fs_objects (SeafFSManager *mgr,
+                                 const char *root_id,
+                                 const char *base_root_id,
+                                 ObjectList *ol);
+
 typedef void (*TraverseFSTreeCallback) (void *user_data, const char *block_id);
 
 int
@@ -185,6 +295,14 @@ seaf_fs_manager_traverse_tree (SeafFSManager *mgr,
 gboolean
 seaf_fs_manager_object_exists (SeafFSManager *mgr, const char *id);
 
+/*
+ * Get hit/miss/eviction counters of the decoded dir and file object caches.
+ * The size of the caches is set by "cache_size" (in MB) in the [fs] section
+ * of seafile.conf.
+ */
+void
+seaf_fs_manager_get_cache_stats (SeafFSManager *mgr, SeafObjCacheStats *stats);
+
 gint64
 seaf_fs_manager_get_fs_size (SeafFSManager *mgr, const char *root_id);
 
@@ -207,6 +325,17 @@ seaf_fs_manager_get_seafdir_by_path(SeafFSManager *mgr,
                                     const char *root_id,
                                     const char *path,
                                     GError **error);
+
+/*
+ * Same as seaf_fs_manager_get_seafdir_by_path(), but the returned dir is
+ * shared, see seaf_fs_manager_get_seafdir_shared().
+ */
+SeafDir *
+seaf_fs_manager_get_seafdir_by_path_shared (SeafFSManager *mgr,
+                                            const char *root_id,
+                                            const char *path,
+                                            GError **error);
+
 char *
 seaf_fs_manager_get_seafile_id_by_path (SeafFSManager *mgr,
                                         const char *root_id,
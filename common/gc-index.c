@@ -0,0 +1,588 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <fcntl.h>
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+#include "seafile-session.h"
+#include "utils.h"
+#include "gc-index.h"
+
+#define INDEX_MAGIC "SGCI"
+#define INDEX_VERSION 2
+
+typedef struct IndexHeader {
+    char    magic[4];
+    guint32 version;
+    guint32 n_heads;
+    guint32 n_commits;
+    guint32 n_fs;
+    guint32 n_blocks;
+    guint32 n_dropped;
+} IndexHeader;
+
+/*
+ * A set of binary IDs. IDs loaded from disk are kept in a sorted array,
+ * IDs added afterwards go to a hash table until the set is merged.
+ */
+typedef struct IDSet {
+    unsigned char *ids;
+    guint32        n_ids;
+    GHashTable    *added;
+} IDSet;
+
+struct GCRepoIndex {
+    char           repo_id[37];
+    char          *path;
+
+    unsigned char *heads;
+    guint32        n_heads;
+
+    IDSet          commits;
+    IDSet          fs;
+    IDSet          blocks;
+    /* Blocks dropped by a rebuild and not checked by GC yet. */
+    IDSet          dropped;
+
+    /* Number of commits and fs objects read in this update. */
+    guint64        n_visited;
+};
+
+static void
+id_set_init (IDSet *set, const unsigned char *ids, guint32 n_ids)
+{
+    set->ids = g_memdup (ids, n_ids * GC_INDEX_ID_LEN);
+    set->n_ids = n_ids;
+    set->added = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                        g_free, NULL);
+}
+
+static void
+id_set_destroy (IDSet *set)
+{
+    g_free (set->ids);
+    g_hash_table_destroy (set->added);
+    memset (set, 0, sizeof(IDSet));
+}
+
+static gboolean
+id_set_contains (IDSet *set, const unsigned char *id)
+{
+    if (set->n_ids > 0 &&
+        bsearch (id, set->ids, set->n_ids, GC_INDEX_ID_LEN, raw_id_cmp) != NULL)
+        return TRUE;
+
+    return (g_hash_table_lookup (set->added, id) != NULL);
+}
+
+/*
+ * Returns FALSE if @id is already in the set.
+ */
+static gboolean
+id_set_add (IDSet *set, const unsigned char *id)
+{
+    unsigned char *key;
+
+    if (id_set_contains (set, id))
+        return FALSE;
+
+    key = g_memdup (id, GC_INDEX_ID_LEN);
+    g_hash_table_insert (set->added, key, key);
+    return TRUE;
+}
+
+/*
+ * Merge added IDs into the sorted array.
+ */
+static void
+id_set_merge (IDSet *set)
+{
+    guint32 n_added = g_hash_table_size (set->added);
+    unsigned char *added, *merged, *p, *q, *dst;
+    unsigned char *p_end, *q_end;
+    GHashTableIter iter;
+    gpointer key;
+
+    if (n_added == 0)
+        return;
+
+    added = g_malloc (n_added * GC_INDEX_ID_LEN);
+    dst = added;
+    g_hash_table_iter_init (&iter, set->added);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        memcpy (dst, key, GC_INDEX_ID_LEN);
+        dst += GC_INDEX_ID_LEN;
+    }
+    qsort (added, n_added, GC_INDEX_ID_LEN, raw_id_cmp);
+
+    merged = g_malloc ((set->n_ids + n_added) * GC_INDEX_ID_LEN);
+    p = set->ids;
+    p_end = set->ids + set->n_ids * GC_INDEX_ID_LEN;
+    q = added;
+    q_end = added + n_added * GC_INDEX_ID_LEN;
+    dst = merged;
+    while (p < p_end || q < q_end) {
+        if (q == q_end || (p < p_end && raw_id_cmp (p, q) < 0)) {
+            memcpy (dst, p, GC_INDEX_ID_LEN);
+            p += GC_INDEX_ID_LEN;
+        } else {
+            memcpy (dst, q, GC_INDEX_ID_LEN);
+            q += GC_INDEX_ID_LEN;
+        }
+        dst += GC_INDEX_ID_LEN;
+    }
+
+    g_free (added);
+    g_free (set->ids);
+    set->ids = merged;
+    set->n_ids += n_added;
+    g_hash_table_remove_all (set->added);
+}
+
+static GCRepoIndex *
+index_new (const char *path, const char *repo_id)
+{
+    GCRepoIndex *index = g_new0 (GCRepoIndex, 1);
+
+    memcpy (index->repo_id, repo_id, 36);
+    index->path = g_strdup (path);
+
+    return index;
+}
+
+static gboolean
+load_index_file (GCRepoIndex *index)
+{
+    char *contents = NULL;
+    gsize len;
+    IndexHeader hdr;
+    guint64 n_total;
+    const unsigned char *p;
+
+    if (!g_file_get_contents (index->path, &contents, &len, NULL))
+        return FALSE;
+
+    if (len < sizeof(hdr))
+        goto corrupt;
+
+    memcpy (&hdr, contents, sizeof(hdr));
+    if (memcmp (hdr.magic, INDEX_MAGIC, 4) != 0 ||
+        ntohl (hdr.version) != INDEX_VERSION)
+        goto corrupt;
+
+    n_total = (guint64)ntohl (hdr.n_heads) + ntohl (hdr.n_commits) +
+        ntohl (hdr.n_fs) + ntohl (hdr.n_blocks) + ntohl (hdr.n_dropped);
+    if (len != sizeof(hdr) + n_total * GC_INDEX_ID_LEN)
+        goto corrupt;
+
+    p = (const unsigned char *)contents + sizeof(hdr);
+
+    index->n_heads = ntohl (hdr.n_heads);
+    index->heads = g_memdup (p, index->n_heads * GC_INDEX_ID_LEN);
+    p += index->n_heads * GC_INDEX_ID_LEN;
+
+    id_set_init (&index->commits, p, ntohl (hdr.n_commits));
+    p += index->commits.n_ids * GC_INDEX_ID_LEN;
+
+    id_set_init (&index->fs, p, ntohl (hdr.n_fs));
+    p += index->fs.n_ids * GC_INDEX_ID_LEN;
+
+    id_set_init (&index->blocks, p, ntohl (hdr.n_blocks));
+    p += index->blocks.n_ids * GC_INDEX_ID_LEN;
+
+    id_set_init (&index->dropped, p, ntohl (hdr.n_dropped));
+
+    g_free (contents);
+    return TRUE;
+
+corrupt:
+    g_warning ("[GC] Index file %s is corrupted, will rebuild it.\n",
+               index->path);
+    g_free (contents);
+    return FALSE;
+}
+
+GCRepoIndex *
+gc_repo_index_load (const char *index_dir, const char *repo_id)
+{
+    GCRepoIndex *index;
+    char *path;
+
+    path = g_build_filename (index_dir, repo_id, NULL);
+    index = index_new (path, repo_id);
+    g_free (path);
+
+    if (!load_index_file (index)) {
+        id_set_init (&index->commits, NULL, 0);
+        id_set_init (&index->fs, NULL, 0);
+        id_set_init (&index->blocks, NULL, 0);
+        id_set_init (&index->dropped, NULL, 0);
+    }
+
+    return index;
+}
+
+void
+gc_repo_index_free (GCRepoIndex *index)
+{
+    if (!index)
+        return;
+
+    g_free (index->path);
+    g_free (index->heads);
+    id_set_destroy (&index->commits);
+    id_set_destroy (&index->fs);
+    id_set_destroy (&index->blocks);
+    id_set_destroy (&index->dropped);
+    g_free (index);
+}
+
+static int
+index_file (GCRepoIndex *index, const char *file_id)
+{
+    unsigned char raw[GC_INDEX_ID_LEN];
+    Seafile *seafile;
+    int i;
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    hex_to_rawdata (file_id, raw, GC_INDEX_ID_LEN);
+    if (!id_set_add (&index->fs, raw))
+        return 0;
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!seafile) {
+        g_warning ("[GC] Failed to find file %s.\n", file_id);
+        return -1;
+    }
+    ++index->n_visited;
+
+    for (i = 0; i < seafile->n_blocks; ++i) {
+        hex_to_rawdata (seafile->blk_sha1s[i], raw, GC_INDEX_ID_LEN);
+        id_set_add (&index->blocks, raw);
+    }
+
+    seafile_unref (seafile);
+    return 0;
+}
+
+/*
+ * Sub-trees already in the index are skipped, so unchanged parts of
+ * the tree are never read again.
+ */
+static int
+index_dir (GCRepoIndex *index, const char *dir_id)
+{
+    unsigned char raw[GC_INDEX_ID_LEN];
+    SeafDir *dir;
+    SeafDirent *dent;
+    GList *p;
+    int ret = 0;
+
+    if (memcmp (dir_id, EMPTY_SHA1, 40) == 0)
+        return 0;
+
+    hex_to_rawdata (dir_id, raw, GC_INDEX_ID_LEN);
+    if (!id_set_add (&index->fs, raw))
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir_shared (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        g_warning ("[GC] Failed to find dir %s.\n", dir_id);
+        return -1;
+    }
+    ++index->n_visited;
+
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+        if (S_ISREG(dent->mode))
+            ret = index_file (index, dent->id);
+        else if (S_ISDIR(dent->mode))
+            ret = index_dir (index, dent->id);
+        if (ret < 0)
+            break;
+    }
+
+    seaf_dir_unref (dir);
+    return ret;
+}
+
+typedef struct {
+    GCRepoIndex *index;
+    /* Which of the old heads are reached in this update. */
+    gboolean    *head_found;
+} UpdateData;
+
+static void
+mark_head_found (UpdateData *data, const unsigned char *raw)
+{
+    GCRepoIndex *index = data->index;
+    guint32 i;
+
+    for (i = 0; i < index->n_heads; ++i) {
+        if (memcmp (raw, index->heads + i * GC_INDEX_ID_LEN,
+                    GC_INDEX_ID_LEN) == 0)
+            data->head_found[i] = TRUE;
+    }
+}
+
+static gboolean
+index_commit (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    UpdateData *data = vdata;
+    GCRepoIndex *index = data->index;
+    unsigned char raw[GC_INDEX_ID_LEN];
+
+    hex_to_rawdata (commit->commit_id, raw, GC_INDEX_ID_LEN);
+
+    /* All ancestors of an indexed commit are indexed too. */
+    if (!id_set_add (&index->commits, raw)) {
+        mark_head_found (data, raw);
+        *stop = TRUE;
+        return TRUE;
+    }
+    ++index->n_visited;
+
+    if (index_dir (index, commit->root_id) < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+static gboolean
+find_head (SeafCommit *commit, void *vdata, gboolean *stop)
+{
+    unsigned char raw[GC_INDEX_ID_LEN];
+
+    hex_to_rawdata (commit->commit_id, raw, GC_INDEX_ID_LEN);
+    mark_head_found ((UpdateData *)vdata, raw);
+
+    return TRUE;
+}
+
+static int
+traverse_heads (GCRepoIndex *index, GList *heads,
+                CommitTraverseFunc func, gboolean *head_found)
+{
+    UpdateData data;
+    GList *ptr;
+
+    data.index = index;
+    data.head_found = head_found;
+
+    for (ptr = heads; ptr; ptr = ptr->next) {
+        if (!seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
+                                                       (char *)ptr->data,
+                                                       func,
+                                                       &data))
+            return -1;
+    }
+
+    return 0;
+}
+
+static gboolean
+all_heads_found (GCRepoIndex *index, gboolean *head_found)
+{
+    guint32 i;
+
+    for (i = 0; i < index->n_heads; ++i) {
+        if (!head_found[i])
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+set_heads (GCRepoIndex *index, GList *heads)
+{
+    GList *ptr;
+    guint32 i = 0;
+
+    g_free (index->heads);
+    index->n_heads = g_list_length (heads);
+    index->heads = g_malloc (index->n_heads * GC_INDEX_ID_LEN);
+    for (ptr = heads; ptr; ptr = ptr->next)
+        hex_to_rawdata ((char *)ptr->data,
+                        index->heads + (i++) * GC_INDEX_ID_LEN,
+                        GC_INDEX_ID_LEN);
+}
+
+/*
+ * Add blocks in @old but not in @new to @dropped.
+ * Both arrays are sorted.
+ */
+static void
+diff_blocks (IDSet *old, IDSet *new, IDSet *dropped)
+{
+    guint32 i = 0, j = 0;
+    const unsigned char *id;
+    int cmp;
+
+    while (i < old->n_ids) {
+        id = old->ids + i * GC_INDEX_ID_LEN;
+        cmp = (j < new->n_ids) ? raw_id_cmp (id, new->ids + j * GC_INDEX_ID_LEN) : -1;
+        if (cmp < 0) {
+            id_set_add (dropped, id);
+            ++i;
+        } else if (cmp == 0) {
+            ++i;
+            ++j;
+        } else
+            ++j;
+    }
+}
+
+int
+gc_repo_index_update (GCRepoIndex *index, GList *heads)
+{
+    gboolean *head_found;
+    gboolean rebuild = FALSE;
+    IDSet old_blocks;
+
+    head_found = g_new0 (gboolean, index->n_heads + 1);
+
+    if (traverse_heads (index, heads, index_commit, head_found) < 0) {
+        g_free (head_found);
+        return -1;
+    }
+
+    /* An old head may be hidden behind another old head, e.g. a branch
+     * is fast-forwarded to the head of another branch. Only walk the
+     * full commit history in this rare case.
+     */
+    if (!all_heads_found (index, head_found)) {
+        if (traverse_heads (index, heads, find_head, head_found) < 0) {
+            g_free (head_found);
+            return -1;
+        }
+        rebuild = !all_heads_found (index, head_found);
+    }
+    g_free (head_found);
+
+    if (rebuild) {
+        g_message ("[GC] History of repo %.8s is changed, rebuild its index.\n",
+                   index->repo_id);
+
+        id_set_merge (&index->blocks);
+        old_blocks = index->blocks;
+
+        id_set_destroy (&index->commits);
+        id_set_destroy (&index->fs);
+        id_set_init (&index->commits, NULL, 0);
+        id_set_init (&index->fs, NULL, 0);
+        id_set_init (&index->blocks, NULL, 0);
+        index->n_heads = 0;
+
+        if (traverse_heads (index, heads, index_commit, NULL) < 0) {
+            id_set_destroy (&old_blocks);
+            return -1;
+        }
+
+        id_set_merge (&index->blocks);
+        diff_blocks (&old_blocks, &index->blocks, &index->dropped);
+        id_set_destroy (&old_blocks);
+    }
+
+    set_heads (index, heads);
+
+    return 0;
+}
+
+static int
+write_ids (int fd, const unsigned char *ids, guint32 n_ids)
+{
+    ssize_t len = (ssize_t)n_ids * GC_INDEX_ID_LEN;
+
+    if (len == 0)
+        return 0;
+    if (writen (fd, ids, len) != len)
+        return -1;
+    return 0;
+}
+
+int
+gc_repo_index_save (GCRepoIndex *index)
+{
+    IndexHeader hdr;
+    char *tmp_path;
+    int fd;
+
+    id_set_merge (&index->commits);
+    id_set_merge (&index->fs);
+    id_set_merge (&index->blocks);
+    id_set_merge (&index->dropped);
+
+    memcpy (hdr.magic, INDEX_MAGIC, 4);
+    hdr.version = htonl (INDEX_VERSION);
+    hdr.n_heads = htonl (index->n_heads);
+    hdr.n_commits = htonl (index->commits.n_ids);
+    hdr.n_fs = htonl (index->fs.n_ids);
+    hdr.n_blocks = htonl (index->blocks.n_ids);
+    hdr.n_dropped = htonl (index->dropped.n_ids);
+
+    tmp_path = g_strconcat (index->path, ".tmp", NULL);
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        g_warning ("[GC] Failed to open %s: %s.\n", tmp_path, strerror(errno));
+        g_free (tmp_path);
+        return -1;
+    }
+
+    if (writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write_ids (fd, index->heads, index->n_heads) < 0 ||
+        write_ids (fd, index->commits.ids, index->commits.n_ids) < 0 ||
+        write_ids (fd, index->fs.ids, index->fs.n_ids) < 0 ||
+        write_ids (fd, index->blocks.ids, index->blocks.n_ids) < 0 ||
+        write_ids (fd, index->dropped.ids, index->dropped.n_ids) < 0 ||
+        fsync (fd) < 0) {
+        g_warning ("[GC] Failed to write %s: %s.\n", tmp_path, strerror(errno));
+        close (fd);
+        g_unlink (tmp_path);
+        g_free (tmp_path);
+        return -1;
+    }
+    close (fd);
+
+    if (ccnet_rename (tmp_path, index->path) < 0) {
+        g_warning ("[GC] Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        g_free (tmp_path);
+        return -1;
+    }
+
+    g_free (tmp_path);
+    return 0;
+}
+
+guint64
+gc_repo_index_get_n_visited (GCRepoIndex *index)
+{
+    return index->n_visited;
+}
+
+const unsigned char *
+gc_repo_index_get_blocks (GCRepoIndex *index, guint32 *n_blocks)
+{
+    *n_blocks = index->blocks.n_ids;
+    return index->blocks.ids;
+}
+
+const unsigned char *
+gc_repo_index_get_dropped (GCRepoIndex *index, guint32 *n_blocks)
+{
+    *n_blocks = index->dropped.n_ids;
+    return index->dropped.ids;
+}
+
+void
+gc_repo_index_clear_dropped (GCRepoIndex *index)
+{
+    id_set_destroy (&index->dropped);
+    id_set_init (&index->dropped, NULL, 0);
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_GC_INDEX_H
+#define SEAF_GC_INDEX_H
+
+#include <glib.h>
+
+/*
+ * Persistent reachability index of a repo, used by incremental GC.
+ *
+ * The index records the commits, fs objects and blocks reachable from
+ * the branch heads of the repo when it was last updated. Since objects
+ * are immutable, updating the index only needs to walk the commits and
+ * trees that are not indexed yet.
+ *
+ * Index files are stored in <seaf_dir>/gc/repos/<repo_id>. All IDs are
+ * kept as sorted arrays of 20-byte binary SHA1s.
+ */
+
+#define GC_INDEX_ID_LEN 20
+
+typedef struct GCRepoIndex GCRepoIndex;
+
+/*
+ * Load the index of @repo_id from @index_dir. If the index file does not
+ * exist or is corrupted, an empty index is returned.
+ */
+GCRepoIndex *
+gc_repo_index_load (const char *index_dir, const char *repo_id);
+
+void
+gc_repo_index_free (GCRepoIndex *index);
+
+/*
+ * Add objects reachable from @heads (a list of commit ids) to the index.
+ *
+ * If some head recorded in the index is not reachable from @heads any more
+ * (e.g. a branch is reset), the index is rebuilt from scratch, and the
+ * blocks that are no longer referenced are recorded as dropped blocks.
+ * They're saved with the index until gc_repo_index_clear_dropped() is
+ * called, so they're not lost if GC is interrupted.
+ *
+ * Returns -1 if any object can't be read, the index should not be saved then.
+ */
+int
+gc_repo_index_update (GCRepoIndex *index, GList *heads);
+
+/*
+ * Atomically write the index back to disk.
+ */
+int
+gc_repo_index_save (GCRepoIndex *index);
+
+/*
+ * Returns the number of commits and fs objects read by gc_repo_index_update().
+ */
+guint64
+gc_repo_index_get_n_visited (GCRepoIndex *index);
+
+/*
+ * Returns the sorted array of block IDs in the index.
+ * Only valid after the index is loaded or saved.
+ */
+const unsigned char *
+gc_repo_index_get_blocks (GCRepoIndex *index, guint32 *n_blocks);
+
+/*
+ * Returns the sorted array of dropped block IDs.
+ * Only valid after the index is loaded or saved.
+ */
+const unsigned char *
+gc_repo_index_get_dropped (GCRepoIndex *index, guint32 *n_blocks);
+
+/*
+ * Forget the dropped blocks, after GC has checked them.
+ */
+void
+gc_repo_index_clear_dropped (GCRepoIndex *index);
+
+#endif
@@ -2,17 +2,37 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "seafile-session.h"
+#include "utils.h"
 #include "bloom-filter.h"
 #include "gc.h"
+#include "gc-index.h"
 #include "info-mgr.h"
 
+#ifndef SEAFILE_SERVER
+#include "index/index.h"
+#endif
+
+/* Number of threads for marking live objects. */
+#define GC_MARK_WORKERS 4
+
 /* Total number of blocks to be scanned. */
 static guint64 total_blocks;
 /* Number of blocks have been scanned. */
 static guint64 scanned_blocks;
 static guint64 removed_blocks;
 
+static int gc_phase;
+/* Start time of current phase. */
+static gint64 phase_start;
+/* Number of commits and fs objects visited in mark phase. */
+static guint64 marked_objects;
+/* Number of blocks checked in sweep phase. */
+static guint64 checked_blocks;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static gint gc_started = 0;
 
 static void *gc_thread_func (void *data);
@@ -45,6 +65,9 @@ gc_get_progress ()
     if (!g_atomic_int_get (&gc_started))
         return -1;
 
+    if (total_blocks == 0)
+        return 0;
+
     return (int) (((double)scanned_blocks/total_blocks) * 100);
 }
 
@@ -54,6 +77,55 @@ gc_is_started ()
     return g_atomic_int_get (&gc_started);
 }
 
+int
+gc_get_progress_info (GCProgress *progress)
+{
+    guint64 processed;
+
+    if (!g_atomic_int_get (&gc_started))
+        return -1;
+
+    memset (progress, 0, sizeof(GCProgress));
+    progress->phase = gc_phase;
+    progress->marked_objects = marked_objects;
+    progress->checked_blocks = checked_blocks;
+    progress->removed_blocks = removed_blocks;
+
+    if (gc_phase == GC_PHASE_NONE)
+        return 0;
+
+    progress->elapsed = (gint64)time(NULL) - phase_start;
+    processed = (gc_phase == GC_PHASE_MARK) ? marked_objects : checked_blocks;
+    if (progress->elapsed > 0)
+        progress->rate = processed / progress->elapsed;
+
+    return 0;
+}
+
+static void
+add_marked_objects (guint64 n)
+{
+    pthread_mutex_lock (&progress_lock);
+    marked_objects += n;
+    pthread_mutex_unlock (&progress_lock);
+}
+
+static void
+set_gc_phase (int phase)
+{
+    GCProgress progress;
+
+    if (gc_phase != GC_PHASE_NONE && gc_get_progress_info (&progress) == 0)
+        g_message ("[GC] Phase %d finished in %"G_GINT64_FORMAT" seconds, "
+                   "%"G_GUINT64_FORMAT" objects per second.\n",
+                   gc_phase, progress.elapsed, progress.rate);
+
+    gc_phase = phase;
+    phase_start = (gint64)time(NULL);
+}
+
+#ifndef SEAFILE_SERVER
+
 /*
  * The number of bits in the bloom filter is 4 times the number of all blocks.
  * Let m be the bits in the bf, n be the number of blocks to be added to the bf
@@ -82,49 +154,299 @@ alloc_gc_index ()
     return bloom_create (size, 3, 0);
 }
 
-typedef struct {
+/*
+ * The mark phase walks each commit in the main thread, and hands the trees
+ * to a pool of workers. Each sub-directory is a separate task, so a large
+ * tree is walked in parallel too. Different commits and repos share most
+ * of their trees, so visited dirs and files are recorded in a shared set
+ * and never read twice.
+ */
+
+#define VISITED_SHARDS 16
+
+typedef struct VisitedShard {
+    pthread_mutex_t lock;
+    /* Keys are 20-byte binary object IDs. */
+    GHashTable *ids;
+} VisitedShard;
+
+typedef struct MarkContext {
+    VisitedShard visited[VISITED_SHARDS];
+    GThreadPool *pool;
+
+    /* Protects all fields below. */
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
     Bloom *index;
-#ifndef SEAFILE_SERVER
-    gboolean no_history;
-    char end_commit[41];
-#endif
-} GCData;
+    int pending;
+    gboolean error;
+} MarkContext;
+
+/*
+ * Returns FALSE if @obj_id has been visited.
+ */
+static gboolean
+mark_visited (MarkContext *ctx, const char *obj_id)
+{
+    unsigned char *key = g_malloc (20);
+    VisitedShard *shard;
+    gboolean added = FALSE;
+
+    hex_to_rawdata (obj_id, key, 20);
+    shard = &ctx->visited[key[0] % VISITED_SHARDS];
+
+    pthread_mutex_lock (&shard->lock);
+    if (!g_hash_table_lookup (shard->ids, key)) {
+        g_hash_table_insert (shard->ids, key, key);
+        added = TRUE;
+    }
+    pthread_mutex_unlock (&shard->lock);
+
+    if (!added)
+        g_free (key);
+    return added;
+}
 
 static void
-insert_block_to_index (void *vindex, const char *block_id)
+set_mark_error (MarkContext *ctx)
 {
-    Bloom *index = vindex;
-    bloom_add (index, block_id);
+    pthread_mutex_lock (&ctx->lock);
+    ctx->error = TRUE;
+    pthread_mutex_unlock (&ctx->lock);
+}
+
+static void
+push_dir (MarkContext *ctx, const char *dir_id)
+{
+    pthread_mutex_lock (&ctx->lock);
+    ++ctx->pending;
+    pthread_mutex_unlock (&ctx->lock);
+
+    g_thread_pool_push (ctx->pool, g_strdup (dir_id), NULL);
+}
+
+static int
+mark_file (MarkContext *ctx, const char *file_id)
+{
+    Seafile *seafile;
+    int i;
+
+    if (memcmp (file_id, EMPTY_SHA1, 40) == 0 || !mark_visited (ctx, file_id))
+        return 0;
+
+    seafile = seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id);
+    if (!seafile) {
+        g_warning ("[GC] Failed to find file %s.\n", file_id);
+        return -1;
+    }
+
+    pthread_mutex_lock (&ctx->lock);
+    for (i = 0; i < seafile->n_blocks; ++i)
+        bloom_add (ctx->index, seafile->blk_sha1s[i]);
+    pthread_mutex_unlock (&ctx->lock);
+
+    seafile_unref (seafile);
+    return 0;
+}
+
+static void
+mark_dir_worker (gpointer vdir_id, gpointer vctx)
+{
+    char *dir_id = vdir_id;
+    MarkContext *ctx = vctx;
+    SeafDir *dir = NULL;
+    SeafDirent *dent;
+    GList *p;
+    guint64 n_marked = 1;
+    gboolean error;
+
+    pthread_mutex_lock (&ctx->lock);
+    error = ctx->error;
+    pthread_mutex_unlock (&ctx->lock);
+    if (error)
+        goto done;
+
+    dir = seaf_fs_manager_get_seafdir_shared (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        g_warning ("[GC] Failed to find dir %s.\n", dir_id);
+        set_mark_error (ctx);
+        goto done;
+    }
+
+    for (p = dir->entries; p; p = p->next) {
+        dent = p->data;
+        if (S_ISREG(dent->mode)) {
+            if (mark_file (ctx, dent->id) < 0) {
+                set_mark_error (ctx);
+                break;
+            }
+            ++n_marked;
+        } else if (S_ISDIR(dent->mode)) {
+            if (mark_visited (ctx, dent->id))
+                push_dir (ctx, dent->id);
+        }
+    }
+
+done:
+    if (dir)
+        seaf_dir_unref (dir);
+    g_free (dir_id);
+    add_marked_objects (n_marked);
+
+    pthread_mutex_lock (&ctx->lock);
+    if (--ctx->pending == 0)
+        pthread_cond_signal (&ctx->done_cond);
+    pthread_mutex_unlock (&ctx->lock);
+}
+
+static MarkContext *
+mark_context_new (Bloom *index)
+{
+    MarkContext *ctx = g_new0 (MarkContext, 1);
+    int i;
+
+    for (i = 0; i < VISITED_SHARDS; ++i) {
+        pthread_mutex_init (&ctx->visited[i].lock, NULL);
+        ctx->visited[i].ids = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                                     g_free, NULL);
+    }
+    pthread_mutex_init (&ctx->lock, NULL);
+    pthread_cond_init (&ctx->done_cond, NULL);
+    ctx->index = index;
+
+    ctx->pool = g_thread_pool_new (mark_dir_worker, ctx,
+                                   GC_MARK_WORKERS, FALSE, NULL);
+    if (!ctx->pool) {
+        g_warning ("[GC] Failed to create mark thread pool.\n");
+        g_free (ctx);
+        return NULL;
+    }
+
+    return ctx;
 }
 
+/*
+ * Wait for all queued trees to be marked.
+ */
+static int
+mark_context_wait (MarkContext *ctx)
+{
+    int ret;
+
+    pthread_mutex_lock (&ctx->lock);
+    while (ctx->pending > 0)
+        pthread_cond_wait (&ctx->done_cond, &ctx->lock);
+    ret = ctx->error ? -1 : 0;
+    pthread_mutex_unlock (&ctx->lock);
+
+    return ret;
+}
+
+static void
+mark_context_free (MarkContext *ctx)
+{
+    int i;
+
+    mark_context_wait (ctx);
+    g_thread_pool_free (ctx->pool, FALSE, TRUE);
+
+    for (i = 0; i < VISITED_SHARDS; ++i) {
+        g_hash_table_destroy (ctx->visited[i].ids);
+        pthread_mutex_destroy (&ctx->visited[i].lock);
+    }
+    pthread_mutex_destroy (&ctx->lock);
+    pthread_cond_destroy (&ctx->done_cond);
+    g_free (ctx);
+}
+
+/*
+ * Queue the tree of @root_id. Returns -1 if some worker has failed,
+ * so that callers can bail out early.
+ */
+static int
+mark_tree (MarkContext *ctx, const char *root_id)
+{
+    gboolean error;
+
+    add_marked_objects (1);
+
+    if (strcmp (root_id, EMPTY_SHA1) != 0 && mark_visited (ctx, root_id))
+        push_dir (ctx, root_id);
+
+    pthread_mutex_lock (&ctx->lock);
+    error = ctx->error;
+    pthread_mutex_unlock (&ctx->lock);
+
+    return error ? -1 : 0;
+}
+
+typedef struct {
+    MarkContext *ctx;
+    gboolean no_history;
+    char end_commit[41];
+} GCData;
+
 static gboolean
 traverse_commit (SeafCommit *commit, void *vdata, gboolean *stop)
 {
     GCData *data = vdata;
-    int ret;
 
-#ifndef SEAFILE_SERVER
     if (data->no_history && 
         strcmp (commit->commit_id, data->end_commit) == 0) {
         *stop = TRUE;
         return TRUE;
     }
-#endif
 
     /* g_debug ("[GC] traversed commit %s.\n", commit->commit_id); */
 
-    ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
-                                         commit->root_id,
-                                         insert_block_to_index,
-                                         data->index);
-    if (ret < 0)
+    if (mark_tree (data->ctx, commit->root_id) < 0)
         return FALSE;
 
     return TRUE;
 }
 
+/*
+ * Files in the index may not be committed yet. Their blocks are reused
+ * when the files are indexed again (see
+ * seaf_fs_manager_index_blocks_with_base()), so they must be kept.
+ * A file object may be missing if the index is older than the last GC.
+ */
+static int
+mark_index_files (SeafRepo *repo, MarkContext *ctx)
+{
+    char index_path[PATH_MAX];
+    struct index_state istate;
+    struct cache_entry *ce;
+    char file_id[41];
+    unsigned int i;
+
+    memset (&istate, 0, sizeof(istate));
+    snprintf (index_path, PATH_MAX, "%s/%s",
+              repo->manager->index_dir, repo->id);
+    if (read_index_from (&istate, index_path) < 0) {
+        g_warning ("[GC] Failed to load index of repo %s.\n", repo->id);
+        return -1;
+    }
+
+    for (i = 0; i < istate.cache_nr; ++i) {
+        ce = istate.cache[i];
+        if (!S_ISREG(ce->ce_mode))
+            continue;
+        rawdata_to_hex (ce->sha1, file_id, 20);
+        if (!seaf_fs_manager_object_exists (seaf->fs_mgr, file_id))
+            continue;
+        if (mark_file (ctx, file_id) < 0) {
+            discard_index (&istate);
+            return -1;
+        }
+    }
+
+    discard_index (&istate);
+    return 0;
+}
+
 static int
-populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
+populate_gc_index_for_repo (SeafRepo *repo, MarkContext *ctx)
 {
     GList *branches, *ptr;
     SeafBranch *branch;
@@ -138,8 +460,7 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
     }
 
     data = g_new0(GCData, 1);
-    data->index = index;
-#ifndef SEAFILE_SERVER
+    data->ctx = ctx;
     data->no_history = TRUE;
     if (data->no_history) {
         char *remote_head = seaf_repo_manager_get_repo_property (repo->manager,
@@ -149,7 +470,6 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
             memcpy (data->end_commit, remote_head, 41);
         g_free (remote_head);
     }
-#endif
 
     for (ptr = branches; ptr != NULL; ptr = ptr->next) {
         branch = ptr->data;
@@ -167,33 +487,30 @@ populate_gc_index_for_repo (SeafRepo *repo, Bloom *index)
     g_list_free (branches);
     g_free (data);
 
+    if (ret == 0)
+        ret = mark_index_files (repo, ctx);
+
     return ret;
 }
 
-#ifndef SEAFILE_SERVER
 static gboolean
-populate_index (SeafCommit *commit, void *vindex, gboolean *stop)
+populate_index (SeafCommit *commit, void *vctx, gboolean *stop)
 {
-    int ret = seaf_fs_manager_traverse_tree (seaf->fs_mgr,
-                                             commit->root_id,
-                                             insert_block_to_index,
-                                             vindex);
-    if (ret < 0)
+    if (mark_tree ((MarkContext *)vctx, commit->root_id) < 0)
         return FALSE;
     return TRUE;
 }
 
 static int
-populate_gc_index_for_head (const char *head_id, Bloom *index)
+populate_gc_index_for_head (const char *head_id, MarkContext *ctx)
 {
     gboolean ret;
     ret = seaf_commit_manager_traverse_commit_tree (seaf->commit_mgr,
                                                     head_id,
                                                     populate_index,
-                                                    index);
-    return (ret == TRUE);
+                                                    ctx);
+    return ret ? 0 : -1;
 }
-#endif
 
 static gboolean
 check_block_liveness (const char *block_id, void *vindex)
@@ -201,6 +518,7 @@ check_block_liveness (const char *block_id, void *vindex)
     Bloom *index = vindex;
 
     ++scanned_blocks;
+    ++checked_blocks;
 
     if (!bloom_test (index, block_id)) {
         ++removed_blocks;
@@ -214,12 +532,15 @@ static void *
 gc_thread_func (void *data)
 {
     Bloom *index;
+    MarkContext *ctx = NULL;
     GList *repos = NULL, *clone_heads = NULL, *ptr;
     int ret;
 
     total_blocks = seaf_block_manager_get_block_number (seaf->block_mgr);
     scanned_blocks = 0;
     removed_blocks = 0;
+    marked_objects = 0;
+    checked_blocks = 0;
 
 #ifdef WIN32
     g_message ("GC started. Total block number is %I64u.\n", total_blocks);
@@ -239,19 +560,21 @@ gc_thread_func (void *data)
         return NULL;
     }
 
+    ctx = mark_context_new (index);
+    if (!ctx)
+        goto out;
+
+    set_gc_phase (GC_PHASE_MARK);
+
     /* If we meet any error when filling in the index, we should bail out.
      */
     repos = seaf_repo_manager_get_repo_list (seaf->repo_mgr, -1, -1);
     for (ptr = repos; ptr != NULL; ptr = ptr->next) {
-        ret = populate_gc_index_for_repo ((SeafRepo *)ptr->data, index);
-#ifdef SEAFILE_SERVER
-        seaf_repo_unref ((SeafRepo *)ptr->data);
-#endif
+        ret = populate_gc_index_for_repo ((SeafRepo *)ptr->data, ctx);
         if (ret < 0)
             goto out;
     }
 
-#ifndef SEAFILE_SERVER
     /* If seaf-daemon exits while downloading a new repo, the downloaded new
      * blocks for that repo won't be refered by any repo_id. So after restart
      * those blocks will be GC'ed. To prevent this, we get a list of commit
@@ -259,12 +582,15 @@ gc_thread_func (void *data)
      */
     clone_heads = seaf_transfer_manager_get_clone_heads (seaf->transfer_mgr);
     for (ptr = clone_heads; ptr != NULL; ptr = ptr->next) {
-        ret = populate_gc_index_for_head ((char *)ptr->data, index);
-        g_free (ptr->data);
+        ret = populate_gc_index_for_head ((char *)ptr->data, ctx);
         if (ret < 0)
             goto out;
     }
-#endif
+
+    if (mark_context_wait (ctx) < 0)
+        goto out;
+
+    set_gc_phase (GC_PHASE_SWEEP);
 
     ret = seaf_block_manager_foreach_block (seaf->block_mgr,
                                             check_block_liveness,
@@ -274,15 +600,574 @@ gc_thread_func (void *data)
     }
 
 out:
+    if (ctx)
+        mark_context_free (ctx);
     bloom_destroy (index);
     g_list_free (repos);
-    g_list_free (clone_heads);
+    string_list_free (clone_heads);
     return NULL;
 }
 
+#else  /* SEAFILE_SERVER */
+
+/*
+ * Incremental GC.
+ *
+ * Each repo has a persistent index of commits, fs objects and blocks
+ * reachable from its branches (see gc-index.h). Updating the index only
+ * walks commits added since last GC. Block manager records new blocks in
+ * a journal, so only those blocks (plus blocks of deleted repos and
+ * blocks dropped by a history change) need to be checked against the
+ * indexes. Garbage blocks are removed exactly, and the saved indexes
+ * let an interrupted GC resume where it stopped.
+ */
+
+#define GC_REPO_INDEX_DIR "repos"
+#define GC_STATE_FILE "state"
+#define GC_JOURNAL_SUFFIX ".gc"
+
+/* Blocks are uploaded before the commit referring to them, so blocks
+ * committed within this period are not checked in this run.
+ */
+#define GC_JOURNAL_GRACE_PERIOD (24 * 3600)
+
+typedef struct {
+    /* Sorted and deduplicated array of binary block IDs. */
+    GArray *blocks;
+    /* Whether the corresponding block is referred by some repo. */
+    guint8 *live;
+} GCCandidates;
+
+static void
+add_candidate (GArray *blocks, const char *block_id)
+{
+    unsigned char raw[GC_INDEX_ID_LEN];
+
+    if (strlen(block_id) != 40 ||
+        hex_to_rawdata (block_id, raw, GC_INDEX_ID_LEN) < 0)
+        return;
+    g_array_append_vals (blocks, raw, 1);
+}
+
+static void
+sort_candidates (GCCandidates *cands)
+{
+    GArray *blocks = cands->blocks;
+    guint i, n = 0;
+
+    if (blocks->len == 0)
+        return;
+
+    qsort (blocks->data, blocks->len, GC_INDEX_ID_LEN, raw_id_cmp);
+    for (i = 1; i < blocks->len; ++i) {
+        if (raw_id_cmp (blocks->data + n * GC_INDEX_ID_LEN,
+                    blocks->data + i * GC_INDEX_ID_LEN) != 0) {
+            ++n;
+            memmove (blocks->data + n * GC_INDEX_ID_LEN,
+                     blocks->data + i * GC_INDEX_ID_LEN,
+                     GC_INDEX_ID_LEN);
+        }
+    }
+    g_array_set_size (blocks, n + 1);
+
+    cands->live = g_new0 (guint8, blocks->len);
+}
+
+/*
+ * Move the block journal aside so that blocks committed during GC go
+ * to a new journal. If GC was interrupted, the journal left by the
+ * last run is used again.
+ */
+static char *
+rotate_journal ()
+{
+    const char *journal = seaf->block_mgr->journal_path;
+    char *rotated = g_strconcat (journal, GC_JOURNAL_SUFFIX, NULL);
+
+    if (g_access (rotated, F_OK) != 0 && g_access (journal, F_OK) == 0 &&
+        ccnet_rename (journal, rotated) < 0) {
+        g_warning ("[GC] Failed to rotate block journal: %s.\n",
+                   strerror(errno));
+        g_free (rotated);
+        return NULL;
+    }
+
+    return rotated;
+}
+
+/*
+ * Blocks in the journal older than the grace period become candidates,
+ * the others are put back to the current journal and added to @recent.
+ */
+static int
+load_journal (const char *path, GArray *blocks, GArray *recent)
+{
+    FILE *in, *out = NULL;
+    char line[128], block_id[41];
+    gint64 mtime, now = (gint64)time(NULL);
+
+    in = g_fopen (path, "r");
+    if (!in) {
+        if (errno == ENOENT)
+            return 0;
+        g_warning ("[GC] Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets (line, sizeof(line), in) != NULL) {
+        if (sscanf (line, "%40s %"G_GINT64_FORMAT, block_id, &mtime) != 2)
+            continue;
+
+        if (now - mtime >= GC_JOURNAL_GRACE_PERIOD) {
+            add_candidate (blocks, block_id);
+            continue;
+        }
+        add_candidate (recent, block_id);
+
+        if (!out) {
+            out = g_fopen (seaf->block_mgr->journal_path, "a");
+            if (!out) {
+                g_warning ("[GC] Failed to open block journal: %s.\n",
+                           strerror(errno));
+                fclose (in);
+                return -1;
+            }
+        }
+        fputs (line, out);
+    }
+
+    fclose (in);
+    if (out && fclose (out) != 0) {
+        g_warning ("[GC] Failed to write block journal.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+load_recent_blocks (const char *path, GArray *recent)
+{
+    FILE *in;
+    char line[128], block_id[41];
+
+    in = g_fopen (path, "r");
+    if (!in)
+        return (errno == ENOENT) ? 0 : -1;
+
+    while (fgets (line, sizeof(line), in) != NULL) {
+        if (sscanf (line, "%40s", block_id) == 1)
+            add_candidate (recent, block_id);
+    }
+
+    fclose (in);
+    return 0;
+}
+
+/*
+ * Recent blocks may be listed as candidates in the first run,
+ * they should never be removed.
+ */
+static void
+keep_recent_blocks (GCCandidates *cands, GArray *recent)
+{
+    unsigned char *cand_ids = (unsigned char *)cands->blocks->data;
+    unsigned char *found;
+    guint i;
+
+    for (i = 0; i < recent->len; ++i) {
+        found = bsearch (recent->data + i * GC_INDEX_ID_LEN,
+                         cand_ids, cands->blocks->len,
+                         GC_INDEX_ID_LEN, raw_id_cmp);
+        if (found)
+            cands->live[(found - cand_ids) / GC_INDEX_ID_LEN] = 1;
+    }
+}
+
+static gboolean
+add_block_to_candidates (const char *block_id, void *vblocks)
+{
+    add_candidate ((GArray *)vblocks, block_id);
+    return TRUE;
+}
+
+/*
+ * Blocks of deleted repos become candidates.
+ * Paths to the index files of those repos are returned in @removed.
+ */
+static int
+load_removed_repos (const char *repos_dir,
+                    GHashTable *repo_ids,
+                    GArray *blocks,
+                    GList **removed)
+{
+    GDir *dir;
+    const char *dname;
+    GCRepoIndex *index;
+    const unsigned char *ids;
+    guint32 n_ids;
+
+    dir = g_dir_open (repos_dir, 0, NULL);
+    if (!dir) {
+        g_warning ("[GC] Failed to open dir %s.\n", repos_dir);
+        return -1;
+    }
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (strlen(dname) != 36 || g_hash_table_lookup (repo_ids, dname))
+            continue;
+
+        index = gc_repo_index_load (repos_dir, dname);
+        ids = gc_repo_index_get_blocks (index, &n_ids);
+        g_array_append_vals (blocks, ids, n_ids);
+        ids = gc_repo_index_get_dropped (index, &n_ids);
+        g_array_append_vals (blocks, ids, n_ids);
+        gc_repo_index_free (index);
+
+        *removed = g_list_prepend (*removed,
+                                   g_build_filename (repos_dir, dname, NULL));
+    }
+
+    g_dir_close (dir);
+    return 0;
+}
+
+static GList *
+get_repo_heads (const char *repo_id)
+{
+    GList *branches, *heads = NULL, *ptr;
+    SeafBranch *branch;
+
+    branches = seaf_branch_manager_get_branch_list (seaf->branch_mgr, repo_id);
+    if (branches == NULL) {
+        g_warning ("[GC] Failed to get branch list of repo %s.\n", repo_id);
+        return NULL;
+    }
+    for (ptr = branches; ptr; ptr = ptr->next) {
+        branch = ptr->data;
+        heads = g_list_prepend (heads, g_strdup (branch->commit_id));
+        seaf_branch_unref (branch);
+    }
+    g_list_free (branches);
+
+    return heads;
+}
+
+typedef struct IndexTask {
+    char   repo_id[37];
+    GList *heads;
+} IndexTask;
+
+typedef struct IndexContext {
+    const char     *repos_dir;
+    /* Protects all fields below. */
+    pthread_mutex_t lock;
+    /* Blocks dropped by rebuilt indexes. */
+    GArray         *dropped;
+    /* Repos whose indexes have dropped blocks. */
+    GList          *dropped_repos;
+    gboolean        error;
+} IndexContext;
+
+/*
+ * Indexes of different repos are independent, so they're updated
+ * in parallel. Branch lists are read in the main thread.
+ */
+static void
+update_index_worker (gpointer vtask, gpointer vctx)
+{
+    IndexTask *task = vtask;
+    IndexContext *ctx = vctx;
+    GCRepoIndex *index;
+    const unsigned char *dropped = NULL;
+    guint32 n_dropped = 0;
+    gboolean error;
+    int ret;
+
+    pthread_mutex_lock (&ctx->lock);
+    error = ctx->error;
+    pthread_mutex_unlock (&ctx->lock);
+    if (error)
+        goto out;
+
+    index = gc_repo_index_load (ctx->repos_dir, task->repo_id);
+    ret = gc_repo_index_update (index, task->heads);
+    if (ret == 0)
+        ret = gc_repo_index_save (index);
+    /* Includes blocks dropped in an interrupted run. */
+    if (ret == 0)
+        dropped = gc_repo_index_get_dropped (index, &n_dropped);
+    add_marked_objects (gc_repo_index_get_n_visited (index));
+
+    pthread_mutex_lock (&ctx->lock);
+    if (ret < 0)
+        ctx->error = TRUE;
+    else if (n_dropped > 0) {
+        g_array_append_vals (ctx->dropped, dropped, n_dropped);
+        ctx->dropped_repos = g_list_prepend (ctx->dropped_repos,
+                                             g_strdup (task->repo_id));
+    }
+    ++scanned_blocks;
+    pthread_mutex_unlock (&ctx->lock);
+
+    gc_repo_index_free (index);
+
+out:
+    string_list_free (task->heads);
+    g_free (task);
+}
+
+/*
+ * Dropped blocks are added to @blocks, and the repos they're dropped from
+ * are returned in @dropped_repos.
+ */
+static int
+update_repo_indexes (const char *repos_dir, GList *repo_ids, GArray *blocks,
+                     GList **dropped_repos)
+{
+    IndexContext ctx;
+    GThreadPool *pool;
+    IndexTask *task;
+    GList *ptr, *heads;
+    int ret = 0;
+
+    memset (&ctx, 0, sizeof(ctx));
+    ctx.repos_dir = repos_dir;
+    ctx.dropped = blocks;
+    pthread_mutex_init (&ctx.lock, NULL);
+
+    pool = g_thread_pool_new (update_index_worker, &ctx,
+                              GC_MARK_WORKERS, FALSE, NULL);
+    if (!pool) {
+        g_warning ("[GC] Failed to create index thread pool.\n");
+        pthread_mutex_destroy (&ctx.lock);
+        return -1;
+    }
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        heads = get_repo_heads ((char *)ptr->data);
+        if (!heads) {
+            ret = -1;
+            break;
+        }
+
+        task = g_new0 (IndexTask, 1);
+        memcpy (task->repo_id, ptr->data, 36);
+        task->heads = heads;
+        g_thread_pool_push (pool, task, NULL);
+    }
+
+    /* Wait for queued tasks to finish. */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    if (ctx.error)
+        ret = -1;
+    *dropped_repos = ctx.dropped_repos;
+    pthread_mutex_destroy (&ctx.lock);
+
+    return ret;
+}
+
+/*
+ * Iterate over the smaller of the two sorted arrays and look up
+ * in the other one.
+ */
+static void
+mark_live_blocks (const char *repos_dir, const char *repo_id,
+                  GCCandidates *cands)
+{
+    GCRepoIndex *index;
+    const unsigned char *ids, *found;
+    guint32 n_ids, i;
+    guint n_cands = cands->blocks->len;
+    unsigned char *cand_ids = (unsigned char *)cands->blocks->data;
+
+    index = gc_repo_index_load (repos_dir, repo_id);
+    ids = gc_repo_index_get_blocks (index, &n_ids);
+
+    if (n_cands < n_ids) {
+        for (i = 0; i < n_cands; ++i) {
+            if (!cands->live[i] &&
+                bsearch (cand_ids + i * GC_INDEX_ID_LEN, ids, n_ids,
+                         GC_INDEX_ID_LEN, raw_id_cmp) != NULL)
+                cands->live[i] = 1;
+        }
+    } else {
+        for (i = 0; i < n_ids; ++i) {
+            found = bsearch (ids + i * GC_INDEX_ID_LEN, cand_ids, n_cands,
+                             GC_INDEX_ID_LEN, raw_id_cmp);
+            if (found)
+                cands->live[(found - cand_ids) / GC_INDEX_ID_LEN] = 1;
+        }
+    }
+
+    gc_repo_index_free (index);
+}
+
+static void
+remove_dead_blocks (GCCandidates *cands)
+{
+    char block_id[41];
+    guint i;
+
+    for (i = 0; i < cands->blocks->len; ++i) {
+        ++scanned_blocks;
+        ++checked_blocks;
+        if (cands->live[i])
+            continue;
+
+        rawdata_to_hex ((unsigned char *)cands->blocks->data + i * GC_INDEX_ID_LEN,
+                        block_id, GC_INDEX_ID_LEN);
+        if (seaf_block_manager_remove_block (seaf->block_mgr, block_id) == 0)
+            ++removed_blocks;
+    }
+}
+
+/* Dropped blocks of @repo_ids have been checked, remove them from the indexes. */
+static void
+clear_dropped_blocks (const char *repos_dir, GList *repo_ids)
+{
+    GCRepoIndex *index;
+    GList *ptr;
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        index = gc_repo_index_load (repos_dir, ptr->data);
+        gc_repo_index_clear_dropped (index);
+        if (gc_repo_index_save (index) < 0)
+            g_warning ("[GC] Failed to save index of repo %s.\n",
+                       (char *)ptr->data);
+        gc_repo_index_free (index);
+    }
+}
+
+static void *
+gc_thread_func (void *data)
+{
+    char *gc_dir = NULL, *repos_dir = NULL, *state_file = NULL;
+    char *rotated_journal = NULL;
+    GList *repo_ids = NULL, *removed = NULL, *dropped_repos = NULL, *ptr;
+    GHashTable *repo_id_set = NULL;
+    GCCandidates cands;
+    GArray *recent;
+    gboolean first_run;
+
+    scanned_blocks = 0;
+    removed_blocks = 0;
+    marked_objects = 0;
+    checked_blocks = 0;
+    memset (&cands, 0, sizeof(cands));
+    cands.blocks = g_array_new (FALSE, FALSE, GC_INDEX_ID_LEN);
+    recent = g_array_new (FALSE, FALSE, GC_INDEX_ID_LEN);
+
+    if (!seaf->block_mgr->journal_path) {
+        g_warning ("[GC] Block journal is not available.\n");
+        goto out;
+    }
+
+    gc_dir = g_path_get_dirname (seaf->block_mgr->journal_path);
+    repos_dir = g_build_filename (gc_dir, GC_REPO_INDEX_DIR, NULL);
+    state_file = g_build_filename (gc_dir, GC_STATE_FILE, NULL);
+    if (checkdir_with_mkdir (repos_dir) < 0) {
+        g_warning ("[GC] Failed to create dir %s.\n", repos_dir);
+        goto out;
+    }
+
+    /* No repo is indexed before the first run, so all blocks are checked. */
+    first_run = (g_access (state_file, F_OK) != 0);
+
+    rotated_journal = rotate_journal ();
+    if (!rotated_journal)
+        goto out;
+    /* Let writers notice the rotation before the old journal is read. */
+    g_usleep ((GC_JOURNAL_REOPEN_INTERVAL + 1) * G_USEC_PER_SEC);
+
+    if (first_run) {
+        g_message ("[GC] Building GC index for the first time.\n");
+        if (seaf_block_manager_foreach_block (seaf->block_mgr,
+                                              add_block_to_candidates,
+                                              cands.blocks) < 0) {
+            g_warning ("[GC] Failed to list blocks.\n");
+            goto out;
+        }
+        /* Blocks committed after rotating the journal are listed too. */
+        if (load_recent_blocks (seaf->block_mgr->journal_path, recent) < 0)
+            goto out;
+    }
+
+    if (load_journal (rotated_journal, cands.blocks, recent) < 0)
+        goto out;
+
+    /* The repo list must be read after rotating the journal. Blocks of
+     * repos created later are all in the new journal.
+     */
+    repo_ids = seaf_repo_manager_get_repo_id_list (seaf->repo_mgr);
+    if (!repo_ids) {
+        g_message ("[GC] No repo is found, skip GC.\n");
+        goto out;
+    }
+
+    repo_id_set = g_hash_table_new (g_str_hash, g_str_equal);
+    for (ptr = repo_ids; ptr; ptr = ptr->next)
+        g_hash_table_insert (repo_id_set, ptr->data, ptr->data);
+
+    if (load_removed_repos (repos_dir, repo_id_set, cands.blocks, &removed) < 0)
+        goto out;
+
+    total_blocks = 2 * g_list_length (repo_ids);
+
+    /* If we meet any error when updating the indexes, we should bail out.
+     * Indexes already saved are reused by the next run.
+     */
+    set_gc_phase (GC_PHASE_MARK);
+    if (update_repo_indexes (repos_dir, repo_ids, cands.blocks,
+                             &dropped_repos) < 0)
+        goto out;
+
+    set_gc_phase (GC_PHASE_SWEEP);
+
+    sort_candidates (&cands);
+    keep_recent_blocks (&cands, recent);
+    total_blocks += cands.blocks->len;
+
+    g_message ("[GC] %u blocks to be checked.\n", cands.blocks->len);
+
+    for (ptr = repo_ids; ptr; ptr = ptr->next) {
+        mark_live_blocks (repos_dir, ptr->data, &cands);
+        ++scanned_blocks;
+    }
+
+    remove_dead_blocks (&cands);
+    clear_dropped_blocks (repos_dir, dropped_repos);
+
+    for (ptr = removed; ptr; ptr = ptr->next)
+        g_unlink ((char *)ptr->data);
+    g_unlink (rotated_journal);
+
+    if (!g_file_set_contents (state_file, "1\n", -1, NULL))
+        g_warning ("[GC] Failed to write %s.\n", state_file);
+
+out:
+    if (repo_id_set)
+        g_hash_table_destroy (repo_id_set);
+    string_list_free (repo_ids);
+    string_list_free (removed);
+    string_list_free (dropped_repos);
+    g_array_free (cands.blocks, TRUE);
+    g_array_free (recent, TRUE);
+    g_free (cands.live);
+    g_free (rotated_journal);
+    g_free (state_file);
+    g_free (repos_dir);
+    g_free (gc_dir);
+    return NULL;
+}
+
+#endif  /* SEAFILE_SERVER */
+
 static void
 gc_done (void *result)
 {
+    set_gc_phase (GC_PHASE_NONE);
     g_atomic_int_set (&gc_started, 0);
 
 #ifdef WIN32
@@ -17,4 +17,33 @@ gc_get_progress ();
 gboolean
 gc_is_started ();
 
+enum {
+    GC_PHASE_NONE = 0,
+    /* Collecting live objects. */
+    GC_PHASE_MARK,
+    /* Removing dead blocks. */
+    GC_PHASE_SWEEP,
+};
+
+typedef struct GCProgress {
+    int     phase;
+    /* Seconds spent in the current phase. */
+    gint64  elapsed;
+    /* fs objects and commits visited in the mark phase. */
+    guint64 marked_objects;
+    /* Blocks checked and removed in the sweep phase. */
+    guint64 checked_blocks;
+    guint64 removed_blocks;
+    /* Objects (mark) or blocks (sweep) processed per second
+     * in the current phase.
+     */
+    guint64 rate;
+} GCProgress;
+
+/*
+ * Returns -1 if GC is not started.
+ */
+int
+gc_get_progress_info (GCProgress *progress);
+
 #endif
@@ -944,6 +944,7 @@ int add_to_index(struct index_state *istate,
     mode_t st_mode = st->st_mode;
     struct cache_entry *ce, *alias;
     unsigned char sha1[20];
+    const unsigned char *base_sha1 = NULL;
     unsigned ce_option = CE_MATCH_IGNORE_VALID|CE_MATCH_IGNORE_SKIP_WORKTREE|CE_MATCH_RACY_IS_DIRTY;
     int add_option = (ADD_CACHE_OK_TO_ADD|ADD_CACHE_OK_TO_REPLACE);
 
@@ -974,7 +975,10 @@ int add_to_index(struct index_state *istate,
         alias->ce_flags |= CE_ADDED;
         return 0;
     }
-    if (index_cb (full_path, sha1, crypt) < 0)
+    if (alias && !ce_stage(alias) && S_ISREG(alias->ce_mode) &&
+        !is_null_sha1(alias->sha1))
+        base_sha1 = alias->sha1;
+    if (index_cb (full_path, sha1, crypt, base_sha1) < 0)
         return -1;
     memcpy (ce->sha1, sha1, 20);
 
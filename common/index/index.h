@@ -405,9 +405,14 @@ extern int remove_file_from_index(struct index_state *, const char *path);
 #define ADD_CACHE_IGNORE_REMOVAL 8
 #define ADD_CACHE_INTENT 16
 
+/*
+ * @base_sha1 is the id of the file in the index before, or NULL if the
+ * file is new.
+ */
 typedef int (*IndexCB) (const char *path,
                         unsigned char sha1[],
-                        struct SeafileCrypt *crypt);
+                        struct SeafileCrypt *crypt,
+                        const unsigned char *base_sha1);
 
 int add_to_index(struct index_state *istate,
                  const char *path,
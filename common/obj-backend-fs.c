@@ -1,5 +1,6 @@
 #include "common.h"
 #include "obj-backend.h"
+#include "batch-exec.h"
 
 typedef struct FsPriv {
     char *obj_dir;
@@ -86,6 +87,35 @@ obj_backend_fs_exists (ObjBackend *bend,
     return FALSE;
 }
 
+typedef struct ExistsBatch {
+    ObjBackend  *bend;
+    const char **obj_ids;
+    gboolean    *exists;
+} ExistsBatch;
+
+static void
+check_exists (void *vbatch, int i)
+{
+    ExistsBatch *batch = vbatch;
+
+    batch->exists[i] = obj_backend_fs_exists (batch->bend, batch->obj_ids[i]);
+}
+
+/*
+ * stat() of objects not in the page cache is dominated by disk latency,
+ * so issue them from several threads to keep the disk queue busy.
+ */
+static void
+obj_backend_fs_exists_many (ObjBackend *bend,
+                            const char **obj_ids,
+                            int n_objs,
+                            gboolean *exists)
+{
+    ExistsBatch batch = { bend, obj_ids, exists };
+
+    batch_exec (check_exists, &batch, n_objs);
+}
+
 static void
 obj_backend_fs_delete (ObjBackend *bend,
                        const char *obj_id)
@@ -142,6 +172,7 @@ obj_backend_fs_new (const char *obj_dir)
     bend->read = obj_backend_fs_read;
     bend->write = obj_backend_fs_write;
     bend->exists = obj_backend_fs_exists;
+    bend->exists_many = obj_backend_fs_exists_many;
     bend->delete = obj_backend_fs_delete;
 
     return bend;
@@ -0,0 +1,1450 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Object backend that appends objects to large pack files, instead of
+ * storing each object in its own file.
+ *
+ * Layout of the object dir:
+ *
+ *   pack-<seq>.pack  PackHeader, followed by records of
+ *                    [20-byte id][4-byte length][8-byte stamp][data].
+ *                    A record of length PACK_TOMBSTONE marks a deleted object.
+ *   pack-<seq>.idx   Index of a sealed pack, see IdxHeader below.
+ *                    Entries are sorted by object id and mmap'd for lookups.
+ *   generation       Counters bumped by every process that changes the
+ *                    packs, see PackGeneration below.
+ *
+ * Each process appends new objects to its own active pack, which is
+ * locked with flock() and indexed in a hash table. When it grows beyond
+ * PACK_MAX_SIZE, its index file is written and the pack becomes read-only.
+ *
+ * Every record has a stamp, and the record of an object with the largest
+ * stamp wins, whichever pack it is in. A new record is stamped after the
+ * record it replaces, so a delete is never undone by a pack sealed later.
+ *
+ * Packs written by other processes (seaf-server, httpserver, gc ...) are
+ * picked up by rescanning the dir when an object is not found and the
+ * generation counters show that another process changed the packs.
+ * Unsealed packs that are not locked were left by a crashed process,
+ * they're truncated to the last complete record and sealed.
+ *
+ * Sealed packs are merged by obj_backend_pack_repack(), which drops
+ * deleted objects. The merged pack is flagged while being written, so
+ * that other processes don't index it before it is sealed.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+#include "obj-backend.h"
+
+#define PACK_MAGIC "SPCK"
+#define IDX_MAGIC "SPIX"
+#define PACK_VERSION 2
+
+#define PACK_FLAG_REPACK 0x1
+
+#define RECORD_HEADER_SIZE 32
+#define PACK_TOMBSTONE 0xFFFFFFFF
+
+#define PACK_MAX_SIZE (64 << 20)
+#define REPACK_MIN_PACKS 16
+#define REPACK_CHECK_INTERVAL 600
+
+#define REPACK_LOCK "repack.lock"
+#define GENERATION_FILE "generation"
+
+typedef struct PackHeader {
+    char    magic[4];
+    guint32 version;
+    guint32 flags;
+} PackHeader;
+
+typedef struct IdxHeader {
+    char    magic[4];
+    guint32 version;
+    guint32 n_entries;
+    /* Largest stamp of the entries. */
+    guint32 max_stamp_hi;
+    guint32 max_stamp_lo;
+    /* fanout[i] is the number of entries with id[0] <= i. */
+    guint32 fanout[256];
+} IdxHeader;
+
+typedef struct IdxEntry {
+    unsigned char id[20];
+    guint32       offset_hi;
+    guint32       offset_lo;
+    guint32       len;
+    guint32       stamp_hi;
+    guint32       stamp_lo;
+} IdxEntry;
+
+/*
+ * Mapped from the generation file, shared by all processes. The counters
+ * are only compared for equality, so they may wrap around.
+ */
+typedef struct PackGeneration {
+    /* Bumped when a pack is created, sealed or removed. */
+    volatile gint packs;
+    /* Bumped when a record is appended to an unsealed pack. */
+    volatile gint records;
+} PackGeneration;
+
+typedef struct Pack {
+    guint32        seq;
+    guint32        flags;
+    int            fd;
+    guint64        size;
+    /* Records before this offset are in the unsealed index. */
+    guint64        scanned;
+    /* Only for sealed packs, from the index. */
+    guint64        max_stamp;
+
+    /* mmap'd index, only for sealed packs. */
+    unsigned char *idx_map;
+    gsize          idx_size;
+    IdxHeader     *hdr;
+    IdxEntry      *entries;
+    guint32        n_entries;
+} Pack;
+
+typedef struct UnsealedEntry {
+    Pack   *pack;
+    guint64 offset;
+    guint32 len;
+    guint64 stamp;
+} UnsealedEntry;
+
+typedef struct PackPriv {
+    char            *pack_dir;
+
+    /* Protects all fields below. Held for reading while an object
+     * is read, so that packs are not closed by repacking.
+     */
+    pthread_rwlock_t lock;
+    /* Sealed packs, by max_stamp in descending order. */
+    GList           *packs;
+    /* Pack written by this process, created on first write. */
+    Pack            *active;
+    /* Unsealed packs written by other processes. */
+    GList           *foreign;
+    /* Raw object id -> UnsealedEntry, for the active and foreign packs. */
+    GHashTable      *unsealed;
+    guint32          next_seq;
+    /* Stamp of the last record written by this process. */
+    guint64          last_stamp;
+    /* Generation counters when the packs were last refreshed. */
+    gint             packs_gen;
+    gint             records_gen;
+    PackGeneration  *gen;
+
+    /* Only one repack can run at a time in this process. */
+    pthread_mutex_t  repack_lock;
+} PackPriv;
+
+static char *
+pack_path (PackPriv *priv, guint32 seq, const char *ext)
+{
+    return g_strdup_printf ("%s/pack-%08u.%s", priv->pack_dir, seq, ext);
+}
+
+static guint64
+get_u64 (guint32 hi, guint32 lo)
+{
+    return ((guint64)ntohl(hi) << 32) | ntohl(lo);
+}
+
+static void
+put_u64 (guint64 val, guint32 *hi, guint32 *lo)
+{
+    *hi = htonl ((guint32)(val >> 32));
+    *lo = htonl ((guint32)val);
+}
+
+static guint64
+entry_offset (const IdxEntry *e)
+{
+    return get_u64 (e->offset_hi, e->offset_lo);
+}
+
+static guint64
+entry_stamp (const IdxEntry *e)
+{
+    return get_u64 (e->stamp_hi, e->stamp_lo);
+}
+
+static void
+set_entry (IdxEntry *e, const unsigned char *id, guint64 offset, guint32 len,
+           guint64 stamp)
+{
+    memcpy (e->id, id, 20);
+    put_u64 (offset, &e->offset_hi, &e->offset_lo);
+    e->len = htonl (len);
+    put_u64 (stamp, &e->stamp_hi, &e->stamp_lo);
+}
+
+static void
+make_record_header (unsigned char *rec, const unsigned char *id,
+                    guint32 len, guint64 stamp)
+{
+    guint32 val[3];
+
+    val[0] = htonl (len);
+    put_u64 (stamp, &val[1], &val[2]);
+    memcpy (rec, id, 20);
+    memcpy (rec + 20, val, 12);
+}
+
+static void
+parse_record_header (const unsigned char *rec, guint32 *len, guint64 *stamp)
+{
+    guint32 val[3];
+
+    memcpy (val, rec + 20, 12);
+    *len = ntohl (val[0]);
+    *stamp = get_u64 (val[1], val[2]);
+}
+
+/*
+ * Stamp for a new record of an object whose newest record has @prev_stamp
+ * (0 if there's none). Stamps follow the clock, so records written by
+ * different processes are ordered by time, but a new record is always
+ * stamped after the one it replaces. Called with write lock held.
+ */
+static guint64
+new_stamp (PackPriv *priv, guint64 prev_stamp)
+{
+    GTimeVal now;
+    guint64 stamp;
+
+    g_get_current_time (&now);
+    stamp = (guint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+    stamp = MAX (stamp, priv->last_stamp + 1);
+    stamp = MAX (stamp, prev_stamp + 1);
+
+    priv->last_stamp = stamp;
+    return stamp;
+}
+
+static int
+open_generation (PackPriv *priv)
+{
+    char *path;
+    struct stat st;
+    void *map;
+    int fd;
+
+    path = g_build_filename (priv->pack_dir, GENERATION_FILE, NULL);
+    fd = g_open (path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) {
+        g_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+
+    /* Extending the file fills it with zeros, so it doesn't matter if
+     * several processes do it at the same time.
+     */
+    if (fstat (fd, &st) < 0 ||
+        (st.st_size < sizeof(PackGeneration) &&
+         ftruncate (fd, sizeof(PackGeneration)) < 0)) {
+        g_warning ("[pack bend] Failed to init %s: %s.\n", path, strerror(errno));
+        close (fd);
+        g_free (path);
+        return -1;
+    }
+
+    map = mmap (NULL, sizeof(PackGeneration), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        g_warning ("[pack bend] Failed to map %s: %s.\n", path, strerror(errno));
+        g_free (path);
+        return -1;
+    }
+
+    g_free (path);
+    priv->gen = map;
+    return 0;
+}
+
+/*
+ * Tell other processes that the packs changed. Our own changes don't
+ * need a refresh, unless another process changed something we haven't
+ * seen yet. Called with write lock held.
+ */
+static void
+bump_generation (volatile gint *counter, gint *seen)
+{
+    gint old = g_atomic_int_exchange_and_add (counter, 1);
+
+    if (old == *seen)
+        *seen = old + 1;
+}
+
+#define bump_packs_gen(priv) \
+    bump_generation (&(priv)->gen->packs, &(priv)->packs_gen)
+#define bump_records_gen(priv) \
+    bump_generation (&(priv)->gen->records, &(priv)->records_gen)
+
+/* Whether other processes changed the packs since the last refresh. */
+static gboolean
+packs_changed (PackPriv *priv)
+{
+    return (g_atomic_int_get (&priv->gen->packs) != priv->packs_gen ||
+            g_atomic_int_get (&priv->gen->records) != priv->records_gen);
+}
+
+static void
+pack_free (Pack *pack)
+{
+    if (!pack)
+        return;
+    if (pack->fd >= 0)
+        close (pack->fd);
+    if (pack->idx_map)
+        munmap (pack->idx_map, pack->idx_size);
+    g_free (pack);
+}
+
+static void
+remove_pack_files (PackPriv *priv, guint32 seq)
+{
+    char *path;
+
+    path = pack_path (priv, seq, "idx");
+    g_unlink (path);
+    g_free (path);
+
+    path = pack_path (priv, seq, "pack");
+    g_unlink (path);
+    g_free (path);
+}
+
+static Pack *
+open_pack (PackPriv *priv, guint32 seq)
+{
+    Pack *pack;
+    PackHeader hdr;
+    struct stat st;
+    char *path;
+
+    path = pack_path (priv, seq, "pack");
+
+    pack = g_new0 (Pack, 1);
+    pack->seq = seq;
+    pack->fd = g_open (path, O_RDWR | O_BINARY, 0);
+    if (pack->fd < 0) {
+        g_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+        goto error;
+    }
+
+    if (fstat (pack->fd, &st) < 0 ||
+        pread (pack->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp (hdr.magic, PACK_MAGIC, 4) != 0 ||
+        ntohl (hdr.version) != PACK_VERSION) {
+        g_warning ("[pack bend] Invalid pack file %s.\n", path);
+        goto error;
+    }
+
+    pack->flags = ntohl (hdr.flags);
+    pack->size = st.st_size;
+    pack->scanned = sizeof(PackHeader);
+
+    g_free (path);
+    return pack;
+
+error:
+    g_free (path);
+    pack_free (pack);
+    return NULL;
+}
+
+/*
+ * Create a new pack locked by this process. Pack numbers are shared by
+ * all processes, so the pack is written to a temp file first and then
+ * linked to the first free name. Called with write lock held.
+ */
+static Pack *
+create_pack (PackPriv *priv, guint32 flags)
+{
+    Pack *pack;
+    PackHeader hdr;
+    char *path, *tmp_path;
+    guint32 seq;
+    int fd;
+
+    while (1) {
+        seq = priv->next_seq++;
+        path = pack_path (priv, seq, "pack");
+        tmp_path = pack_path (priv, seq, "pack.new");
+
+        fd = g_open (tmp_path, O_RDWR | O_CREAT | O_EXCL | O_BINARY, 0644);
+        if (fd < 0) {
+            g_free (path);
+            g_free (tmp_path);
+            if (errno == EEXIST)
+                continue;
+            g_warning ("[pack bend] Failed to create pack: %s.\n", strerror(errno));
+            return NULL;
+        }
+
+        memcpy (hdr.magic, PACK_MAGIC, 4);
+        hdr.version = htonl (PACK_VERSION);
+        hdr.flags = htonl (flags);
+
+        if (flock (fd, LOCK_EX | LOCK_NB) < 0 ||
+            writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+            g_warning ("[pack bend] Failed to init pack %s: %s.\n",
+                       tmp_path, strerror(errno));
+            goto error;
+        }
+
+        if (link (tmp_path, path) == 0)
+            break;
+
+        if (errno != EEXIST) {
+            g_warning ("[pack bend] Failed to link %s: %s.\n", path, strerror(errno));
+            goto error;
+        }
+
+        close (fd);
+        g_unlink (tmp_path);
+        g_free (path);
+        g_free (tmp_path);
+    }
+
+    g_unlink (tmp_path);
+    g_free (path);
+    g_free (tmp_path);
+    bump_packs_gen (priv);
+
+    pack = g_new0 (Pack, 1);
+    pack->seq = seq;
+    pack->flags = flags;
+    pack->fd = fd;
+    pack->size = pack->scanned = sizeof(PackHeader);
+
+    return pack;
+
+error:
+    close (fd);
+    g_unlink (tmp_path);
+    g_free (path);
+    g_free (tmp_path);
+    return NULL;
+}
+
+static int
+load_idx (Pack *pack, const char *path)
+{
+    struct stat st;
+    int fd;
+    void *map;
+    IdxHeader *hdr;
+
+    fd = g_open (path, O_RDONLY | O_BINARY, 0);
+    if (fd < 0) {
+        g_warning ("[pack bend] Failed to open %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat (fd, &st) < 0 || st.st_size < sizeof(IdxHeader)) {
+        g_warning ("[pack bend] Invalid index file %s.\n", path);
+        close (fd);
+        return -1;
+    }
+
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        g_warning ("[pack bend] Failed to map %s: %s.\n", path, strerror(errno));
+        return -1;
+    }
+
+    hdr = map;
+    if (memcmp (hdr->magic, IDX_MAGIC, 4) != 0 ||
+        ntohl (hdr->version) != PACK_VERSION ||
+        st.st_size != sizeof(IdxHeader) +
+                      (guint64)ntohl(hdr->n_entries) * sizeof(IdxEntry) ||
+        ntohl (hdr->fanout[255]) != ntohl (hdr->n_entries)) {
+        g_warning ("[pack bend] Index file %s is corrupted.\n", path);
+        munmap (map, st.st_size);
+        return -1;
+    }
+
+    pack->idx_map = map;
+    pack->idx_size = st.st_size;
+    pack->hdr = hdr;
+    pack->entries = (IdxEntry *)(pack->idx_map + sizeof(IdxHeader));
+    pack->n_entries = ntohl (hdr->n_entries);
+    pack->max_stamp = get_u64 (hdr->max_stamp_hi, hdr->max_stamp_lo);
+
+    return 0;
+}
+
+static IdxEntry *
+idx_lookup (Pack *pack, const unsigned char *id)
+{
+    guint32 lo, hi;
+
+    lo = (id[0] == 0) ? 0 : ntohl (pack->hdr->fanout[id[0] - 1]);
+    hi = ntohl (pack->hdr->fanout[id[0]]);
+    if (hi <= lo || hi > pack->n_entries)
+        return NULL;
+
+    return bsearch (id, pack->entries + lo, hi - lo, sizeof(IdxEntry), raw_id_cmp);
+}
+
+static void
+add_unsealed_entry (GHashTable *index, Pack *pack, const unsigned char *id,
+                    guint64 offset, guint32 len, guint64 stamp)
+{
+    UnsealedEntry *e;
+
+    e = g_hash_table_lookup (index, id);
+    if (e && e->stamp > stamp)
+        return;
+
+    e = g_new0 (UnsealedEntry, 1);
+    e->pack = pack;
+    e->offset = offset;
+    e->len = len;
+    e->stamp = stamp;
+    g_hash_table_replace (index, g_memdup (id, 20), e);
+}
+
+static gboolean
+entry_in_pack (gpointer key, gpointer value, gpointer pack)
+{
+    return (((UnsealedEntry *)value)->pack == pack);
+}
+
+/*
+ * Add the complete records of an unsealed pack to @index, starting from
+ * where the last scan stopped. If @truncate is TRUE (the pack is locked
+ * by us), a partially written record at the end of the pack is removed.
+ */
+static int
+scan_pack (Pack *pack, GHashTable *index, gboolean truncate)
+{
+    unsigned char rec[RECORD_HEADER_SIZE];
+    guint64 offset = pack->scanned;
+    guint64 stamp;
+    guint32 len;
+    struct stat st;
+
+    if (fstat (pack->fd, &st) < 0)
+        return -1;
+    pack->size = st.st_size;
+
+    while (offset + RECORD_HEADER_SIZE <= pack->size) {
+        if (pread (pack->fd, rec, RECORD_HEADER_SIZE, offset) != RECORD_HEADER_SIZE)
+            break;
+        parse_record_header (rec, &len, &stamp);
+
+        if (len != PACK_TOMBSTONE &&
+            offset + RECORD_HEADER_SIZE + len > pack->size)
+            break;
+
+        add_unsealed_entry (index, pack, rec, offset + RECORD_HEADER_SIZE,
+                            len, stamp);
+
+        offset += RECORD_HEADER_SIZE;
+        if (len != PACK_TOMBSTONE)
+            offset += len;
+    }
+    pack->scanned = offset;
+
+    if (truncate && offset != pack->size) {
+        g_warning ("[pack bend] Truncate pack %u from %"G_GUINT64_FORMAT
+                   " to %"G_GUINT64_FORMAT" bytes.\n",
+                   pack->seq, pack->size, offset);
+        if (ftruncate (pack->fd, offset) < 0)
+            return -1;
+        pack->size = offset;
+    }
+
+    return 0;
+}
+
+/*
+ * Write sorted @entries to the index file of pack @seq.
+ */
+static int
+write_idx (PackPriv *priv, guint32 seq, IdxEntry *entries, guint32 n_entries)
+{
+    IdxHeader hdr;
+    char *path, *tmp_path;
+    guint32 counts[256], total = 0;
+    guint64 max_stamp = 0;
+    int fd, i;
+    ssize_t len;
+    int ret = -1;
+
+    memset (&hdr, 0, sizeof(hdr));
+    memset (counts, 0, sizeof(counts));
+    for (i = 0; i < n_entries; ++i) {
+        ++counts[entries[i].id[0]];
+        max_stamp = MAX (max_stamp, entry_stamp (&entries[i]));
+    }
+
+    memcpy (hdr.magic, IDX_MAGIC, 4);
+    hdr.version = htonl (PACK_VERSION);
+    hdr.n_entries = htonl (n_entries);
+    put_u64 (max_stamp, &hdr.max_stamp_hi, &hdr.max_stamp_lo);
+    for (i = 0; i < 256; ++i) {
+        total += counts[i];
+        hdr.fanout[i] = htonl (total);
+    }
+
+    path = pack_path (priv, seq, "idx");
+    tmp_path = g_strconcat (path, ".tmp", NULL);
+
+    fd = g_open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        g_warning ("[pack bend] Failed to open %s: %s.\n", tmp_path, strerror(errno));
+        goto out;
+    }
+
+    len = (ssize_t)n_entries * sizeof(IdxEntry);
+    if (writen (fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        (len > 0 && writen (fd, entries, len) != len) ||
+        fsync (fd) < 0) {
+        g_warning ("[pack bend] Failed to write %s: %s.\n", tmp_path, strerror(errno));
+        close (fd);
+        g_unlink (tmp_path);
+        goto out;
+    }
+    close (fd);
+
+    if (ccnet_rename (tmp_path, path) < 0) {
+        g_warning ("[pack bend] Failed to rename %s: %s.\n", tmp_path, strerror(errno));
+        g_unlink (tmp_path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    g_free (path);
+    g_free (tmp_path);
+    return ret;
+}
+
+/*
+ * Write the index file of @pack from the records of @pack in @index,
+ * and map it.
+ */
+static int
+index_pack (PackPriv *priv, Pack *pack, GHashTable *index)
+{
+    char *idx_path;
+    IdxEntry *entries;
+    GHashTableIter iter;
+    gpointer key, value;
+    UnsealedEntry *e;
+    guint32 n = 0;
+    int ret;
+
+    entries = g_new0 (IdxEntry, g_hash_table_size (index) + 1);
+    g_hash_table_iter_init (&iter, index);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        e = value;
+        if (e->pack == pack)
+            set_entry (&entries[n++], key, e->offset, e->len, e->stamp);
+    }
+    qsort (entries, n, sizeof(IdxEntry), raw_id_cmp);
+
+    if (fsync (pack->fd) < 0 ||
+        write_idx (priv, pack->seq, entries, n) < 0) {
+        g_free (entries);
+        return -1;
+    }
+    g_free (entries);
+
+    idx_path = pack_path (priv, pack->seq, "idx");
+    ret = load_idx (pack, idx_path);
+    g_free (idx_path);
+
+    return ret;
+}
+
+static void
+insert_pack (PackPriv *priv, Pack *pack)
+{
+    GList *ptr;
+
+    for (ptr = priv->packs; ptr; ptr = ptr->next) {
+        if (((Pack *)ptr->data)->max_stamp <= pack->max_stamp)
+            break;
+    }
+    priv->packs = g_list_insert_before (priv->packs, ptr, pack);
+}
+
+/*
+ * Seal the active pack. A new one is created on next write.
+ * Called with write lock held.
+ */
+static int
+seal_active_pack (PackPriv *priv)
+{
+    Pack *pack = priv->active;
+
+    if (index_pack (priv, pack, priv->unsealed) < 0)
+        return -1;
+
+    g_hash_table_foreach_remove (priv->unsealed, entry_in_pack, pack);
+    flock (pack->fd, LOCK_UN);
+    insert_pack (priv, pack);
+    priv->active = NULL;
+    bump_packs_gen (priv);
+
+    return 0;
+}
+
+static Pack *
+find_pack (PackPriv *priv, guint32 seq)
+{
+    GList *ptr;
+
+    if (priv->active && priv->active->seq == seq)
+        return priv->active;
+    for (ptr = priv->packs; ptr; ptr = ptr->next)
+        if (((Pack *)ptr->data)->seq == seq)
+            return ptr->data;
+    for (ptr = priv->foreign; ptr; ptr = ptr->next)
+        if (((Pack *)ptr->data)->seq == seq)
+            return ptr->data;
+    return NULL;
+}
+
+/*
+ * Seal a pack left unsealed by a crashed process.
+ */
+static int
+seal_orphan_pack (PackPriv *priv, Pack *pack)
+{
+    GHashTable *index;
+    int ret = 0;
+
+    if (pack->flags & PACK_FLAG_REPACK) {
+        /* Unfinished repack, the objects are still in the old packs. */
+        g_message ("[pack bend] Remove unfinished pack %u.\n", pack->seq);
+        remove_pack_files (priv, pack->seq);
+        bump_packs_gen (priv);
+        return -1;
+    }
+
+    g_message ("[pack bend] Seal orphan pack %u.\n", pack->seq);
+
+    index = g_hash_table_new_full (raw_id_hash, raw_id_equal, g_free, g_free);
+    if (scan_pack (pack, index, TRUE) < 0 ||
+        index_pack (priv, pack, index) < 0)
+        ret = -1;
+    g_hash_table_destroy (index);
+
+    flock (pack->fd, LOCK_UN);
+    if (ret == 0)
+        bump_packs_gen (priv);
+    return ret;
+}
+
+static void
+add_pack (PackPriv *priv, guint32 seq)
+{
+    Pack *pack;
+    char *idx_path;
+
+    pack = open_pack (priv, seq);
+    if (!pack)
+        return;
+
+    idx_path = pack_path (priv, seq, "idx");
+    if (g_file_test (idx_path, G_FILE_TEST_EXISTS)) {
+        if (load_idx (pack, idx_path) < 0)
+            goto error;
+        insert_pack (priv, pack);
+    } else if (flock (pack->fd, LOCK_EX | LOCK_NB) == 0) {
+        if (seal_orphan_pack (priv, pack) < 0)
+            goto error;
+        insert_pack (priv, pack);
+    } else {
+        if (!(pack->flags & PACK_FLAG_REPACK))
+            scan_pack (pack, priv->unsealed, FALSE);
+        priv->foreign = g_list_prepend (priv->foreign, pack);
+    }
+
+    g_free (idx_path);
+    return;
+
+error:
+    g_free (idx_path);
+    pack_free (pack);
+}
+
+static void
+drop_pack (PackPriv *priv, Pack *pack)
+{
+    priv->packs = g_list_remove (priv->packs, pack);
+    priv->foreign = g_list_remove (priv->foreign, pack);
+    g_hash_table_foreach_remove (priv->unsealed, entry_in_pack, pack);
+    pack_free (pack);
+}
+
+static void
+list_packs (PackPriv *priv)
+{
+    GDir *dir;
+    const char *dname;
+    GHashTable *seen;
+    GList *ptr, *next;
+    guint32 seq;
+    Pack *pack;
+
+    dir = g_dir_open (priv->pack_dir, 0, NULL);
+    if (!dir) {
+        g_warning ("[pack bend] Failed to open dir %s.\n", priv->pack_dir);
+        return;
+    }
+
+    seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        if (sscanf (dname, "pack-%u.pack", &seq) != 1 ||
+            !g_str_has_suffix (dname, ".pack"))
+            continue;
+
+        g_hash_table_insert (seen, GUINT_TO_POINTER(seq), GUINT_TO_POINTER(1));
+        if (seq >= priv->next_seq)
+            priv->next_seq = seq + 1;
+
+        if (!find_pack (priv, seq))
+            add_pack (priv, seq);
+    }
+    g_dir_close (dir);
+
+    /* Packs removed by repacking in other processes. */
+    for (ptr = priv->packs; ptr; ptr = next) {
+        next = ptr->next;
+        pack = ptr->data;
+        if (!g_hash_table_lookup (seen, GUINT_TO_POINTER(pack->seq)))
+            drop_pack (priv, pack);
+    }
+    for (ptr = priv->foreign; ptr; ptr = next) {
+        next = ptr->next;
+        pack = ptr->data;
+        if (!g_hash_table_lookup (seen, GUINT_TO_POINTER(pack->seq)))
+            drop_pack (priv, pack);
+    }
+
+    g_hash_table_destroy (seen);
+}
+
+/*
+ * Pick up packs created, extended, sealed or removed by other processes.
+ * If @force is FALSE, only what the generation counters show as changed
+ * is checked. Called with write lock held.
+ */
+static void
+refresh_packs (PackPriv *priv, gboolean force)
+{
+    GList *ptr, *next;
+    Pack *pack;
+    char *idx_path;
+    gboolean packs_changed;
+    gint gen;
+
+    /* Take the counters before looking at the packs, so that changes
+     * made while we're refreshing are picked up next time.
+     */
+    gen = g_atomic_int_get (&priv->gen->packs);
+    packs_changed = (force || gen != priv->packs_gen);
+    priv->packs_gen = gen;
+    priv->records_gen = g_atomic_int_get (&priv->gen->records);
+
+    if (packs_changed)
+        list_packs (priv);
+
+    for (ptr = priv->foreign; ptr; ptr = next) {
+        next = ptr->next;
+        pack = ptr->data;
+
+        idx_path = pack_path (priv, pack->seq, "idx");
+        if (packs_changed && g_file_test (idx_path, G_FILE_TEST_EXISTS)) {
+            if (load_idx (pack, idx_path) == 0) {
+                priv->foreign = g_list_delete_link (priv->foreign, ptr);
+                g_hash_table_foreach_remove (priv->unsealed, entry_in_pack, pack);
+                insert_pack (priv, pack);
+            }
+        } else if (!(pack->flags & PACK_FLAG_REPACK)) {
+            scan_pack (pack, priv->unsealed, FALSE);
+        }
+        g_free (idx_path);
+    }
+}
+
+static int
+read_data (Pack *pack, guint64 offset, guint32 len, void **data, int *out_len)
+{
+    char *buf = g_malloc (len ? len : 1);
+
+    if (len > 0 && pread (pack->fd, buf, len, offset) != len) {
+        g_warning ("[pack bend] Failed to read pack %u: %s.\n",
+                   pack->seq, strerror(errno));
+        g_free (buf);
+        return -1;
+    }
+
+    *data = buf;
+    *out_len = (int)len;
+    return 0;
+}
+
+/*
+ * Find the record of @id with the largest stamp, which may be a tombstone.
+ * Called with lock held.
+ */
+static gboolean
+find_record (PackPriv *priv, const unsigned char *id,
+             Pack **pack, guint64 *offset, guint32 *len, guint64 *stamp)
+{
+    UnsealedEntry *ue;
+    IdxEntry *e;
+    GList *ptr;
+    gboolean found = FALSE;
+
+    ue = g_hash_table_lookup (priv->unsealed, id);
+    if (ue) {
+        *pack = ue->pack;
+        *offset = ue->offset;
+        *len = ue->len;
+        *stamp = ue->stamp;
+        found = TRUE;
+    }
+
+    /* Sealed packs may have newer records than unsealed ones, e.g. a pack
+     * sealed after its process crashed. The remaining packs can't have a
+     * newer record once their max stamp is reached.
+     */
+    for (ptr = priv->packs; ptr; ptr = ptr->next) {
+        if (found && *stamp >= ((Pack *)ptr->data)->max_stamp)
+            break;
+        e = idx_lookup (ptr->data, id);
+        if (e && (!found || entry_stamp (e) > *stamp)) {
+            *pack = ptr->data;
+            *offset = entry_offset (e);
+            *len = ntohl (e->len);
+            *stamp = entry_stamp (e);
+            found = TRUE;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Look up @id. If it's not found or deleted, and other processes changed
+ * the packs, they're rescanned in case the object was just written by
+ * another process. Only one thread rescans, the others find the packs
+ * refreshed when they get the write lock. Returns with the lock held,
+ * the caller must release it.
+ */
+static gboolean
+lookup_obj (PackPriv *priv, const unsigned char *id,
+            Pack **pack, guint64 *offset, guint32 *len)
+{
+    guint64 stamp;
+
+    pthread_rwlock_rdlock (&priv->lock);
+    if (find_record (priv, id, pack, offset, len, &stamp) &&
+        *len != PACK_TOMBSTONE)
+        return TRUE;
+    if (!packs_changed (priv))
+        return FALSE;
+    pthread_rwlock_unlock (&priv->lock);
+
+    pthread_rwlock_wrlock (&priv->lock);
+    if (packs_changed (priv))
+        refresh_packs (priv, FALSE);
+    if (find_record (priv, id, pack, offset, len, &stamp))
+        return (*len != PACK_TOMBSTONE);
+    return FALSE;
+}
+
+static int
+obj_backend_pack_read (ObjBackend *bend,
+                       const char *obj_id,
+                       void **data,
+                       int *len)
+{
+    PackPriv *priv = bend->priv;
+    unsigned char id[20];
+    Pack *pack;
+    guint64 offset;
+    guint32 obj_len;
+    int ret = -1;
+
+    if (hex_to_rawdata (obj_id, id, 20) < 0)
+        return -1;
+
+    if (lookup_obj (priv, id, &pack, &offset, &obj_len))
+        ret = read_data (pack, offset, obj_len, data, len);
+    pthread_rwlock_unlock (&priv->lock);
+
+    return ret;
+}
+
+static gboolean
+obj_backend_pack_exists (ObjBackend *bend,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    unsigned char id[20];
+    Pack *pack;
+    guint64 offset;
+    guint32 len;
+    gboolean ret;
+
+    if (hex_to_rawdata (obj_id, id, 20) < 0)
+        return FALSE;
+
+    ret = lookup_obj (priv, id, &pack, &offset, &len);
+    pthread_rwlock_unlock (&priv->lock);
+
+    return ret;
+}
+
+static void
+obj_backend_pack_exists_many (ObjBackend *bend,
+                              const char **obj_ids,
+                              int n_objs,
+                              gboolean *exists)
+{
+    PackPriv *priv = bend->priv;
+    unsigned char id[20];
+    Pack *pack;
+    guint64 offset, stamp;
+    guint32 len;
+    gboolean changed, refreshed = FALSE;
+    int i;
+
+    pthread_rwlock_rdlock (&priv->lock);
+    for (i = 0; i < n_objs; ++i) {
+        exists[i] = (hex_to_rawdata (obj_ids[i], id, 20) == 0 &&
+                     find_record (priv, id, &pack, &offset, &len, &stamp) &&
+                     len != PACK_TOMBSTONE);
+    }
+    changed = packs_changed (priv);
+    pthread_rwlock_unlock (&priv->lock);
+
+    if (!changed)
+        return;
+
+    /* Rescan the packs at most once for the whole batch. */
+    for (i = 0; i < n_objs; ++i) {
+        if (exists[i] || hex_to_rawdata (obj_ids[i], id, 20) < 0)
+            continue;
+        if (!refreshed) {
+            pthread_rwlock_wrlock (&priv->lock);
+            if (packs_changed (priv))
+                refresh_packs (priv, FALSE);
+            refreshed = TRUE;
+        }
+        exists[i] = (find_record (priv, id, &pack, &offset, &len, &stamp) &&
+                     len != PACK_TOMBSTONE);
+    }
+    if (refreshed)
+        pthread_rwlock_unlock (&priv->lock);
+}
+
+/*
+ * Append a record to the active pack. Called with write lock held.
+ */
+static int
+append_record (PackPriv *priv, const unsigned char *id,
+               const void *data, guint32 len, guint64 stamp)
+{
+    Pack *pack;
+    guint32 data_len = (len == PACK_TOMBSTONE) ? 0 : len;
+    char *buf;
+    ssize_t n;
+
+    if (!priv->active) {
+        priv->active = create_pack (priv, 0);
+        if (!priv->active)
+            return -1;
+    }
+    pack = priv->active;
+
+    buf = g_malloc (RECORD_HEADER_SIZE + data_len);
+    make_record_header ((unsigned char *)buf, id, len, stamp);
+    if (data_len > 0)
+        memcpy (buf + RECORD_HEADER_SIZE, data, data_len);
+
+    /* Write the record at once, so that other processes never see
+     * a record header without its data.
+     */
+    n = pwrite (pack->fd, buf, RECORD_HEADER_SIZE + data_len, pack->size);
+    g_free (buf);
+    if (n != RECORD_HEADER_SIZE + data_len) {
+        g_warning ("[pack bend] Failed to write pack %u: %s.\n",
+                   pack->seq, strerror(errno));
+        if (ftruncate (pack->fd, pack->size) < 0)
+            g_warning ("[pack bend] Failed to truncate pack %u.\n", pack->seq);
+        return -1;
+    }
+
+    add_unsealed_entry (priv->unsealed, pack, id,
+                        pack->size + RECORD_HEADER_SIZE, len, stamp);
+    pack->size += RECORD_HEADER_SIZE + data_len;
+    pack->scanned = pack->size;
+    bump_records_gen (priv);
+
+    if (pack->size >= PACK_MAX_SIZE && seal_active_pack (priv) < 0)
+        g_warning ("[pack bend] Failed to seal pack %u.\n", pack->seq);
+
+    return 0;
+}
+
+static int
+obj_backend_pack_write (ObjBackend *bend,
+                        const char *obj_id,
+                        void *data,
+                        int len)
+{
+    PackPriv *priv = bend->priv;
+    unsigned char id[20];
+    Pack *pack;
+    guint64 offset, stamp = 0;
+    guint32 obj_len;
+    int ret = 0;
+
+    if (hex_to_rawdata (obj_id, id, 20) < 0)
+        return -1;
+
+    pthread_rwlock_wrlock (&priv->lock);
+    /* Don't write existing objects again. A deleted object is written
+     * with a stamp after its tombstone.
+     */
+    if (!find_record (priv, id, &pack, &offset, &obj_len, &stamp) ||
+        obj_len == PACK_TOMBSTONE)
+        ret = append_record (priv, id, data, (guint32)len,
+                             new_stamp (priv, stamp));
+    pthread_rwlock_unlock (&priv->lock);
+
+    if (ret < 0)
+        g_warning ("[pack bend] Failed to write object %s.\n", obj_id);
+
+    return ret;
+}
+
+static void
+obj_backend_pack_delete (ObjBackend *bend,
+                         const char *obj_id)
+{
+    PackPriv *priv = bend->priv;
+    unsigned char id[20];
+    Pack *pack;
+    guint64 offset, stamp;
+    guint32 len;
+
+    if (hex_to_rawdata (obj_id, id, 20) < 0)
+        return;
+
+    pthread_rwlock_wrlock (&priv->lock);
+    if (packs_changed (priv))
+        refresh_packs (priv, FALSE);
+    if (find_record (priv, id, &pack, &offset, &len, &stamp) &&
+        len != PACK_TOMBSTONE)
+        append_record (priv, id, NULL, PACK_TOMBSTONE, new_stamp (priv, stamp));
+    pthread_rwlock_unlock (&priv->lock);
+}
+
+/*
+ * Repacking.
+ *
+ * Sealed packs are immutable, and only repacking removes them, so
+ * they can be read without the lock while repack_lock is held.
+ */
+
+typedef struct MergeCursor {
+    Pack   *pack;
+    guint32 pos;
+} MergeCursor;
+
+static int
+copy_record (Pack *src, IdxEntry *e, Pack *dst, IdxEntry *out_entry)
+{
+    guint32 len = ntohl (e->len);
+    unsigned char rec[RECORD_HEADER_SIZE];
+    void *data = NULL;
+    int data_len = 0;
+
+    if (len != PACK_TOMBSTONE &&
+        read_data (src, entry_offset (e), len, &data, &data_len) < 0)
+        return -1;
+
+    make_record_header (rec, e->id, len, entry_stamp (e));
+
+    if (writen (dst->fd, rec, RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE ||
+        (data_len > 0 && writen (dst->fd, data, data_len) != data_len)) {
+        g_free (data);
+        return -1;
+    }
+    g_free (data);
+
+    set_entry (out_entry, e->id, dst->size + RECORD_HEADER_SIZE, len,
+               entry_stamp (e));
+    dst->size += RECORD_HEADER_SIZE + data_len;
+    return 0;
+}
+
+/*
+ * Whether a pack that is not being merged has a record of @id. Its
+ * tombstone must be kept then, older records may still be hidden by it.
+ */
+static gboolean
+held_by_other_pack (PackPriv *priv, GList *merged, const unsigned char *id)
+{
+    GList *ptr;
+    gboolean ret = FALSE;
+
+    pthread_rwlock_rdlock (&priv->lock);
+    if (g_hash_table_lookup (priv->unsealed, id))
+        ret = TRUE;
+    for (ptr = priv->packs; ptr && !ret; ptr = ptr->next) {
+        if (!g_list_find (merged, ptr->data) && idx_lookup (ptr->data, id))
+            ret = TRUE;
+    }
+    pthread_rwlock_unlock (&priv->lock);
+
+    return ret;
+}
+
+/*
+ * K-way merge of the sorted indexes of @packs into @dst. For each object
+ * id, only the record with the largest stamp is kept. Tombstones are
+ * dropped with the records they hide, unless another pack still has a
+ * record of the object.
+ */
+static int
+merge_packs (PackPriv *priv, GList *packs, Pack *dst)
+{
+    int n_packs = g_list_length (packs);
+    MergeCursor *cursors = g_new0 (MergeCursor, n_packs);
+    GArray *entries = g_array_new (FALSE, FALSE, sizeof(IdxEntry));
+    IdxEntry *min, *e, out;
+    int min_i, i, cmp, ret = -1;
+    GList *ptr;
+
+    for (ptr = packs, i = 0; ptr; ptr = ptr->next, ++i)
+        cursors[i].pack = ptr->data;
+
+    while (1) {
+        min = NULL;
+        min_i = -1;
+        for (i = 0; i < n_packs; ++i) {
+            if (cursors[i].pos >= cursors[i].pack->n_entries)
+                continue;
+            e = &cursors[i].pack->entries[cursors[i].pos];
+            cmp = min ? raw_id_cmp (e, min) : -1;
+            if (cmp < 0 || (cmp == 0 && entry_stamp (e) > entry_stamp (min))) {
+                min = e;
+                min_i = i;
+            }
+        }
+        if (!min)
+            break;
+
+        if (ntohl (min->len) != PACK_TOMBSTONE ||
+            held_by_other_pack (priv, packs, min->id)) {
+            if (copy_record (cursors[min_i].pack, min, dst, &out) < 0) {
+                g_warning ("[pack bend] Failed to copy object to pack %u.\n",
+                           dst->seq);
+                goto out;
+            }
+            g_array_append_val (entries, out);
+        }
+
+        /* Skip older records of the same object. */
+        for (i = 0; i < n_packs; ++i) {
+            if (i != min_i && cursors[i].pos < cursors[i].pack->n_entries &&
+                raw_id_cmp (&cursors[i].pack->entries[cursors[i].pos], min) == 0)
+                ++cursors[i].pos;
+        }
+        ++cursors[min_i].pos;
+    }
+
+    if (fsync (dst->fd) < 0 ||
+        write_idx (priv, dst->seq, (IdxEntry *)entries->data, entries->len) < 0)
+        goto out;
+
+    ret = 0;
+
+out:
+    g_free (cursors);
+    g_array_free (entries, TRUE);
+    return ret;
+}
+
+int
+obj_backend_pack_repack (ObjBackend *bend, int min_packs)
+{
+    PackPriv *priv = bend->priv;
+    GList *packs = NULL, *ptr;
+    Pack *dst = NULL;
+    char *path;
+    int lock_fd, ret = 0;
+
+    pthread_mutex_lock (&priv->repack_lock);
+
+    /* Only one process repacks at a time. */
+    path = g_build_filename (priv->pack_dir, REPACK_LOCK, NULL);
+    lock_fd = g_open (path, O_RDWR | O_CREAT, 0644);
+    g_free (path);
+    if (lock_fd < 0 || flock (lock_fd, LOCK_EX | LOCK_NB) < 0)
+        goto out;
+
+    pthread_rwlock_wrlock (&priv->lock);
+    refresh_packs (priv, FALSE);
+    if (g_list_length (priv->packs) >= MAX(min_packs, 2)) {
+        packs = g_list_copy (priv->packs);
+        dst = create_pack (priv, PACK_FLAG_REPACK);
+        if (!dst)
+            ret = -1;
+    }
+    pthread_rwlock_unlock (&priv->lock);
+
+    if (!dst)
+        goto out;
+
+    g_message ("[pack bend] Repacking %u packs in %s.\n",
+               g_list_length (packs), priv->pack_dir);
+
+    path = pack_path (priv, dst->seq, "idx");
+    if (merge_packs (priv, packs, dst) < 0 || load_idx (dst, path) < 0) {
+        g_free (path);
+        remove_pack_files (priv, dst->seq);
+        pack_free (dst);
+        ret = -1;
+        goto out;
+    }
+    g_free (path);
+    flock (dst->fd, LOCK_UN);
+
+    pthread_rwlock_wrlock (&priv->lock);
+    for (ptr = packs; ptr; ptr = ptr->next)
+        priv->packs = g_list_remove (priv->packs, ptr->data);
+    insert_pack (priv, dst);
+    pthread_rwlock_unlock (&priv->lock);
+
+    /* If we crash before all old packs are removed, the remaining ones
+     * only contain duplicated objects, and will be merged next time.
+     */
+    for (ptr = packs; ptr; ptr = ptr->next) {
+        remove_pack_files (priv, ((Pack *)ptr->data)->seq);
+        pack_free (ptr->data);
+    }
+
+    pthread_rwlock_wrlock (&priv->lock);
+    bump_packs_gen (priv);
+    pthread_rwlock_unlock (&priv->lock);
+
+out:
+    if (lock_fd >= 0)
+        close (lock_fd);
+    g_list_free (packs);
+    pthread_mutex_unlock (&priv->repack_lock);
+    return ret;
+}
+
+int
+obj_backend_pack_seal (ObjBackend *bend)
+{
+    PackPriv *priv = bend->priv;
+    int ret = 0;
+
+    pthread_rwlock_wrlock (&priv->lock);
+    if (priv->active)
+        ret = seal_active_pack (priv);
+    pthread_rwlock_unlock (&priv->lock);
+
+    return ret;
+}
+
+static void *
+repack_thread (void *vbend)
+{
+    while (1) {
+        sleep (REPACK_CHECK_INTERVAL);
+        if (obj_backend_pack_repack ((ObjBackend *)vbend, REPACK_MIN_PACKS) < 0)
+            g_warning ("[pack bend] Failed to repack.\n");
+    }
+
+    return NULL;
+}
+
+/*
+ * If @auto_repack is TRUE, sealed packs are merged in the background.
+ * Only one of the processes sharing @pack_dir should enable it.
+ */
+ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gboolean auto_repack)
+{
+    ObjBackend *bend;
+    PackPriv *priv;
+    pthread_t tid;
+
+    bend = g_new0 (ObjBackend, 1);
+    priv = g_new0 (PackPriv, 1);
+    bend->priv = priv;
+
+    priv->pack_dir = g_strdup (pack_dir);
+    priv->next_seq = 1;
+    pthread_rwlock_init (&priv->lock, NULL);
+    pthread_mutex_init (&priv->repack_lock, NULL);
+    priv->unsealed = g_hash_table_new_full (raw_id_hash, raw_id_equal,
+                                            g_free, g_free);
+
+    if (checkdir_with_mkdir (pack_dir) < 0) {
+        g_warning ("[pack bend] Objects dir %s does not exist and"
+                   " is unable to create\n", pack_dir);
+        goto onerror;
+    }
+
+    if (open_generation (priv) < 0)
+        goto onerror;
+
+    refresh_packs (priv, TRUE);
+
+    bend->read = obj_backend_pack_read;
+    bend->write = obj_backend_pack_write;
+    bend->exists = obj_backend_pack_exists;
+    bend->exists_many = obj_backend_pack_exists_many;
+    bend->delete = obj_backend_pack_delete;
+
+    if (auto_repack) {
+        if (pthread_create (&tid, NULL, repack_thread, bend) != 0)
+            g_warning ("[pack bend] Failed to start repack thread.\n");
+        else
+            pthread_detach (tid);
+    }
+
+    return bend;
+
+onerror:
+    g_hash_table_destroy (priv->unsealed);
+    g_free (priv->pack_dir);
+    g_free (priv);
+    g_free (bend);
+
+    return NULL;
+}
@@ -87,6 +87,20 @@ obj_backend_riak_exists (ObjBackend *bend,
     return ret;
 }
 
+static void
+obj_backend_riak_exists_many (ObjBackend *bend,
+                              const char **obj_ids,
+                              int n_objs,
+                              gboolean *exists)
+{
+    SeafRiakClient *conn = get_connection (bend->priv);
+    RiakPriv *priv = bend->priv;
+
+    seaf_riak_client_query_many (conn, priv->bucket, obj_ids, n_objs, exists);
+
+    return_connection (priv, conn);
+}
+
 static void
 obj_backend_riak_delete (ObjBackend *bend,
                          const char *obj_id)
@@ -128,6 +142,7 @@ obj_backend_riak_new (const char *host,
     bend->read = obj_backend_riak_read;
     bend->write = obj_backend_riak_write;
     bend->exists = obj_backend_riak_exists;
+    bend->exists_many = obj_backend_riak_exists_many;
     bend->delete = obj_backend_riak_delete;
 
     return bend;
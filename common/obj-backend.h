@@ -19,6 +19,14 @@ struct ObjBackend {
     gboolean    (*exists) (ObjBackend *bend,
                            const char *obj_id);
 
+    /* Check existence of @n_objs objects at once, results are stored
+     * in @exists. Optional, exists() is called for each object if NULL.
+     */
+    void        (*exists_many) (ObjBackend *bend,
+                                const char **obj_ids,
+                                int n_objs,
+                                gboolean *exists);
+
     void        (*delete) (ObjBackend *bend,
                            const char *obj_id);
 
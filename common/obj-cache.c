@@ -0,0 +1,240 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "utils.h"
+#include "obj-cache.h"
+
+#define N_SHARDS 16
+
+typedef struct CacheEntry {
+    unsigned char key[20];
+    void          *obj;
+    guint32       size;
+    /* Embedded link in the shard's LRU queue, head is most recently used. */
+    GList         lru_link;
+} CacheEntry;
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;
+    GHashTable     *entries;
+    GQueue          lru;
+    guint64         size;
+    guint64         capacity;
+
+    guint64         hits;
+    guint64         misses;
+    guint64         evictions;
+} CacheShard;
+
+struct SeafObjCache {
+    CacheShard       shards[N_SHARDS];
+    guint64          capacity;
+    ObjCacheCopyFunc copy_func;
+    ObjCacheFreeFunc free_func;
+};
+
+static inline CacheShard *
+get_shard (SeafObjCache *cache, const unsigned char *key)
+{
+    return &cache->shards[key[0] % N_SHARDS];
+}
+
+SeafObjCache *
+seaf_obj_cache_new (guint64 capacity,
+                    ObjCacheCopyFunc copy_func,
+                    ObjCacheFreeFunc free_func)
+{
+    SeafObjCache *cache = g_new0 (SeafObjCache, 1);
+    CacheShard *shard;
+    int i;
+
+    cache->capacity = capacity;
+    cache->copy_func = copy_func;
+    cache->free_func = free_func;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &cache->shards[i];
+        pthread_mutex_init (&shard->lock, NULL);
+        shard->entries = g_hash_table_new (raw_id_hash, raw_id_equal);
+        g_queue_init (&shard->lru);
+        shard->capacity = capacity / N_SHARDS;
+    }
+
+    return cache;
+}
+
+static void
+free_entry (SeafObjCache *cache, CacheEntry *entry)
+{
+    cache->free_func (entry->obj);
+    g_free (entry);
+}
+
+void
+seaf_obj_cache_free (SeafObjCache *cache)
+{
+    CacheShard *shard;
+    GList *link;
+    int i;
+
+    if (!cache)
+        return;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &cache->shards[i];
+        while ((link = g_queue_pop_head_link (&shard->lru)) != NULL)
+            free_entry (cache, link->data);
+        g_hash_table_destroy (shard->entries);
+        pthread_mutex_destroy (&shard->lock);
+    }
+
+    g_free (cache);
+}
+
+void *
+seaf_obj_cache_lookup (SeafObjCache *cache, const char *obj_id)
+{
+    unsigned char key[20];
+    CacheShard *shard;
+    CacheEntry *entry;
+    void *ret = NULL;
+
+    if (hex_to_rawdata (obj_id, key, 20) < 0)
+        return NULL;
+    shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        /* Move to the head of LRU list. */
+        g_queue_unlink (&shard->lru, &entry->lru_link);
+        g_queue_push_head_link (&shard->lru, &entry->lru_link);
+        ret = cache->copy_func (entry->obj);
+        ++shard->hits;
+    } else
+        ++shard->misses;
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return ret;
+}
+
+static void
+evict_lru (SeafObjCache *cache, CacheShard *shard, GList **evicted)
+{
+    GList *link;
+    CacheEntry *entry;
+
+    while (shard->size > shard->capacity) {
+        link = g_queue_pop_tail_link (&shard->lru);
+        if (!link)
+            break;
+        entry = link->data;
+        g_hash_table_remove (shard->entries, entry->key);
+        shard->size -= entry->size;
+        ++shard->evictions;
+        /* Release the objects after the lock is dropped. */
+        *evicted = g_list_prepend (*evicted, entry);
+    }
+}
+
+void
+seaf_obj_cache_insert (SeafObjCache *cache,
+                       const char *obj_id,
+                       void *obj,
+                       guint32 size)
+{
+    CacheEntry *entry;
+    CacheShard *shard;
+    GList *evicted = NULL, *ptr;
+
+    entry = g_new0 (CacheEntry, 1);
+    if (hex_to_rawdata (obj_id, entry->key, 20) < 0) {
+        g_free (entry);
+        cache->free_func (obj);
+        return;
+    }
+    shard = get_shard (cache, entry->key);
+
+    if (size > shard->capacity) {
+        g_free (entry);
+        cache->free_func (obj);
+        return;
+    }
+
+    entry->obj = obj;
+    entry->size = size;
+    entry->lru_link.data = entry;
+
+    pthread_mutex_lock (&shard->lock);
+
+    if (g_hash_table_lookup (shard->entries, entry->key) != NULL) {
+        /* Another thread has added the same object. */
+        pthread_mutex_unlock (&shard->lock);
+        free_entry (cache, entry);
+        return;
+    }
+
+    g_hash_table_insert (shard->entries, entry->key, entry);
+    g_queue_push_head_link (&shard->lru, &entry->lru_link);
+    shard->size += size;
+
+    evict_lru (cache, shard, &evicted);
+
+    pthread_mutex_unlock (&shard->lock);
+
+    for (ptr = evicted; ptr; ptr = ptr->next)
+        free_entry (cache, ptr->data);
+    g_list_free (evicted);
+}
+
+void
+seaf_obj_cache_remove (SeafObjCache *cache, const char *obj_id)
+{
+    unsigned char key[20];
+    CacheShard *shard;
+    CacheEntry *entry;
+
+    if (hex_to_rawdata (obj_id, key, 20) < 0)
+        return;
+    shard = get_shard (cache, key);
+
+    pthread_mutex_lock (&shard->lock);
+
+    entry = g_hash_table_lookup (shard->entries, key);
+    if (entry) {
+        g_hash_table_remove (shard->entries, entry->key);
+        g_queue_unlink (&shard->lru, &entry->lru_link);
+        shard->size -= entry->size;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    if (entry)
+        free_entry (cache, entry);
+}
+
+void
+seaf_obj_cache_get_stats (SeafObjCache *cache, SeafObjCacheStats *stats)
+{
+    CacheShard *shard;
+    int i;
+
+    memset (stats, 0, sizeof(SeafObjCacheStats));
+    stats->capacity = cache->capacity;
+
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &cache->shards[i];
+        pthread_mutex_lock (&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->n_objects += g_hash_table_size (shard->entries);
+        stats->size += shard->size;
+        pthread_mutex_unlock (&shard->lock);
+    }
+}
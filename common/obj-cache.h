@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_OBJ_CACHE_H
+#define SEAF_OBJ_CACHE_H
+
+#include <glib.h>
+
+/*
+ * A bounded, thread-safe LRU cache for decoded immutable objects
+ * (SeafDir, Seafile, ...), keyed by the 20-byte binary object ID.
+ *
+ * The cache is split into several shards, each protected by its own lock,
+ * so that concurrent lookups of different objects rarely contend.
+ * Eviction is driven by the estimated in-memory size of the objects.
+ */
+
+typedef struct SeafObjCache SeafObjCache;
+
+/*
+ * Called with the shard lock held to hand out a cached object.
+ * Refcounted objects return themselves with an extra reference;
+ * mutable objects should return a private copy.
+ */
+typedef void *(*ObjCacheCopyFunc) (void *obj);
+
+/* Called to drop the cache's reference to an object. */
+typedef void (*ObjCacheFreeFunc) (void *obj);
+
+typedef struct SeafObjCacheStats {
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+    guint64 n_objects;
+    guint64 size;
+    guint64 capacity;
+} SeafObjCacheStats;
+
+/*
+ * @capacity: max total size (in bytes) of objects kept in the cache.
+ */
+SeafObjCache *
+seaf_obj_cache_new (guint64 capacity,
+                    ObjCacheCopyFunc copy_func,
+                    ObjCacheFreeFunc free_func);
+
+void
+seaf_obj_cache_free (SeafObjCache *cache);
+
+/*
+ * Returns: the object returned by copy_func, or NULL if @obj_id is
+ * not cached.
+ */
+void *
+seaf_obj_cache_lookup (SeafObjCache *cache, const char *obj_id);
+
+/*
+ * Add @obj to the cache. The cache takes over the caller's reference to @obj.
+ * If the object is already cached or too large, @obj is released
+ * with free_func immediately.
+ *
+ * @size: estimated memory footprint of @obj.
+ */
+void
+seaf_obj_cache_insert (SeafObjCache *cache,
+                       const char *obj_id,
+                       void *obj,
+                       guint32 size);
+
+void
+seaf_obj_cache_remove (SeafObjCache *cache, const char *obj_id);
+
+void
+seaf_obj_cache_get_stats (SeafObjCache *cache, SeafObjCacheStats *stats);
+
+#endif
@@ -16,6 +16,9 @@ typedef struct AsyncTask {
     void    *data;
     int     len;
     gboolean success;
+    /* For batched stat, the IDs to check. obj_id is unused then. */
+    char    **batch_ids;
+    int     n_batch;
 } AsyncTask;
 
 typedef struct OSCallbackStruct {
@@ -55,6 +58,12 @@ load_obj_backend (GKeyFile *config, const char *obj_type);
 static ObjBackend*
 load_riak_obj_backend(GKeyFile *config, const char *bend_group);
 
+static ObjBackend*
+load_pack_obj_backend(GKeyFile *config, const char *bend_group);
+
+extern ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gboolean auto_repack);
+
 extern ObjBackend *
 obj_backend_riak_new (const char *host,
                       const char *port,
@@ -208,6 +217,24 @@ seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
     return bend->exists (bend, obj_id);
 }
 
+void
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char **obj_ids,
+                           int n_objs,
+                           gboolean *exists)
+{
+    ObjBackend *bend = obj_store->bend;
+    int i;
+
+    if (bend->exists_many) {
+        bend->exists_many (bend, obj_ids, n_objs, exists);
+        return;
+    }
+
+    for (i = 0; i < n_objs; ++i)
+        exists[i] = bend->exists (bend, obj_ids[i]);
+}
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *obj_id)
@@ -237,6 +264,35 @@ load_filesystem_obj_backend(GKeyFile *config, const char *bend_group)
     return bend;
 }
 
+/*
+ * Packs are merged in the background only if "repack = true" is set,
+ * and only by seaf-server. httpserver and the monitor share the object
+ * dir but never repack it.
+ */
+static ObjBackend*
+load_pack_obj_backend(GKeyFile *config, const char *bend_group)
+{
+    ObjBackend *bend;
+    char *obj_dir;
+    gboolean repack = FALSE;
+
+    obj_dir = g_key_file_get_string (config, bend_group, "object_dir", NULL);
+    if (!obj_dir) {
+        g_warning ("[Object store] Object dir not set in config for %s.\n",
+                   bend_group);
+        return NULL;
+    }
+
+#if !defined HTTP_SERVER && !defined SEAFILE_MONITOR
+    repack = g_key_file_get_boolean (config, bend_group, "repack", NULL);
+#endif
+
+    bend = obj_backend_pack_new (obj_dir, repack);
+
+    g_free (obj_dir);
+    return bend;
+}
+
 static ObjBackend*
 load_riak_obj_backend(GKeyFile *config, const char *bend_group)
 {
@@ -303,6 +359,10 @@ load_obj_backend (GKeyFile *config, const char *obj_type)
         bend = load_filesystem_obj_backend (config, bend_group);
         g_free (backend);
         return bend;
+    } else if (strcmp (backend, "pack") == 0) {
+        bend = load_pack_obj_backend (config, bend_group);
+        g_free (backend);
+        return bend;
     } else if (strcmp (backend, "riak") == 0) {
         bend = load_riak_obj_backend (config, bend_group);
         g_free (backend);
@@ -330,6 +390,35 @@ reader_thread (void *data, void *user_data)
                               task);
 }
 
+/*
+ * Check all objects in a batch at once, then report the results
+ * one by one, as if they were stat'ed separately.
+ */
+static void
+stat_batch (SeafObjStore *obj_store, AsyncTask *batch)
+{
+    gboolean *exists = g_new0 (gboolean, batch->n_batch);
+    AsyncTask *task;
+    int i;
+
+    seaf_obj_store_objs_exist (obj_store, (const char **)batch->batch_ids,
+                               batch->n_batch, exists);
+
+    for (i = 0; i < batch->n_batch; ++i) {
+        task = g_new0 (AsyncTask, 1);
+        task->rw_id = batch->rw_id;
+        memcpy (task->obj_id, batch->batch_ids[i], 41);
+        task->success = exists[i];
+
+        cevent_manager_add_event (obj_store->ev_mgr, obj_store->stat_ev_id,
+                                  task);
+    }
+
+    g_free (exists);
+    g_strfreev (batch->batch_ids);
+    g_free (batch);
+}
+
 static void
 stat_thread (void *data, void *user_data)
 {
@@ -337,6 +426,11 @@ stat_thread (void *data, void *user_data)
     SeafObjStore *obj_store = user_data;
     ObjBackend *bend = obj_store->bend;
 
+    if (task->batch_ids) {
+        stat_batch (obj_store, task);
+        return;
+    }
+
     task->success = TRUE;
 
     if (!bend->exists (bend, task->obj_id))
@@ -520,6 +614,37 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
     return 0;
 }
 
+int
+seaf_obj_store_async_stat_batch (struct SeafObjStore *obj_store,
+                                 guint32 stat_id,
+                                 const char **obj_ids,
+                                 int n_objs)
+{
+    AsyncTask *task;
+    GError *error = NULL;
+    int i;
+
+    if (n_objs == 0)
+        return 0;
+
+    task = g_new0 (AsyncTask, 1);
+    task->rw_id = stat_id;
+    task->batch_ids = g_new0 (char *, n_objs + 1);
+    for (i = 0; i < n_objs; ++i)
+        task->batch_ids[i] = g_strdup (obj_ids[i]);
+    task->n_batch = n_objs;
+
+    g_thread_pool_push (obj_store->stat_tpool, task, &error);
+    if (error) {
+        g_warning ("Failed to start aysnc stat of %d objects.\n", n_objs);
+        g_strfreev (task->batch_ids);
+        g_free (task);
+        return -1;
+    }
+
+    return 0;
+}
+
 guint32
 seaf_obj_store_register_async_write (struct SeafObjStore *obj_store,
                                      OSAsyncCallback callback,
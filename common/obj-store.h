@@ -34,6 +34,15 @@ gboolean
 seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
                            const char *obj_id);
 
+/*
+ * Check existence of @n_objs objects at once, exists[i] is set for obj_ids[i].
+ */
+void
+seaf_obj_store_objs_exist (struct SeafObjStore *obj_store,
+                           const char **obj_ids,
+                           int n_objs,
+                           gboolean *exists);
+
 void
 seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
                            const char *obj_id);
@@ -98,4 +107,14 @@ seaf_obj_store_async_stat (struct SeafObjStore *obj_store,
                            guint32 stat_id,
                            const char *obj_id);
 
+/*
+ * Stat a batch of objects with one backend request where possible.
+ * The callback is still called once for each object.
+ */
+int
+seaf_obj_store_async_stat_batch (struct SeafObjStore *obj_store,
+                                 guint32 stat_id,
+                                 const char **obj_ids,
+                                 int n_objs);
+
 #endif
@@ -2,6 +2,8 @@
 #define BLOCKTX_COMMON_IMPL_V2_H
 
 #include "utils.h"
+#include "wire-compress.h"
+#include "block-credit.h"
 
 #define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
 #include "log.h"
@@ -29,15 +31,51 @@
 
 #define MAX_BL_LEN 1024
 
+/*
+ * Block protocol v3.
+ *
+ * It's used when the session protocol version (see check-tx) is at least
+ * BLOCK_V3_PROTO_VERSION, and is requested by an extra argument to the
+ * slave processor. The processors stay the same, but all per-block
+ * messages go over the data connection instead of the processor channel:
+ *
+ *  - Upload: the sender only sends a block when it has a credit from the
+ *    receiver, see block-credit.h for the window and the ack batches.
+ *
+ *  - Download: block requests are written to the data connection, several
+ *    in one write when possible. Every request is a credit for one block.
+ *
+ *  - Small blocks: the sender packs the packets of consecutive small blocks
+ *    into one bundle and sends it with one write. The receiver keeps small
+ *    blocks in memory and commits them in batches, with one sync pass for
+ *    the whole batch. Small blocks are only acked after they're committed.
+ *    The packets in a bundle are the same as normal block packets.
+ *
+ *  - Compression: if it's negotiated (see wire-compress.h), the sender
+ *    compresses the blocks which look compressible. BLOCK_PKT_COMPRESSED is
+ *    set in the block size of their packets, and the data is the raw block
+ *    size (uint32_t) followed by the compressed block. The receiver handles
+ *    compressed blocks like small blocks.
+ */
+#define BLOCK_V3_PROTO_VERSION  4
+
+#define SMALL_BLOCK_SIZE        (64 * 1024)
+#define BUNDLE_SIZE             (1 << 20)
+#define SMALL_BATCH_BLOCKS      128
+#define SMALL_BATCH_SIZE        (4 << 20)
+
+#define BLOCK_PKT_COMPRESSED    0x80000000
+
 typedef struct {
     int     block_idx;
     char    block_id[41];
 } BlockRequest;
 
+/* block_idx is -1 if the response only carries transfer stats. */
 typedef struct {
     int      block_idx;
     int      tx_bytes;
-    int      tx_time;
+    int      raw_bytes;
 } BlockResponse;
 
 typedef struct {
@@ -46,6 +84,12 @@ typedef struct {
     char     block_id[41];
 } __attribute__((__packed__)) BlockPacket;
 
+/* v3, download: request for one block. */
+typedef struct {
+    uint32_t block_idx;
+    char     block_id[41];
+} __attribute__((__packed__)) BlockReqPacket;
+
 typedef struct ThreadData ThreadData;
 
 /* function called when receiving event from transfer thread via pipe. */
@@ -68,12 +112,24 @@ struct ThreadData {
     char                *token;
     TransferFunc         transfer_func;
     int                  thread_ret;
+    /* Block protocol version, 2 or 3. */
+    int                  version;
+    /* v3: blocks may be compressed. */
+    gboolean             compress;
+#if defined SENDBLOCK_PROC || defined PUTBLOCK_PROC
+    /* v3: packets of small blocks not sent yet. */
+    GByteArray          *bundle;
+    int                  bundle_bytes;
+    int                  bundle_raw_bytes;
+#endif
 };
 
 typedef struct {
     ThreadData      *tdata;
     int              bm_offset;
     GHashTable      *block_hash;
+    int              version;
+    gboolean         compress;
 } BlockProcPriv;
 
 /*
@@ -92,6 +148,8 @@ prepare_thread_data (CcnetProcessor *processor,
     priv->tdata->task_pipe[1] = -1;
     priv->tdata->transfer_func = tranfer_func;
     priv->tdata->processor = processor;
+    priv->tdata->version = priv->version;
+    priv->tdata->compress = priv->compress;
 
     priv->tdata->cevent_id = cevent_manager_register (seaf->ev_mgr,
                                                       handler,
@@ -147,17 +205,67 @@ thread_done (void *vtdata)
  */
 
 static void
-send_block_rsp (int cevent_id, int block_idx, int tx_bytes, int tx_time)
+send_block_rsp (int cevent_id, int block_idx, int tx_bytes, int raw_bytes)
 {
     BlockResponse *blk_rsp = g_new0 (BlockResponse, 1);
     blk_rsp->block_idx = block_idx;
     blk_rsp->tx_bytes = tx_bytes;
-    blk_rsp->tx_time = tx_time;
+    blk_rsp->raw_bytes = raw_bytes;
     cevent_manager_add_event (seaf->ev_mgr, 
                               cevent_id,
                               (void *)blk_rsp);
 }
 
+#if defined SENDBLOCK_PROC || defined GETBLOCK_PROC
+
+/*
+ * Update global transferred bytes. Sleep here if the rate limit of all
+ * the tasks is exceeded, so the peer is slowed down by TCP flow control.
+ */
+static void
+update_tx_bytes (TransferTask *task, int n)
+{
+    g_atomic_int_add (&task->tx_bytes, n);
+    seaf_transfer_manager_throttle (task->manager, task->type, n);
+}
+
+#endif
+
+/*
+ * Wait until the task pipe or the data connection is readable.
+ * If @poll is TRUE, return at once.
+ * Returns -1 on error, otherwise a mask of PIPE_READABLE and DATA_READABLE.
+ */
+#define PIPE_READABLE 1
+#define DATA_READABLE 2
+
+static int
+wait_for_input (ThreadData *tdata, gboolean poll)
+{
+    fd_set fds;
+    struct timeval tv = { 0, 0 };
+    int max_fd = MAX (tdata->task_pipe[0], tdata->data_fd);
+    int rc, ret = 0;
+
+    do {
+        FD_ZERO (&fds);
+        FD_SET (tdata->task_pipe[0], &fds);
+        FD_SET (tdata->data_fd, &fds);
+        rc = select (max_fd + 1, &fds, NULL, NULL, poll ? &tv : NULL);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) {
+        seaf_warning ("select error: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    if (FD_ISSET (tdata->task_pipe[0], &fds))
+        ret |= PIPE_READABLE;
+    if (FD_ISSET (tdata->data_fd, &fds))
+        ret |= DATA_READABLE;
+    return ret;
+}
+
 #if defined SENDBLOCK_PROC || defined PUTBLOCK_PROC
 
 static int
@@ -201,8 +309,7 @@ send_block_packet (ThreadData *tdata,
             return -1;
         }
 #ifdef SENDBLOCK_PROC
-        /* Update global transferred bytes. */
-        g_atomic_int_add (&(tdata->task->tx_bytes), n);
+        update_tx_bytes (tdata->task, n);
 #endif
     }
     if (n < 0) {
@@ -212,20 +319,176 @@ send_block_packet (ThreadData *tdata,
     }
 
 #if defined SENDBLOCK_PROC
-    send_block_rsp (tdata->cevent_id, block_idx, 0, 0);
+    /* In v3 the main thread is notified when the block is acked,
+     * only the stats are reported here.
+     */
+    if (tdata->version < 3)
+        send_block_rsp (tdata->cevent_id, block_idx, size, size);
+    else
+        send_block_rsp (tdata->cevent_id, -1, size, size);
 #endif
 
     return size;
 }
 
 static int
-send_blocks (ThreadData *tdata)
+send_block_by_id (ThreadData *tdata, int block_idx, const char *block_id)
 {
     SeafBlockManager *block_mgr = seaf->block_mgr;
-    BlockRequest blk_req;
     BlockHandle *handle;
+    int n_sent;
+
+    handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("[send block] failed to open block %s.\n", block_id);
+        return -1;
+    }
+
+    n_sent = send_block_packet (tdata, block_idx, block_id,
+                                handle, tdata->data_fd);
+
+    seaf_block_manager_close_block (block_mgr, handle);
+    seaf_block_manager_block_handle_free (block_mgr, handle);
+
+    return n_sent;
+}
+
+/* v3: send all the bundled packets with one write. */
+static int
+flush_bundle (ThreadData *tdata)
+{
+    GByteArray *bundle = tdata->bundle;
+
+    if (bundle->len == 0)
+        return 0;
+
+    if (sendn (tdata->data_fd, bundle->data, bundle->len) < 0) {
+        seaf_warning ("Failed to write socket: %s.\n",
+                      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return -1;
+    }
+#ifdef SENDBLOCK_PROC
+    update_tx_bytes (tdata->task, tdata->bundle_bytes);
+    send_block_rsp (tdata->cevent_id, -1,
+                    tdata->bundle_bytes, tdata->bundle_raw_bytes);
+#endif
+
+    g_byte_array_set_size (bundle, 0);
+    tdata->bundle_bytes = 0;
+    tdata->bundle_raw_bytes = 0;
+    return 0;
+}
+
+/*
+ * v3: replace the block packet at @pkt_offset, the last one in the bundle,
+ * with a compressed packet if the block is compressible.
+ * Returns the size of the block data in the bundle.
+ */
+static int
+compress_bundled_block (ThreadData *tdata, guint pkt_offset, int size)
+{
+    GByteArray *bundle = tdata->bundle;
+    guint data_offset = pkt_offset + sizeof(BlockPacket);
+    BlockPacket *pkt;
+    uint32_t raw_size;
+    void *zdata;
+    int zlen;
+
+    zdata = wire_compress (bundle->data + data_offset, size, &zlen);
+    if (!zdata)
+        return size;
+
+    raw_size = htonl ((uint32_t) size);
+    g_byte_array_set_size (bundle, data_offset);
+    g_byte_array_append (bundle, (guint8 *)&raw_size, sizeof(raw_size));
+    g_byte_array_append (bundle, zdata, zlen);
+    g_free (zdata);
+
+    pkt = (BlockPacket *)(bundle->data + pkt_offset);
+    pkt->block_size = htonl ((uint32_t)(sizeof(raw_size) + zlen) |
+                             BLOCK_PKT_COMPRESSED);
+
+    return sizeof(raw_size) + zlen;
+}
+
+/*
+ * v3: small blocks are added to the bundle. Larger blocks are sent
+ * at once, after the bundled blocks, unless they may be compressed.
+ */
+static int
+send_block_v3 (ThreadData *tdata, int block_idx, const char *block_id)
+{
+    SeafBlockManager *block_mgr = seaf->block_mgr;
+    GByteArray *bundle = tdata->bundle;
+    BlockHandle *handle;
+    BlockMetadata *md;
+    BlockPacket pkt;
+    guint pkt_offset, offset;
+    int size, done = 0, n;
+    int ret = -1;
+
+    handle = seaf_block_manager_open_block (block_mgr, block_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("[send block] failed to open block %s.\n", block_id);
+        return -1;
+    }
+
+    md = seaf_block_manager_stat_block_by_handle (block_mgr, handle);
+    if (!md) {
+        seaf_warning ("Failed to stat block %s.\n", block_id);
+        goto out;
+    }
+    size = (int) md->size;
+    g_free (md);
+
+    if (size > SMALL_BLOCK_SIZE && !tdata->compress) {
+        if (flush_bundle (tdata) < 0)
+            goto out;
+        ret = send_block_packet (tdata, block_idx, block_id,
+                                 handle, tdata->data_fd);
+        goto out;
+    }
+
+    pkt.block_size = htonl ((uint32_t) size);
+    pkt.block_idx = htonl ((uint32_t) block_idx);
+    memcpy (pkt.block_id, block_id, 41);
+    pkt_offset = bundle->len;
+    g_byte_array_append (bundle, (guint8 *)&pkt, sizeof(pkt));
+
+    offset = bundle->len;
+    g_byte_array_set_size (bundle, offset + size);
+    while (done < size) {
+        n = seaf_block_manager_read_block (block_mgr, handle,
+                                           bundle->data + offset + done,
+                                           size - done);
+        if (n <= 0) {
+            seaf_warning ("Failed to read block %s.\n", block_id);
+            goto out;
+        }
+        done += n;
+    }
+
+    if (tdata->compress)
+        tdata->bundle_bytes += compress_bundled_block (tdata, pkt_offset, size);
+    else
+        tdata->bundle_bytes += size;
+    tdata->bundle_raw_bytes += size;
+
+    if (bundle->len >= BUNDLE_SIZE && flush_bundle (tdata) < 0)
+        goto out;
+    ret = size;
+
+out:
+    seaf_block_manager_close_block (block_mgr, handle);
+    seaf_block_manager_block_handle_free (block_mgr, handle);
+    return ret;
+}
+
+static int
+send_blocks (ThreadData *tdata)
+{
+    BlockRequest blk_req;
     int         n;
-    int         n_sent;
 
     while (1) {
         n = pipereadn (tdata->task_pipe[0], &blk_req, sizeof(blk_req));
@@ -238,26 +501,204 @@ send_blocks (ThreadData *tdata)
             return -1;
         }
 
-        handle = seaf_block_manager_open_block (block_mgr, 
-                                                blk_req.block_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("[send block] failed to open block %s.\n", 
-                       blk_req.block_id);
+        if (send_block_by_id (tdata, blk_req.block_idx, blk_req.block_id) < 0)
             return -1;
+    }
+
+    return 0;
+}
+
+#ifdef SENDBLOCK_PROC
+
+/* Read a batch of acks. Returns the credits granted, or -1 on error. */
+static int
+recv_acks (ThreadData *tdata)
+{
+    BlockAckPacket pkt;
+    uint32_t *acks;
+    uint32_t n_acks, i;
+    int credits;
+
+    if (recvn (tdata->data_fd, &pkt, sizeof(pkt)) != sizeof(pkt)) {
+        seaf_warning ("Failed to read block ack: %s.\n",
+                      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return -1;
+    }
+
+    credits = block_ack_packet_parse (&pkt, &n_acks);
+    if (credits < 0) {
+        seaf_warning ("Bad block ack.\n");
+        return -1;
+    }
+
+    if (n_acks == 0)
+        return credits;
+
+    acks = g_new (uint32_t, n_acks);
+    if (recvn (tdata->data_fd, acks, n_acks * sizeof(uint32_t)) !=
+        n_acks * sizeof(uint32_t)) {
+        seaf_warning ("Failed to read block ack: %s.\n",
+                      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        g_free (acks);
+        return -1;
+    }
+
+    for (i = 0; i < n_acks; ++i)
+        send_block_rsp (tdata->cevent_id, (int) ntohl (acks[i]), 0, 0);
+
+    g_free (acks);
+    return credits;
+}
+
+/*
+ * v3 upload. Blocks to send come from the task pipe, credits and
+ * acks come back on the data connection.
+ */
+static int
+send_blocks_v3 (ThreadData *tdata)
+{
+    GQueue *queue = g_queue_new ();
+    BlockRequest *req;
+    gboolean can_send;
+    int credits = 0, n, mask;
+    int ret = -1;
+
+    tdata->bundle = g_byte_array_new ();
+
+    while (1) {
+        /* Don't block if a block can be sent right now. Otherwise
+         * the bundled blocks have to be sent before waiting.
+         */
+        can_send = (credits > 0 && !g_queue_is_empty (queue));
+        if (!can_send && flush_bundle (tdata) < 0)
+            goto out;
+
+        mask = wait_for_input (tdata, can_send);
+        if (mask < 0)
+            goto out;
+
+        if (mask & DATA_READABLE) {
+            if ((n = recv_acks (tdata)) < 0)
+                goto out;
+            credits += n;
         }
 
-        n_sent = send_block_packet (tdata, blk_req.block_idx, blk_req.block_id, 
-                                    handle, tdata->data_fd);
-        if (n_sent < 0)
-            return -1;
+        /* Take all the queued requests, so that small blocks can be bundled. */
+        while (mask & PIPE_READABLE) {
+            req = g_new (BlockRequest, 1);
+            n = pipereadn (tdata->task_pipe[0], req, sizeof(*req));
+            if (n != sizeof(*req)) {
+                if (n != 0)
+                    seaf_warning ("read task pipe incorrect.\n");
+                else
+                    seaf_debug ("Processor exited. Worker thread exits now.\n");
+                g_free (req);
+                goto out;
+            }
+            g_queue_push_tail (queue, req);
 
-        seaf_block_manager_close_block (block_mgr, handle);
-        seaf_block_manager_block_handle_free (block_mgr, handle);
+            if (g_queue_get_length (queue) >= BLOCK_V3_WINDOW)
+                break;
+            mask = wait_for_input (tdata, TRUE);
+            if (mask < 0)
+                goto out;
+        }
+
+        while (credits > 0 && (req = g_queue_pop_head (queue)) != NULL) {
+            n = send_block_v3 (tdata, req->block_idx, req->block_id);
+            g_free (req);
+            if (n < 0)
+                goto out;
+            --credits;
+        }
     }
 
-    return 0;
+out:
+    while ((req = g_queue_pop_head (queue)) != NULL)
+        g_free (req);
+    g_queue_free (queue);
+    g_byte_array_free (tdata->bundle, TRUE);
+    tdata->bundle = NULL;
+    return ret;
+}
+
+#endif  /* SENDBLOCK_PROC */
+
+#ifdef PUTBLOCK_PROC
+
+/*
+ * v3 download, server side. Block requests come from the data connection,
+ * the task pipe is only used to find out when the processor is done.
+ */
+static int
+put_blocks_v3 (ThreadData *tdata)
+{
+    GQueue *queue = g_queue_new ();
+    BlockReqPacket *req;
+    int mask, n;
+    int ret = -1;
+
+    tdata->bundle = g_byte_array_new ();
+
+    while (1) {
+        if (g_queue_is_empty (queue) && flush_bundle (tdata) < 0)
+            goto out;
+
+        mask = wait_for_input (tdata, !g_queue_is_empty (queue));
+        if (mask < 0)
+            goto out;
+
+        if (mask & PIPE_READABLE) {
+            seaf_debug ("Task pipe closed. Worker thread exits now.\n");
+            goto out;
+        }
+
+        /* Take all the received requests, so that small blocks can be bundled. */
+        while (mask & DATA_READABLE) {
+            if (g_queue_get_length (queue) >= BLOCK_V3_WINDOW) {
+                seaf_warning ("Too many block requests.\n");
+                goto out;
+            }
+
+            req = g_new (BlockReqPacket, 1);
+            n = recvn (tdata->data_fd, req, sizeof(*req));
+            if (n != sizeof(*req)) {
+                if (n != 0)
+                    seaf_warning ("Failed to read block request: %s.\n",
+                                  evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+                else
+                    seaf_debug ("data connection closed.\n");
+                g_free (req);
+                goto out;
+            }
+            req->block_id[40] = '\0';
+            g_queue_push_tail (queue, req);
+
+            mask = wait_for_input (tdata, TRUE);
+            if (mask < 0)
+                goto out;
+        }
+
+        while ((req = g_queue_pop_head (queue)) != NULL) {
+            n = send_block_v3 (tdata, (int) ntohl (req->block_idx),
+                               req->block_id);
+            g_free (req);
+            if (n < 0)
+                goto out;
+        }
+    }
+
+out:
+    while ((req = g_queue_pop_head (queue)) != NULL)
+        g_free (req);
+    g_queue_free (queue);
+    g_byte_array_free (tdata->bundle, TRUE);
+    tdata->bundle = NULL;
+    return ret;
 }
 
+#endif  /* PUTBLOCK_PROC */
+
 #endif  /* defined SENDBLOCK_PROC || defined PUTBLOCK_PROC */
 
 #if defined GETBLOCK_PROC || defined RECVBLOCK_PROC
@@ -265,8 +706,21 @@ send_blocks (ThreadData *tdata)
 enum {
     RECV_STATE_HEADER,
     RECV_STATE_BLOCK,
+    RECV_STATE_SMALL_BLOCK,
 };
 
+typedef struct {
+    uint32_t block_idx;         /* in network byte order */
+    char     block_id[41];
+    int      size;
+    char    *data;
+    /* Size of the data received, which is compressed if it's
+     * different from size.
+     */
+    int      wire_size;
+    gboolean compressed;
+} SmallBlock;
+
 typedef struct {
     ThreadData *tdata;
     int state;
@@ -274,14 +728,134 @@ typedef struct {
     int remain;
     BlockHandle *handle;
     uint32_t cevent_id;
+    /* v3 upload: indexes of received blocks not yet acked. */
+    GArray *acks;
+    /* v3: small blocks received but not committed yet. If NULL, small
+     * blocks are written like other blocks.
+     */
+    GPtrArray *small_blocks;
+    int small_bytes;
+    SmallBlock *cur_small;
 } RecvFSM;
 
+static void
+small_block_free (gpointer data)
+{
+    SmallBlock *sb = data;
+
+    g_free (sb->data);
+    g_free (sb);
+}
+
+/* @block_idx is in network byte order. */
+static void
+block_received (RecvFSM *fsm, uint32_t block_idx, int size, int wire_size)
+{
+#ifdef GETBLOCK_PROC
+    /* Notify finish receiving this block. */
+    send_block_rsp (fsm->cevent_id, (int)ntohl (block_idx), wire_size, size);
+#else
+    /* v3: ack the block to the sender. */
+    if (fsm->acks)
+        g_array_append_val (fsm->acks, block_idx);
+#endif
+}
+
+static int
+small_block_done (RecvFSM *fsm)
+{
+    SmallBlock *sb = fsm->cur_small;
+    uint32_t raw_size;
+    char *data;
+
+    if (sb->compressed) {
+        if (sb->wire_size < sizeof(raw_size)) {
+            seaf_warning ("Bad compressed block %s.\n", sb->block_id);
+            return -1;
+        }
+        memcpy (&raw_size, sb->data, sizeof(raw_size));
+        data = wire_decompress (sb->data + sizeof(raw_size),
+                                sb->wire_size - sizeof(raw_size),
+                                (int) ntohl (raw_size));
+        if (!data) {
+            seaf_warning ("Failed to decompress block %s.\n", sb->block_id);
+            return -1;
+        }
+        g_free (sb->data);
+        sb->data = data;
+        sb->size = (int) ntohl (raw_size);
+    }
+
+    g_ptr_array_add (fsm->small_blocks, sb);
+    fsm->small_bytes += sb->size;
+    fsm->cur_small = NULL;
+
+    fsm->state = RECV_STATE_HEADER;
+    fsm->remain = sizeof(BlockPacket);
+    return 0;
+}
+
+static gboolean
+small_batch_full (RecvFSM *fsm)
+{
+    return (fsm->small_blocks->len >= SMALL_BATCH_BLOCKS ||
+            fsm->small_bytes >= SMALL_BATCH_SIZE);
+}
+
+static int
+commit_small_blocks (RecvFSM *fsm)
+{
+    GPtrArray *blocks = fsm->small_blocks;
+    int n = blocks->len;
+    const char **ids;
+    const void **bufs;
+    int *lens;
+    SmallBlock *sb;
+    int i, ret = 0;
+
+    if (n == 0)
+        return 0;
+
+    ids = g_new (const char *, n);
+    bufs = g_new (const void *, n);
+    lens = g_new (int, n);
+    for (i = 0; i < n; ++i) {
+        sb = g_ptr_array_index (blocks, i);
+        ids[i] = sb->block_id;
+        bufs[i] = sb->data;
+        lens[i] = sb->size;
+    }
+
+    if (seaf_block_manager_write_blocks (seaf->block_mgr,
+                                         ids, bufs, lens, n) < 0) {
+        seaf_warning ("Failed to commit %d small blocks.\n", n);
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < n; ++i) {
+        sb = g_ptr_array_index (blocks, i);
+        block_received (fsm, sb->block_idx, sb->size, sb->wire_size);
+    }
+
+    g_ptr_array_set_size (blocks, 0);
+    fsm->small_bytes = 0;
+
+out:
+    g_free (ids);
+    g_free (bufs);
+    g_free (lens);
+    return ret;
+}
+
 static int
 recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
 {
     SeafBlockManager *block_mgr = seaf->block_mgr;
     char *block_id;
     BlockHandle *handle;
+    uint32_t block_size;
+    gboolean compressed;
     int n, round;
     char buf[1024];
 
@@ -301,10 +875,34 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
 
         fsm->remain -= n;
         if (fsm->remain == 0) {
-            fsm->remain = (int) ntohl (fsm->hdr.block_size);
+            block_size = ntohl (fsm->hdr.block_size);
+            compressed = ((block_size & BLOCK_PKT_COMPRESSED) != 0);
+            fsm->remain = (int) (block_size & ~BLOCK_PKT_COMPRESSED);
             block_id = fsm->hdr.block_id;
             block_id[40] = 0;
 
+            if (compressed && (!fsm->tdata->compress ||
+                               fsm->remain > WIRE_MAX_RAW_SIZE)) {
+                seaf_warning ("Bad compressed block %s.\n", block_id);
+                return -1;
+            }
+
+            if (fsm->small_blocks &&
+                (fsm->remain <= SMALL_BLOCK_SIZE || compressed)) {
+                SmallBlock *sb = g_new0 (SmallBlock, 1);
+                sb->block_idx = fsm->hdr.block_idx;
+                memcpy (sb->block_id, block_id, 41);
+                sb->size = fsm->remain;
+                sb->wire_size = fsm->remain;
+                sb->compressed = compressed;
+                sb->data = g_malloc (sb->size);
+                fsm->cur_small = sb;
+                fsm->state = RECV_STATE_SMALL_BLOCK;
+                if (fsm->remain == 0)
+                    return small_block_done (fsm);
+                break;
+            }
+
             handle = seaf_block_manager_open_block (block_mgr, 
                                                     block_id, BLOCK_WRITE);
             if (!handle) {
@@ -336,8 +934,7 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
         }
 
 #ifdef GETBLOCK_PROC
-        /* Update global transferred bytes. */
-        g_atomic_int_add (&(fsm->tdata->task->tx_bytes), n);
+        update_tx_bytes (fsm->tdata->task, n);
 #endif
 
         fsm->remain -= n;
@@ -356,23 +953,67 @@ recv_tick (RecvFSM *fsm, evutil_socket_t sockfd)
             /* Set this handle to invalid. */
             fsm->handle = NULL;
 
-#ifdef GETBLOCK_PROC
-            /* Notify finish receiving this block. */
-            send_block_rsp (fsm->cevent_id,
-                            (int)ntohl (fsm->hdr.block_idx),
-                            0, 0);
-#endif
+            block_size = ntohl (fsm->hdr.block_size);
+            block_received (fsm, fsm->hdr.block_idx, block_size, block_size);
 
             /* Prepare for the next packet. */
             fsm->state = RECV_STATE_HEADER;
             fsm->remain = sizeof(BlockPacket);
         }
         break;
+    case RECV_STATE_SMALL_BLOCK:
+        n = recv (sockfd,
+                  fsm->cur_small->data + fsm->cur_small->size - fsm->remain,
+                  fsm->remain, 0);
+        if (n < 0) {
+            seaf_warning ("failed to read data: %s.\n",
+                       evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+            return -1;
+        } else if (n == 0) {
+            seaf_debug ("data connection closed.\n");
+            return -1;
+        }
+
+#ifdef GETBLOCK_PROC
+        update_tx_bytes (fsm->tdata->task, n);
+#endif
+
+        fsm->remain -= n;
+        if (fsm->remain == 0)
+            return small_block_done (fsm);
+        break;
     }
 
     return 0;
 }
 
+static RecvFSM *
+recv_fsm_new (ThreadData *tdata)
+{
+    RecvFSM *fsm = g_new0 (RecvFSM, 1);
+
+    fsm->remain = sizeof (BlockPacket);
+    fsm->cevent_id = tdata->cevent_id;
+    fsm->tdata = tdata;
+    return fsm;
+}
+
+static void
+recv_fsm_free (RecvFSM *fsm)
+{
+    if (fsm->handle) {
+        seaf_block_manager_close_block (seaf->block_mgr, fsm->handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, fsm->handle);
+    }
+    if (fsm->acks)
+        g_array_free (fsm->acks, TRUE);
+    if (fsm->small_blocks)
+        g_ptr_array_free (fsm->small_blocks, TRUE);
+    if (fsm->cur_small)
+        small_block_free (fsm->cur_small);
+    g_free (fsm);
+}
+
 static int
 recv_blocks (ThreadData *tdata)
 {
@@ -380,10 +1021,7 @@ recv_blocks (ThreadData *tdata)
     int max_fd = MAX (tdata->task_pipe[0], tdata->data_fd);
     int rc;
 
-    RecvFSM *fsm = g_new0 (RecvFSM, 1);
-    fsm->remain = sizeof (BlockPacket);
-    fsm->cevent_id = tdata->cevent_id;
-    fsm->tdata = tdata;
+    RecvFSM *fsm = recv_fsm_new (tdata);
 
     while (1) {
         FD_ZERO (&fds);
@@ -417,18 +1055,168 @@ recv_blocks (ThreadData *tdata)
         }
     }
 
-    g_free (fsm);
+    recv_fsm_free (fsm);
     return 0;
 
 error:
-    if (fsm->handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, fsm->handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, fsm->handle);
+    recv_fsm_free (fsm);
+    return -1;
+}
+
+#ifdef RECVBLOCK_PROC
+
+/* The block indexes in fsm->acks are already in network byte order. */
+static int
+send_acks (RecvFSM *fsm, evutil_socket_t sockfd, int credits)
+{
+    void *pkt;
+    int len;
+    int ret = 0;
+
+    pkt = block_ack_packet_new ((uint32_t *)fsm->acks->data, fsm->acks->len,
+                                credits, &len);
+
+    if (sendn (sockfd, pkt, len) < 0) {
+        seaf_warning ("Failed to send block ack: %s.\n",
+                      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        ret = -1;
     }
-    g_free (fsm);
+
+    g_free (pkt);
+    g_array_set_size (fsm->acks, 0);
+    return ret;
+}
+
+/*
+ * v3 upload, server side. Small blocks and acks are flushed in batches,
+ * or as soon as there's no more data to read, so that the sender doesn't
+ * run out of credits.
+ */
+static int
+recv_blocks_v3 (ThreadData *tdata)
+{
+    RecvFSM *fsm = recv_fsm_new (tdata);
+    gboolean idle;
+    int mask;
+
+    fsm->acks = g_array_new (FALSE, FALSE, sizeof(uint32_t));
+    fsm->small_blocks = g_ptr_array_new_with_free_func (small_block_free);
+
+    if (send_acks (fsm, tdata->data_fd, BLOCK_V3_WINDOW) < 0)
+        goto error;
+
+    while (1) {
+        mask = wait_for_input (tdata,
+                               fsm->acks->len > 0 || fsm->small_blocks->len > 0);
+        if (mask < 0)
+            goto error;
+
+        if (mask & PIPE_READABLE) {
+            seaf_debug ("Task pipe closed. Worker thread exits now.\n");
+            goto error;
+        }
+
+        if (mask & DATA_READABLE) {
+            if (recv_tick (fsm, tdata->data_fd) < 0)
+                goto error;
+        }
+        idle = !(mask & DATA_READABLE);
+
+        if (small_batch_full (fsm) || (idle && fsm->small_blocks->len > 0)) {
+            if (commit_small_blocks (fsm) < 0)
+                goto error;
+        }
+
+        if (block_acks_due (fsm->acks->len, idle)) {
+            if (send_acks (fsm, tdata->data_fd, fsm->acks->len) < 0)
+                goto error;
+        }
+    }
+
+error:
+    recv_fsm_free (fsm);
     return -1;
 }
 
+#endif  /* RECVBLOCK_PROC */
+
+#ifdef GETBLOCK_PROC
+
+/*
+ * v3 download, client side. Block requests are read from the task pipe
+ * and forwarded to the data connection, batched when several are queued.
+ */
+static int
+forward_requests (ThreadData *tdata)
+{
+    BlockRequest req;
+    BlockReqPacket pkts[64];
+    int n_pkts = 0, n, mask;
+
+    do {
+        n = pipereadn (tdata->task_pipe[0], &req, sizeof(req));
+        if (n != sizeof(req)) {
+            if (n != 0)
+                seaf_warning ("read task pipe incorrect.\n");
+            else
+                seaf_debug ("Processor exited. Worker thread exits now.\n");
+            return -1;
+        }
+
+        pkts[n_pkts].block_idx = htonl ((uint32_t) req.block_idx);
+        memcpy (pkts[n_pkts].block_id, req.block_id, 41);
+        ++n_pkts;
+        if (n_pkts == G_N_ELEMENTS(pkts))
+            break;
+        mask = wait_for_input (tdata, TRUE);
+    } while (mask > 0 && (mask & PIPE_READABLE));
+
+    if (sendn (tdata->data_fd, pkts, n_pkts * sizeof(BlockReqPacket)) < 0) {
+        seaf_warning ("Failed to send block requests: %s.\n",
+                      evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+get_blocks_v3 (ThreadData *tdata)
+{
+    RecvFSM *fsm = recv_fsm_new (tdata);
+    int mask;
+
+    fsm->small_blocks = g_ptr_array_new_with_free_func (small_block_free);
+
+    while (1) {
+        mask = wait_for_input (tdata, fsm->small_blocks->len > 0);
+        if (mask < 0)
+            goto error;
+
+        if (mask & DATA_READABLE) {
+            if (recv_tick (fsm, tdata->data_fd) < 0)
+                goto error;
+        }
+
+        if (small_batch_full (fsm) ||
+            (!(mask & DATA_READABLE) && fsm->small_blocks->len > 0)) {
+            if (commit_small_blocks (fsm) < 0)
+                goto error;
+        }
+
+        if (mask & PIPE_READABLE) {
+            if (forward_requests (tdata) < 0)
+                goto error;
+        }
+    }
+
+error:
+    recv_fsm_free (fsm);
+    return -1;
+}
+
+#endif  /* GETBLOCK_PROC */
+
 #endif  /* defined GETBLOCK_PROC || defined RECVBLOCK_PROC */
 
 #if defined GETBLOCK_PROC || defined SENDBLOCK_PROC
@@ -440,6 +1228,7 @@ master_block_proc_start (CcnetProcessor *processor,
                          Bitfield *active,
                          Bitfield *block_bitmap)
 {
+    USE_PRIV;
     GString *buf;
     if (!tx_task || !tx_task->session_token) {
         seaf_warning ("transfer task not set.\n");
@@ -456,6 +1245,17 @@ master_block_proc_start (CcnetProcessor *processor,
                      processor->peer_id,
                      remote_processor_name,
                      tx_task->session_token);
+
+    /* Older servers don't take the block protocol version argument. */
+    if (tx_task->protocol_version >= BLOCK_V3_PROTO_VERSION) {
+        priv->version = 3;
+        g_string_append (buf, " 3");
+    } else
+        priv->version = 2;
+
+    priv->compress = (tx_task->protocol_version >= WIRE_COMPRESS_PROTO_VERSION);
+    if (priv->compress)
+        g_string_append (buf, " " WIRE_COMPRESS_ARG);
                          
     ccnet_processor_send_request (processor, buf->str);
     g_string_free (buf, TRUE);
@@ -661,10 +1461,26 @@ process_block_bitmap (CcnetProcessor *processor, char *content, int clen)
 static int
 verify_session_token (CcnetProcessor *processor, int argc, char **argv)
 {
-    if (argc != 1) {
+    USE_PRIV;
+
+    priv->compress = wire_compress_requested (&argc, argv);
+    if (argc != 1 && argc != 2) {
         return -1;
     }
 
+    priv->version = 2;
+    if (argc == 2) {
+        if (strcmp (argv[1], "3") != 0) {
+            seaf_warning ("Unknown block protocol version %s.\n", argv[1]);
+            return -1;
+        }
+        priv->version = 3;
+    }
+
+    /* Compression is only supported in v3. */
+    if (priv->compress && priv->version < 3)
+        return -1;
+
     char *session_token = argv[0];
     if (seaf_token_manager_verify_token (seaf->token_mgr,
                                          processor->peer_id,
@@ -749,6 +1565,8 @@ static void
 process_block_list (CcnetProcessor *processor, char *content, int clen)
 {
     char *block_id;
+    const char **block_ids;
+    gboolean *exists;
     int n_blocks;
     Bitfield bitmap;
     int i;
@@ -763,14 +1581,25 @@ process_block_list (CcnetProcessor *processor, char *content, int clen)
     n_blocks = clen/41;
     BitfieldConstruct (&bitmap, n_blocks);
 
+    block_ids = g_new (const char *, n_blocks);
+    exists = g_new0 (gboolean, n_blocks);
+
     block_id = content;
     for (i = 0; i < n_blocks; ++i) {
         block_id[40] = '\0';
-        if (seaf_block_manager_block_exists(seaf->block_mgr, block_id))
-            BitfieldAdd (&bitmap, i);
+        block_ids[i] = block_id;
         block_id += 41;
     }
 
+    seaf_block_manager_blocks_exist (seaf->block_mgr, block_ids, n_blocks, exists);
+    for (i = 0; i < n_blocks; ++i) {
+        if (exists[i])
+            BitfieldAdd (&bitmap, i);
+    }
+
+    g_free (block_ids);
+    g_free (exists);
+
     ccnet_processor_send_response (processor, SC_BBITMAP, SS_BBITMAP,
                                    (char *)(bitmap.bits), bitmap.byteCount);
     BitfieldDestruct (&bitmap);
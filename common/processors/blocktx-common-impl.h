@@ -795,6 +795,8 @@ static void
 process_block_list (CcnetProcessor *processor, char *content, int clen)
 {
     char *block_id;
+    const char **block_ids;
+    gboolean *exists;
     int n_blocks;
     Bitfield bitmap;
     int i;
@@ -809,14 +811,25 @@ process_block_list (CcnetProcessor *processor, char *content, int clen)
     n_blocks = clen/41;
     BitfieldConstruct (&bitmap, n_blocks);
 
+    block_ids = g_new (const char *, n_blocks);
+    exists = g_new0 (gboolean, n_blocks);
+
     block_id = content;
     for (i = 0; i < n_blocks; ++i) {
         block_id[40] = '\0';
-        if (seaf_block_manager_block_exists(seaf->block_mgr, block_id))
-            BitfieldAdd (&bitmap, i);
+        block_ids[i] = block_id;
         block_id += 41;
     }
 
+    seaf_block_manager_blocks_exist (seaf->block_mgr, block_ids, n_blocks, exists);
+    for (i = 0; i < n_blocks; ++i) {
+        if (exists[i])
+            BitfieldAdd (&bitmap, i);
+    }
+
+    g_free (block_ids);
+    g_free (exists);
+
     ccnet_processor_send_response (processor, SC_BBITMAP, SS_BBITMAP,
                                    (char *)(bitmap.bits), bitmap.byteCount);
     BitfieldDestruct (&bitmap);
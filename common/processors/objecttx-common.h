@@ -35,6 +35,27 @@
 #define SC_ROOT_END     "305"
 #define SS_ROOT_END     "FS Root End"
 
+/*
+ * Fs upload with pushed objects.
+ *
+ * Used when the session protocol version is at least FS_PUSH_PROTO_VERSION
+ * and the server has a head for the repo. The sender requests it with
+ * FS_PUSH_ARG after the session token. It diffs the new fs roots against
+ * the root of the remote head, skipping identical sub-trees, and sends
+ * the new objects right after the root list, without waiting for the
+ * receiver to ask for them. Every FS_PUSH_BATCH objects received are
+ * acked with SC_ACK, and at most FS_PUSH_WINDOW objects are not acked.
+ * SC_END is sent after the last object.
+ *
+ * When all the pushed objects are received, the receiver checks that the
+ * objects referred to by them exist, and asks for the missing ones as
+ * in the normal mode.
+ */
+#define FS_PUSH_PROTO_VERSION   6
+#define FS_PUSH_ARG             "push"
+#define FS_PUSH_BATCH           64
+#define FS_PUSH_WINDOW          256
+
 /* max fs object segment size */
 #define MAX_OBJ_SEG_SIZE 64000
 
@@ -64,6 +64,8 @@ seafile_putblock_v2_proc_init (SeafilePutblockV2Proc *processor)
 static int
 block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 {
+    USE_PRIV;
+
     if (verify_session_token (processor, argc, argv) < 0) {
         ccnet_processor_send_response (processor, 
                                        SC_ACCESS_DENIED, SS_ACCESS_DENIED,
@@ -72,7 +74,9 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
         return -1;
     }
     
-    prepare_thread_data(processor, send_blocks, put_block_cb);
+    prepare_thread_data(processor,
+                        priv->version == 3 ? put_blocks_v3 : send_blocks,
+                        put_block_cb);
     ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
 
     return 0;
@@ -92,7 +96,8 @@ process_get_block (CcnetProcessor *processor, char *content, int clen)
     char *space, *block_id;
     USE_PRIV;
 
-    if (content[clen-1] != '\0') {
+    /* In v3 block requests are sent on the data connection. */
+    if (priv->version == 3 || content[clen-1] != '\0') {
         ccnet_processor_send_response (processor, SC_BAD_BLK_REQ, SS_BAD_BLK_REQ,
                                        NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -35,6 +35,13 @@ seaf_riak_client_query (SeafRiakClient *client,
                         const char *bucket,
                         const char *key);
 
+void
+seaf_riak_client_query_many (SeafRiakClient *client,
+                             const char *bucket,
+                             const char **keys,
+                             int n_keys,
+                             gboolean *exists);
+
 int
 seaf_riak_client_delete (SeafRiakClient *client,
                          const char *bucket,
@@ -4,6 +4,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <curl/curl.h>
 #include <glib.h>
 
@@ -217,6 +218,110 @@ seaf_riak_client_query (SeafRiakClient *client,
     return ret;
 }
 
+#define MAX_CONCURRENT_QUERIES 32
+
+static void
+setup_query (CURL *curl, SeafRiakClient *client,
+             const char *bucket, const char *key, long idx)
+{
+    char *url;
+
+    url = g_strdup_printf ("http://%s:%s/riak/%s/%s?r=1",
+                           client->host, client->port, bucket, key);
+    /* libcurl copies the url. */
+    curl_easy_setopt (curl, CURLOPT_URL, url);
+    curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt (curl, CURLOPT_PRIVATE, (char *)idx);
+#ifdef RIAK_TEST
+    curl_easy_setopt (curl, CURLOPT_VERBOSE, 1L);
+#endif
+    g_free (url);
+}
+
+/*
+ * Send HEAD requests for @keys, with up to MAX_CONCURRENT_QUERIES
+ * requests in flight, instead of one round-trip after another.
+ */
+void
+seaf_riak_client_query_many (SeafRiakClient *client,
+                             const char *bucket,
+                             const char **keys,
+                             int n_keys,
+                             gboolean *exists)
+{
+    CURLM *multi;
+    CURL *curl;
+    CURLMsg *msg;
+    char *priv;
+    int i, next = 0, running = 0, n_msgs, maxfd;
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+    long timeout;
+
+    memset (exists, 0, sizeof(gboolean) * n_keys);
+
+    multi = curl_multi_init ();
+    if (!multi) {
+        for (i = 0; i < n_keys; ++i)
+            exists[i] = seaf_riak_client_query (client, bucket, keys[i]);
+        return;
+    }
+
+    for (i = 0; i < MAX_CONCURRENT_QUERIES && next < n_keys; ++i) {
+        curl = curl_easy_init ();
+        setup_query (curl, client, bucket, keys[next], next);
+        curl_multi_add_handle (multi, curl);
+        ++next;
+    }
+
+    curl_multi_perform (multi, &running);
+    while (running > 0 || next < n_keys) {
+        FD_ZERO (&rfds);
+        FD_ZERO (&wfds);
+        FD_ZERO (&efds);
+        maxfd = -1;
+        curl_multi_fdset (multi, &rfds, &wfds, &efds, &maxfd);
+
+        timeout = -1;
+        curl_multi_timeout (multi, &timeout);
+        if (timeout < 0 || timeout > 100)
+            timeout = 100;
+        tv.tv_sec = 0;
+        tv.tv_usec = timeout * 1000;
+
+        if (maxfd >= 0)
+            select (maxfd + 1, &rfds, &wfds, &efds, &tv);
+        else if (timeout > 0)
+            g_usleep (timeout * 1000);
+
+        curl_multi_perform (multi, &running);
+
+        while ((msg = curl_multi_info_read (multi, &n_msgs)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            curl = msg->easy_handle;
+            curl_easy_getinfo (curl, CURLINFO_PRIVATE, &priv);
+            exists[(long)priv] = (msg->data.result == CURLE_OK);
+
+            curl_multi_remove_handle (multi, curl);
+            if (next < n_keys) {
+                /* Reuse the handle and its connection. */
+                curl_easy_reset (curl);
+                setup_query (curl, client, bucket, keys[next], next);
+                curl_multi_add_handle (multi, curl);
+                ++next;
+                ++running;
+            } else {
+                curl_easy_cleanup (curl);
+            }
+        }
+    }
+
+    curl_multi_cleanup (multi);
+}
+
 int
 seaf_riak_client_delete (SeafRiakClient *client,
                          const char *bucket,
@@ -133,8 +133,9 @@ seafile_list_dir_by_path(const char *commit_id, const char *path, GError **error
     GList *ptr;
     GList *res = NULL;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, commit->root_id,
-                                               p, error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      commit->root_id,
+                                                      p, error);
     if (!dir) {
         seaf_warning ("Can't find seaf dir for %s\n", path);
         goto out;
@@ -150,7 +151,7 @@ seafile_list_dir_by_path(const char *commit_id, const char *path, GError **error
         res = g_list_prepend (res, d);
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
     res = g_list_reverse (res);
 
  out:
@@ -188,15 +189,16 @@ seafile_get_dirid_by_path(const char *commit_id, const char *path, GError **erro
     }
 
     SeafDir *dir;
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, commit->root_id,
-                                               p, error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      commit->root_id,
+                                                      p, error);
     if (!dir) {
         seaf_warning ("Can't find seaf dir for %s\n", path);
         goto out;
     }
 
     res = g_strdup (dir->dir_id);
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
 
  out:
 
@@ -226,7 +228,21 @@ seafile_get_session_info (GError **error)
 int
 seafile_set_config (const char *key, const char *value, GError **error)
 {
-    return seafile_session_config_set_string(seaf, key, value);
+    if (seafile_session_config_set_string(seaf, key, value) < 0)
+        return -1;
+
+    /* Transfer settings take effect at once. */
+    if (g_strcmp0 (key, KEY_UPLOAD_LIMIT) == 0)
+        seaf_transfer_manager_set_upload_rate_limit (seaf->transfer_mgr,
+                                                     atoi(value));
+    else if (g_strcmp0 (key, KEY_DOWNLOAD_LIMIT) == 0)
+        seaf_transfer_manager_set_download_rate_limit (seaf->transfer_mgr,
+                                                       atoi(value));
+    else if (g_strcmp0 (key, KEY_MAX_DATA_CONNECTIONS) == 0)
+        seaf_transfer_manager_set_max_data_connections (seaf->transfer_mgr,
+                                                        atoi(value));
+
+    return 0;
 }
 
 char *
@@ -899,6 +915,7 @@ convert_task (TransferTask *task)
                   "state", task_state_to_str(task->state),
                   "rt_state", task_rt_state_to_str(task->runtime_state),
                   "rsize", rsize, "dsize", dsize,
+                  "raw_bytes", task->raw_bytes, "wire_bytes", task->wire_bytes,
                   "error_str", task_error_str(task->error),
                   NULL);
 
@@ -1195,7 +1212,7 @@ seafile_list_dir (const char *dir_id, GError **error)
     GList *res = NULL;
     GList *p;
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, dir_id);
+    dir = seaf_fs_manager_get_seafdir_shared (seaf->fs_mgr, dir_id);
     if (!dir) {
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_DIR_ID, "Bad dir id");
         return NULL;
@@ -1211,7 +1228,7 @@ seafile_list_dir (const char *dir_id, GError **error)
         res = g_list_prepend (res, d);
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
     res = g_list_reverse (res);
     return res;
 }
@@ -1520,6 +1537,38 @@ seafile_gc_get_progress (GError **error)
     return progress;
 }
 
+gint64
+seafile_gc_get_stat (const char *name, GError **error)
+{
+    GCProgress progress;
+
+    if (!name) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (gc_get_progress_info (&progress) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GC_NOT_STARTED, "GC is not running");
+        return -1;
+    }
+
+    if (strcmp (name, "phase") == 0)
+        return progress.phase;
+    else if (strcmp (name, "elapsed") == 0)
+        return progress.elapsed;
+    else if (strcmp (name, "marked") == 0)
+        return (gint64)progress.marked_objects;
+    else if (strcmp (name, "checked") == 0)
+        return (gint64)progress.checked_blocks;
+    else if (strcmp (name, "removed") == 0)
+        return (gint64)progress.removed_blocks;
+    else if (strcmp (name, "rate") == 0)
+        return (gint64)progress.rate;
+
+    g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Unknown gc stat %s", name);
+    return -1;
+}
+
 /*
  * RPC functions only available for server.
  */
@@ -1759,6 +1808,35 @@ seafile_server_repo_size(const char *repo_id, GError **error)
     return ret;
 }
 
+gint64
+seafile_get_fs_cache_stat (const char *name, GError **error)
+{
+    SeafObjCacheStats stats;
+
+    if (!name) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    seaf_fs_manager_get_cache_stats (seaf->fs_mgr, &stats);
+
+    if (strcmp (name, "hits") == 0)
+        return (gint64)stats.hits;
+    else if (strcmp (name, "misses") == 0)
+        return (gint64)stats.misses;
+    else if (strcmp (name, "evictions") == 0)
+        return (gint64)stats.evictions;
+    else if (strcmp (name, "objects") == 0)
+        return (gint64)stats.n_objects;
+    else if (strcmp (name, "size") == 0)
+        return (gint64)stats.size;
+    else if (strcmp (name, "capacity") == 0)
+        return (gint64)stats.capacity;
+
+    g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Unknown cache stat %s", name);
+    return -1;
+}
+
 int
 seafile_repo_set_access_property (const char *repo_id, const char *ap, GError **error)
 {
@@ -2562,6 +2640,55 @@ seafile_put_file (const char *repo_id, const char *temp_file_path,
     return 0;
 }
 
+int
+seafile_post_multi_files_by_id (const char *repo_id,
+                                const char *parent_dir,
+                                const char *filenames_json,
+                                const char *file_ids_json,
+                                const char *user,
+                                GError **error)
+{
+    if (!repo_id || !filenames_json || !parent_dir || !file_ids_json || !user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_repo_manager_post_multi_files_by_id (seaf->repo_mgr,
+                                                  repo_id,
+                                                  parent_dir,
+                                                  filenames_json,
+                                                  file_ids_json,
+                                                  user,
+                                                  error) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+seafile_put_file_by_id (const char *repo_id, const char *file_id,
+                        const char *parent_dir, const char *file_name,
+                        const char *user, const char *head_id,
+                        GError **error)
+{
+    if (!repo_id || !file_id || !parent_dir || !file_name || !user) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_repo_manager_put_file_by_id (seaf->repo_mgr, repo_id,
+                                          file_id, parent_dir,
+                                          file_name, user, head_id,
+                                          error) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 seafile_post_dir (const char *repo_id, const char *parent_dir,
                   const char *new_dir_name, const char *user,
@@ -2619,6 +2746,23 @@ seafile_del_file (const char *repo_id, const char *parent_dir,
     return 0;
 }
 
+int
+seafile_batch_ops (const char *repo_id, const char *ops_json,
+                   const char *user, GError **error)
+{
+    if (!repo_id || !ops_json || !user) {
+        g_set_error (error, 0, SEAF_ERR_BAD_ARGS, "Argument should not be null");
+        return -1;
+    }
+
+    if (seaf_repo_manager_batch_ops (seaf->repo_mgr, repo_id,
+                                     ops_json, user, error) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 seafile_copy_file (const char *src_repo_id,
                    const char *src_dir,
@@ -2879,6 +3023,19 @@ seafile_check_quota (const char *repo_id, GError **error)
     return seaf_quota_manager_check_quota (seaf->quota_mgr, repo_id);
 }
 
+int
+seafile_check_quota_with_delta (const char *repo_id, gint64 delta,
+                                GError **error)
+{
+    if (!repo_id || delta < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Bad arguments");
+        return -1;
+    }
+
+    return seaf_quota_manager_check_quota_with_delta (seaf->quota_mgr,
+                                                      repo_id, delta);
+}
+
 char *
 seafile_get_file_by_path (const char *repo_id, const char *path,
                           GError **error)
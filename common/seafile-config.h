@@ -12,6 +12,9 @@
 #define KEY_DB_USER "db_user"
 #define KEY_DB_PASSWD "db_passwd"
 #define KEY_DB_NAME "db_name"
+#define KEY_UPLOAD_LIMIT "upload_limit"
+#define KEY_DOWNLOAD_LIMIT "download_limit"
+#define KEY_MAX_DATA_CONNECTIONS "max_data_connections"
 
 /*
  * Returns: config value in string. The string should be freed by caller. 
@@ -329,3 +329,62 @@ dec_error:
 
     return -1;
 }
+
+int
+seafile_decrypted_size (SeafileCrypt *crypt,
+                        const char *tail,
+                        int tail_len,
+                        int enc_len)
+{
+    EVP_CIPHER_CTX ctx;
+    unsigned char out[2 * BLK_SIZE];
+    const unsigned char *last, *iv;
+    int update_len, final_len;
+    int ret;
+
+    if (enc_len <= 0 || enc_len % BLK_SIZE != 0 ||
+        tail_len < MIN (enc_len, 2 * BLK_SIZE)) {
+        g_warning ("Invalid param(s).\n");
+        return -1;
+    }
+
+    last = (const unsigned char *)tail + tail_len - BLK_SIZE;
+
+    EVP_CIPHER_CTX_init (&ctx);
+
+    if (crypt->version >= 1) {
+        /* In CBC mode, the IV of a cipher block is the previous one. */
+        iv = (enc_len > BLK_SIZE) ? last - BLK_SIZE : crypt->iv;
+        ret = EVP_DecryptInit_ex (&ctx,
+                                  EVP_aes_128_cbc(), /* cipher mode */
+                                  NULL, /* engine, NULL for default */
+                                  crypt->key,  /* derived key */
+                                  iv);  /* initial vector */
+    } else
+        ret = EVP_DecryptInit_ex (&ctx,
+                                  EVP_aes_128_ecb(), /* cipher mode */
+                                  NULL, /* engine, NULL for default */
+                                  crypt->key,  /* derived key */
+                                  crypt->iv);  /* initial vector */
+
+    if (ret == DEC_FAILURE)
+        goto dec_error;
+
+    ret = EVP_DecryptUpdate (&ctx, out, &update_len, last, BLK_SIZE);
+    if (ret == DEC_FAILURE)
+        goto dec_error;
+
+    /* Strips the padding. */
+    ret = EVP_DecryptFinal_ex (&ctx, out + update_len, &final_len);
+    if (ret == DEC_FAILURE)
+        goto dec_error;
+
+    EVP_CIPHER_CTX_cleanup (&ctx);
+
+    return enc_len - BLK_SIZE + update_len + final_len;
+
+dec_error:
+    EVP_CIPHER_CTX_cleanup (&ctx);
+
+    return -1;
+}
@@ -95,4 +95,21 @@ seafile_decrypt_final (EVP_CIPHER_CTX *ctx,
                        char *data_out,
                        int *out_len);
 
+/*
+ * Get the length of decrypted data without decrypting all of it.
+ * Only the last cipher block (and the one before it, as IV in CBC mode)
+ * is decrypted to find the padding.
+ *
+ * @tail: the last @tail_len bytes of encrypted data, at least 32 bytes
+ * unless @enc_len is smaller.
+ * @enc_len: length of the encrypted data.
+ *
+ * Returns the length of decrypted data, or -1 on failure.
+ */
+int
+seafile_decrypted_size (SeafileCrypt *crypt,
+                        const char *tail,
+                        int tail_len,
+                        int enc_len);
+
 #endif  /* _SEAFILE_CRYPT_H */
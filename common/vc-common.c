@@ -276,38 +276,22 @@ is_up_to_date (const char *src_head, const char *dst_head)
 VCCompareResult
 vc_compare_commits (const char *c1, const char *c2)
 {
-    SeafCommit *commit1, *commit2, *ca;
-    VCCompareResult ret;
+    int ret;
 
     /* Treat the same as up-to-date. */
     if (strcmp (c1, c2) == 0)
         return VC_UP_TO_DATE;
 
-    commit1 = seaf_commit_manager_get_commit (seaf->commit_mgr, c1);
-    if (!commit1)
-        return VC_INDEPENDENT;
-
-    commit2 = seaf_commit_manager_get_commit (seaf->commit_mgr, c2);
-    if (!commit2) {
-        seaf_commit_unref (commit1);
-        return VC_INDEPENDENT;
-    }
-
-    ca = get_merge_base (commit1, commit2);
-
-    if (!ca)
-        ret = VC_INDEPENDENT;
-    else if (strcmp(ca->commit_id, commit1->commit_id) == 0)
-        ret = VC_UP_TO_DATE;
-    else if (strcmp(ca->commit_id, commit2->commit_id) == 0)
-        ret = VC_FAST_FORWARD;
+    /* This only needs ancestry, which is answered from the commit graph
+     * without computing merge bases.
+     */
+    ret = seaf_commit_manager_compare_commit (seaf->commit_mgr, c1, c2);
+    if (ret == -1)
+        return VC_UP_TO_DATE;
+    else if (ret == 1)
+        return VC_FAST_FORWARD;
     else
-        ret = VC_INDEPENDENT;
-
-    if (ca) seaf_commit_unref (ca);
-    seaf_commit_unref (commit1);
-    seaf_commit_unref (commit2);
-    return ret;
+        return VC_INDEPENDENT;
 }
 
 /**
@@ -0,0 +1,216 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <zlib.h>
+
+#ifndef WIN32
+    #include <arpa/inet.h>
+#endif
+
+#define DEBUG_FLAG SEAFILE_DEBUG_TRANSFER
+#include "log.h"
+
+#include "wire-compress.h"
+
+/* Favor speed, the data is compressed on every transfer. */
+#define COMPRESS_LEVEL Z_BEST_SPEED
+
+/* Smaller data is not worth the cost. */
+#define MIN_COMPRESS_SIZE 128
+
+#define PROBE_SIZE 4096
+#define PROBE_CHUNKS 4
+
+/*
+ * Data with more than 7.5 bits of entropy per byte is taken as random.
+ * That is, n^2 / sum(count^2) > 2^7.5, see wire_data_compressible().
+ */
+#define RANDOM_ENTROPY_FACTOR 181
+
+gboolean
+wire_compress_requested (int *argc, char **argv)
+{
+    if (*argc > 0 && strcmp (argv[*argc - 1], WIRE_COMPRESS_ARG) == 0) {
+        --(*argc);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * The collision entropy, -log2(sum(p^2)), is used since it can be compared
+ * without floating point math. It's never larger than the Shannon entropy,
+ * so random data is still recognized.
+ */
+gboolean
+wire_data_compressible (const void *data, int len)
+{
+    const unsigned char *p = data;
+    guint32 counts[256];
+    gint64 n = 0, sumsq = 0;
+    int chunk, step, i, j;
+
+    if (len < MIN_COMPRESS_SIZE)
+        return FALSE;
+
+    memset (counts, 0, sizeof(counts));
+
+    /* Take a few chunks spread over the data. */
+    if (len <= PROBE_SIZE) {
+        chunk = len;
+        step = len;
+    } else {
+        chunk = PROBE_SIZE / PROBE_CHUNKS;
+        step = len / PROBE_CHUNKS;
+    }
+
+    for (i = 0; i + chunk <= len && n < PROBE_SIZE; i += step) {
+        for (j = 0; j < chunk; ++j)
+            ++counts[p[i + j]];
+        n += chunk;
+    }
+
+    for (i = 0; i < 256; ++i)
+        sumsq += (gint64)counts[i] * counts[i];
+
+    return (n * n <= sumsq * RANDOM_ENTROPY_FACTOR);
+}
+
+/* @out must have room for compressBound(@len) bytes. */
+static gboolean
+compress_to (void *out, int *out_len, const void *data, int len)
+{
+    uLongf zlen = compressBound ((uLong)len);
+
+    if (!wire_data_compressible (data, len))
+        return FALSE;
+
+    if (compress2 (out, &zlen, data, (uLong)len, COMPRESS_LEVEL) != Z_OK) {
+        seaf_warning ("[wire] Failed to compress %d bytes.\n", len);
+        return FALSE;
+    }
+
+    /* Not worth it if less than 1/16 is saved. */
+    if (zlen >= len - len / 16)
+        return FALSE;
+
+    *out_len = (int)zlen;
+    return TRUE;
+}
+
+static gboolean
+decompress_to (void *out, int raw_len, const void *data, int len)
+{
+    uLongf out_len = (uLongf)raw_len;
+
+    if (uncompress (out, &out_len, data, (uLong)len) != Z_OK ||
+        out_len != (uLongf)raw_len) {
+        seaf_warning ("[wire] Failed to decompress %d bytes.\n", len);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void *
+wire_compress (const void *data, int len, int *out_len)
+{
+    void *out = g_malloc (compressBound ((uLong)len));
+
+    if (!compress_to (out, out_len, data, len)) {
+        g_free (out);
+        return NULL;
+    }
+    return out;
+}
+
+void *
+wire_decompress (const void *data, int len, int raw_len)
+{
+    void *out;
+
+    if (raw_len <= 0 || raw_len > WIRE_MAX_RAW_SIZE) {
+        seaf_warning ("[wire] Bad raw size %d.\n", raw_len);
+        return NULL;
+    }
+
+    out = g_malloc (raw_len);
+    if (!decompress_to (out, raw_len, data, len)) {
+        g_free (out);
+        return NULL;
+    }
+    return out;
+}
+
+void *
+object_pack_new (const char *id, const void *data, int len,
+                 gboolean compress, int *pack_len)
+{
+    ObjectPack *pack;
+    ObjectPackZ *zpack;
+    int zlen;
+
+    if (!compress) {
+        *pack_len = sizeof(ObjectPack) + len;
+        pack = malloc (*pack_len);
+        memcpy (pack->id, id, 41);
+        memcpy (pack->object, data, len);
+        return pack;
+    }
+
+    zpack = malloc (sizeof(ObjectPackZ) + MAX (len, compressBound ((uLong)len)));
+    memcpy (zpack->id, id, 41);
+    zpack->raw_len = htonl ((uint32_t)len);
+
+    if (compress_to (zpack->object, &zlen, data, len)) {
+        zpack->flags = OBJ_PACK_COMPRESSED;
+        *pack_len = sizeof(ObjectPackZ) + zlen;
+    } else {
+        zpack->flags = 0;
+        memcpy (zpack->object, data, len);
+        *pack_len = sizeof(ObjectPackZ) + len;
+    }
+
+    return zpack;
+}
+
+ObjectPack *
+object_pack_unpack (const char *content, int clen, int *pack_len)
+{
+    const ObjectPackZ *zpack = (const ObjectPackZ *)content;
+    ObjectPack *pack;
+    int raw_len, len;
+
+    if (clen < sizeof(ObjectPackZ)) {
+        seaf_warning ("[wire] Bad object pack.\n");
+        return NULL;
+    }
+
+    raw_len = (int)ntohl (zpack->raw_len);
+    len = clen - sizeof(ObjectPackZ);
+
+    if (!(zpack->flags & OBJ_PACK_COMPRESSED)) {
+        if (raw_len != len) {
+            seaf_warning ("[wire] Bad object pack.\n");
+            return NULL;
+        }
+        pack = g_malloc (sizeof(ObjectPack) + len);
+        memcpy (pack->object, zpack->object, len);
+    } else {
+        if (raw_len <= 0 || raw_len > WIRE_MAX_RAW_SIZE) {
+            seaf_warning ("[wire] Bad raw size %d.\n", raw_len);
+            return NULL;
+        }
+        pack = g_malloc (sizeof(ObjectPack) + raw_len);
+        if (!decompress_to (pack->object, raw_len, zpack->object, len)) {
+            g_free (pack);
+            return NULL;
+        }
+    }
+    memcpy (pack->id, zpack->id, 41);
+    pack->id[40] = '\0';
+    *pack_len = sizeof(ObjectPack) + raw_len;
+
+    return pack;
+}
@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef SEAF_WIRE_COMPRESS_H
+#define SEAF_WIRE_COMPRESS_H
+
+#include <glib.h>
+
+#include "processors/objecttx-common.h"
+
+/*
+ * Compression of objects and blocks sent to peers.
+ *
+ * The master asks for it by appending WIRE_COMPRESS_ARG to the arguments
+ * of the slave processor, only if the session protocol version (see
+ * check-tx) is at least WIRE_COMPRESS_PROTO_VERSION. Data is compressed
+ * with zlib, one object or block at a time. Data which looks random from
+ * a quick entropy probe, like encrypted or already compressed blocks,
+ * is sent as is.
+ */
+#define WIRE_COMPRESS_PROTO_VERSION 5
+#define WIRE_COMPRESS_ARG "zlib"
+
+/* Don't take compressed data which inflates to more than this. */
+#define WIRE_MAX_RAW_SIZE (64 << 20)
+
+/*
+ * If the last argument is WIRE_COMPRESS_ARG, remove it from the list
+ * and return TRUE.
+ */
+gboolean
+wire_compress_requested (int *argc, char **argv);
+
+/*
+ * Estimate the entropy of @data from the byte frequencies of a sample.
+ * Returns FALSE if it's unlikely to be made smaller by compression.
+ */
+gboolean
+wire_data_compressible (const void *data, int len);
+
+/*
+ * Returns the compressed data and sets @out_len, or returns NULL if
+ * the data is not worth compressing.
+ */
+void *
+wire_compress (const void *data, int len, int *out_len);
+
+/*
+ * @raw_len is the size of the data before compression.
+ * Returns NULL if @data is not valid.
+ */
+void *
+wire_decompress (const void *data, int len, int raw_len);
+
+/*
+ * Object pack used when compression is negotiated. The object is
+ * compressed if OBJ_PACK_COMPRESSED is set in @flags.
+ */
+#define OBJ_PACK_COMPRESSED 0x1
+
+typedef struct {
+    char     id[41];
+    uint8_t  flags;
+    uint32_t raw_len;           /* size of the object, in network byte order */
+    uint8_t  object[0];
+} __attribute__((__packed__)) ObjectPackZ;
+
+/*
+ * Build the pack for an object. If @compress is TRUE it's an ObjectPackZ,
+ * otherwise a plain ObjectPack. The returned pack should be freed with free().
+ */
+void *
+object_pack_new (const char *id, const void *data, int len,
+                 gboolean compress, int *pack_len);
+
+/*
+ * Convert a received ObjectPackZ to a plain ObjectPack, which should be
+ * freed with g_free(). Returns NULL if the pack is not valid.
+ */
+ObjectPack *
+object_pack_unpack (const char *content, int clen, int *pack_len);
+
+#endif
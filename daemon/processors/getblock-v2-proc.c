@@ -93,7 +93,10 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
         return -1;
     }
 
-    prepare_thread_data (processor, recv_blocks, got_block_cb);
+    proc->version = priv->version;
+    prepare_thread_data (processor,
+                         priv->version == 3 ? get_blocks_v3 : recv_blocks,
+                         got_block_cb);
     priv->tdata->task = proc->tx_task;
 
     return 0;
@@ -118,19 +121,33 @@ seafile_getblock_v2_proc_get_block (SeafileGetblockV2Proc *proc,
     char *block_id;
     char buf[128];
     int len;
+    USE_PRIV;
 
     if (processor->state != ESTABLISHED)
         return -1;
 
+    block_id = g_ptr_array_index (proc->tx_task->block_list->block_ids, block_idx);
+
+    if (proc->version == 3) {
+        /* The worker thread sends the request on the data connection. */
+        BlockRequest blk_req;
+        memcpy (blk_req.block_id, block_id, 41);
+        blk_req.block_idx = block_idx;
+        if (pipewriten (priv->tdata->task_pipe[1],
+                        &blk_req, sizeof(blk_req)) < 0) {
+            g_warning ("failed to write task pipe.\n");
+            return -1;
+        }
+    } else {
+        len = snprintf (buf, 128, "%d %s", block_idx, block_id);
+        ccnet_processor_send_update (processor,
+                                     SC_GET_BLOCK, SS_GET_BLOCK,
+                                     buf, len + 1);
+    }
+
     ++(proc->pending_blocks);
     BitfieldAdd (&proc->active, block_idx);
 
-    block_id = g_ptr_array_index (proc->tx_task->block_list->block_ids, block_idx);
-    len = snprintf (buf, 128, "%d %s", block_idx, block_id);
-    ccnet_processor_send_update (processor,
-                                 SC_GET_BLOCK, SS_GET_BLOCK,
-                                 buf, len + 1);
-
     return 0;
 }
 
@@ -146,12 +163,19 @@ got_block_cb (CEvent *event, void *vprocessor)
     SeafileGetblockV2Proc *proc = vprocessor;
     BlockResponse *blk_rsp = event->data;
 
+    transfer_task_add_tx_stats (proc->tx_task,
+                                blk_rsp->raw_bytes, blk_rsp->tx_bytes);
+
     if (blk_rsp->block_idx >= 0) {
         BitfieldAdd (&proc->tx_task->block_list->block_map, blk_rsp->block_idx);
         BitfieldRem (&proc->active, blk_rsp->block_idx);
         BitfieldRem (&proc->tx_task->active, blk_rsp->block_idx);
         ++(proc->tx_task->block_list->n_valid_blocks);
         --(proc->pending_blocks);
+
+        if (proc->version == 3 && proc->tx_task->state == TASK_STATE_NORMAL)
+            transfer_task_dispatch_blocks (proc->tx_task,
+                                           (CcnetProcessor *)proc);
     }
 
     g_free (blk_rsp);
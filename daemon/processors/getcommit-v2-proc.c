@@ -15,6 +15,7 @@
 #include "seafile-session.h"
 #include "getcommit-v2-proc.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 
 /*
               seafile-putcommit-v2 <HEAD> [END] (END is empty in clone)
@@ -64,7 +65,8 @@ static int
 get_commit_start (CcnetProcessor *processor, int argc, char **argv)
 {
     GString *buf = g_string_new (NULL);
-    TransferTask *task = ((SeafileGetcommitV2Proc *)processor)->tx_task;
+    SeafileGetcommitV2Proc *proc = (SeafileGetcommitV2Proc *)processor;
+    TransferTask *task = proc->tx_task;
     SeafBranch *master = NULL;
     char *end_commit_id = NULL;
 
@@ -91,6 +93,9 @@ get_commit_start (CcnetProcessor *processor, int argc, char **argv)
         g_string_printf (buf, "remote %s seafile-putcommit-v2 %s %s",
                          processor->peer_id, 
                          task->head, task->session_token);
+    proc->compress = (task->protocol_version >= WIRE_COMPRESS_PROTO_VERSION);
+    if (proc->compress)
+        g_string_append (buf, " " WIRE_COMPRESS_ARG);
     ccnet_processor_send_request (processor, buf->str);
     g_string_free (buf, TRUE);
 
@@ -111,10 +116,21 @@ save_commit (ObjectPack *pack, int len)
 static void
 receive_commit (CcnetProcessor *processor, char *content, int clen)
 {
-    ObjectPack *pack = (ObjectPack *)content;
-    TransferTask *task = ((SeafileGetcommitV2Proc *)processor)->tx_task;
+    SeafileGetcommitV2Proc *proc = (SeafileGetcommitV2Proc *)processor;
+    TransferTask *task = proc->tx_task;
+    ObjectPack *pack, *unpacked = NULL;
+    int wire_len = clen;
     SeafCommit *commit;
 
+    if (proc->compress) {
+        unpacked = object_pack_unpack (content, clen, &clen);
+        if (!unpacked)
+            goto bad;
+        content = (char *)unpacked;
+    }
+    pack = (ObjectPack *)content;
+    transfer_task_add_tx_stats (task, clen, wire_len);
+
     if (clen < sizeof(ObjectPack)) {
         g_warning ("[getcommit] invalid object id.\n");
         goto bad;
@@ -134,12 +150,13 @@ receive_commit (CcnetProcessor *processor, char *content, int clen)
         object_list_insert (task->fs_roots, commit->root_id);
     seaf_commit_unref (commit);
 
+    g_free (unpacked);
     return;
 
 bad:
+    g_free (unpacked);
     g_warning ("[getcommit] Bad commit object received.\n");
-    transfer_task_set_error (((SeafileGetcommitV2Proc *)processor)->tx_task,
-                             TASK_ERR_DOWNLOAD_COMMIT);
+    transfer_task_set_error (task, TASK_ERR_DOWNLOAD_COMMIT);
     ccnet_processor_done (processor, FALSE);
 }
 
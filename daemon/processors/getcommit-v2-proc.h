@@ -20,6 +20,7 @@ struct _SeafileGetcommitV2Proc {
     CcnetProcessor parent_instance;
 
     TransferTask  *tx_task;
+    gboolean       compress;    /* commits are received as ObjectPackZ */
 };
 
 struct _SeafileGetcommitV2ProcClass {
@@ -17,6 +17,7 @@
 #include "commit-mgr.h"
 #include "fs-mgr.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "getfs-proc.h"
 #include "transfer-mgr.h"
 
@@ -29,17 +30,30 @@ enum {
     FETCH_OBJECT
 };
 
+/*
+ * A dir to check, and the dir at the same path in the local head, if any.
+ * Entries which are the same in both are complete and are not checked.
+ */
+typedef struct {
+    char id[41];
+    char base_id[41];
+} InspectItem;
+
 typedef struct  {
-    GQueue *inspect_queue;      /* objects to check exists */
+    GQueue *inspect_queue;      /* InspectItems */
     int pending_objects;
     char root_id[41];
     char buf[4096];
     char *bufptr;
     int  n_batch;
+    /* requested object id -> base id */
     GHashTable  *fs_objects;
 
     char *obj_seg;
     int  obj_seg_len;
+
+    /* Objects are received as ObjectPackZ. */
+    gboolean compress;
 } SeafileGetfsProcPriv;
 
 #define GET_PRIV(o)  \
@@ -60,6 +74,10 @@ static void
 release_resource(CcnetProcessor *processor)
 {
     USE_PRIV;
+    InspectItem *item;
+
+    while ((item = g_queue_pop_head (priv->inspect_queue)) != NULL)
+        g_free (item);
     g_queue_free (priv->inspect_queue);
     g_hash_table_destroy (priv->fs_objects);
     g_free (priv->obj_seg);
@@ -109,10 +127,22 @@ request_object_batch_flush (CcnetProcessor *processor,
     priv->bufptr = priv->buf;
 }
 
+static void
+push_inspect_item (SeafileGetfsProcPriv *priv,
+                   const char *id, const char *base_id)
+{
+    InspectItem *item = g_new (InspectItem, 1);
+
+    memcpy (item->id, id, 41);
+    g_strlcpy (item->base_id, base_id, 41);
+    g_queue_push_tail (priv->inspect_queue, item);
+}
+
 inline static void
 request_object_batch (CcnetProcessor *processor, 
                       SeafileGetfsProcPriv *priv,
-                      const char *id)
+                      const char *id,
+                      const char *base_id)
 {
     g_assert(priv->bufptr - priv->buf <= (4096-41));
 
@@ -124,37 +154,62 @@ request_object_batch (CcnetProcessor *processor,
     *priv->bufptr = '\n';
     priv->bufptr++;
 
-    g_hash_table_insert (priv->fs_objects, g_strdup(id), (gpointer)1);
+    g_hash_table_insert (priv->fs_objects, g_strdup(id), g_strdup(base_id));
     if (++priv->n_batch == MAX_NUM_BATCH)
         request_object_batch_flush (processor, priv);
     ++priv->pending_objects;
 }
 
 static void
-check_seafdir (CcnetProcessor *processor, SeafDir *dir)
+check_seafdir (CcnetProcessor *processor, SeafDir *dir, const char *base_id)
 {
     USE_PRIV;
     GList *ptr;
-    SeafDirent *dent;
+    SeafDirent *dent, *base_dent;
+    SeafDir *base = NULL;
+    GHashTable *base_dents = g_hash_table_new (g_str_hash, g_str_equal);
+    const char *sub_base;
+
+    if (base_id[0] != '\0')
+        base = seaf_fs_manager_get_seafdir (seaf->fs_mgr, base_id);
+    if (base) {
+        for (ptr = base->entries; ptr; ptr = ptr->next) {
+            base_dent = ptr->data;
+            g_hash_table_insert (base_dents, base_dent->name, base_dent);
+        }
+    }
 
     for (ptr = dir->entries; ptr; ptr = ptr->next) {
         dent = ptr->data;
+
+        /* The local head is complete, so is this sub-tree. */
+        base_dent = g_hash_table_lookup (base_dents, dent->name);
+        if (base_dent && strcmp (dent->id, base_dent->id) == 0)
+            continue;
+
+        sub_base = "";
+        if (base_dent && S_ISDIR(base_dent->mode) && S_ISDIR(dent->mode))
+            sub_base = base_dent->id;
+
         if (!seaf_fs_manager_object_exists(seaf->fs_mgr, dent->id)) {
-            request_object_batch (processor, priv, dent->id);
+            request_object_batch (processor, priv, dent->id, sub_base);
             continue;
         }
         if (S_ISDIR(dent->mode)) {
-            g_queue_push_tail (priv->inspect_queue, g_strdup(dent->id));
+            push_inspect_item (priv, dent->id, sub_base);
         }
         /* TODO: check seafile object integrity. */
     }
+
+    g_hash_table_destroy (base_dents);
+    seaf_dir_free (base);
 }
 
 static int
 check_object (CcnetProcessor *processor)
 {
     USE_PRIV;
-    char *obj_id;
+    InspectItem *item;
     SeafDir *dir;
     static int i = 0;
 
@@ -164,22 +219,22 @@ check_object (CcnetProcessor *processor)
     /* Note: All files in a directory must be checked in an iteration,
      * so we may send out more items than REQUEST_THRESHOLD */
     while (g_hash_table_size (priv->fs_objects) < MAX_NUM_UNREVD) {
-        obj_id = (char *) g_queue_pop_head (priv->inspect_queue);
-        if (obj_id == NULL)
+        item = g_queue_pop_head (priv->inspect_queue);
+        if (item == NULL)
             break;
-        if (!seaf_fs_manager_object_exists(seaf->fs_mgr, obj_id)) {
-            request_object_batch (processor, priv, obj_id);
+        if (!seaf_fs_manager_object_exists(seaf->fs_mgr, item->id)) {
+            request_object_batch (processor, priv, item->id, item->base_id);
         } else {
-            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, obj_id);
+            dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, item->id);
             if (!dir) {
                 /* corrupt dir object */
-                request_object_batch (processor, priv, obj_id);
+                request_object_batch (processor, priv, item->id, item->base_id);
             } else {
-                check_seafdir(processor, dir);
+                check_seafdir(processor, dir, item->base_id);
                 seaf_dir_free (dir);
             }
         }
-        g_free (obj_id);        /* free the memory */
+        g_free (item);
     }
 
     request_object_batch_flush (processor, priv);
@@ -205,10 +260,14 @@ start (CcnetProcessor *processor, int argc, char **argv)
     TransferTask *task = ((SeafileGetfsProc *)processor)->tx_task;
     GString *buf = g_string_new (NULL);
 
-    if (task->session_token)
+    if (task->session_token) {
         g_string_printf (buf, "remote %s seafile-putfs %s", 
                          processor->peer_id, task->session_token);
-    else
+        priv->compress =
+            (task->protocol_version >= WIRE_COMPRESS_PROTO_VERSION);
+        if (priv->compress)
+            g_string_append (buf, " " WIRE_COMPRESS_ARG);
+    } else
         g_string_printf (buf, "remote %s seafile-putfs", 
                          processor->peer_id);
     ccnet_processor_send_request (processor, buf->str);
@@ -217,7 +276,7 @@ start (CcnetProcessor *processor, int argc, char **argv)
     processor->state = REQUEST_SENT;
     priv->inspect_queue = g_queue_new ();
     priv->fs_objects = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, NULL);
+                                              g_free, g_free);
 
     return 0;
 }
@@ -235,9 +294,19 @@ static int
 recv_fs_object (CcnetProcessor *processor, char *content, int clen)
 {
     USE_PRIV;
-    ObjectPack *pack = (ObjectPack *)content;
+    TransferTask *task = ((SeafileGetfsProc *)processor)->tx_task;
+    ObjectPack *pack, *unpacked = NULL;
+    int wire_len = clen;
     uint32_t type;
-    /* TransferTask *task = ((SeafileGetfsProc *)processor)->tx_task; */
+
+    if (priv->compress) {
+        unpacked = object_pack_unpack (content, clen, &clen);
+        if (!unpacked)
+            goto bad;
+        content = (char *)unpacked;
+    }
+    pack = (ObjectPack *)content;
+    transfer_task_add_tx_stats (task, clen, wire_len);
 
     if (clen < sizeof(ObjectPack)) {
         g_warning ("[getfs] invalid object id.\n");
@@ -249,12 +318,14 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
     type = seaf_metadata_type_from_data(pack->object, clen);
     if (type == SEAF_METADATA_TYPE_DIR) {
         SeafDir *dir;
+        const char *base_id;
         dir = seaf_dir_from_data (pack->id, pack->object, clen - 41);
         if (!dir) {
             g_warning ("[getfs] Bad directory object %s.\n", pack->id);
             goto bad;
         }
-        g_queue_push_tail (priv->inspect_queue, g_strdup(dir->dir_id));
+        base_id = g_hash_table_lookup (priv->fs_objects, pack->id);
+        push_inspect_item (priv, dir->dir_id, base_id ? base_id : "");
         seaf_dir_free (dir);
     } else if (type == SEAF_METADATA_TYPE_FILE) {
         /* TODO: check seafile format. */
@@ -274,12 +345,13 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
     }
 
     g_hash_table_remove (priv->fs_objects, pack->id);
+    g_free (unpacked);
     return 0;
 
 bad:
+    g_free (unpacked);
     g_warning ("Bad fs object received.\n");
-    transfer_task_set_error (((SeafileGetfsProc *)processor)->tx_task,
-                             TASK_ERR_DOWNLOAD_FS);
+    transfer_task_set_error (task, TASK_ERR_DOWNLOAD_FS);
     ccnet_processor_done (processor, FALSE);
     return -1;
 }
@@ -311,18 +383,45 @@ process_fs_object_seg (CcnetProcessor *processor)
     }
 }
 
+/* Root of the local head, or an empty string. */
+static void
+get_base_root (TransferTask *task, char *base_root)
+{
+    SeafRepo *repo;
+    SeafCommit *head;
+
+    base_root[0] = '\0';
+
+    if (task->is_clone)
+        return;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, task->repo_id);
+    if (!repo || !repo->head)
+        return;
+
+    head = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           repo->head->commit_id);
+    if (!head)
+        return;
+
+    memcpy (base_root, head->root_id, 41);
+    seaf_commit_unref (head);
+}
+
 static void
 load_fsroot_list (CcnetProcessor *processor)
 {
     USE_PRIV;
     SeafileGetfsProc *proc = (SeafileGetfsProc *) processor;
     ObjectList *ol = proc->tx_task->fs_roots;
+    char base_root[41];
     int i;
     int ollen = object_list_length (ol);
 
+    get_base_root (proc->tx_task, base_root);
+
     for (i = 0; i < ollen; i++) {
-        g_queue_push_tail (priv->inspect_queue,
-                           g_strdup(g_ptr_array_index(ol->obj_ids, i)));
+        push_inspect_item (priv, g_ptr_array_index(ol->obj_ids, i), base_root);
     }
 }
 
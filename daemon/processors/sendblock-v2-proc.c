@@ -96,7 +96,10 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
         return -1;
     }
 
-    prepare_thread_data (processor, send_blocks, sent_block_cb);
+    proc->version = priv->version;
+    prepare_thread_data (processor,
+                         priv->version == 3 ? send_blocks_v3 : send_blocks,
+                         sent_block_cb);
     priv->tdata->task = proc->tx_task;
 
     return 0;
@@ -150,15 +153,52 @@ seafile_sendblock_v2_proc_is_ready (SeafileSendblockV2Proc *proc)
     return (((CcnetProcessor *)proc)->state == ESTABLISHED);
 }
 
+static int
+block_acked (SeafileSendblockV2Proc *proc, int block_idx)
+{
+    CcnetProcessor *processor = (CcnetProcessor *)proc;
+
+    if (block_idx < 0 || block_idx >= proc->tx_task->block_list->n_blocks) {
+        g_warning ("Bad block index %d.\n", block_idx);
+        ccnet_processor_done (processor, FALSE);
+        return -1;
+    }
+
+    BitfieldRem (&proc->active, block_idx);
+    BitfieldRem (&proc->tx_task->active, block_idx);
+    BitfieldAdd (&proc->tx_task->uploaded, block_idx);
+    g_debug ("[sendlbock] recv ack for block %d\n", block_idx);
+    ++(proc->tx_task->n_uploaded);
+
+    return 0;
+}
+
 static void
 sent_block_cb (CEvent *event, void *vprocessor)
 {
     SeafileSendblockV2Proc *proc = vprocessor;
     BlockResponse *blk_rsp = event->data;
 
-    if (blk_rsp->block_idx >= 0)
-        --(proc->pending_blocks);
+    transfer_task_add_tx_stats (proc->tx_task,
+                                blk_rsp->raw_bytes, blk_rsp->tx_bytes);
+
+    if (blk_rsp->block_idx < 0)
+        goto out;
 
+    --(proc->pending_blocks);
+
+    /* In v3 the event is sent when the block is acked. Queue more blocks
+     * right away instead of waiting for the next schedule.
+     */
+    if (proc->version == 3) {
+        if (block_acked (proc, blk_rsp->block_idx) < 0)
+            goto out;
+        if (proc->tx_task->state == TASK_STATE_NORMAL)
+            transfer_task_dispatch_blocks (proc->tx_task,
+                                           (CcnetProcessor *)proc);
+    }
+
+out:
     g_free (blk_rsp);
 }
 
@@ -166,7 +206,6 @@ static void
 process_ack (CcnetProcessor *processor, char *content, int clen)
 {
     SeafileSendblockV2Proc *proc = (SeafileSendblockV2Proc *)processor;
-    int block_idx;
 
     if (content[clen-1] != '\0') {
         g_warning ("Bad block ack.\n");
@@ -174,18 +213,7 @@ process_ack (CcnetProcessor *processor, char *content, int clen)
         return;
     }
 
-    block_idx = atoi(content);
-    if (block_idx < 0 || block_idx >= proc->tx_task->block_list->n_blocks) {
-        g_warning ("Bad block index %d.\n", block_idx);
-        ccnet_processor_done (processor, FALSE);
-        return;
-    }
-
-    BitfieldRem (&proc->active, block_idx);
-    BitfieldRem (&proc->tx_task->active, block_idx);
-    BitfieldAdd (&proc->tx_task->uploaded, block_idx);
-    g_debug ("[sendlbock] recv ack for block %d\n", block_idx);
-    ++(proc->tx_task->n_uploaded);
+    block_acked (proc, atoi(content));
 }
 
 static void handle_response (CcnetProcessor *processor,
@@ -27,6 +27,8 @@ struct _SeafileSendblockV2Proc {
     int            tx_time;
     double         avg_tx_rate;
     int            pending_blocks;
+    /* Block protocol version, 2 or 3. */
+    int            version;
 };
 
 struct _SeafileSendblockV2ProcClass {
@@ -14,6 +14,7 @@
 #include "seafile-session.h"
 #include "sendcommit-v3-proc.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "vc-common.h"
 
 /*
@@ -43,6 +44,8 @@ typedef struct  {
     GList       *id_list;
     GHashTable  *commit_hash;
     gboolean    fast_forward;
+    /* Commits are sent as ObjectPackZ. */
+    gboolean    compress;
 } SeafileSendcommitProcPriv;
 
 #define GET_PRIV(o)  \
@@ -105,6 +108,9 @@ send_commit_start (CcnetProcessor *processor, int argc, char **argv)
     buf = g_string_new (NULL);
     g_string_printf (buf, "remote %s seafile-recvcommit-v3 %s %s",
                      processor->peer_id, task->to_branch, task->session_token);
+    priv->compress = (task->protocol_version >= WIRE_COMPRESS_PROTO_VERSION);
+    if (priv->compress)
+        g_string_append (buf, " " WIRE_COMPRESS_ARG);
     ccnet_processor_send_request (processor, buf->str);
     g_string_free (buf, TRUE);
 
@@ -114,6 +120,8 @@ send_commit_start (CcnetProcessor *processor, int argc, char **argv)
 static void
 send_commit (CcnetProcessor *processor, const char *object_id)
 {
+    USE_PRIV;
+    TransferTask *task = ((SeafileSendcommitV3Proc *)processor)->tx_task;
     char *data;
     int len;
     ObjectPack *pack = NULL;
@@ -125,10 +133,8 @@ send_commit (CcnetProcessor *processor, const char *object_id)
         goto fail;
     }
 
-    pack_size = sizeof(ObjectPack) + len;
-    pack = malloc (pack_size);
-    memcpy (pack->id, object_id, 41);
-    memcpy (pack->object, data, len);
+    pack = object_pack_new (object_id, data, len, priv->compress, &pack_size);
+    transfer_task_add_tx_stats (task, sizeof(ObjectPack) + len, pack_size);
 
     ccnet_processor_send_update (processor, SC_OBJECT, SS_OBJECT,
                                  (char *)pack, pack_size);
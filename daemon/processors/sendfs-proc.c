@@ -43,6 +43,7 @@
 #include "commit-mgr.h"
 #include "fs-mgr.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "sendfs-proc.h"
 
 enum {
@@ -61,7 +62,12 @@ static void handle_response (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
-    /* FILL IT */
+    SeafileSendfsProc *proc = (SeafileSendfsProc *)processor;
+
+    if (proc->push_objects) {
+        object_list_free (proc->push_objects);
+        proc->push_objects = NULL;
+    }
 
     CCNET_PROCESSOR_CLASS (seafile_sendfs_proc_parent_class)->release_resource (processor);
 }
@@ -84,6 +90,42 @@ seafile_sendfs_proc_init (SeafileSendfsProc *processor)
 }
 
 
+/*
+ * In push mode, the objects which are not in the remote head are sent
+ * without being asked for. Returns NULL if push mode can't be used.
+ */
+static ObjectList *
+collect_push_objects (TransferTask *task)
+{
+    SeafCommit *base;
+    ObjectList *ol, *roots = task->fs_roots;
+    char *root_id;
+    int i;
+
+    if (task->protocol_version < FS_PUSH_PROTO_VERSION ||
+        task->remote_head[0] == 0)
+        return NULL;
+
+    base = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                           task->remote_head);
+    if (!base)
+        return NULL;
+
+    ol = object_list_new ();
+    for (i = 0; i < object_list_length (roots); ++i) {
+        root_id = g_ptr_array_index (roots->obj_ids, i);
+        if (seaf_fs_manager_diff_fs_objects (seaf->fs_mgr, root_id,
+                                             base->root_id, ol) < 0) {
+            object_list_free (ol);
+            ol = NULL;
+            break;
+        }
+    }
+
+    seaf_commit_unref (base);
+    return ol;
+}
+
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
@@ -94,6 +136,15 @@ start (CcnetProcessor *processor, int argc, char **argv)
     buf = g_string_new (NULL);
     g_string_printf (buf, "remote %s seafile-recvfs %s", 
                      processor->peer_id, task->session_token);
+    proc->push_objects = collect_push_objects (task);
+    if (proc->push_objects) {
+        seaf_debug ("Push %d fs objects.\n",
+                    object_list_length (proc->push_objects));
+        g_string_append (buf, " " FS_PUSH_ARG);
+    }
+    proc->compress = (task->protocol_version >= WIRE_COMPRESS_PROTO_VERSION);
+    if (proc->compress)
+        g_string_append (buf, " " WIRE_COMPRESS_ARG);
     ccnet_processor_send_request (processor, buf->str);
     g_string_free (buf, TRUE);
 
@@ -106,6 +157,7 @@ start (CcnetProcessor *processor, int argc, char **argv)
 static gboolean
 send_fs_object (CcnetProcessor *processor, char *object_id)
 {
+    SeafileSendfsProc *proc = (SeafileSendfsProc *)processor;
     char *data;
     int len;
     ObjectPack *pack = NULL;
@@ -117,10 +169,8 @@ send_fs_object (CcnetProcessor *processor, char *object_id)
         goto fail;
     }
 
-    pack_size = sizeof(ObjectPack) + len;
-    pack = malloc (pack_size);
-    memcpy (pack->id, object_id, 41);
-    memcpy (pack->object, data, len);
+    pack = object_pack_new (object_id, data, len, proc->compress, &pack_size);
+    transfer_task_add_tx_stats (proc->tx_task, sizeof(ObjectPack) + len, pack_size);
 
     if (pack_size <= MAX_OBJ_SEG_SIZE) {
         ccnet_processor_send_update (processor, SC_OBJECT, SS_OBJECT,
@@ -187,6 +237,32 @@ send_fs_objects (CcnetProcessor *processor, char *content, int clen)
     }
 }
 
+/* Push mode: send objects until the window is full. */
+static void
+push_fs_objects (CcnetProcessor *processor)
+{
+    SeafileSendfsProc *proc = (SeafileSendfsProc *)processor;
+    ObjectList *ol = proc->push_objects;
+    int ollen = object_list_length (ol);
+
+    if (proc->sent_end)
+        return;
+
+    while (proc->push_idx < ollen && proc->n_unacked < FS_PUSH_WINDOW) {
+        if (!send_fs_object (processor,
+                             g_ptr_array_index (ol->obj_ids, proc->push_idx)))
+            return;
+        ++(proc->push_idx);
+        ++(proc->n_unacked);
+    }
+
+    /* Also reached right away when there's nothing to push. */
+    if (proc->push_idx == ollen) {
+        ccnet_processor_send_update (processor, SC_END, SS_END, NULL, 0);
+        proc->sent_end = TRUE;
+    }
+}
+
 static void
 send_fs_roots (CcnetProcessor *processor)
 {
@@ -201,6 +277,8 @@ send_fs_roots (CcnetProcessor *processor)
         ccnet_processor_send_update (processor, SC_ROOT_END, SS_ROOT_END,
                                      NULL, 0);
         processor->state = SEND_OBJECT;
+        if (proc->push_objects)
+            push_fs_objects (processor);
         return;
     }
 
@@ -237,6 +315,10 @@ handle_response (CcnetProcessor *processor,
         if (strncmp(code, SC_GET_OBJECT, 3) == 0) {
             send_fs_objects (processor, content, clen);
             return;
+        } else if (proc->push_objects && strncmp(code, SC_ACK, 3) == 0) {
+            proc->n_unacked -= FS_PUSH_BATCH;
+            push_fs_objects (processor);
+            return;
         } else if (strncmp(code, SC_END, 3) == 0) {
             seaf_debug ("Send fs objects end.\n");
             ccnet_processor_done (processor, TRUE);
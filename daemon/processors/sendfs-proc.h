@@ -22,6 +22,13 @@ struct _SeafileSendfsProc {
 
     TransferTask  *tx_task;
     int last_idx;               /* used in send root fs to peer */
+    gboolean compress;          /* objects are sent as ObjectPackZ */
+
+    /* Push mode, see objecttx-common.h. NULL in the normal mode. */
+    ObjectList *push_objects;
+    int push_idx;
+    int n_unacked;
+    gboolean sent_end;
 };
 
 struct _SeafileSendfsProcClass {
@@ -336,10 +336,17 @@ should_ignore(const char *filename, void *data)
 static int
 index_cb (const char *path,
           unsigned char sha1[],
-          SeafileCrypt *crypt)
+          SeafileCrypt *crypt,
+          const unsigned char *base_sha1)
 {
-    /* Check in blocks and get object ID. */
-    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, path, sha1, crypt) < 0) {
+    char base_id[41];
+
+    /* Check in blocks and get object ID. Blocks of the version in the
+     * index are reused. */
+    if (base_sha1)
+        rawdata_to_hex (base_sha1, base_id, 20);
+    if (seaf_fs_manager_index_blocks_with_base (seaf->fs_mgr, path, sha1, crypt,
+                                                base_sha1 ? base_id : NULL) < 0) {
         g_warning ("Failed to index file %s.\n", path);
         return -1;
     }
@@ -454,22 +461,30 @@ is_empty_dir (const char *path)
     return (n == 0);
 }
 
+/*
+ * Mark entries under @prefix which are gone from the worktree. Entries are
+ * sorted by name, so the ones under @prefix are found by binary search.
+ */
 static void
-remove_deleted (struct index_state *istate, const char *worktree, const char *prefix)
+mark_deleted (struct index_state *istate, const char *worktree, const char *prefix)
 {
     struct cache_entry **ce_array = istate->cache;
     struct cache_entry *ce;
     char path[PATH_MAX];
-    unsigned int i;
+    int i;
     int len = strlen(prefix);
     struct stat st;
     int ret;
 
-    for (i = 0; i < istate->cache_nr; ++i) {
+    i = index_name_pos (istate, prefix, len);
+    if (i < 0)
+        i = -i - 1;
+
+    for (; i < istate->cache_nr; ++i) {
         ce = ce_array[i];
         /* Only check entries under 'prefix'. */
         if (strncmp (ce->name, prefix, len) != 0)
-            continue;
+            break;
         snprintf (path, PATH_MAX, "%s/%s", worktree, ce->name);
         ret = g_lstat (path, &st);
 
@@ -481,12 +496,75 @@ remove_deleted (struct index_state *istate, const char *worktree, const char *pr
                 ce_array[i]->ce_flags |= CE_REMOVE;
         }
     }
+}
 
+static void
+remove_deleted (struct index_state *istate, const char *worktree, const char *prefix)
+{
+    mark_deleted (istate, worktree, prefix);
     remove_marked_cache_entries (istate);
 }
 
-int
-seaf_repo_index_add (SeafRepo *repo, const char *path)
+/* Paths under an ignored dir are ignored too. */
+static gboolean
+path_should_ignore (const char *path)
+{
+    char **parts, **p;
+    gboolean ret = FALSE;
+
+    parts = g_strsplit (path, "/", 0);
+    for (p = parts; *p != NULL; ++p) {
+        if (**p != '\0' && should_ignore (*p, NULL)) {
+            ret = TRUE;
+            break;
+        }
+    }
+    g_strfreev (parts);
+
+    return ret;
+}
+
+/*
+ * Only check the changed @paths, instead of the whole worktree.
+ * A new dir is added with everything in it. When a file is added
+ * under a dir which was an empty dir entry, the dir entry is replaced
+ * by add_to_index().
+ */
+static int
+add_dirty_paths (struct index_state *istate,
+                 const char *worktree,
+                 GList *paths,
+                 SeafileCrypt *crypt)
+{
+    GList *ptr;
+    const char *path;
+    char *full_path;
+    struct stat st;
+    int ret = 0;
+
+    for (ptr = paths; ptr != NULL; ptr = ptr->next) {
+        path = ptr->data;
+        if (path_should_ignore (path))
+            continue;
+
+        full_path = g_build_path (PATH_SEPERATOR, worktree, path, NULL);
+        if (g_lstat (full_path, &st) == 0 &&
+            add_recursive (istate, worktree, path, crypt, TRUE) < 0) {
+            g_free (full_path);
+            ret = -1;
+            break;
+        }
+        g_free (full_path);
+
+        mark_deleted (istate, worktree, path);
+    }
+
+    remove_marked_cache_entries (istate);
+    return ret;
+}
+
+static int
+index_add_common (SeafRepo *repo, const char *path, GList *paths)
 {
     SeafRepoManager *mgr = repo->manager;
     char index_path[PATH_MAX];
@@ -518,18 +596,23 @@ seaf_repo_index_add (SeafRepo *repo, const char *path)
         return -1;
     }
 
-    /* Skip any leading '/'. */
-    while (path[0] == '/')
-        path = &path[1];
-
     if (repo->encrypted) {
         crypt = seafile_crypt_new (repo->enc_version, repo->enc_key, repo->enc_iv);
     }
 
-    if (add_recursive (&istate, repo->worktree, path, crypt, TRUE) < 0)
-        goto error;
+    if (path) {
+        /* Skip any leading '/'. */
+        while (path[0] == '/')
+            path = &path[1];
 
-    remove_deleted (&istate, repo->worktree, path);
+        if (add_recursive (&istate, repo->worktree, path, crypt, TRUE) < 0)
+            goto error;
+
+        remove_deleted (&istate, repo->worktree, path);
+    } else {
+        if (add_dirty_paths (&istate, repo->worktree, paths, crypt) < 0)
+            goto error;
+    }
 
     if (update_index (&istate, index_path) < 0)
         goto error;
@@ -545,6 +628,18 @@ error:
     return -1;
 }
 
+int
+seaf_repo_index_add (SeafRepo *repo, const char *path)
+{
+    return index_add_common (repo, path, NULL);
+}
+
+int
+seaf_repo_index_add_paths (SeafRepo *repo, GList *paths)
+{
+    return index_add_common (repo, NULL, paths);
+}
+
 /*
  * Add the files in @worktree to index and return the corresponding
  * @root_id. The repo doesn't have to exist.
@@ -106,6 +106,13 @@ seaf_repo_verify_passwd (SeafRepo *repo, const char *passwd);
 int
 seaf_repo_index_add (SeafRepo *repo, const char *path);
 
+/*
+ * Like seaf_repo_index_add(), but only check @paths, which are relative
+ * to the worktree. Used when the worktree monitor knows what has changed.
+ */
+int
+seaf_repo_index_add_paths (SeafRepo *repo, GList *paths);
+
 int
 seaf_repo_index_worktree_files (const char *repo_id,
                                 const char *worktree,
@@ -828,17 +828,24 @@ check_net_state (void *data)
 struct CommitResult {
     SyncTask *task;
     gboolean changed;
+
+    /* Paths changed since the last commit, taken from the worktree
+     * monitor in commit_repo(). If @paths_known is FALSE, the whole
+     * worktree is scanned.
+     */
+    gboolean paths_known;
+    GList *dirty_paths;
+    gboolean add_failed;
 };
 
 static void *
-commit_job (void *vtask)
+commit_job (void *vres)
 {
-    SyncTask *task = vtask;
+    struct CommitResult *res = vres;
+    SyncTask *task = res->task;
     SeafRepo *repo = task->repo;
-    struct CommitResult *res = g_new0 (struct CommitResult, 1);
     GError *error = NULL;
-
-    res->task = task;
+    int ret;
 
     if (repo->delete_pending)
         return res;
@@ -868,9 +875,17 @@ commit_job (void *vtask)
         }
     }
 
-    if (seaf_repo_index_add (repo, "") < 0) {
+    /* Only check the paths reported by the worktree monitor, if it
+     * knows all the changes. */
+    if (res->paths_known)
+        ret = seaf_repo_index_add_paths (repo, res->dirty_paths);
+    else
+        ret = seaf_repo_index_add (repo, "");
+
+    if (ret < 0) {
         seaf_warning ("[Sync mgr] Failed to add in repo %s(%.8s).\n",
                       repo->name, repo->id);
+        res->add_failed = TRUE;
         goto out;
     }
 
@@ -890,22 +905,38 @@ out:
     return res;
 }
 
+static void
+commit_result_free (struct CommitResult *res)
+{
+    string_list_free (res->dirty_paths);
+    g_free (res);
+}
+
 static void
 commit_job_done (void *vres)
 {
     struct CommitResult *res = vres;
     SeafRepo *repo = res->task->repo;
+    WTStatus *status;
+
+    if (res->add_failed) {
+        /* The changes taken from the monitor are not in the index. */
+        status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor,
+                                                      repo->id);
+        if (status)
+            wt_status_set_full_scan (status);
+    }
 
     if (repo->delete_pending) {
         seaf_repo_manager_del_repo (seaf->repo_mgr, repo);
         transition_sync_state (res->task, SYNC_STATE_CANCELED);
-        g_free (res);
+        commit_result_free (res);
         return;
     }
 
     if (res->task->state == SYNC_STATE_CANCEL_PENDING) {
         transition_sync_state (res->task, SYNC_STATE_CANCELED);
-        g_free (res);
+        commit_result_free (res);
         return;
     }
 
@@ -940,18 +971,33 @@ commit_job_done (void *vres)
     } else 
         start_sync_repo_proc (res->task->mgr, res->task);
 
-    g_free (res);
+    commit_result_free (res);
 }
 
 static void
 commit_repo (SyncTask *task)
 {
+    struct CommitResult *res = g_new0 (struct CommitResult, 1);
+    WTStatus *status;
+
     transition_sync_state (task, SYNC_STATE_COMMIT);
 
+    res->task = task;
+
+    /* Take the changed paths here rather than in the job thread. The
+     * status belongs to the monitor and is freed when the repo is
+     * unwatched, so it is only used from the main thread.
+     */
+    status = seaf_wt_monitor_get_worktree_status (seaf->wt_monitor,
+                                                  task->repo->id);
+    if (status)
+        res->paths_known = wt_status_take_dirty_paths (status,
+                                                       &res->dirty_paths);
+
     ccnet_job_manager_schedule_job (seaf->job_mgr, 
                                     commit_job, 
                                     commit_job_done,
-                                    task);
+                                    res);
 }
 
 #define GET_EMAIL_TOKEN_IN_PROGRESS 1
@@ -1333,7 +1379,10 @@ auto_commit_pulse (void *vmanager)
                         status->last_check = now;
                     }
                 } else if (now - status->last_check >= manager->wt_interval) {
-                    /* Try to commit if no change has been detected in 10 mins. */
+                    /* Try to commit if no change has been detected in 10 mins.
+                     * Scan the whole worktree in case some events were missed.
+                     */
+                    wt_status_set_full_scan (status);
                     enqueue_sync_task (manager, repo);
                     status->last_check = now;
                 }
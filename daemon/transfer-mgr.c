@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <ccnet.h>
 #include "utils.h"
@@ -27,6 +28,8 @@
 #include "vc-utils.h"
 #include "gc.h"
 #include "mq-mgr.h"
+#include "seafile-config.h"
+#include "block-credit.h"
 
 #include "processors/check-tx-v2-proc.h"
 #include "processors/getcommit-proc.h"
@@ -50,6 +53,16 @@
 
 #define DEFAULT_BLOCK_SIZE  (1 << 20)
 
+#define DEFAULT_MAX_CONNS       4
+#define MAX_CONNS_LIMIT         16
+/* Seconds over which the rate is measured before adding a connection. */
+#define CONN_ADJUST_PERIOD      5
+/* A new connection is kept only if the rate improves by 1/CONN_MIN_GAIN. */
+#define CONN_MIN_GAIN           10
+
+/* Longest sleep of a worker thread in one throttle round, in usec. */
+#define MAX_THROTTLE_WAIT       100000
+
 static int schedule_task_pulse (void *vmanager);
 static void free_task_resources (TransferTask *task);
 static void state_machine_tick (TransferTask *task);
@@ -188,8 +201,8 @@ seaf_transfer_task_new (SeafTransferManager *manager,
     task->from_branch = g_strdup(from_branch);
     task->to_branch = g_strdup(to_branch);
     task->token = g_strdup(token);
-    task->processors = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                              g_free, NULL);
+    task->processors = g_hash_table_new (g_direct_hash, g_direct_equal);
+    task->n_conns = 1;
     if (!tx_id) {
         uuid = gen_uuid();
         memcpy (task->tx_id, uuid, 37);
@@ -229,53 +242,58 @@ transfer_task_get_rate (TransferTask *task)
     return (double) g_atomic_int_get (&task->tx_bytes);
 }
 
+void
+transfer_task_add_tx_stats (TransferTask *task, int raw_bytes, int wire_bytes)
+{
+    task->raw_bytes += raw_bytes;
+    task->wire_bytes += wire_bytes;
+}
+
 static BlockList *
 load_blocklist_with_local_history (TransferTask *task)
 {
-    BlockList *bl1, *bl2, *bl = NULL;
+    BlockList *bl;
     ObjectList *roots = task->fs_roots;
+    SeafCommit *base = NULL;
     char *root_id;
-    int i;
+    int i, ret;
 
     /* Best effort to reduce block list size. This can effectively
      * reduce the I/O load on the server.
      */
     /* Upload the blocks pointed by new commits, excluding
      * blocks pointed by remote head (if server has this repo).
+     * Only the parts of the trees which differ from remote head
+     * are traversed. The server has all the blocks of remote head,
+     * and it tells us which other blocks it has already.
      */
-    bl1 = block_list_new ();
-    for (i = 0; i < roots->obj_ids->len; ++i) {
-        root_id = g_ptr_array_index (roots->obj_ids, i);
-        if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
-                                                root_id, bl1) < 0) {
-            block_list_free (bl1);
+    if (task->remote_head[0] != 0) {
+        base = seaf_commit_manager_get_commit (seaf->commit_mgr,
+                                               task->remote_head);
+        if (!base)
             return NULL;
-        }
     }
 
-    if (task->remote_head[0] != 0) {
-        SeafCommit *base = seaf_commit_manager_get_commit (seaf->commit_mgr,
-                                                           task->remote_head);
-        if (!base) {
-            block_list_free (bl1);
-            return NULL;
-        }
-        bl2 = block_list_new ();
-        if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr, 
-                                                base->root_id, bl2) < 0) {
-            seaf_commit_unref (base);
-            block_list_free (bl1);
-            block_list_free (bl2);
-            return NULL;
+    bl = block_list_new ();
+    for (i = 0; i < roots->obj_ids->len; ++i) {
+        root_id = g_ptr_array_index (roots->obj_ids, i);
+        if (base)
+            ret = seaf_fs_manager_populate_blocklist_diff (seaf->fs_mgr,
+                                                           root_id,
+                                                           base->root_id,
+                                                           bl);
+        else
+            ret = seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
+                                                      root_id, bl);
+        if (ret < 0) {
+            block_list_free (bl);
+            bl = NULL;
+            break;
         }
-        bl = block_list_difference (bl1, bl2);
-        seaf_commit_unref (base);
-        block_list_free (bl1);
-        block_list_free (bl2);
-    } else {
-        bl = bl1;
     }
 
+    if (base)
+        seaf_commit_unref (base);
     return bl;
 }
 
@@ -513,6 +531,77 @@ inline static gboolean is_peer_relay (const char *peer_id)
     return is_relay;
 }
 
+/*
+ * Rate limiter.
+ *
+ * A token bucket shared by all the tasks in one direction. The worker
+ * threads take tokens for the bytes they have transferred. The bucket
+ * may go into debt after a large write, then the following transfers
+ * wait until the debt is paid.
+ */
+
+struct RateLimiter {
+    pthread_mutex_t lock;
+    gint64          rate;           /* bytes per second, 0 if unlimited */
+    gint64          tokens;
+    gint64          last_refill;    /* in usec */
+};
+
+static struct RateLimiter *
+rate_limiter_new ()
+{
+    struct RateLimiter *limiter = g_new0 (struct RateLimiter, 1);
+
+    pthread_mutex_init (&limiter->lock, NULL);
+    return limiter;
+}
+
+static void
+rate_limiter_set_rate (struct RateLimiter *limiter, int rate)
+{
+    pthread_mutex_lock (&limiter->lock);
+    limiter->rate = MAX (rate, 0);
+    limiter->tokens = 0;
+    limiter->last_refill = get_current_time ();
+    pthread_mutex_unlock (&limiter->lock);
+}
+
+/* Must be called with the lock held. At most one second of tokens is kept. */
+static void
+rate_limiter_refill (struct RateLimiter *limiter)
+{
+    gint64 now = get_current_time ();
+
+    if (now > limiter->last_refill)
+        limiter->tokens += (now - limiter->last_refill) * limiter->rate / 1000000;
+    limiter->tokens = MIN (limiter->tokens, limiter->rate);
+    limiter->last_refill = now;
+}
+
+static void
+rate_limiter_consume (struct RateLimiter *limiter, int bytes)
+{
+    gint64 wait;
+
+    pthread_mutex_lock (&limiter->lock);
+
+    while (limiter->rate > 0) {
+        rate_limiter_refill (limiter);
+        if (limiter->tokens >= 0) {
+            limiter->tokens -= bytes;
+            break;
+        }
+
+        /* The rate may be changed while we're sleeping. */
+        wait = -limiter->tokens * 1000000 / limiter->rate;
+        pthread_mutex_unlock (&limiter->lock);
+        g_usleep (CLAMP (wait, 1000, MAX_THROTTLE_WAIT));
+        pthread_mutex_lock (&limiter->lock);
+    }
+
+    pthread_mutex_unlock (&limiter->lock);
+}
+
 /*
  * Transfer Manager.
  */
@@ -530,6 +619,10 @@ seaf_transfer_manager_new (struct _SeafileSession *seaf)
                                                (GDestroyNotify) g_free,
                                                (GDestroyNotify) seaf_transfer_task_free);
 
+    mgr->max_conns = DEFAULT_MAX_CONNS;
+    mgr->upload_limiter = rate_limiter_new ();
+    mgr->download_limiter = rate_limiter_new ();
+
     char *db_path = g_build_path (PATH_SEPERATOR, seaf->seaf_dir, TRANSFER_DB, NULL);
     if (sqlite_open_db (db_path, &mgr->db) < 0) {
         g_critical ("[Transfer mgr] Failed to open transfer db\n");
@@ -599,6 +692,58 @@ static void register_processors (CcnetClient *client)
                                            SEAFILE_TYPE_SENDCOMMIT_V3_PROC);
 }
 
+void
+seaf_transfer_manager_set_upload_rate_limit (SeafTransferManager *manager,
+                                             int limit)
+{
+    rate_limiter_set_rate (manager->upload_limiter, limit);
+}
+
+void
+seaf_transfer_manager_set_download_rate_limit (SeafTransferManager *manager,
+                                               int limit)
+{
+    rate_limiter_set_rate (manager->download_limiter, limit);
+}
+
+void
+seaf_transfer_manager_set_max_data_connections (SeafTransferManager *manager,
+                                                int max_conns)
+{
+    manager->max_conns = CLAMP (max_conns, 1, MAX_CONNS_LIMIT);
+}
+
+void
+seaf_transfer_manager_throttle (SeafTransferManager *manager,
+                                int task_type,
+                                int bytes)
+{
+    if (task_type == TASK_TYPE_UPLOAD)
+        rate_limiter_consume (manager->upload_limiter, bytes);
+    else
+        rate_limiter_consume (manager->download_limiter, bytes);
+}
+
+static void
+load_transfer_config (SeafTransferManager *manager)
+{
+    gboolean exists;
+    int value;
+
+    value = seafile_session_config_get_int (seaf, KEY_UPLOAD_LIMIT, &exists);
+    if (exists)
+        seaf_transfer_manager_set_upload_rate_limit (manager, value);
+
+    value = seafile_session_config_get_int (seaf, KEY_DOWNLOAD_LIMIT, &exists);
+    if (exists)
+        seaf_transfer_manager_set_download_rate_limit (manager, value);
+
+    value = seafile_session_config_get_int (seaf, KEY_MAX_DATA_CONNECTIONS,
+                                            &exists);
+    if (exists)
+        seaf_transfer_manager_set_max_data_connections (manager, value);
+}
+
 int
 seaf_transfer_manager_start (SeafTransferManager *manager)
 {
@@ -611,6 +756,8 @@ seaf_transfer_manager_start (SeafTransferManager *manager)
 
     register_processors (seaf->session);
 
+    load_transfer_config (manager);
+
     manager->schedule_timer = ccnet_timer_new (schedule_task_pulse, manager,
                                                SCHEDULE_INTERVAL * 1000);
 
@@ -913,7 +1060,7 @@ tx_done_cb (CcnetProcessor *processor, gboolean success, void *data)
         /* Otherwise processs exits successfully, or the error is
          * recoverable, restart processor later. 
          */
-        g_hash_table_remove (task->processors, processor->peer_id);
+        g_hash_table_remove (task->processors, processor);
     }
 }
 
@@ -1044,6 +1191,22 @@ start_getfs_proc (TransferTask *task, const char *peer_id, GCallback done_cb)
  * tolerated. We'll continuously retry.
  */
 
+static int
+count_peer_processors (TransferTask *task, const char *peer_id)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    int n = 0;
+
+    g_hash_table_iter_init (&iter, task->processors);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (strcmp (((CcnetProcessor *)value)->peer_id, peer_id) == 0)
+            ++n;
+    }
+
+    return n;
+}
+
 static void
 download_dispatch_blocks_to_processor (TransferTask *task,
                                        SeafileGetblockV2Proc *proc,
@@ -1056,7 +1219,10 @@ download_dispatch_blocks_to_processor (TransferTask *task,
     if (!seafile_getblock_v2_proc_is_ready (proc))
         return;
 
-    expected = MIN (proc->block_bitmap.bitCount/n_procs, MAX_QUEUED_BLOCKS);
+    /* At least one block per processor, or a processor with nothing
+     * pending is never given any and the transfer stalls. */
+    expected = MIN (MAX (1, proc->block_bitmap.bitCount/n_procs),
+                    proc->version == 3 ? BLOCK_V3_MAX_QUEUED : MAX_QUEUED_BLOCKS);
     n_blocks = expected - proc->pending_blocks;
     if (n_blocks <= 0)
         return;
@@ -1103,14 +1269,15 @@ start_chunk_server_download (TransferTask *task)
     GList *ptr = task->chunk_servers;
     const char *cs_id;
     CcnetProcessor *processor;
+    int n;
 
     while (ptr) {
         cs_id = ptr->data;
-        if (!g_hash_table_lookup (task->processors, cs_id)) {
+        for (n = count_peer_processors (task, cs_id); n < task->n_conns; ++n) {
             processor = start_getblock_proc (task, cs_id);
-            if (processor != NULL) {
-                g_hash_table_insert (task->processors, g_strdup(cs_id), processor);
-            }
+            if (processor == NULL)
+                break;
+            g_hash_table_insert (task->processors, processor, processor);
         }
         ptr = ptr->next;
     }
@@ -1660,14 +1827,15 @@ start_chunk_server_upload (TransferTask *task)
     GList *ptr = task->chunk_servers;
     const char *cs_id;
     CcnetProcessor *processor;
+    int n;
 
     while (ptr) {
         cs_id = ptr->data;
-        if (!g_hash_table_lookup (task->processors, cs_id)) {
+        for (n = count_peer_processors (task, cs_id); n < task->n_conns; ++n) {
             processor = start_sendblock_proc (task, cs_id);
-            if (processor != NULL) {
-                g_hash_table_insert (task->processors, g_strdup(cs_id), processor);
-            }
+            if (processor == NULL)
+                break;
+            g_hash_table_insert (task->processors, processor, processor);
         }
         ptr = ptr->next;
     }
@@ -1685,7 +1853,10 @@ upload_dispatch_blocks_to_processor (TransferTask *task,
     if (!seafile_sendblock_v2_proc_is_ready (proc))
         return;
 
-    expected = MIN (task->uploaded.bitCount/n_procs, MAX_QUEUED_BLOCKS);
+    /* At least one block per processor, or a processor with nothing
+     * pending is never given any and the transfer stalls. */
+    expected = MIN (MAX (1, task->uploaded.bitCount/n_procs),
+                    proc->version == 3 ? BLOCK_V3_MAX_QUEUED : MAX_QUEUED_BLOCKS);
     n_blocks = expected - proc->pending_blocks;
     if (n_blocks <= 0)
         return;
@@ -1726,6 +1897,30 @@ upload_dispatch_blocks (TransferTask *task)
     }
 }
 
+void
+transfer_task_dispatch_blocks (TransferTask *task, CcnetProcessor *processor)
+{
+    guint n_procs = g_hash_table_size (task->processors);
+    int pending;
+
+    if (task->runtime_state != TASK_RT_STATE_DATA || n_procs == 0)
+        return;
+
+    if (task->type == TASK_TYPE_UPLOAD)
+        pending = ((SeafileSendblockV2Proc *)processor)->pending_blocks;
+    else
+        pending = ((SeafileGetblockV2Proc *)processor)->pending_blocks;
+    if (!block_queue_refill_due (pending))
+        return;
+
+    if (task->type == TASK_TYPE_UPLOAD)
+        upload_dispatch_blocks_to_processor (
+            task, (SeafileSendblockV2Proc *)processor, n_procs);
+    else
+        download_dispatch_blocks_to_processor (
+            task, (SeafileGetblockV2Proc *)processor, n_procs);
+}
+
 static void
 update_branch_cb (CcnetProcessor *processor, gboolean success, void *data)
 {
@@ -2007,6 +2202,53 @@ send_transfer_message (GList *tasks)
     g_string_free (buf, TRUE);
 }
 
+/*
+ * Open one more data connection to each chunk server as long as that
+ * makes the transfer faster. A single TCP connection can't fill a link
+ * with a large bandwidth-delay product.
+ *
+ * The rate is measured over CONN_ADJUST_PERIOD seconds for the current
+ * number of connections. If the last connection added didn't improve
+ * the rate by at least 1/CONN_MIN_GAIN, we stop growing.
+ */
+static void
+adjust_data_connections (TransferTask *task, int tx_bytes)
+{
+    int max_conns = task->manager->max_conns;
+    gint64 rate;
+
+    if (task->n_conns > max_conns)
+        task->n_conns = max_conns;
+
+    if (task->state != TASK_STATE_NORMAL ||
+        task->runtime_state != TASK_RT_STATE_DATA ||
+        task->conns_tuned || task->n_conns >= max_conns)
+        return;
+
+    task->period_bytes += tx_bytes;
+    if (++(task->period_ticks) < CONN_ADJUST_PERIOD)
+        return;
+
+    rate = task->period_bytes / task->period_ticks;
+    task->period_bytes = 0;
+    task->period_ticks = 0;
+
+    /* Stalled, more connections won't help. */
+    if (rate == 0)
+        return;
+
+    if (task->period_rate > 0 &&
+        rate < task->period_rate + task->period_rate / CONN_MIN_GAIN) {
+        seaf_debug ("Transfer repo %.8s: %d data connections.\n",
+                    task->repo_id, task->n_conns);
+        task->conns_tuned = TRUE;
+        return;
+    }
+
+    task->period_rate = rate;
+    ++(task->n_conns);
+}
+
 static int
 schedule_task_pulse (void *vmanager)
 {
@@ -2050,12 +2292,14 @@ schedule_task_pulse (void *vmanager)
     g_hash_table_iter_init (&iter, mgr->download_tasks);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         task = value;
+        adjust_data_connections (task, g_atomic_int_get (&task->tx_bytes));
         g_atomic_int_set (&task->tx_bytes, 0);
     }
 
     g_hash_table_iter_init (&iter, mgr->upload_tasks);
     while (g_hash_table_iter_next (&iter, &key, &value)) {
         task = value;
+        adjust_data_connections (task, g_atomic_int_get (&task->tx_bytes));
         g_atomic_int_set (&task->tx_bytes, 0);
     }
 
@@ -6,6 +6,7 @@
 #include <glib.h>
 #include <ccnet/timer.h>
 #include <ccnet/peer.h>
+#include <ccnet/processor.h>
 
 #include "bitfield.h"
 #include "object-list.h"
@@ -103,17 +104,30 @@ typedef struct {
     ObjectList  *fs_roots;      /* the root of file systems to be sent/get */
 
     GList       *chunk_servers;
-    GHashTable  *processors;
+    GHashTable  *processors;    /* block tx processors, keyed by themselves */
     BlockList   *block_list;
     Bitfield     active;
     gint         tx_bytes;      /* bytes transferred in the last second. */
 
+    /* Data connections opened to each chunk server. It's increased while
+     * that makes the transfer faster, see adjust_data_connections().
+     */
+    int          n_conns;
+    gboolean     conns_tuned;
+    gint64       period_bytes;
+    int          period_ticks;
+    gint64       period_rate;   /* rate of the last period with n_conns */
+
     /* Fields only used by upload task. */
     Bitfield     uploaded;
     int          n_uploaded;
 
     gint64       rsize;            /* size remain   */
     gint64       dsize;            /* size done     */
+
+    /* Objects and blocks transferred, before and after wire compression. */
+    gint64       raw_bytes;
+    gint64       wire_bytes;
 } TransferTask;
 
 const char *
@@ -128,6 +142,10 @@ task_error_str (int task_errno);
 double
 transfer_task_get_rate (TransferTask *task);
 
+/* Must be called in the main thread. */
+void
+transfer_task_add_tx_stats (TransferTask *task, int raw_bytes, int wire_bytes);
+
 void
 transfer_task_set_error (TransferTask *task, int error);
 
@@ -137,6 +155,13 @@ transfer_task_set_netdown (TransferTask *task);
 void
 transition_state_to_error (TransferTask *task, int task_errno);
 
+/*
+ * Queue more blocks to @processor, a sendblock or getblock processor
+ * of @task, if there is room in its window.
+ */
+void
+transfer_task_dispatch_blocks (TransferTask *task, CcnetProcessor *processor);
+
 /*
  * Transfer Manager
  */
@@ -151,6 +176,13 @@ struct _SeafTransferManager {
     GHashTable      *upload_tasks;
 
     CcnetTimer      *schedule_timer;
+
+    /* Upper limit of the data connections per chunk server. */
+    int              max_conns;
+
+    /* Shared by all the tasks, see seaf_transfer_manager_throttle(). */
+    struct RateLimiter *upload_limiter;
+    struct RateLimiter *download_limiter;
 };
 
 typedef struct _SeafTransferManager SeafTransferManager;
@@ -159,6 +191,31 @@ SeafTransferManager *seaf_transfer_manager_new (struct _SeafileSession *seaf);
 
 int seaf_transfer_manager_start (SeafTransferManager *manager);
 
+/*
+ * Set the rate limit of all uploads or downloads, in bytes per second.
+ * 0 means unlimited.
+ */
+void
+seaf_transfer_manager_set_upload_rate_limit (SeafTransferManager *manager,
+                                             int limit);
+
+void
+seaf_transfer_manager_set_download_rate_limit (SeafTransferManager *manager,
+                                               int limit);
+
+void
+seaf_transfer_manager_set_max_data_connections (SeafTransferManager *manager,
+                                                int max_conns);
+
+/*
+ * Called by the block tx worker threads after @bytes are transferred for
+ * a task of @task_type. Sleeps while the rate limit is exceeded.
+ */
+void
+seaf_transfer_manager_throttle (SeafTransferManager *manager,
+                                int task_type,
+                                int bytes);
+
 char *
 seaf_transfer_manager_add_download (SeafTransferManager *manager,
                                     const char *repo_id,
@@ -5,6 +5,7 @@
 #include "seafile-error.h"
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <glib/gstdio.h>
 
@@ -222,19 +223,22 @@ compare_file_content (const char *path, struct stat *st, const unsigned char *ce
     return hashcmp (sha1, ce_sha1);
 }
 
+/*
+ * Create the leading directories of @ce and handle directory entries.
+ * The path of the entry is returned in @path.
+ * Returns 1 if the entry is done, 0 if the file should be checked out.
+ */
 static int
-checkout_entry (struct cache_entry *ce,
-                struct unpack_trees_options *o,
-                gboolean recover_merge,
-                const char *conflict_suffix)
+prepare_checkout_entry (struct cache_entry *ce,
+                        struct unpack_trees_options *o,
+                        GHashTable *created_dirs,
+                        char *path)
 {
     int base_len = strlen(o->base);
     int len = ce_namelen(ce);
     int full_len;
-    char path[PATH_MAX];
     int offset;
     struct stat st;
-    char file_id[41];
 
     if (!len) {
         g_warning ("entry name should not be empty.\n");
@@ -255,13 +259,20 @@ checkout_entry (struct cache_entry *ce,
             break;
         path[offset] = 0;
 
-        if (g_lstat (path, &st) == 0 && S_ISDIR(st.st_mode))
+        /* Entries in the same dir are next to each other. */
+        if (g_hash_table_lookup (created_dirs, path))
+            continue;
+
+        if (g_lstat (path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            g_hash_table_insert (created_dirs, g_strdup(path), (gpointer)1);
             continue;
+        }
         
         if (ccnet_mkdir (path, 0777) < 0) {
             g_warning ("Failed to create directory %s.\n", path);
             return -1;
         }
+        g_hash_table_insert (created_dirs, g_strdup(path), (gpointer)1);
     }
     path[offset] = 0;
 
@@ -284,9 +295,23 @@ checkout_entry (struct cache_entry *ce,
         if (g_mkdir (path, 0777) < 0) {
             g_warning ("Failed to create empty dir %s.\n", path);
         }
-        return 0;
+        return 1;
     }
 
+    return 0;
+}
+
+/* May run in a worker thread. Only @ce is updated. */
+static int
+checkout_file_entry (struct cache_entry *ce,
+                     struct unpack_trees_options *o,
+                     const char *path,
+                     gboolean recover_merge,
+                     const char *conflict_suffix)
+{
+    struct stat st;
+    char file_id[41];
+
     if (!o->reset && g_lstat (path, &st) == 0 && S_ISREG(st.st_mode) &&
         (ce->ce_ctime.sec != st.st_ctime || ce->ce_mtime.sec != st.st_mtime))
     {
@@ -325,6 +350,108 @@ update_cache:
     return 0;
 }
 
+/*
+ * Files are checked out in a thread pool, while directories are created
+ * in the calling thread before the files in them are queued. Each file is
+ * written by one worker from start to end, and a worker only updates the
+ * stat info of its own cache entry, so the resulting index doesn't depend
+ * on the order the files are finished.
+ * At most CHECKOUT_MAX_PENDING files are queued, each worker holds one
+ * block in memory at a time.
+ */
+#define CHECKOUT_WORKERS 4
+#define CHECKOUT_MAX_PENDING (CHECKOUT_WORKERS * 16)
+
+typedef struct CheckoutScheduler {
+    struct unpack_trees_options *o;
+    gboolean        recover_merge;
+    int            *finished_entries;
+    GThreadPool    *tpool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             n_pending;
+    int             errs;
+} CheckoutScheduler;
+
+typedef struct CheckoutJob {
+    CheckoutScheduler  *sched;
+    struct cache_entry *ce;
+    char               *path;
+    char               *conflict_suffix;
+} CheckoutJob;
+
+static void
+entry_finished (CheckoutScheduler *sched)
+{
+    if (sched->finished_entries)
+        g_atomic_int_inc (sched->finished_entries);
+}
+
+static void
+checkout_worker (gpointer data, gpointer user_data)
+{
+    CheckoutJob *job = data;
+    CheckoutScheduler *sched = job->sched;
+    int ret;
+
+    ret = checkout_file_entry (job->ce, sched->o, job->path,
+                               sched->recover_merge, job->conflict_suffix);
+    entry_finished (sched);
+
+    pthread_mutex_lock (&sched->lock);
+    if (ret < 0)
+        sched->errs = 1;
+    sched->n_pending--;
+    pthread_cond_signal (&sched->cond);
+    pthread_mutex_unlock (&sched->lock);
+
+    g_free (job->path);
+    g_free (job->conflict_suffix);
+    g_free (job);
+}
+
+static void
+schedule_checkout (CheckoutScheduler *sched,
+                   struct cache_entry *ce,
+                   const char *path,
+                   char *conflict_suffix)
+{
+    CheckoutJob *job;
+
+    if (!sched->tpool) {
+        if (checkout_file_entry (ce, sched->o, path, sched->recover_merge,
+                                 conflict_suffix) < 0)
+            sched->errs = 1;
+        entry_finished (sched);
+        g_free (conflict_suffix);
+        return;
+    }
+
+    pthread_mutex_lock (&sched->lock);
+    while (sched->n_pending >= CHECKOUT_MAX_PENDING)
+        pthread_cond_wait (&sched->cond, &sched->lock);
+    sched->n_pending++;
+    pthread_mutex_unlock (&sched->lock);
+
+    job = g_new0 (CheckoutJob, 1);
+    job->sched = sched;
+    job->ce = ce;
+    job->path = g_strdup (path);
+    job->conflict_suffix = conflict_suffix;
+
+    g_thread_pool_push (sched->tpool, job, NULL);
+}
+
+static void
+wait_for_checkouts (CheckoutScheduler *sched)
+{
+    pthread_mutex_lock (&sched->lock);
+    while (sched->n_pending > 0)
+        pthread_cond_wait (&sched->cond, &sched->lock);
+    pthread_mutex_unlock (&sched->lock);
+}
+
 int
 update_worktree (struct unpack_trees_options *o,
                  gboolean recover_merge,
@@ -336,7 +463,12 @@ update_worktree (struct unpack_trees_options *o,
     int i;
     struct cache_entry *ce;
     char *conflict_suffix = NULL;
+    char path[PATH_MAX];
+    CheckoutScheduler sched;
+    GHashTable *created_dirs;
+    GError *error = NULL;
     int errs = 0;
+    int ret;
 
     for (i = 0; i < result->cache_nr; ++i) {
         ce = result->cache[i];
@@ -344,22 +476,60 @@ update_worktree (struct unpack_trees_options *o,
             errs |= unlink_entry (ce, o);
     }
 
+    memset (&sched, 0, sizeof(sched));
+    sched.o = o;
+    sched.recover_merge = recover_merge;
+    sched.finished_entries = finished_entries;
+    pthread_mutex_init (&sched.lock, NULL);
+    pthread_cond_init (&sched.cond, NULL);
+
+    sched.tpool = g_thread_pool_new (checkout_worker, NULL,
+                                     CHECKOUT_WORKERS, FALSE, &error);
+    if (error) {
+        /* Check out files one by one. */
+        g_warning ("Failed to create checkout thread pool: %s.\n",
+                   error->message);
+        g_clear_error (&error);
+        sched.tpool = NULL;
+    }
+
+    created_dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
     for (i = 0; i < result->cache_nr; ++i) {
         ce = result->cache[i];
-        if (ce->ce_flags & CE_UPDATE) {
-            if (conflict_head_id) {
-                conflict_suffix = get_last_changer_of_file (conflict_head_id,
-                                                            ce->name);
-                if (!conflict_suffix)
-                    conflict_suffix = g_strdup(default_conflict_suffix);
-            }
-            errs |= checkout_entry (ce, o, recover_merge, conflict_suffix);
-            g_free (conflict_suffix);
+        if (!(ce->ce_flags & CE_UPDATE)) {
+            entry_finished (&sched);
+            continue;
+        }
+
+        ret = prepare_checkout_entry (ce, o, created_dirs, path);
+        if (ret != 0) {
+            if (ret < 0)
+                errs = 1;
+            entry_finished (&sched);
+            continue;
         }
-        if (finished_entries)
-            *finished_entries = *finished_entries + 1;
+
+        conflict_suffix = NULL;
+        if (conflict_head_id) {
+            conflict_suffix = get_last_changer_of_file (conflict_head_id,
+                                                        ce->name);
+            if (!conflict_suffix)
+                conflict_suffix = g_strdup(default_conflict_suffix);
+        }
+        schedule_checkout (&sched, ce, path, conflict_suffix);
     }
 
+    if (sched.tpool) {
+        wait_for_checkouts (&sched);
+        g_thread_pool_free (sched.tpool, FALSE, TRUE);
+    }
+    errs |= sched.errs;
+
+    g_hash_table_destroy (created_dirs);
+    pthread_mutex_destroy (&sched.lock);
+    pthread_cond_destroy (&sched.cond);
+
     return errs != 0;
 }
 
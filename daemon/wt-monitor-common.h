@@ -3,6 +3,81 @@
 #ifndef WT_MONITOR_COMMON_H
 #define WT_MONITOR_COMMON_H
 
+WTStatus *
+wt_status_new (const char *repo_id)
+{
+    WTStatus *status = g_new0 (WTStatus, 1);
+
+    memcpy (status->repo_id, repo_id, 37);
+    pthread_mutex_init (&status->lock, NULL);
+    status->dirty_paths = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    /* Changes before the watch is added are not known. */
+    status->full_scan = TRUE;
+
+    return status;
+}
+
+void
+wt_status_free (WTStatus *status)
+{
+    if (!status)
+        return;
+    g_hash_table_destroy (status->dirty_paths);
+    pthread_mutex_destroy (&status->lock);
+    g_free (status);
+}
+
+void
+wt_status_add_dirty_path (WTStatus *status, const char *path)
+{
+    pthread_mutex_lock (&status->lock);
+
+    if (!status->full_scan) {
+        if (g_hash_table_size (status->dirty_paths) >= WT_MAX_DIRTY_PATHS) {
+            status->full_scan = TRUE;
+            g_hash_table_remove_all (status->dirty_paths);
+        } else if (!g_hash_table_lookup (status->dirty_paths, path)) {
+            g_hash_table_insert (status->dirty_paths, g_strdup(path), (gpointer)1);
+        }
+    }
+
+    pthread_mutex_unlock (&status->lock);
+}
+
+void
+wt_status_set_full_scan (WTStatus *status)
+{
+    pthread_mutex_lock (&status->lock);
+    status->full_scan = TRUE;
+    g_hash_table_remove_all (status->dirty_paths);
+    pthread_mutex_unlock (&status->lock);
+}
+
+gboolean
+wt_status_take_dirty_paths (WTStatus *status, GList **paths)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean ret;
+
+    pthread_mutex_lock (&status->lock);
+
+    ret = !status->full_scan;
+    if (ret) {
+        *paths = NULL;
+        g_hash_table_iter_init (&iter, status->dirty_paths);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            *paths = g_list_prepend (*paths, g_strdup((char *)key));
+    }
+    status->full_scan = FALSE;
+    g_hash_table_remove_all (status->dirty_paths);
+
+    pthread_mutex_unlock (&status->lock);
+
+    return ret;
+}
+
 SeafWTMonitor *
 seaf_wt_monitor_new (SeafileSession *seaf)
 {
@@ -13,7 +88,7 @@ seaf_wt_monitor_new (SeafileSession *seaf)
         (g_str_hash, g_str_equal, g_free, NULL);
 
     priv->status_hash = g_hash_table_new_full
-        (g_direct_hash, g_direct_equal, NULL, g_free);
+        (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)wt_status_free);
 
 #ifdef WIN32
     priv->buf_hash = g_hash_table_new_full
@@ -178,8 +253,7 @@ handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd)
         }
 
         g_hash_table_insert (priv->handle_hash, g_strdup(cmd->repo_id), (gpointer)(long)inotify_fd);
-        status = g_new0 (WTStatus, 1);
-        memcpy (status->repo_id, cmd->repo_id, 37);
+        status = wt_status_new (cmd->repo_id);
         g_hash_table_insert (priv->status_hash, (gpointer)(long)inotify_fd, status);
 
         seaf_debug ("[wt mon] add watch for repo %s\n", cmd->repo_id);
@@ -31,9 +31,14 @@ typedef struct WatchCommand {
 #define DIR_WATCH_MASK IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
 #define FILE_WATCH_MASK IN_MODIFY | IN_ATTRIB
 
+/* Room for many events, each is at most sizeof(inotify_event) + NAME_MAX + 1. */
+#define EVENT_BUF_SIZE (64 * 1024)
+
 struct SeafWTMonitorPriv {
     GHashTable *handle_hash;        /* repo_id -> inotify_fd (or handle) */
     GHashTable *status_hash;    /* inotify_df (or handle) -> wt status */
+    /* inotify_fd -> (watch descriptor -> path relative to worktree) */
+    GHashTable *watch_hash;
     ccnet_pipe_t cmd_pipe[2];
     ccnet_pipe_t res_pipe[2];
     fd_set read_fds;
@@ -42,12 +47,32 @@ struct SeafWTMonitorPriv {
 
 static void handle_watch_command (SeafWTMonitorPriv *priv, WatchCommand *cmd);
 
+/*
+ * If @status is not NULL, paths of new watches are marked dirty, since
+ * they may have been created or changed before the watch was added.
+ */
+static void
+record_watch (GHashTable *wd_paths, int wd, const char *path, int wt_len,
+              WTStatus *status)
+{
+    const char *rel = path + wt_len;
+
+    while (*rel == '/')
+        ++rel;
+    if (status && !g_hash_table_lookup (wd_paths, GINT_TO_POINTER(wd)))
+        wt_status_add_dirty_path (status, rel);
+    g_hash_table_replace (wd_paths, GINT_TO_POINTER(wd), g_strdup(rel));
+}
+
+/* @wt_len is the length of the worktree path, which @path starts with. */
 static int
-add_watch_recursive (int in_fd, char *path, int pathlen)
+add_watch_recursive (int in_fd, char *path, int pathlen,
+                     GHashTable *wd_paths, int wt_len, WTStatus *status)
 {
     struct stat st;
     DIR *dir;
     struct dirent *dent;
+    int wd;
 
     if (stat (path, &st) < 0) {
         seaf_warning ("[wt mon] fail to stat %s: %s\n", path, strerror(errno));
@@ -55,15 +80,19 @@ add_watch_recursive (int in_fd, char *path, int pathlen)
     }
 
     if (S_ISREG (st.st_mode)) {
-        if (inotify_add_watch (in_fd, path, (uint32_t)FILE_WATCH_MASK) < 0) {
+        wd = inotify_add_watch (in_fd, path, (uint32_t)FILE_WATCH_MASK);
+        if (wd < 0) {
             seaf_warning ("[wt mon] fail to add watch to %s: %s.\n", path, strerror(errno));
             return -1;
         }
+        record_watch (wd_paths, wd, path, wt_len, status);
     } else if (S_ISDIR (st.st_mode)) {
-        if (inotify_add_watch (in_fd, path, (uint32_t)DIR_WATCH_MASK) < 0) {
+        wd = inotify_add_watch (in_fd, path, (uint32_t)DIR_WATCH_MASK);
+        if (wd < 0) {
             seaf_warning ("[wt mon] fail to add watch to %s: %s.\n", path, strerror(errno));
             return -1;
         }
+        record_watch (wd_paths, wd, path, wt_len, status);
 
         dir = opendir (path);
         if (!dir) {
@@ -81,7 +110,8 @@ add_watch_recursive (int in_fd, char *path, int pathlen)
                 continue;
 
             int len = snprintf (path + pathlen, PATH_MAX, "/%s", dent->d_name);
-            if (add_watch_recursive (in_fd, path, pathlen + len) < 0)
+            if (add_watch_recursive (in_fd, path, pathlen + len,
+                                     wd_paths, wt_len, status) < 0)
                 return -1;
         }
         if (errno != 0) {
@@ -96,11 +126,12 @@ add_watch_recursive (int in_fd, char *path, int pathlen)
 }
 
 static int
-add_watch (const char *repo_id)
+add_watch (const char *repo_id, GHashTable *wd_paths)
 {
     SeafRepo *repo;
     int inotify_fd;
     char path[PATH_MAX];
+    int len;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -115,7 +146,8 @@ add_watch (const char *repo_id)
     }
 
     g_strlcpy (path, repo->worktree, PATH_MAX);
-    if (add_watch_recursive (inotify_fd, path, strlen(path)) < 0) {
+    len = strlen(path);
+    if (add_watch_recursive (inotify_fd, path, len, wd_paths, len, NULL) < 0) {
         close (inotify_fd);
         return -1;
     }
@@ -141,10 +173,13 @@ update_maxfd (SeafWTMonitorPriv *priv)
 }
 
 static int
-refresh_watch (int inotify_fd, const char *repo_id)
+refresh_watch (int inotify_fd, const char *repo_id, GHashTable *wd_paths,
+               WTStatus *status)
 {
     SeafRepo *repo;
     char path[PATH_MAX];
+    int len;
+    guint n_watches;
 
     repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
     if (!repo) {
@@ -153,19 +188,83 @@ refresh_watch (int inotify_fd, const char *repo_id)
     }
 
     g_strlcpy (path, repo->worktree, PATH_MAX);
-    if (add_watch_recursive (inotify_fd, path, strlen(path)) < 0) {
+    len = strlen(path);
+    n_watches = g_hash_table_size (wd_paths);
+    if (add_watch_recursive (inotify_fd, path, len,
+                             wd_paths, len, status) < 0) {
         return -1;
     }
 
+    if (status && g_hash_table_size (wd_paths) != n_watches)
+        g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+
     return 0;
 }
 
+/*
+ * Record the paths in a batch of events. Events are never split between
+ * reads, so the buffer only holds whole events.
+ */
+static void
+process_events (WTStatus *status, GHashTable *wd_paths,
+                const char *buf, int len)
+{
+    const struct inotify_event *event;
+    const char *dir;
+    char *path;
+    int off = 0;
+
+    while (off + (int)sizeof(struct inotify_event) <= len) {
+        event = (const struct inotify_event *)(buf + off);
+        off += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            seaf_debug ("[wt mon] event queue overflow, repo %s.\n",
+                        status->repo_id);
+            wt_status_set_full_scan (status);
+            continue;
+        }
+
+        if (event->mask & IN_IGNORED) {
+            g_hash_table_remove (wd_paths, GINT_TO_POINTER(event->wd));
+            continue;
+        }
+
+        /* Paths of watches under a moved dir are stale until the
+         * watches are refreshed, so don't trust them.
+         */
+        if ((event->mask & (IN_MOVED_FROM | IN_MOVED_TO)) &&
+            (event->mask & IN_ISDIR)) {
+            wt_status_set_full_scan (status);
+            continue;
+        }
+
+        dir = g_hash_table_lookup (wd_paths, GINT_TO_POINTER(event->wd));
+        if (!dir) {
+            wt_status_set_full_scan (status);
+            continue;
+        }
+
+        if (event->len > 0 && event->name[0] != '\0') {
+            if (dir[0] != '\0')
+                path = g_strconcat (dir, "/", event->name, NULL);
+            else
+                path = g_strdup (event->name);
+            wt_status_add_dirty_path (status, path);
+            g_free (path);
+        } else {
+            wt_status_add_dirty_path (status, dir);
+        }
+    }
+
+    g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+}
+
 static void *
 wt_monitor_job (void *vmonitor)
 {
     SeafWTMonitor *monitor = vmonitor;
     SeafWTMonitorPriv *priv = monitor->priv;
-    /* 2 * sizeof(inotify_event) + 256, should be large enough for one event.*/
     WTStatus *status;
 
     WatchCommand cmd;
@@ -173,10 +272,16 @@ wt_monitor_job (void *vmonitor)
     int rc;
     fd_set fds;
     int inotify_fd;
-    char event_buf[(sizeof(struct inotify_event) << 1) + 256];
+    /* Aligned for struct inotify_event. */
+    static char event_buf[EVENT_BUF_SIZE] __attribute__ ((aligned(8)));
     gpointer key, value;
     GHashTableIter iter;
 
+    /* Only used in this thread. */
+    priv->watch_hash = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                              NULL,
+                                              (GDestroyNotify)g_hash_table_destroy);
+
     FD_SET (priv->cmd_pipe[0], &priv->read_fds);
     priv->maxfd = priv->cmd_pipe[0];
 
@@ -204,10 +309,6 @@ wt_monitor_job (void *vmonitor)
         while (g_hash_table_iter_next (&iter, &key, &value)) {
             inotify_fd = (int)(long)key;
             if (FD_ISSET (inotify_fd, &fds)) {
-                /* We don't care about the details of the event now.
-                 * So we just read out the data but don't parse it.
-                 * We may read partial event structure.
-                 */
                 n = read (inotify_fd, event_buf, sizeof(event_buf));
                 if (n <= 0) {
                     seaf_warning ("[wt mon] failed to read inotify event.\n");
@@ -215,7 +316,9 @@ wt_monitor_job (void *vmonitor)
                 }
                 status = value;
                 if (status) {
-                    g_atomic_int_set (&status->last_changed, (gint)time(NULL));
+                    process_events (status,
+                                    g_hash_table_lookup (priv->watch_hash, key),
+                                    event_buf, n);
                 }
             }
         }
@@ -227,11 +330,19 @@ wt_monitor_job (void *vmonitor)
 static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *handle) 
 {
     int inotify_fd;
+    GHashTable *wd_paths;
     g_assert (handle != NULL);
-    inotify_fd = add_watch (repo_id);
 
-    if (inotify_fd < 0)
+    wd_paths = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                      NULL, g_free);
+    inotify_fd = add_watch (repo_id, wd_paths);
+
+    if (inotify_fd < 0) {
+        g_hash_table_destroy (wd_paths);
         return -1;
+    }
+
+    g_hash_table_insert (priv->watch_hash, (gpointer)(long)inotify_fd, wd_paths);
 
     FD_SET (inotify_fd, &priv->read_fds);
     priv->maxfd = MAX (inotify_fd, priv->maxfd);
@@ -242,6 +353,7 @@ static int handle_add_repo (SeafWTMonitorPriv *priv, const char *repo_id, long *
 static int handle_rm_repo (SeafWTMonitorPriv *priv, gpointer handle)
 {
     int inotify_fd = (int)(long)handle;
+    g_hash_table_remove (priv->watch_hash, handle);
     close (inotify_fd);
     FD_CLR (inotify_fd, &priv->read_fds);
     update_maxfd (priv);
@@ -255,7 +367,9 @@ static int handle_refresh_repo (SeafWTMonitorPriv *priv, const char *repo_id)
         return -1;
 
     int inotify_fd = (int)(long)value;
-    if (refresh_watch (inotify_fd, repo_id) < 0)
+    if (refresh_watch (inotify_fd, repo_id,
+                       g_hash_table_lookup (priv->watch_hash, value),
+                       g_hash_table_lookup (priv->status_hash, value)) < 0)
         return -1;
 
     return 0;
@@ -48,6 +48,7 @@ static void stream_callback (ConstFSEventStreamRef streamRef,
 
     status = g_hash_table_lookup (priv->status_hash, streamRef);
     if (status) {
+        wt_status_set_full_scan (status);
         g_atomic_int_set (&status->last_changed, (gint)time(NULL));
     }
 
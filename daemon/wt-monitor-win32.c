@@ -406,6 +406,7 @@ wt_monitor_job (void *vmonitor)
                 repo_id = "Unknown-repo-id";
 
             if (status) {
+                wt_status_set_full_scan (status);
                 g_atomic_int_set (&status->last_changed, (gint)time(NULL));
 
                 seaf_debug("worktree change detected, repo %s\n", repo_id);
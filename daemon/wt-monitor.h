@@ -1,12 +1,47 @@
 #ifndef SEAF_WT_MONITOR_H
 #define SEAF_WT_MONITOR_H
 
+#include <pthread.h>
+
+/* Above this number of changed paths, just scan the whole worktree. */
+#define WT_MAX_DIRTY_PATHS 10000
+
 typedef struct WTStatus {
     char        repo_id[37];
     gint        last_check;
     gint        last_changed;
+
+    /*
+     * Paths changed since the last commit, relative to the worktree.
+     * If full_scan is set, the set is not complete and the whole worktree
+     * has to be scanned. Monitors which don't report changed paths set
+     * full_scan on every change. Protected by @lock.
+     */
+    pthread_mutex_t lock;
+    GHashTable  *dirty_paths;
+    gboolean    full_scan;
 } WTStatus;
 
+WTStatus *
+wt_status_new (const char *repo_id);
+
+void
+wt_status_free (WTStatus *status);
+
+void
+wt_status_add_dirty_path (WTStatus *status, const char *path);
+
+void
+wt_status_set_full_scan (WTStatus *status);
+
+/*
+ * Take the changed paths and reset the set. Returns FALSE if the whole
+ * worktree should be scanned, then @paths is not set. Otherwise the paths
+ * are returned in @paths, which should be freed with string_list_free().
+ */
+gboolean
+wt_status_take_dirty_paths (WTStatus *status, GList **paths);
+
 typedef struct SeafWTMonitorPriv SeafWTMonitorPriv;
 
 struct _SeafileSession;
@@ -17,6 +17,7 @@
 #include "seafile.h"
 
 #include "utils.h"
+#include "obj-cache.h"
 
 #include "seafile-session.h"
 #include "httpserver.h"
@@ -26,6 +27,13 @@
 #define CONTENT_TYPE_FILENAME "content-type.txt"
 #define FILE_TYPE_MAP_DEFAULT_LEN 1
 
+/* Max bytes of block files queued to a connection at a time. */
+#define SENDFILE_QUEUE_SIZE (4 * 1024 * 1024)
+
+/* Requests with more ranges are served with the whole file. */
+#define MAX_RANGES 64
+#define BLOCK_MAP_CACHE_SIZE (16 * 1024 * 1024)
+
 struct file_type_map {
     char *suffix;
     char *type;
@@ -46,12 +54,41 @@ typedef struct SendfileData {
     void *saved_cb_arg;
 } SendfileData;
 
-typedef struct SendDirData {
+/* Offsets of blocks in a file, for serving byte ranges. */
+typedef struct BlockMap {
+    int n_blocks;
+    /* offsets[i] is the start of block i, offsets[n_blocks] is file size. */
+    guint64 offsets[];
+} BlockMap;
+
+typedef struct ByteRange {
+    guint64 start;
+    guint64 end;                /* inclusive */
+} ByteRange;
+
+typedef struct SendRangeData {
     evhtp_request_t *req;
-    size_t remain;
+    Seafile *file;
+    SeafileCrypt *crypt;
+    BlockMap *map;
+    ByteRange *ranges;
+    int n_ranges;
+    int cur;                    /* range being sent */
+    guint64 pos;                /* next byte to send */
+    gboolean part_started;
+    gboolean trailer_sent;
+    char *part_type;
+    char boundary[17];
+
+    bufferevent_data_cb saved_read_cb;
+    bufferevent_data_cb saved_write_cb;
+    bufferevent_event_cb saved_event_cb;
+    void *saved_cb_arg;
+} SendRangeData;
 
-    int zipfd;
-    char *zipfile;
+typedef struct SendDirData {
+    evhtp_request_t *req;
+    PackDir *pd;
 
     bufferevent_data_cb saved_read_cb;
     bufferevent_data_cb saved_write_cb;
@@ -63,6 +100,9 @@ typedef struct SendDirData {
 
 extern SeafileSession *seaf;
 
+/* Block maps of recently accessed files, keyed by file ID. */
+static SeafObjCache *block_map_cache;
+
 static struct file_type_map ftmap[] = {
     { "txt", "text/plain" },
     { "html", "text/html" },
@@ -81,16 +121,103 @@ free_sendfile_data (SendfileData *data)
     g_free (data);
 }
 
+static void
+free_sendrange_data (SendRangeData *data)
+{
+    seafile_unref (data->file);
+    g_free (data->crypt);
+    g_free (data->map);
+    g_free (data->ranges);
+    g_free (data->part_type);
+    g_free (data);
+}
+
 static void
 free_senddir_data (SendDirData *data)
 {
-    close (data->zipfd);
-    unlink (data->zipfile);
-    
-    g_free (data->zipfile);
+    pack_dir_free (data->pd);
     g_free (data);
 }
 
+static void
+send_file_done (SendfileData *data)
+{
+    /* Recover evhtp's callbacks */
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    free_sendfile_data (data);
+}
+
+/*
+ * Zero-copy path for unencrypted files on backends that store blocks
+ * as plain files. Block files are added to the output buffer by fd,
+ * and libevent sends them with sendfile() without copying them through
+ * user space.
+ */
+static void
+write_data_zero_copy_cb (struct bufferevent *bev, void *ctx)
+{
+    SendfileData *data = ctx;
+    struct evbuffer *output = bufferevent_get_output (bev);
+    const char *blk_id;
+    struct stat st;
+    int fd;
+
+    /* All blocks are sent out when the output buffer is drained again. */
+    if (data->idx == data->file->n_blocks) {
+        send_file_done (data);
+        return;
+    }
+
+    while (data->idx < data->file->n_blocks &&
+           evbuffer_get_length (output) < SENDFILE_QUEUE_SIZE) {
+        blk_id = data->file->blk_sha1s[data->idx];
+
+        fd = seaf_block_manager_open_block_fd (seaf->block_mgr, blk_id);
+        if (fd < 0) {
+            seaf_warning ("Failed to open block %s\n", blk_id);
+            goto err;
+        }
+
+        if (fstat (fd, &st) < 0) {
+            seaf_warning ("Failed to stat block %s: %s.\n",
+                          blk_id, strerror(errno));
+            close (fd);
+            goto err;
+        }
+
+        /* The fd is closed by libevent once the data is sent. */
+        if (st.st_size == 0) {
+            close (fd);
+        } else if (evbuffer_add_file (output, fd, 0, st.st_size) < 0) {
+            seaf_warning ("Failed to send block %s.\n", blk_id);
+            close (fd);
+            goto err;
+        }
+
+        ++(data->idx);
+    }
+
+    /* Nothing queued, so this callback won't be called again. */
+    if (evbuffer_get_length (output) == 0)
+        send_file_done (data);
+
+    return;
+
+err:
+    evhtp_connection_free (evhtp_request_get_connection (data->req));
+    free_sendfile_data (data);
+}
+
 static void
 write_data_cb (struct bufferevent *bev, void *ctx)
 {
@@ -139,19 +266,7 @@ next:
 
         /* We've read up the data of this block, finish or try next block. */
         if (data->idx == data->file->n_blocks - 1) {
-            /* Recover evhtp's callbacks */
-            struct bufferevent *bev = evhtp_request_get_bev (data->req);
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
-
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
-
-            evhtp_send_reply_end (data->req);
-
-            free_sendfile_data (data);
+            send_file_done (data);
             return;
         }
 
@@ -216,34 +331,31 @@ write_dir_data_cb (struct bufferevent *bev, void *ctx)
     char buf[64 * 1024];
     int n;
 
-    n = readn (data->zipfd, buf, sizeof(buf));
-    if (n <= 0) {
-        seaf_warning ("failed to read zipfile %s\n", data->zipfile);
+    n = pack_dir_read (data->pd, buf, sizeof(buf));
+    if (n < 0) {
+        seaf_warning ("failed to generate zip archive\n");
         evhtp_connection_free (evhtp_request_get_connection (data->req));
         free_senddir_data (data);
         return;
-        
-    } else {
-        bufferevent_write (bev, buf, n);
-        data->remain -= n;
 
-        if (data->remain == 0) {
-            /* Recover evhtp's callbacks */
-            struct bufferevent *bev = evhtp_request_get_bev (data->req);
-            bev->readcb = data->saved_read_cb;
-            bev->writecb = data->saved_write_cb;
-            bev->errorcb = data->saved_event_cb;
-            bev->cbarg = data->saved_cb_arg;
+    } else if (n == 0) {
+        /* Recover evhtp's callbacks */
+        struct bufferevent *bev = evhtp_request_get_bev (data->req);
+        bev->readcb = data->saved_read_cb;
+        bev->writecb = data->saved_write_cb;
+        bev->errorcb = data->saved_event_cb;
+        bev->cbarg = data->saved_cb_arg;
 
-            /* Resume reading incomming requests. */
-            evhtp_request_resume (data->req);
+        /* Resume reading incomming requests. */
+        evhtp_request_resume (data->req);
 
-            evhtp_send_reply_end (data->req);
+        evhtp_send_reply_end (data->req);
 
-            free_senddir_data (data);
-            return;
-        }
+        free_senddir_data (data);
+        return;
     }
+
+    bufferevent_write (bev, buf, n);
 }
 
 static void
@@ -268,6 +380,481 @@ my_dir_event_cb (struct bufferevent *bev, short events, void *ctx)
     free_senddir_data (data);
 }
 
+static void
+my_range_event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    SendRangeData *data = ctx;
+
+    data->saved_event_cb (bev, events, data->saved_cb_arg);
+
+    /* Free aux data. */
+    free_sendrange_data (data);
+}
+
+static void *
+block_map_copy (void *obj)
+{
+    BlockMap *map = obj;
+
+    return g_memdup (map, sizeof(BlockMap) + (map->n_blocks + 1) * sizeof(guint64));
+}
+
+/* Read a whole block into memory. */
+static char *
+read_block_data (const char *blk_id, int *len)
+{
+    BlockHandle *handle;
+    BlockMetadata *bmd;
+    char *buf;
+    int n;
+
+    handle = seaf_block_manager_open_block (seaf->block_mgr, blk_id, BLOCK_READ);
+    if (!handle) {
+        seaf_warning ("Failed to open block %s\n", blk_id);
+        return NULL;
+    }
+
+    bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr, handle);
+    if (!bmd) {
+        seaf_warning ("Failed to stat block %s\n", blk_id);
+        seaf_block_manager_close_block (seaf->block_mgr, handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+        return NULL;
+    }
+
+    buf = g_malloc (bmd->size);
+    n = seaf_block_manager_read_block (seaf->block_mgr, handle, buf, bmd->size);
+    if (n != bmd->size) {
+        seaf_warning ("Error when reading from block %s.\n", blk_id);
+        g_free (buf);
+        buf = NULL;
+    }
+    *len = n;
+
+    g_free (bmd);
+    seaf_block_manager_close_block (seaf->block_mgr, handle);
+    seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
+
+    return buf;
+}
+
+/*
+ * Get the size of a decrypted block. Only the last 32 bytes of the block
+ * are needed, which can be read directly if the backend supports it.
+ */
+static int
+get_plain_block_size (SeafileCrypt *crypt, const char *blk_id, guint32 enc_size)
+{
+    char tail[32];
+    int tail_len = MIN (enc_size, sizeof(tail));
+    char *buf;
+    int fd, n;
+
+    fd = seaf_block_manager_open_block_fd (seaf->block_mgr, blk_id);
+    if (fd >= 0) {
+        n = pread (fd, tail, tail_len, enc_size - tail_len);
+        close (fd);
+        if (n != tail_len) {
+            seaf_warning ("Failed to read block %s.\n", blk_id);
+            return -1;
+        }
+        return seafile_decrypted_size (crypt, tail, tail_len, enc_size);
+    }
+
+    buf = read_block_data (blk_id, &n);
+    if (!buf)
+        return -1;
+    n = seafile_decrypted_size (crypt, buf, n, enc_size);
+    g_free (buf);
+
+    return n;
+}
+
+static BlockMap *
+compute_block_map (Seafile *file, SeafileCrypt *crypt)
+{
+    BlockMap *map;
+    BlockMetadata **mds;
+    guint64 offset = 0;
+    int i, size;
+
+    map = g_malloc (sizeof(BlockMap) + (file->n_blocks + 1) * sizeof(guint64));
+    map->n_blocks = file->n_blocks;
+
+    mds = g_new0 (BlockMetadata *, file->n_blocks);
+    seaf_block_manager_stat_blocks (seaf->block_mgr,
+                                    (const char **)file->blk_sha1s,
+                                    file->n_blocks, mds);
+
+    for (i = 0; i < file->n_blocks; ++i) {
+        if (!mds[i])
+            goto error;
+
+        size = mds[i]->size;
+        if (crypt) {
+            size = get_plain_block_size (crypt, file->blk_sha1s[i], size);
+            if (size < 0)
+                goto error;
+        }
+        map->offsets[i] = offset;
+        offset += size;
+    }
+    map->offsets[file->n_blocks] = offset;
+
+    if (offset != file->file_size) {
+        seaf_warning ("Size of blocks of file %s doesn't match file size.\n",
+                      file->file_id);
+        goto error;
+    }
+
+    for (i = 0; i < file->n_blocks; ++i)
+        g_free (mds[i]);
+    g_free (mds);
+    return map;
+
+error:
+    for (i = 0; i < file->n_blocks; ++i)
+        g_free (mds[i]);
+    g_free (mds);
+    g_free (map);
+    return NULL;
+}
+
+static BlockMap *
+get_block_map (Seafile *file, SeafileCrypt *crypt)
+{
+    BlockMap *map;
+
+    map = seaf_obj_cache_lookup (block_map_cache, file->file_id);
+    if (map)
+        return map;
+
+    map = compute_block_map (file, crypt);
+    if (map)
+        seaf_obj_cache_insert (block_map_cache, file->file_id,
+                               block_map_copy (map),
+                               sizeof(BlockMap) +
+                               (map->n_blocks + 1) * sizeof(guint64));
+
+    return map;
+}
+
+/* Find the block containing @offset. */
+static int
+find_block (BlockMap *map, guint64 offset)
+{
+    int lo = 0, hi = map->n_blocks - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (map->offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return lo;
+}
+
+static gboolean
+parse_number (const char **p, guint64 *value)
+{
+    char *end;
+
+    if (!g_ascii_isdigit (**p))
+        return FALSE;
+    *value = g_ascii_strtoull (*p, &end, 10);
+    *p = end;
+    return TRUE;
+}
+
+/*
+ * Parse a "Range: bytes=..." header against a file of @size bytes.
+ * Returns the number of satisfiable ranges, 0 if the header should be
+ * ignored, or -1 if no range is satisfiable.
+ */
+static int
+parse_range_header (const char *value, guint64 size,
+                    ByteRange *ranges, int max_ranges)
+{
+    const char *p = value;
+    guint64 start, end;
+    gboolean has_start, has_end;
+    int n = 0, n_specs = 0;
+
+    while (g_ascii_isspace (*p))
+        ++p;
+    if (strncmp (p, "bytes=", 6) != 0)
+        return 0;
+    p += 6;
+
+    while (1) {
+        while (g_ascii_isspace (*p) || *p == ',')
+            ++p;
+        if (*p == '\0')
+            break;
+
+        has_start = parse_number (&p, &start);
+        if (*p++ != '-')
+            return 0;
+        has_end = parse_number (&p, &end);
+        while (g_ascii_isspace (*p))
+            ++p;
+        if (*p != ',' && *p != '\0')
+            return 0;
+
+        if (++n_specs > max_ranges)
+            return 0;
+
+        if (has_start) {
+            if (has_end && end < start)
+                return 0;
+            if (start >= size)
+                continue;
+            if (!has_end || end >= size)
+                end = size - 1;
+        } else {
+            /* Suffix range, the last @end bytes. */
+            if (!has_end)
+                return 0;
+            if (end == 0 || size == 0)
+                continue;
+            start = (end >= size) ? 0 : size - end;
+            end = size - 1;
+        }
+
+        ranges[n].start = start;
+        ranges[n].end = end;
+        ++n;
+    }
+
+    if (n_specs == 0)
+        return 0;
+
+    return (n > 0) ? n : -1;
+}
+
+static char *
+format_part_header (SendRangeData *data, ByteRange *range)
+{
+    return g_strdup_printf ("\r\n--%s\r\n"
+                            "Content-Type: %s\r\n"
+                            "Content-Range: bytes %"G_GUINT64_FORMAT"-%"
+                            G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT"\r\n\r\n",
+                            data->boundary, data->part_type,
+                            range->start, range->end,
+                            data->file->file_size);
+}
+
+static guint64
+get_range_content_length (SendRangeData *data)
+{
+    guint64 len = 0;
+    char *header;
+    int i;
+
+    for (i = 0; i < data->n_ranges; ++i) {
+        len += data->ranges[i].end - data->ranges[i].start + 1;
+        if (data->n_ranges > 1) {
+            header = format_part_header (data, &data->ranges[i]);
+            len += strlen (header);
+            g_free (header);
+        }
+    }
+
+    /* Closing boundary "\r\n--<boundary>--\r\n". */
+    if (data->n_ranges > 1)
+        len += strlen (data->boundary) + 8;
+
+    return len;
+}
+
+/*
+ * Send @len bytes of block @blk_idx from @off. Encrypted blocks have to be
+ * decrypted as a whole, but the blocks before are skipped.
+ */
+static int
+send_block_range (struct bufferevent *bev, SendRangeData *data,
+                  int blk_idx, guint32 off, guint32 len)
+{
+    const char *blk_id = data->file->blk_sha1s[blk_idx];
+    char *buf, *dec_out;
+    int n, dec_out_len, fd;
+
+    if (!data->crypt &&
+        (fd = seaf_block_manager_open_block_fd (seaf->block_mgr, blk_id)) >= 0) {
+        /* The fd is closed by libevent once the data is sent. */
+        if (evbuffer_add_file (bufferevent_get_output (bev), fd, off, len) < 0) {
+            seaf_warning ("Failed to send block %s.\n", blk_id);
+            close (fd);
+            return -1;
+        }
+        return 0;
+    }
+
+    buf = read_block_data (blk_id, &n);
+    if (!buf)
+        return -1;
+
+    if (data->crypt) {
+        if (seafile_decrypt (&dec_out, &dec_out_len, buf, n, data->crypt) < 0) {
+            seaf_warning ("Decrypt block %s failed.\n", blk_id);
+            g_free (buf);
+            return -1;
+        }
+        g_free (buf);
+        buf = dec_out;
+        n = dec_out_len;
+    }
+
+    if ((guint64)off + len > n) {
+        seaf_warning ("Block %s is shorter than expected.\n", blk_id);
+        g_free (buf);
+        return -1;
+    }
+
+    bufferevent_write (bev, buf + off, len);
+    g_free (buf);
+
+    return 0;
+}
+
+static void
+send_range_done (SendRangeData *data)
+{
+    /* Recover evhtp's callbacks */
+    struct bufferevent *bev = evhtp_request_get_bev (data->req);
+    bev->readcb = data->saved_read_cb;
+    bev->writecb = data->saved_write_cb;
+    bev->errorcb = data->saved_event_cb;
+    bev->cbarg = data->saved_cb_arg;
+
+    /* Resume reading incomming requests. */
+    evhtp_request_resume (data->req);
+
+    evhtp_send_reply_end (data->req);
+
+    free_sendrange_data (data);
+}
+
+/* Send at most one block of the current range each time. */
+static void
+write_range_cb (struct bufferevent *bev, void *ctx)
+{
+    SendRangeData *data = ctx;
+    ByteRange *range;
+    guint64 blk_end;
+    char *header;
+    int blk_idx;
+    guint32 off, len;
+
+    if (data->cur == data->n_ranges) {
+        if (data->n_ranges > 1 && !data->trailer_sent) {
+            evbuffer_add_printf (bufferevent_get_output (bev),
+                                 "\r\n--%s--\r\n", data->boundary);
+            data->trailer_sent = TRUE;
+            return;
+        }
+        send_range_done (data);
+        return;
+    }
+
+    range = &data->ranges[data->cur];
+    if (!data->part_started) {
+        data->pos = range->start;
+        if (data->n_ranges > 1) {
+            header = format_part_header (data, range);
+            bufferevent_write (bev, header, strlen(header));
+            g_free (header);
+        }
+        data->part_started = TRUE;
+    }
+
+    blk_idx = find_block (data->map, data->pos);
+    blk_end = MIN (data->map->offsets[blk_idx + 1], range->end + 1);
+    off = data->pos - data->map->offsets[blk_idx];
+    len = blk_end - data->pos;
+
+    if (send_block_range (bev, data, blk_idx, off, len) < 0) {
+        evhtp_connection_free (evhtp_request_get_connection (data->req));
+        free_sendrange_data (data);
+        return;
+    }
+
+    data->pos = blk_end;
+    if (data->pos > range->end) {
+        ++(data->cur);
+        data->part_started = FALSE;
+    }
+}
+
+/*
+ * Serve byte ranges of a file. Takes over @file, @crypt, @map and @ranges.
+ */
+static void
+start_send_ranges (evhtp_request_t *req, Seafile *file, SeafileCrypt *crypt,
+                   BlockMap *map, ByteRange *ranges, int n_ranges,
+                   const char *content_type)
+{
+    SendRangeData *data;
+    char buf[256];
+
+    data = g_new0 (SendRangeData, 1);
+    data->req = req;
+    data->file = file;
+    data->crypt = crypt;
+    data->map = map;
+    data->ranges = ranges;
+    data->n_ranges = n_ranges;
+    data->part_type = g_strdup (content_type ? content_type :
+                                "application/octet-stream");
+    snprintf (data->boundary, sizeof(data->boundary), "%08x%08x",
+              g_random_int(), g_random_int());
+
+    if (n_ranges == 1) {
+        if (content_type)
+            evhtp_headers_add_header (req->headers_out,
+                                      evhtp_header_new("Content-Type",
+                                                       content_type, 1, 1));
+        snprintf (buf, sizeof(buf), "bytes %"G_GUINT64_FORMAT"-%"
+                  G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT,
+                  ranges[0].start, ranges[0].end, file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Range", buf, 1, 1));
+    } else {
+        snprintf (buf, sizeof(buf), "multipart/byteranges; boundary=%s",
+                  data->boundary);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Type", buf, 1, 1));
+    }
+
+    snprintf (buf, sizeof(buf), "%"G_GUINT64_FORMAT,
+              get_range_content_length (data));
+    evhtp_headers_add_header (req->headers_out,
+                              evhtp_header_new("Content-Length", buf, 1, 1));
+
+    /* We need to overwrite evhtp's callback functions to
+     * write file data piece by piece.
+     */
+    struct bufferevent *bev = evhtp_request_get_bev (req);
+    data->saved_read_cb = bev->readcb;
+    data->saved_write_cb = bev->writecb;
+    data->saved_event_cb = bev->errorcb;
+    data->saved_cb_arg = bev->cbarg;
+    bufferevent_setcb (bev,
+                       NULL,
+                       write_range_cb,
+                       my_range_event_cb,
+                       data);
+    /* Block any new request from this connection before finish
+     * handling this request.
+     */
+    evhtp_request_pause (req);
+
+    /* Kick start data transfer by sending out http headers. */
+    evhtp_send_reply_start(req, EVHTP_RES_PARTIAL);
+}
+
 static char *
 parse_content_type(const char *filename)
 {
@@ -336,6 +923,11 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     unsigned char enc_key[16], enc_iv[16];
     SeafileCrypt *crypt = NULL;
     SendfileData *data;
+    gboolean zero_copy;
+    const char *range_hdr;
+    ByteRange *ranges = NULL;
+    int n_ranges = 0;
+    BlockMap *map = NULL;
 
     file = seaf_fs_manager_get_seafile(seaf->fs_mgr, file_id);
     if (file == NULL)
@@ -358,6 +950,9 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                                               "*", 1, 1));
 
 
+    evhtp_headers_add_header(req->headers_out,
+                             evhtp_header_new("Accept-Ranges", "bytes", 1, 1));
+
     type = parse_content_type(filename);
     if (type != NULL) {
         if (strstr(type, "text")) {
@@ -365,16 +960,47 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         } else {
             content_type = g_strdup (type);
         }
+    }
 
-        evhtp_headers_add_header(req->headers_out,
-                                 evhtp_header_new("Content-Type",
-                                                  content_type, 1, 1));
-        g_free (content_type);
+    range_hdr = evhtp_header_find (req->headers_in, "Range");
+    if (range_hdr) {
+        ranges = g_new (ByteRange, MAX_RANGES);
+        n_ranges = parse_range_header (range_hdr, file->file_size,
+                                       ranges, MAX_RANGES);
+        if (n_ranges < 0) {
+            snprintf (file_size, sizeof(file_size), "bytes */%"G_GUINT64_FORMAT"",
+                      file->file_size);
+            evhtp_headers_add_header (req->headers_out,
+                                      evhtp_header_new("Content-Range",
+                                                       file_size, 1, 1));
+            evhtp_send_reply (req, EVHTP_RES_RANGENOTSC);
+            g_free (ranges);
+            g_free (content_type);
+            g_free (crypt);
+            seafile_unref (file);
+            return 0;
+        }
+
+        /* Serve the whole file if block offsets can't be determined. */
+        if (n_ranges > 0)
+            map = get_block_map (file, crypt);
+        if (!map) {
+            g_free (ranges);
+            ranges = NULL;
+            n_ranges = 0;
+        }
     }
 
-    snprintf(file_size, sizeof(file_size), "%"G_GINT64_FORMAT"", file->file_size);
-    evhtp_headers_add_header (req->headers_out,
-                              evhtp_header_new("Content-Length", file_size, 1, 1));
+    if (n_ranges == 0) {
+        if (content_type)
+            evhtp_headers_add_header(req->headers_out,
+                                     evhtp_header_new("Content-Type",
+                                                      content_type, 1, 1));
+
+        snprintf(file_size, sizeof(file_size), "%"G_GINT64_FORMAT"", file->file_size);
+        evhtp_headers_add_header (req->headers_out,
+                                  evhtp_header_new("Content-Length", file_size, 1, 1));
+    }
 
     if (strcmp(operation, "download") == 0) {
         if (test_firefox (req)) {
@@ -397,6 +1023,13 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
                              evhtp_header_new("Content-Disposition", cont_filename,
                                               1, 1));
 
+    if (n_ranges > 0) {
+        start_send_ranges (req, file, crypt, map, ranges, n_ranges, content_type);
+        g_free (content_type);
+        return 0;
+    }
+    g_free (content_type);
+
     /* If it's an empty file, send an empty reply. */
     if (file->n_blocks == 0) {
         evhtp_send_reply (req, EVHTP_RES_OK);
@@ -409,6 +1042,10 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->file = file;
     data->crypt = crypt;
 
+    /* Encrypted blocks have to be decrypted in user space. */
+    zero_copy = (crypt == NULL &&
+                 seaf_block_manager_has_block_fd (seaf->block_mgr));
+
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
      */
@@ -419,7 +1056,7 @@ do_file(evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     data->saved_cb_arg = bev->cbarg;
     bufferevent_setcb (bev,
                        NULL,
-                       write_data_cb,
+                       zero_copy ? write_data_zero_copy_cb : write_data_cb,
                        my_event_cb,
                        data);
     /* Block any new request from this connection before finish
@@ -438,18 +1075,15 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         const char *filename, const char *operation,
         SeafileCryptKey *crypt_key)
 {
-    char *zipfile = NULL;
+    PackDir *pd = NULL;
     char *filename_escaped = NULL;
     char cont_filename[PATH_MAX];
     char file_size[255];
-    struct stat st;
     char *key_hex, *iv_hex;
     unsigned char enc_key[16], enc_iv[16];
     SeafileCrypt *crypt = NULL;
-    int zipfd = 0;
     int ret = 0;
 
-    /* Let's zip the directory first */
     filename_escaped = g_uri_unescape_string (filename, NULL);
     if (!filename_escaped) {
         seaf_warning ("failed to unescape string %s\n", filename);
@@ -469,22 +1103,20 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
         g_free (iv_hex);
     }
 
-    zipfile = pack_dir (filename_escaped, file_id, crypt, test_windows(req));
-    if (!zipfile) {
+    /* The zip archive is generated while it's sent. Only the file list
+     * is read here, to compute the size of the archive.
+     */
+    pd = pack_dir_new (filename_escaped, file_id, crypt, test_windows(req));
+    if (!pd) {
         ret = -1;
         goto out;
     }
-    
-    /* OK, the dir is zipped */
+
     evhtp_headers_add_header(req->headers_out,
                 evhtp_header_new("Content-Type", "application/zip", 1, 1));
-    
-    if (stat(zipfile, &st) < 0) {
-        ret = -1;
-        goto out;
-    }
 
-    snprintf (file_size, sizeof(file_size), "%"G_GUINT64_FORMAT"", st.st_size);
+    snprintf (file_size, sizeof(file_size), "%"G_GUINT64_FORMAT"",
+              pack_dir_get_size (pd));
     evhtp_headers_add_header (req->headers_out,
             evhtp_header_new("Content-Length", file_size, 1, 1));
 
@@ -499,19 +1131,10 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
     evhtp_headers_add_header(req->headers_out,
             evhtp_header_new("Content-Disposition", cont_filename, 1, 1));
 
-    zipfd = open (zipfile, O_RDONLY);
-    if (zipfd < 0) {
-        seaf_warning ("failed to open zipfile %s\n", zipfile);
-        ret = -1;
-        goto out;
-    }
-
     SendDirData *data;
     data = g_new0 (SendDirData, 1);
     data->req = req;
-    data->zipfd = zipfd;
-    data->zipfile = zipfile;
-    data->remain = st.st_size;
+    data->pd = pd;
 
     /* We need to overwrite evhtp's callback functions to
      * write file data piece by piece.
@@ -536,16 +1159,9 @@ do_dir (evhtp_request_t *req, SeafRepo *repo, const char *file_id,
 
 out:
     g_free (filename_escaped);
-    if (ret < 0) {
-        if (zipfile != NULL) {
-            unlink (zipfile);
-            g_free (zipfile);
-        }
-
-        if (zipfd > 0) {
-            close (zipfd);
-        }
-    }
+    /* pack_dir_new() only takes @crypt when it succeeds. */
+    if (ret < 0)
+        g_free (crypt);
 
     return ret;
 }
@@ -684,6 +1300,9 @@ bad_req:
 int
 access_file_init (evhtp_t *htp)
 {
+    block_map_cache = seaf_obj_cache_new (BLOCK_MAP_CACHE_SIZE,
+                                          block_map_copy, g_free);
+
     evhtp_set_regex_cb (htp, "^/files/.*", access_cb, NULL);
 
     return 0;
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "content-range.h"
+
+int
+parse_content_range (const char *value, gint64 *first, gint64 *size)
+{
+    gint64 last;
+    char *end;
+
+    if (strncmp (value, "bytes ", 6) != 0)
+        return -1;
+    value += 6;
+
+    /* Empty file, there is no byte range. */
+    if (strcmp (value, "*/0") == 0) {
+        *first = 0;
+        *size = 0;
+        return 0;
+    }
+
+    *first = strtoll (value, &end, 10);
+    if (end == value || *end != '-')
+        return -1;
+    value = end + 1;
+
+    last = strtoll (value, &end, 10);
+    if (end == value || *end != '/')
+        return -1;
+    value = end + 1;
+
+    *size = strtoll (value, &end, 10);
+    if (end == value || *end != 0)
+        return -1;
+
+    if (*first < 0 || last < *first || last >= *size)
+        return -1;
+
+    return 0;
+}
+
+gboolean
+content_range_can_resume (gint64 saved_size, gint64 size)
+{
+    return size > 0 && saved_size == size;
+}
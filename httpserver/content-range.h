@@ -0,0 +1,19 @@
+#ifndef CONTENT_RANGE_H
+#define CONTENT_RANGE_H
+
+#include <glib.h>
+
+/* Parse "Content-Range: bytes <first>-<last>/<size>" of a piece of a
+   chunked upload. A range of "*" with a size of 0 is accepted for an
+   empty file.
+   Returns 0 on success, -1 if @value is malformed.
+ */
+int parse_content_range (const char *value, gint64 *first, gint64 *size);
+
+/* Whether a piece of a file of @size bytes can continue an upload saved
+   for a file of @saved_size bytes. An empty file never continues an
+   upload, it has no data to resume.
+ */
+gboolean content_range_can_resume (gint64 saved_size, gint64 size);
+
+#endif
@@ -13,19 +13,98 @@
 
 #include "seafile-session.h"
 #include "httpserver.h"
+#include "pack-dir.h"
 
-#include <archive.h>
-#include <archive_entry.h>
 #include <iconv.h>
-
-typedef struct {
-    struct archive *a;
+#include <zlib.h>
+
+/*
+ * The archive is written in zip format without compression. Entries are
+ * written with the "data descriptor" flag set, so that the CRC of a file
+ * can be written after its data. Since neither compression nor CRC
+ * changes the size of an entry, the layout of the whole archive is
+ * known before any data is read, and the archive is generated while
+ * it's being sent.
+ *
+ * Zip64 extensions are used only for files >= 4GB, offsets >= 4GB or
+ * more than 65535 entries.
+ */
+
+#define ZIP_LOCAL_HEADER_SIG    0x04034b50
+#define ZIP_DESCRIPTOR_SIG      0x08074b50
+#define ZIP_CENTRAL_HEADER_SIG  0x02014b50
+#define ZIP_END_SIG             0x06054b50
+#define ZIP64_END_SIG           0x06064b50
+#define ZIP64_LOCATOR_SIG       0x07064b50
+
+#define ZIP_LOCAL_HEADER_SIZE   30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE            22
+#define ZIP64_END_SIZE          56
+#define ZIP64_LOCATOR_SIZE      20
+#define ZIP_DESCRIPTOR_SIZE     16
+#define ZIP64_DESCRIPTOR_SIZE   24
+
+#define ZIP_FLAG_DESCRIPTOR     (1 << 3)
+#define ZIP_FLAG_UTF8           (1 << 11)
+
+#define ZIP_VERSION             20
+#define ZIP64_VERSION           45
+/* Upper byte 3 means unix, so that modes in external attrs are used. */
+#define ZIP_VERSION_MADE_BY     ((3 << 8) | ZIP64_VERSION)
+
+#define ZIP64_EXTRA_ID          0x0001
+#define ZIP_MAX_32              0xFFFFFFFFULL
+#define ZIP_MAX_16              0xFFFF
+
+#define READ_BUF_SIZE           (64 * 1024)
+
+typedef struct ZipEntry {
+    char *name;                 /* path in the archive, maybe converted */
+    char file_id[41];
+    guint32 mode;
+    guint64 size;
+    guint64 offset;             /* offset of the local header */
+    guint32 crc;
+} ZipEntry;
+
+typedef enum {
+    PACK_LOCAL_HEADER,
+    PACK_FILE_DATA,
+    PACK_DESCRIPTOR,
+    PACK_CENTRAL_DIR,
+    PACK_END,
+    PACK_DONE,
+} PackState;
+
+struct PackDir {
     SeafileCrypt *crypt;
-    const char *top_dir_name;
     gboolean is_windows;
-    time_t mtime;
+    const char *top_dir_name;
+    guint16 dos_time;
+    guint16 dos_date;
+
+    GPtrArray *entries;
+    guint64 cd_offset;
+    guint64 cd_size;
+    guint64 total_size;
+
+    /* Streaming state. */
+    PackState state;
+    guint cur;
+    Seafile *file;
+    int blk_idx;
+    BlockHandle *handle;
+    guint32 blk_remain;
+    EVP_CIPHER_CTX ctx;
+    guint64 written;
+    guint32 crc;
+    guint64 sent;
 
-} PackDirData;
+    /* Generated data not returned yet. */
+    GByteArray *pending;
+    guint pending_off;
+};
 
 static char *
 do_iconv (char *fromcode, char *tocode, char *in)
@@ -35,7 +114,7 @@ do_iconv (char *fromcode, char *tocode, char *in)
     char out[1024];
     char *pin = in;
     char *pout = out;
-    
+
     conv = iconv_open (tocode, fromcode);
     if (conv < 0) {
         return NULL;
@@ -56,200 +135,239 @@ do_iconv (char *fromcode, char *tocode, char *in)
     return g_strndup(out, outlen);
 }
 
-static int
-add_file_to_archive (PackDirData *data,
-                     const char *parent_dir,
-                     SeafDirent *dent)
+static void
+put16 (GByteArray *buf, guint16 v)
 {
-    struct archive *a = data->a;
-    struct SeafileCrypt *crypt = data->crypt;
-    gboolean is_windows = data->is_windows;
-    const char *top_dir_name = data->top_dir_name;
-    
-    struct archive_entry *entry = NULL;
-    Seafile *file = NULL;
-    char *pathname = NULL;
-    char buf[64 * 1024];
-    int len = 0;
-    int n = 0;
-    int idx = 0;
-    BlockHandle *handle = NULL;
-    BlockMetadata *bmd = NULL;
-    char *blk_id = NULL;
-    uint32_t remain = 0;
-    EVP_CIPHER_CTX ctx;
-    char *dec_out = NULL;
-    int dec_out_len = -1;
-    int ret = 0;
+    guint8 b[2] = { v & 0xFF, (v >> 8) & 0xFF };
+    g_byte_array_append (buf, b, 2);
+}
 
-    pathname = g_build_filename (top_dir_name, parent_dir, dent->name, NULL);
+static void
+put32 (GByteArray *buf, guint32 v)
+{
+    put16 (buf, v & 0xFFFF);
+    put16 (buf, v >> 16);
+}
 
-    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, dent->id);
-    if (!file) {
-        ret = -1;
-        goto out;
-    }
+static void
+put64 (GByteArray *buf, guint64 v)
+{
+    put32 (buf, (guint32)(v & 0xFFFFFFFF));
+    put32 (buf, (guint32)(v >> 32));
+}
 
-    entry = archive_entry_new ();
+static gboolean
+entry_is_zip64 (ZipEntry *e)
+{
+    return (e->size >= ZIP_MAX_32);
+}
 
-    /* File name fixup for WinRAR */
-    if (is_windows && seaf->windows_encoding) {
-        char *win_file_name = do_iconv ("UTF-8", seaf->windows_encoding, pathname);
-        if (!win_file_name) {
-            seaf_warning ("Failed to convert file name to %s\n", seaf->windows_encoding);
-            ret = -1;
-            goto out;
-        }
-        archive_entry_copy_pathname (entry, win_file_name);
-        g_free (win_file_name);
+static guint16
+entry_flags (PackDir *pd)
+{
+    /* Converted names are not in UTF-8. */
+    if (pd->is_windows && seaf->windows_encoding)
+        return ZIP_FLAG_DESCRIPTOR;
+    return ZIP_FLAG_DESCRIPTOR | ZIP_FLAG_UTF8;
+}
 
-    } else {
-        archive_entry_set_pathname (entry, pathname);
-    }
+static guint64
+local_entry_size (ZipEntry *e)
+{
+    guint64 size = ZIP_LOCAL_HEADER_SIZE + strlen(e->name) + e->size;
+
+    if (entry_is_zip64 (e))
+        size += 20 + ZIP64_DESCRIPTOR_SIZE;
+    else
+        size += ZIP_DESCRIPTOR_SIZE;
 
-    /* FIXME: 0644 should be set when upload files in repo-mgr.c */
-    archive_entry_set_mode (entry, dent->mode | 0644);
-    archive_entry_set_size (entry, file->file_size);
-    archive_entry_set_mtime (entry, data->mtime, 0);
+    return size;
+}
 
-    n = archive_write_header (a, entry);
-    if (n != ARCHIVE_OK) {
-        seaf_warning ("archive_write_header  error: %s\n", archive_error_string(a));
-        ret = -1;
-        goto out;
+static int
+central_extra_size (ZipEntry *e)
+{
+    int size = 0;
+
+    if (entry_is_zip64 (e))
+        size += 16;
+    if (e->offset >= ZIP_MAX_32)
+        size += 8;
+
+    return (size > 0) ? size + 4 : 0;
+}
+
+static gboolean
+archive_is_zip64 (PackDir *pd)
+{
+    return (pd->entries->len >= ZIP_MAX_16 ||
+            pd->cd_offset >= ZIP_MAX_32 ||
+            pd->cd_size >= ZIP_MAX_32);
+}
+
+static void
+write_local_header (PackDir *pd, ZipEntry *e)
+{
+    GByteArray *buf = pd->pending;
+    gboolean zip64 = entry_is_zip64 (e);
+    int name_len = strlen(e->name);
+
+    put32 (buf, ZIP_LOCAL_HEADER_SIG);
+    put16 (buf, zip64 ? ZIP64_VERSION : ZIP_VERSION);
+    put16 (buf, entry_flags (pd));
+    put16 (buf, 0);             /* stored */
+    put16 (buf, pd->dos_time);
+    put16 (buf, pd->dos_date);
+    /* CRC and sizes are in the data descriptor. */
+    put32 (buf, 0);
+    put32 (buf, zip64 ? ZIP_MAX_32 : 0);
+    put32 (buf, zip64 ? ZIP_MAX_32 : 0);
+    put16 (buf, name_len);
+    put16 (buf, zip64 ? 20 : 0);
+    g_byte_array_append (buf, (guint8 *)e->name, name_len);
+
+    if (zip64) {
+        put16 (buf, ZIP64_EXTRA_ID);
+        put16 (buf, 16);
+        put64 (buf, 0);
+        put64 (buf, 0);
     }
+}
 
-    /* Read data of this entry block by block */
-    while (idx < file->n_blocks) {
-        blk_id = file->blk_sha1s[idx];
-        handle = seaf_block_manager_open_block (seaf->block_mgr,
-                                                blk_id, BLOCK_READ);
-        if (!handle) {
-            seaf_warning ("Failed to open block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
+static void
+write_descriptor (PackDir *pd, ZipEntry *e)
+{
+    GByteArray *buf = pd->pending;
 
-        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
-                                                       handle);
-        if (!bmd) {
-            seaf_warning ("Failed to stat block %s\n", blk_id);
-            ret = -1;
-            goto out;
-        }
-        remain = bmd->size;
-        g_free (bmd);
+    put32 (buf, ZIP_DESCRIPTOR_SIG);
+    put32 (buf, e->crc);
+    if (entry_is_zip64 (e)) {
+        put64 (buf, e->size);
+        put64 (buf, e->size);
+    } else {
+        put32 (buf, (guint32)e->size);
+        put32 (buf, (guint32)e->size);
+    }
+}
 
-        if (crypt) {
-            if (seafile_decrypt_init (&ctx, crypt) < 0) {
-                seaf_warning ("Failed to init decrypt.\n");
-                ret = -1;
-                goto out;
-            }
+static void
+write_central_header (PackDir *pd, ZipEntry *e)
+{
+    GByteArray *buf = pd->pending;
+    gboolean zip64 = entry_is_zip64 (e);
+    gboolean offset64 = (e->offset >= ZIP_MAX_32);
+    int name_len = strlen(e->name);
+    int extra_len = central_extra_size (e);
+
+    put32 (buf, ZIP_CENTRAL_HEADER_SIG);
+    put16 (buf, ZIP_VERSION_MADE_BY);
+    put16 (buf, (zip64 || offset64) ? ZIP64_VERSION : ZIP_VERSION);
+    put16 (buf, entry_flags (pd));
+    put16 (buf, 0);
+    put16 (buf, pd->dos_time);
+    put16 (buf, pd->dos_date);
+    put32 (buf, e->crc);
+    put32 (buf, zip64 ? ZIP_MAX_32 : (guint32)e->size);
+    put32 (buf, zip64 ? ZIP_MAX_32 : (guint32)e->size);
+    put16 (buf, name_len);
+    put16 (buf, extra_len);
+    put16 (buf, 0);             /* comment */
+    put16 (buf, 0);             /* disk number */
+    put16 (buf, 0);             /* internal attrs */
+    put32 (buf, (e->mode | 0644) << 16);
+    put32 (buf, offset64 ? ZIP_MAX_32 : (guint32)e->offset);
+    g_byte_array_append (buf, (guint8 *)e->name, name_len);
+
+    if (extra_len > 0) {
+        put16 (buf, ZIP64_EXTRA_ID);
+        put16 (buf, extra_len - 4);
+        if (zip64) {
+            put64 (buf, e->size);
+            put64 (buf, e->size);
         }
+        if (offset64)
+            put64 (buf, e->offset);
+    }
+}
 
-        while (remain != 0) {
-            n = seaf_block_manager_read_block (seaf->block_mgr, handle,
-                                               buf, sizeof(buf));
-            if (n <= 0) {
-                seaf_warning ("failed to read block %s\n", blk_id);
-                ret = -1;
-                goto out;
-            }
-            remain -= n;
-
-            /* OK, We're read some data of this block  */
-            if (crypt == NULL) {
-                /* not encrypted */
-                len = archive_write_data (a, buf, n);
-                if (len <= 0) {
-                    seaf_warning ("archive_write_data returned %d\n", len);
-                    ret = -1;
-                    goto out;
-                }
-
-            } else {
-                /* an encrypted block */
-                dec_out = g_new (char, n + 16);
-                if (!dec_out) {
-                    seaf_warning ("Failed to alloc memory.\n");
-                    ret = -1;
-                    goto out;
-                }
-
-                int r = seafile_decrypt_update (&ctx,
-                                                dec_out,
-                                                &dec_out_len,
-                                                buf,
-                                                n);
-                if (r != 0) {
-                    seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                    ret = -1;
-                    goto out;
-                }
-
-                if (dec_out_len > 0) {
-                    len = archive_write_data (a, dec_out, dec_out_len);
-                    if (len <= 0) {
-                        seaf_warning ("archive_write_data returned %d\n", len);
-                        ret = -1;
-                        goto out;
-                    }
-                }
-
-                /* If it's the last piece of a block, call decrypt_final()
-                 * to decrypt the possible partial block. */
-                if (remain == 0) {
-                    r = seafile_decrypt_final (&ctx, dec_out, &dec_out_len);
-                    if (r != 0) {
-                        seaf_warning ("Decrypt block %s failed.\n", blk_id);
-                        ret = -1;
-                        goto out;
-                    }
-
-                    if (dec_out_len != 0) {
-                        len = archive_write_data (a, dec_out, dec_out_len);
-                        if (len <= 0) {
-                            seaf_warning ("archive_write_data returned %d\n", len);
-                            ret = -1;
-                            goto out;
-                        }
-                    }
-                }
+static void
+write_end_record (PackDir *pd)
+{
+    GByteArray *buf = pd->pending;
+    guint64 n_entries = pd->entries->len;
+
+    if (archive_is_zip64 (pd)) {
+        put32 (buf, ZIP64_END_SIG);
+        put64 (buf, ZIP64_END_SIZE - 12);
+        put16 (buf, ZIP_VERSION_MADE_BY);
+        put16 (buf, ZIP64_VERSION);
+        put32 (buf, 0);
+        put32 (buf, 0);
+        put64 (buf, n_entries);
+        put64 (buf, n_entries);
+        put64 (buf, pd->cd_size);
+        put64 (buf, pd->cd_offset);
+
+        put32 (buf, ZIP64_LOCATOR_SIG);
+        put32 (buf, 0);
+        put64 (buf, pd->cd_offset + pd->cd_size);
+        put32 (buf, 1);
+
+        n_entries = ZIP_MAX_16;
+    }
 
-                g_free (dec_out);
-                dec_out = NULL;
-            }
-        }
+    put32 (buf, ZIP_END_SIG);
+    put16 (buf, 0);
+    put16 (buf, 0);
+    put16 (buf, MIN (n_entries, ZIP_MAX_16));
+    put16 (buf, MIN (n_entries, ZIP_MAX_16));
+    put32 (buf, MIN (pd->cd_size, ZIP_MAX_32));
+    put32 (buf, MIN (pd->cd_offset, ZIP_MAX_32));
+    put16 (buf, 0);
+}
 
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free (seaf->block_mgr, handle);
-        handle = NULL;
+static int
+add_file_entry (PackDir *pd, const char *parent_dir, SeafDirent *dent)
+{
+    ZipEntry *e;
+    Seafile *file;
+    char *pathname;
 
-        /* turn to next block */
-        idx++;
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, dent->id);
+    if (!file) {
+        seaf_warning ("failed to get file %s\n", dent->id);
+        return -1;
     }
 
-out:
-    g_free (pathname);
-    if (entry)
-        archive_entry_free (entry);
-    if (file)
-        seafile_unref (file);
-    if (handle) {
-        seaf_block_manager_close_block (seaf->block_mgr, handle);
-        seaf_block_manager_block_handle_free(seaf->block_mgr, handle);
+    pathname = g_build_filename (pd->top_dir_name, parent_dir, dent->name, NULL);
+
+    e = g_new0 (ZipEntry, 1);
+    memcpy (e->file_id, dent->id, 41);
+    e->mode = dent->mode;
+    e->size = file->file_size;
+    seafile_unref (file);
+
+    /* File name fixup for WinRAR */
+    if (pd->is_windows && seaf->windows_encoding) {
+        e->name = do_iconv ("UTF-8", seaf->windows_encoding, pathname);
+        if (!e->name) {
+            seaf_warning ("Failed to convert file name to %s\n",
+                          seaf->windows_encoding);
+            g_free (pathname);
+            g_free (e);
+            return -1;
+        }
+        g_free (pathname);
+    } else {
+        e->name = pathname;
     }
-    g_free (dec_out);
 
-    return ret;
+    g_ptr_array_add (pd->entries, e);
+    return 0;
 }
 
 static int
-archive_dir (PackDirData *data,
-             const char *root_id,
-             const char *dirpath)
-             
+add_dir_entries (PackDir *pd, const char *root_id, const char *dirpath)
 {
     SeafDir *dir = NULL;
     SeafDirent *dent;
@@ -257,89 +375,363 @@ archive_dir (PackDirData *data,
     char *subpath = NULL;
     int ret = 0;
 
-    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, root_id);
+    dir = seaf_fs_manager_get_seafdir_shared (seaf->fs_mgr, root_id);
     if (!dir) {
         seaf_warning ("failed to get dir %s\n", root_id);
-        goto out;
+        return -1;
     }
 
     for (ptr = dir->entries; ptr; ptr = ptr->next) {
         dent = ptr->data;
-        if (S_ISREG(dent->mode)) {
-            ret = add_file_to_archive (data, dirpath, dent);
-
-        } else if (S_ISLNK(dent->mode)) {
-            if (archive_version_number() >= 3000001) {
-                /* Symlink in zip arhive is not supported in earlier version
-                 * of libarchive */
-                ret = add_file_to_archive (data, dirpath, dent);
-            }
+        if (S_ISREG(dent->mode) || S_ISLNK(dent->mode)) {
+            ret = add_file_entry (pd, dirpath, dent);
 
         } else if (S_ISDIR(dent->mode)) {
             subpath = g_build_filename (dirpath, dent->name, NULL);
-            ret = archive_dir (data, dent->id, subpath);
+            ret = add_dir_entries (pd, dent->id, subpath);
             g_free (subpath);
         }
 
-        if (ret < 0) {
-            goto out;
-        }
+        if (ret < 0)
+            break;
     }
 
-out:
-    if (dir)
-        seaf_dir_free (dir);
-
+    seaf_dir_unref (dir);
     return ret;
 }
 
-char *pack_dir (const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows)
+/* Compute offsets of all entries and the total size of the archive. */
+static void
+layout_archive (PackDir *pd)
 {
-    struct archive *a = NULL;
-    char *tmpfile_name = NULL ;
-    char *ret = NULL;
-    int fd = -1;
-
-    fd = g_file_open_tmp ("seafile-XXXXXX.zip", &tmpfile_name, NULL);
-    if (fd < 0) {
-        goto out;
+    ZipEntry *e;
+    guint64 offset = 0;
+    guint i;
+
+    for (i = 0; i < pd->entries->len; ++i) {
+        e = g_ptr_array_index (pd->entries, i);
+        e->offset = offset;
+        offset += local_entry_size (e);
     }
 
-    a = archive_write_new ();
-    archive_write_set_compression_none (a);
-    archive_write_set_format_zip (a);
-    archive_write_open_fd (a, fd);
-
-    PackDirData *data = g_new0 (PackDirData, 1);
-    data->crypt = crypt;
-    data->is_windows = is_windows;
-    data->a = a;
-    data->top_dir_name = dirname;
-    data->mtime = time(NULL);
-
-    if (archive_dir (data, root_id, "") < 0) {
-        g_debug ("failed to archive_dir\n");
-        goto out;
+    pd->cd_offset = offset;
+    pd->cd_size = 0;
+    for (i = 0; i < pd->entries->len; ++i) {
+        e = g_ptr_array_index (pd->entries, i);
+        pd->cd_size += ZIP_CENTRAL_HEADER_SIZE + strlen(e->name) +
+            central_extra_size (e);
     }
 
-    if (archive_write_finish(a) < 0) {
-        goto out;
+    pd->total_size = pd->cd_offset + pd->cd_size + ZIP_END_SIZE;
+    if (archive_is_zip64 (pd))
+        pd->total_size += ZIP64_END_SIZE + ZIP64_LOCATOR_SIZE;
+}
+
+static void
+set_dos_time (PackDir *pd, time_t t)
+{
+    struct tm tm;
+
+    localtime_r (&t, &tm);
+    pd->dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    pd->dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+static void
+close_block (PackDir *pd)
+{
+    if (pd->handle) {
+        seaf_block_manager_close_block (seaf->block_mgr, pd->handle);
+        seaf_block_manager_block_handle_free (seaf->block_mgr, pd->handle);
+        pd->handle = NULL;
+    }
+}
+
+PackDir *
+pack_dir_new (const char *dirname,
+              const char *root_id,
+              SeafileCrypt *crypt,
+              gboolean is_windows)
+{
+    PackDir *pd;
+
+    pd = g_new0 (PackDir, 1);
+    pd->crypt = crypt;
+    pd->is_windows = is_windows;
+    pd->top_dir_name = dirname;
+    pd->entries = g_ptr_array_new ();
+    pd->pending = g_byte_array_new ();
+    set_dos_time (pd, time(NULL));
+
+    if (add_dir_entries (pd, root_id, "") < 0) {
+        /* @crypt stays with the caller on failure. */
+        pd->crypt = NULL;
+        pack_dir_free (pd);
+        return NULL;
     }
+    /* Names are copied into entries. */
+    pd->top_dir_name = NULL;
+
+    layout_archive (pd);
+
+    return pd;
+}
+
+guint64
+pack_dir_get_size (PackDir *pd)
+{
+    return pd->total_size;
+}
+
+/*
+ * Read the next piece of data of the current file into pd->pending.
+ * Returns 0 when all data of the file is read.
+ */
+static int
+read_file_data (PackDir *pd)
+{
+    char buf[READ_BUF_SIZE];
+    char *dec_out;
+    int dec_out_len = -1;
+    BlockMetadata *bmd;
+    char *blk_id;
+    int n;
+
+    while (!pd->handle) {
+        if (pd->blk_idx == pd->file->n_blocks)
+            return 0;
+
+        blk_id = pd->file->blk_sha1s[pd->blk_idx];
+        pd->handle = seaf_block_manager_open_block (seaf->block_mgr,
+                                                    blk_id, BLOCK_READ);
+        if (!pd->handle) {
+            seaf_warning ("Failed to open block %s\n", blk_id);
+            return -1;
+        }
+
+        bmd = seaf_block_manager_stat_block_by_handle (seaf->block_mgr,
+                                                       pd->handle);
+        if (!bmd) {
+            seaf_warning ("Failed to stat block %s\n", blk_id);
+            return -1;
+        }
+        pd->blk_remain = bmd->size;
+        g_free (bmd);
 
-    ret = g_strdup (tmpfile_name);
+        if (pd->crypt && seafile_decrypt_init (&pd->ctx, pd->crypt) < 0) {
+            seaf_warning ("Failed to init decrypt.\n");
+            return -1;
+        }
 
-out:
-    if (data) g_free (data);
-    if (fd > 0) close (fd);
-    
-    if (!ret && tmpfile_name) {
-        /* zip failed: remove tmp file */
-        unlink (tmpfile_name);
+        if (pd->blk_remain == 0) {
+            close_block (pd);
+            ++(pd->blk_idx);
+        }
     }
-    g_free (tmpfile_name);
 
-    return ret;
+    blk_id = pd->file->blk_sha1s[pd->blk_idx];
+    n = seaf_block_manager_read_block (seaf->block_mgr, pd->handle,
+                                       buf, sizeof(buf));
+    if (n <= 0) {
+        seaf_warning ("failed to read block %s\n", blk_id);
+        return -1;
+    }
+    pd->blk_remain -= n;
+
+    if (!pd->crypt) {
+        g_byte_array_append (pd->pending, (guint8 *)buf, n);
+    } else {
+        dec_out = g_new (char, n + 16);
+        if (seafile_decrypt_update (&pd->ctx, dec_out, &dec_out_len,
+                                    buf, n) != 0) {
+            seaf_warning ("Decrypt block %s failed.\n", blk_id);
+            g_free (dec_out);
+            return -1;
+        }
+        g_byte_array_append (pd->pending, (guint8 *)dec_out, dec_out_len);
+
+        /* If it's the last piece of a block, call decrypt_final()
+         * to decrypt the possible partial block. */
+        if (pd->blk_remain == 0) {
+            if (seafile_decrypt_final (&pd->ctx, dec_out, &dec_out_len) != 0) {
+                seaf_warning ("Decrypt block %s failed.\n", blk_id);
+                g_free (dec_out);
+                return -1;
+            }
+            g_byte_array_append (pd->pending, (guint8 *)dec_out, dec_out_len);
+        }
+        g_free (dec_out);
+    }
+
+    if (pd->blk_remain == 0) {
+        close_block (pd);
+        ++(pd->blk_idx);
+    }
+
+    return 1;
+}
+
+/*
+ * Content-Length is sent before the archive is generated, so make sure
+ * the data matches the layout computed from the recorded sizes.
+ * Only called when all generated data has been returned.
+ */
+static gboolean
+check_offset (PackDir *pd, guint64 expected)
+{
+    if (pd->sent != expected) {
+        seaf_warning ("Zip archive offset is %"G_GUINT64_FORMAT
+                      ", expected %"G_GUINT64_FORMAT".\n",
+                      pd->sent, expected);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Generate the next piece of the archive into pd->pending. */
+static int
+generate_next (PackDir *pd)
+{
+    ZipEntry *e = NULL;
+    guint old_len;
+    int rc;
+
+    if (pd->cur < pd->entries->len)
+        e = g_ptr_array_index (pd->entries, pd->cur);
+
+    switch (pd->state) {
+    case PACK_LOCAL_HEADER:
+        if (!e) {
+            if (!check_offset (pd, pd->cd_offset))
+                return -1;
+            pd->state = PACK_CENTRAL_DIR;
+            pd->cur = 0;
+            return 0;
+        }
+        if (!check_offset (pd, e->offset))
+            return -1;
+
+        pd->file = seaf_fs_manager_get_seafile (seaf->fs_mgr, e->file_id);
+        if (!pd->file) {
+            seaf_warning ("failed to get file %s\n", e->file_id);
+            return -1;
+        }
+        pd->blk_idx = 0;
+        pd->written = 0;
+        pd->crc = 0;
+
+        write_local_header (pd, e);
+        pd->state = PACK_FILE_DATA;
+        return 0;
+
+    case PACK_FILE_DATA:
+        old_len = pd->pending->len;
+        rc = read_file_data (pd);
+        if (rc < 0)
+            return -1;
+
+        if (rc > 0) {
+            pd->crc = crc32 (pd->crc, pd->pending->data + old_len,
+                             pd->pending->len - old_len);
+            pd->written += pd->pending->len - old_len;
+            if (pd->written > e->size) {
+                seaf_warning ("Size of file %s is larger than recorded.\n",
+                              e->file_id);
+                return -1;
+            }
+            return 0;
+        }
+
+        /* Content-Length was computed from the recorded size. */
+        if (pd->written != e->size) {
+            seaf_warning ("Size of file %s is %"G_GUINT64_FORMAT
+                          ", but %"G_GUINT64_FORMAT" is recorded.\n",
+                          e->file_id, pd->written, e->size);
+            return -1;
+        }
+
+        seafile_unref (pd->file);
+        pd->file = NULL;
+        e->crc = pd->crc;
+        pd->state = PACK_DESCRIPTOR;
+        return 0;
+
+    case PACK_DESCRIPTOR:
+        write_descriptor (pd, e);
+        ++(pd->cur);
+        pd->state = PACK_LOCAL_HEADER;
+        return 0;
+
+    case PACK_CENTRAL_DIR:
+        if (!e) {
+            pd->state = PACK_END;
+            return 0;
+        }
+        write_central_header (pd, e);
+        ++(pd->cur);
+        return 0;
+
+    case PACK_END:
+        if (!check_offset (pd, pd->cd_offset + pd->cd_size))
+            return -1;
+        write_end_record (pd);
+        pd->state = PACK_DONE;
+        return 0;
+
+    case PACK_DONE:
+        return 0;
+    }
+
+    return -1;
+}
+
+int
+pack_dir_read (PackDir *pd, char *buf, int len)
+{
+    int n, copied = 0;
+
+    while (copied < len) {
+        if (pd->pending_off == pd->pending->len) {
+            g_byte_array_set_size (pd->pending, 0);
+            pd->pending_off = 0;
+
+            if (pd->state == PACK_DONE) {
+                if (!check_offset (pd, pd->total_size))
+                    return -1;
+                break;
+            }
+            if (generate_next (pd) < 0)
+                return -1;
+            continue;
+        }
+
+        n = MIN (len - copied, pd->pending->len - pd->pending_off);
+        memcpy (buf + copied, pd->pending->data + pd->pending_off, n);
+        pd->pending_off += n;
+        pd->sent += n;
+        copied += n;
+    }
+
+    return copied;
+}
+
+void
+pack_dir_free (PackDir *pd)
+{
+    ZipEntry *e;
+    guint i;
+
+    for (i = 0; i < pd->entries->len; ++i) {
+        e = g_ptr_array_index (pd->entries, i);
+        g_free (e->name);
+        g_free (e);
+    }
+    g_ptr_array_free (pd->entries, TRUE);
+    g_byte_array_free (pd->pending, TRUE);
+
+    close_block (pd);
+    if (pd->file)
+        seafile_unref (pd->file);
+    g_free (pd->crypt);
+    g_free (pd);
 }
@@ -1,11 +1,28 @@
 #ifndef PACK_DIR_H
 #define PACK_DIR_H
 
-/* Pack a seafile directory to a zipped archive, saved in a temporary file.
-   Return the path of this temporary file.
+/* Pack a seafile directory to a zip archive, which is generated while it's
+   read, so that the download can start before the whole directory is read.
  */
-char *pack_dir (const char *dirname,
-                const char *root_id,
-                SeafileCrypt *crypt,
-                gboolean is_windows);
+typedef struct PackDir PackDir;
+
+/* Collect the files in the directory and compute the layout of the archive.
+   @crypt is owned by the returned object. If NULL is returned, @crypt is
+   not freed and still belongs to the caller.
+ */
+PackDir *pack_dir_new (const char *dirname,
+                       const char *root_id,
+                       SeafileCrypt *crypt,
+                       gboolean is_windows);
+
+/* Size of the whole archive, known before any data is read. */
+guint64 pack_dir_get_size (PackDir *pd);
+
+/* Read the next @len bytes of the archive into @buf.
+   Returns the number of bytes read, 0 at the end of the archive, or -1 on error.
+ */
+int pack_dir_read (PackDir *pd, char *buf, int len);
+
+void pack_dir_free (PackDir *pd);
+
 #endif
@@ -15,6 +15,7 @@
 #include <ccnet.h>
 
 #include "seafile-object.h"
+#include "seafile-crypt.h"
 #include "seafile.h"
 
 #include "utils.h"
@@ -22,6 +23,7 @@
 #include "seafile-session.h"
 #include "httpserver.h"
 #include "upload-file.h"
+#include "content-range.h"
 
 enum RecvState {
     RECV_INIT,
@@ -56,12 +58,13 @@ typedef struct RecvFSM {
 
     GHashTable *form_kvs;       /* key/value of form fields */
     GList *uploaded_files;      /* uploaded file names */
-    GList *tmp_files;           /* tmp files for each uploaded file */
+    GList *file_ids;            /* file id for each uploaded file */
 
     gboolean recved_crlf; /* Did we recv a CRLF when write out the last line? */
     char *file_name;
-    char *tmp_file;
-    int fd;
+    /* File data is chunked into blocks while it's received. */
+    SeafIndexStream *stream;
+    SeafileCrypt *crypt;
 
     /* For upload progress. */
     char *progress_id;
@@ -70,7 +73,6 @@ typedef struct RecvFSM {
 
 #define MAX_CONTENT_LINE 10240
 #define TEMP_FILE_DIR "/tmp/seafhttp"
-#define MAX_UPLOAD_FILE_SIZE 100 * ((gint64)1 << 20) /* 100MB */
 
 static GHashTable *upload_progress;
 static pthread_mutex_t pg_lock;
@@ -164,64 +166,6 @@ redirect_to_success_page (evhtp_request_t *req,
     evhtp_send_reply(req, EVHTP_RES_FOUND);
 }
 
-static gboolean
-check_tmp_file_list (GList *tmp_files, int *error_code)
-{
-    GList *ptr;
-    char *tmp_file;
-    struct stat st;
-    gint64 total_size = 0;
-
-    for (ptr = tmp_files; ptr; ptr = ptr->next) {
-        tmp_file = ptr->data;
-
-        if (stat (tmp_file, &st) < 0) {
-            seaf_warning ("[upload] Failed to stat temp file %s.\n", tmp_file);
-            *error_code = ERROR_RECV;
-            return FALSE;
-        }
-
-        total_size += (gint64)st.st_size;
-    }
-
-    if (total_size > MAX_UPLOAD_FILE_SIZE) {
-        seaf_warning ("[upload] File size is too large.\n");
-        *error_code = ERROR_SIZE;
-        return FALSE;
-    }
-
-    return TRUE;
-}
-
-static char *
-file_list_to_json (GList *files)
-{
-    JsonNode *root;
-    JsonArray *array;
-    GList *ptr;
-    char *file;
-    JsonGenerator *gen;
-    char *json_data;
-    gsize len;
-
-    root = json_node_new (JSON_NODE_ARRAY);
-    array = json_array_new ();
-
-    for (ptr = files; ptr; ptr = ptr->next) {
-        file = ptr->data;
-        json_array_add_string_element (array, file);
-    }
-    json_node_set_array (root, array);
-
-    gen = json_generator_new ();
-    json_generator_set_root (gen, root);
-    json_data = json_generator_to_data (gen, &len);
-    json_node_free (root);
-    g_object_unref (gen);
-
-    return json_data;
-}
-
 static void
 upload_cb(evhtp_request_t *req, void *arg)
 {
@@ -231,7 +175,7 @@ upload_cb(evhtp_request_t *req, void *arg)
     GError *error = NULL;
     int error_code = ERROR_INTERNAL;
     char *err_file = NULL;
-    char *filenames_json, *tmp_files_json;
+    char *filenames_json, *file_ids_json;
 
     /* After upload_headers_cb() returns an error, libevhtp may still
      * receive data from the web browser and call into this cb.
@@ -240,7 +184,7 @@ upload_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->tmp_files) {
+    if (!fsm->file_ids) {
         seaf_warning ("[upload] No file uploaded.\n");
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         return;
@@ -254,9 +198,6 @@ upload_cb(evhtp_request_t *req, void *arg)
         return;
     }
 
-    if (!check_tmp_file_list (fsm->tmp_files, &error_code))
-        goto error;
-
     rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
                                                  NULL,
                                                  "seafserv-threaded-rpcserver");
@@ -267,18 +208,18 @@ upload_cb(evhtp_request_t *req, void *arg)
         goto error;
     }
 
-    filenames_json = file_list_to_json (fsm->uploaded_files);
-    tmp_files_json = file_list_to_json (fsm->tmp_files);
+    filenames_json = string_list_to_json (fsm->uploaded_files);
+    file_ids_json = string_list_to_json (fsm->file_ids);
 
-    seafile_post_multi_files (rpc_client,
-                              fsm->repo_id,
-                              parent_dir,
-                              filenames_json,
-                              tmp_files_json,
-                              fsm->user,
-                              &error);
+    seafile_post_multi_files_by_id (rpc_client,
+                                    fsm->repo_id,
+                                    parent_dir,
+                                    filenames_json,
+                                    file_ids_json,
+                                    fsm->user,
+                                    &error);
     g_free (filenames_json);
-    g_free (tmp_files_json);
+    g_free (file_ids_json);
     if (error) {
         if (error->code == POST_FILE_ERR_FILENAME) {
             error_code = ERROR_FILENAME;
@@ -316,7 +257,7 @@ update_cb(evhtp_request_t *req, void *arg)
     if (!fsm || fsm->state == RECV_ERROR)
         return;
 
-    if (!fsm->tmp_files) {
+    if (!fsm->file_ids) {
         seaf_warning ("[update] No file uploaded.\n");
         evhtp_send_reply (req, EVHTP_RES_BADREQ);
         return;
@@ -333,9 +274,6 @@ update_cb(evhtp_request_t *req, void *arg)
     parent_dir = g_path_get_dirname (target_file);
     filename = g_path_get_basename (target_file);
 
-    if (!check_tmp_file_list (fsm->tmp_files, &error_code))
-        goto error;
-
     head_id = evhtp_kv_find (req->uri->query, "head");
 
     rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
@@ -348,14 +286,14 @@ update_cb(evhtp_request_t *req, void *arg)
         goto error;
     }
 
-    seafile_put_file (rpc_client,
-                      fsm->repo_id,
-                      (char *)(fsm->tmp_files->data),
-                      parent_dir,
-                      filename,
-                      fsm->user,
-                      head_id,
-                      &error);
+    seafile_put_file_by_id (rpc_client,
+                            fsm->repo_id,
+                            (char *)(fsm->file_ids->data),
+                            parent_dir,
+                            filename,
+                            fsm->user,
+                            head_id,
+                            &error);
     if (error) {
         if (g_strcmp0 (error->message, "file does not exist") == 0) {
             error_code = ERROR_NOT_EXIST;
@@ -387,7 +325,6 @@ static evhtp_res
 upload_finish_cb (evhtp_request_t *req, void *arg)
 {
     RecvFSM *fsm = arg;
-    GList *ptr;
 
     if (!fsm)
         return EVHTP_RES_OK;
@@ -402,14 +339,10 @@ upload_finish_cb (evhtp_request_t *req, void *arg)
     g_hash_table_destroy (fsm->form_kvs);
 
     g_free (fsm->file_name);
-    if (fsm->tmp_file) {
-        close (fsm->fd);
-    }
-    g_free (fsm->tmp_file);
+    seaf_fs_manager_index_stream_free (fsm->stream);
+    g_free (fsm->crypt);
 
-    for (ptr = fsm->tmp_files; ptr; ptr = ptr->next)
-        g_unlink ((char *)(ptr->data));
-    string_list_free (fsm->tmp_files);
+    string_list_free (fsm->file_ids);
     string_list_free (fsm->uploaded_files);
 
     evbuffer_free (fsm->line);
@@ -504,21 +437,17 @@ parse_mime_header (char *header, RecvFSM *fsm)
 }
 
 static int
-open_temp_file (RecvFSM *fsm)
+start_index_stream (RecvFSM *fsm)
 {
-    GString *temp_file = g_string_new (NULL);
-
-    g_string_printf (temp_file, "%s/%sXXXXXX", TEMP_FILE_DIR, fsm->file_name);
-
-    fsm->fd = mkstemp (temp_file->str);
-    if (fsm->fd < 0) {
-        g_string_free (temp_file, TRUE);
-        return -1;
-    }
-
-    fsm->tmp_file = g_string_free (temp_file, FALSE);
-
-    return 0;
+    /* The request size is used to choose the chunk size, since the
+     * size of the file is unknown yet.
+     */
+    fsm->stream = seaf_fs_manager_index_stream_new (seaf->fs_mgr,
+                                                    fsm->crypt,
+                                                    fsm->progress->size,
+                                                    0, NULL, 0);
+    fsm->recved_crlf = FALSE;
+    return fsm->stream ? 0 : -1;
 }
 
 static evhtp_res
@@ -552,18 +481,41 @@ recv_form_field (RecvFSM *fsm, gboolean *no_line)
     return EVHTP_RES_OK;
 }
 
-static void
+static int
 add_uploaded_file (RecvFSM *fsm)
 {
+    unsigned char sha1[20];
+    char file_id[41];
+    guint64 size;
+    int ret;
+
+    ret = seaf_fs_manager_index_stream_finish (fsm->stream, sha1, &size);
+    seaf_fs_manager_index_stream_free (fsm->stream);
+    fsm->stream = NULL;
+    if (ret < 0) {
+        seaf_warning ("[upload] Failed to index %s.\n", fsm->file_name);
+        return -1;
+    }
+    rawdata_to_hex (sha1, file_id, 20);
+
     fsm->uploaded_files = g_list_prepend (fsm->uploaded_files,
                                           get_basename(fsm->file_name));
-    fsm->tmp_files = g_list_prepend (fsm->tmp_files, g_strdup(fsm->tmp_file));
+    fsm->file_ids = g_list_prepend (fsm->file_ids, g_strdup(file_id));
 
     g_free (fsm->file_name);
-    g_free (fsm->tmp_file);
-    close (fsm->fd);
     fsm->file_name = NULL;
-    fsm->tmp_file = NULL;
+    return 0;
+}
+
+static int
+write_file_data (RecvFSM *fsm, const char *data, size_t len)
+{
+    if (seaf_fs_manager_index_stream_write (fsm->stream, data, (int)len) < 0) {
+        seaf_warning ("[upload] Failed to write blocks for %s.\n",
+                      fsm->file_name);
+        return -1;
+    }
+    return 0;
 }
 
 static evhtp_res
@@ -581,45 +533,40 @@ recv_file_data (RecvFSM *fsm, gboolean *no_line)
          * It should be safe to assume the boundary line is
          * no longer than 10240 bytes.
          */
-        if (evbuffer_get_length (fsm->line) >= MAX_CONTENT_LINE) {
-            seaf_debug ("[upload] recv file data %d bytes.\n",
-                     evbuffer_get_length(fsm->line));
+        len = evbuffer_get_length (fsm->line);
+        if (len >= MAX_CONTENT_LINE) {
+            seaf_debug ("[upload] recv file data %d bytes.\n", len);
             if (fsm->recved_crlf) {
-                if (writen (fsm->fd, "\r\n", 2) < 0) {
-                    seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                               strerror(errno));
+                if (write_file_data (fsm, "\r\n", 2) < 0)
                     return EVHTP_RES_SERVERR;
-                }
             }
-            if (evbuffer_write (fsm->line, fsm->fd) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
+            if (write_file_data (fsm,
+                                 (char *)evbuffer_pullup (fsm->line, -1),
+                                 len) < 0)
                 return EVHTP_RES_SERVERR;
-            }
+            evbuffer_drain (fsm->line, len);
             fsm->recved_crlf = FALSE;
         }
         *no_line = TRUE;
     } else if (strstr (line, fsm->boundary) != NULL) {
         seaf_debug ("[upload] file data ends.\n");
 
-        add_uploaded_file (fsm);
+        free (line);
+        if (add_uploaded_file (fsm) < 0)
+            return EVHTP_RES_SERVERR;
 
         g_free (fsm->input_name);
         fsm->input_name = NULL;
         fsm->state = RECV_HEADERS;
-        free (line);
     } else {
         seaf_debug ("[upload] recv file data %d bytes.\n", len + 2);
         if (fsm->recved_crlf) {
-            if (writen (fsm->fd, "\r\n", 2) < 0) {
-                seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                           strerror(errno));
+            if (write_file_data (fsm, "\r\n", 2) < 0) {
+                free (line);
                 return EVHTP_RES_SERVERR;
             }
         }
-        if (writen (fsm->fd, line, len) < 0) {
-            seaf_warning ("[upload] Failed to write temp file: %s.\n",
-                       strerror(errno));
+        if (write_file_data (fsm, line, len) < 0) {
             free (line);
             return EVHTP_RES_SERVERR;
         }
@@ -695,8 +642,8 @@ upload_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
                     /* Read an blank line, headers end. */
                     free (line);
                     if (g_strcmp0 (fsm->input_name, "file") == 0) {
-                        if (open_temp_file (fsm) < 0) {
-                            seaf_warning ("[upload] Failed open temp file.\n");
+                        if (start_index_stream (fsm) < 0) {
+                            seaf_warning ("[upload] Failed to start indexing.\n");
                             res = EVHTP_RES_SERVERR;
                             goto out;
                         }
@@ -828,6 +775,51 @@ check_access_token (SearpcClient *rpc,
     return 0;
 }
 
+/* Blocks of encrypted repos are encrypted while they're received. */
+static int
+get_repo_crypt (SearpcClient *rpc,
+                const char *repo_id,
+                const char *user,
+                SeafileCrypt **crypt)
+{
+    SeafRepo *repo;
+    SeafileCryptKey *key;
+    char *key_hex, *iv_hex;
+    unsigned char enc_key[16], enc_iv[16];
+
+    *crypt = NULL;
+
+    repo = seaf_repo_manager_get_repo (seaf->repo_mgr, repo_id);
+    if (!repo) {
+        seaf_warning ("[upload] Failed to get repo %s.\n", repo_id);
+        return -1;
+    }
+
+    if (!repo->encrypted) {
+        seaf_repo_unref (repo);
+        return 0;
+    }
+
+    key = (SeafileCryptKey *) seafile_get_decrypt_key (rpc, repo_id,
+                                                       user, NULL);
+    if (!key) {
+        seaf_warning ("[upload] Password for repo %s is not set.\n", repo_id);
+        seaf_repo_unref (repo);
+        return -1;
+    }
+
+    g_object_get (key, "key", &key_hex, "iv", &iv_hex, NULL);
+    hex_to_rawdata (key_hex, enc_key, 16);
+    hex_to_rawdata (iv_hex, enc_iv, 16);
+    *crypt = seafile_crypt_new (repo->enc_version, enc_key, enc_iv);
+    g_free (key_hex);
+    g_free (iv_hex);
+    g_object_unref (key);
+    seaf_repo_unref (repo);
+
+    return 0;
+}
+
 static int
 get_progress_info (evhtp_request_t *req,
                    evhtp_headers_t *hdr,
@@ -854,6 +846,25 @@ get_progress_info (evhtp_request_t *req,
     return 0;
 }
 
+/*
+ * Refuse uploads that would exceed the quota before any data is read.
+ * The quota is checked again when the files are added to the repo.
+ */
+static int
+check_quota_for_upload (const char *repo_id, gint64 size)
+{
+    SearpcClient *rpc_client;
+    int ret;
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+    ret = seafile_check_quota_with_delta (rpc_client, repo_id, size, NULL);
+    ccnet_rpc_client_free (rpc_client);
+
+    return ret;
+}
+
 static evhtp_res
 upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
 {
@@ -863,8 +874,10 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     gint64 content_len;
     char *progress_id = NULL;
     char *err_msg = NULL;
+    int code = EVHTP_RES_BADREQ;
     RecvFSM *fsm = NULL;
     Progress *progress = NULL;
+    SeafileCrypt *crypt = NULL;
 
     /* URL format: http://host:port/[upload|update]/<token>?X-Progress-ID=<uuid> */
     token = req->uri->path->file;
@@ -881,6 +894,7 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     if (check_access_token (rpc_client, token, &repo_id, &user) < 0) {
         seaf_warning ("[upload] Invalid token.\n");
         err_msg = "Access denied";
+        code = EVHTP_RES_FORBIDDEN;
         goto err;
     }
 
@@ -892,6 +906,18 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
     if (get_progress_info (req, hdr, &content_len, &progress_id) < 0)
         goto err;
 
+    if (check_quota_for_upload (repo_id, content_len) < 0) {
+        seaf_warning ("[upload] Out of quota.\n");
+        err_msg = "Out of quota";
+        code = EVHTP_RES_FORBIDDEN;
+        goto err;
+    }
+
+    if (get_repo_crypt (rpc_client, repo_id, user, &crypt) < 0) {
+        err_msg = "Failed to get repo key";
+        goto err;
+    }
+
     progress = g_new0 (Progress, 1);
     progress->size = content_len;
 
@@ -904,6 +930,7 @@ upload_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
                                            g_free, g_free);
     fsm->progress_id = progress_id;
     fsm->progress = progress;
+    fsm->crypt = crypt;
 
     pthread_mutex_lock (&pg_lock);
     g_hash_table_insert (upload_progress, g_strdup(progress_id), progress);
@@ -929,7 +956,7 @@ err:
     req->keepalive = 0;
     if (err_msg)
         evbuffer_add_printf (req->buffer_out, "%s\n", err_msg);
-    evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    evhtp_send_reply (req, code);
 
     if (rpc_client)
         ccnet_rpc_client_free (rpc_client);
@@ -937,6 +964,7 @@ err:
     g_free (repo_id);
     g_free (user);
     g_free (boundary);
+    g_free (progress_id);
     return EVHTP_RES_OK;
 }
 
@@ -985,6 +1013,648 @@ upload_progress_cb(evhtp_request_t *req, void *arg)
     g_string_free (buf, TRUE);
 }
 
+/*
+ * Resumable upload.
+ *
+ * A file can be uploaded in several requests to
+ *   /upload_chunk/<token>?upload_id=<id>&parent_dir=<dir>&filename=<name>
+ * or, to update an existing file,
+ *   /upload_chunk/<token>?upload_id=<id>&target_file=<path>[&head=<commit id>]
+ *
+ * <id> is chosen by the client to identify the upload. The body of each
+ * request is a piece of the file, given by the header
+ *   Content-Range: bytes <first>-<last>/<file size>
+ *
+ * An empty file is uploaded with no body, and with "*" for the range and
+ * 0 for the file size in Content-Range.
+ *
+ * The reply is {"offset": <n>}, where n is the number of bytes the server
+ * has got. The next piece should start at n. Data before n in a piece is
+ * skipped, and a piece starting after n is refused with 416. When all the
+ * data is received, the file is added to the repo.
+ *
+ * A GET request to the same url returns the offset, so that the client
+ * can find out where to resume after a disconnect.
+ *
+ * Blocks are written while the data arrives. When a request ends, for
+ * whatever reason, the block list and the data not chunked yet are saved
+ * in CHUNK_STATE_DIR, so that nothing received is lost. Upload ids are
+ * scoped by user, so the files are named by a hash of the user and the id.
+ */
+
+#define CHUNK_STATE_DIR TEMP_FILE_DIR "/chunks"
+#define MAX_UPLOAD_ID_LEN 64
+/* Unfinished uploads are removed after this many seconds. */
+#define CHUNK_STATE_EXPIRE (24 * 3600)
+
+typedef struct ChunkRecv {
+    char *upload_id;
+    char *state_id;         /* names the state files, see make_state_id() */
+    char *repo_id;
+    char *user;
+    gint64 size;            /* size of the whole file */
+    gint64 offset;          /* bytes received so far */
+    gint64 skip;            /* bytes at the start of the body to skip */
+    gint64 saved_offset;    /* offset of the saved pending file, or -1 */
+    SeafileCrypt *crypt;
+    SeafIndexStream *stream;
+    gboolean error;
+    char file_id[41];       /* set when all data is received */
+} ChunkRecv;
+
+/* Uploads being received by state id, to refuse concurrent requests
+ * for one upload. */
+static GHashTable *active_uploads;
+static pthread_mutex_t chunk_lock;
+
+static gboolean
+is_valid_upload_id (const char *upload_id)
+{
+    const char *p;
+
+    if (!upload_id || *upload_id == 0 ||
+        strlen(upload_id) > MAX_UPLOAD_ID_LEN)
+        return FALSE;
+
+    for (p = upload_id; *p; ++p) {
+        if (!g_ascii_isalnum (*p) && *p != '-' && *p != '_')
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static char *
+make_state_id (const char *user, const char *upload_id)
+{
+    char *key, *state_id;
+
+    key = g_strconcat (user, "/", upload_id, NULL);
+    state_id = g_compute_checksum_for_string (G_CHECKSUM_SHA1, key, -1);
+    g_free (key);
+
+    return state_id;
+}
+
+static char *
+chunk_state_path (const char *state_id)
+{
+    return g_build_filename (CHUNK_STATE_DIR, state_id, NULL);
+}
+
+/* Pending data is saved to a file named by the offset it starts at.
+ * Data starting at the same offset only grows, so a pending file is never
+ * shorter than what the state file records, even if the server stops
+ * between writing the two files.
+ */
+static char *
+chunk_pending_path (const char *state_id, gint64 offset)
+{
+    return g_strdup_printf ("%s/%s.%"G_GINT64_FORMAT,
+                            CHUNK_STATE_DIR, state_id, offset);
+}
+
+static void
+remove_pending_file (ChunkRecv *cr, gint64 offset)
+{
+    char *path = chunk_pending_path (cr->state_id, offset);
+
+    g_unlink (path);
+    g_free (path);
+}
+
+static void
+remove_chunk_state (ChunkRecv *cr)
+{
+    char *path;
+
+    if (cr->saved_offset >= 0)
+        remove_pending_file (cr, cr->saved_offset);
+
+    path = chunk_state_path (cr->state_id);
+    g_unlink (path);
+    g_free (path);
+}
+
+static int
+save_chunk_state (ChunkRecv *cr)
+{
+    const unsigned char *sha1s;
+    const char *pending;
+    int n_blocks, pending_len, i;
+    gint64 offset;
+    char *path, *blocks, *json_data;
+    JsonObject *object;
+    JsonNode *root;
+    JsonGenerator *gen;
+    gsize len;
+    GError *error = NULL;
+    int ret = 0;
+
+    offset = seaf_fs_manager_index_stream_get_blocks (cr->stream,
+                                                      &sha1s, &n_blocks);
+    pending = seaf_fs_manager_index_stream_get_pending (cr->stream,
+                                                        &pending_len);
+
+    path = chunk_pending_path (cr->state_id, offset);
+    if (!g_file_set_contents (path, pending, pending_len, &error)) {
+        seaf_warning ("[upload chunk] Failed to save %s: %s.\n",
+                      path, error->message);
+        g_clear_error (&error);
+        g_free (path);
+        return -1;
+    }
+    g_free (path);
+
+    blocks = g_new0 (char, n_blocks * 40 + 1);
+    for (i = 0; i < n_blocks; ++i)
+        rawdata_to_hex (sha1s + i * 20, blocks + i * 40, 20);
+
+    object = json_object_new ();
+    json_object_set_string_member (object, "repo_id", cr->repo_id);
+    json_object_set_string_member (object, "user", cr->user);
+    json_object_set_int_member (object, "size", cr->size);
+    json_object_set_int_member (object, "offset", offset);
+    json_object_set_int_member (object, "pending", pending_len);
+    json_object_set_string_member (object, "blocks", blocks);
+    g_free (blocks);
+
+    root = json_node_new (JSON_NODE_OBJECT);
+    json_node_take_object (root, object);
+    gen = json_generator_new ();
+    json_generator_set_root (gen, root);
+    json_data = json_generator_to_data (gen, &len);
+    json_node_free (root);
+    g_object_unref (gen);
+
+    path = chunk_state_path (cr->state_id);
+    if (!g_file_set_contents (path, json_data, len, &error)) {
+        seaf_warning ("[upload chunk] Failed to save %s: %s.\n",
+                      path, error->message);
+        g_clear_error (&error);
+        ret = -1;
+    }
+    g_free (path);
+    g_free (json_data);
+
+    /* The old pending file is replaced. */
+    if (ret == 0) {
+        if (cr->saved_offset >= 0 && cr->saved_offset != offset)
+            remove_pending_file (cr, cr->saved_offset);
+        cr->saved_offset = offset;
+    }
+
+    return ret;
+}
+
+/* Returns the offset of the saved upload, 0 if there is none,
+ * or -1 if it's corrupt or belongs to another user or repo.
+ */
+static gint64
+load_chunk_state (ChunkRecv *cr, gboolean open_stream)
+{
+    JsonParser *parser;
+    JsonObject *object;
+    const char *repo_id, *user, *blocks;
+    unsigned char *sha1s = NULL;
+    char *path, *pending = NULL;
+    gsize len;
+    gint64 size, offset, pending_len;
+    int n_blocks, i;
+    gint64 ret = -1;
+
+    path = chunk_state_path (cr->state_id);
+    if (!g_file_test (path, G_FILE_TEST_EXISTS)) {
+        g_free (path);
+        if (!open_stream)
+            return 0;
+        cr->stream = seaf_fs_manager_index_stream_new (seaf->fs_mgr,
+                                                       cr->crypt, cr->size,
+                                                       0, NULL, 0);
+        return cr->stream ? 0 : -1;
+    }
+
+    parser = json_parser_new ();
+    if (!json_parser_load_from_file (parser, path, NULL) ||
+        !JSON_NODE_HOLDS_OBJECT (json_parser_get_root (parser))) {
+        seaf_warning ("[upload chunk] Corrupt state file %s.\n", path);
+        goto out;
+    }
+    object = json_node_get_object (json_parser_get_root (parser));
+
+    repo_id = json_object_get_string_member (object, "repo_id");
+    user = json_object_get_string_member (object, "user");
+    size = json_object_get_int_member (object, "size");
+    offset = json_object_get_int_member (object, "offset");
+    pending_len = json_object_get_int_member (object, "pending");
+    blocks = json_object_get_string_member (object, "blocks");
+    if (g_strcmp0 (repo_id, cr->repo_id) != 0 ||
+        g_strcmp0 (user, cr->user) != 0) {
+        seaf_warning ("[upload chunk] Upload %s belongs to another user.\n",
+                      cr->upload_id);
+        goto out;
+    }
+    /* The size isn't known when only the offset is asked for. */
+    if (!blocks || strlen(blocks) % 40 != 0 ||
+        (open_stream && !content_range_can_resume (size, cr->size))) {
+        seaf_warning ("[upload chunk] Bad state for upload %s.\n",
+                      cr->upload_id);
+        goto out;
+    }
+
+    if (!open_stream) {
+        ret = offset + pending_len;
+        goto out;
+    }
+
+    n_blocks = strlen(blocks) / 40;
+    sha1s = g_new (unsigned char, n_blocks * 20 + 1);
+    for (i = 0; i < n_blocks; ++i)
+        hex_to_rawdata (blocks + i * 40, sha1s + i * 20, 20);
+
+    g_free (path);
+    path = chunk_pending_path (cr->state_id, offset);
+    if (!g_file_get_contents (path, &pending, &len, NULL) ||
+        len < pending_len) {
+        seaf_warning ("[upload chunk] Pending data of %s is lost.\n",
+                      cr->upload_id);
+        goto out;
+    }
+
+    cr->stream = seaf_fs_manager_index_stream_new (seaf->fs_mgr, cr->crypt,
+                                                   size, offset,
+                                                   sha1s, n_blocks);
+    if (!cr->stream ||
+        seaf_fs_manager_index_stream_write (cr->stream, pending,
+                                            (int)pending_len) < 0)
+        goto out;
+
+    cr->saved_offset = offset;
+    ret = offset + pending_len;
+
+out:
+    g_object_unref (parser);
+    g_free (path);
+    g_free (sha1s);
+    g_free (pending);
+    return ret;
+}
+
+static void
+remove_stale_chunk_state ()
+{
+    GDir *dir;
+    const char *dname;
+    char *path;
+    struct stat st;
+    time_t now = time(NULL);
+
+    dir = g_dir_open (CHUNK_STATE_DIR, 0, NULL);
+    if (!dir)
+        return;
+
+    while ((dname = g_dir_read_name (dir)) != NULL) {
+        path = g_build_filename (CHUNK_STATE_DIR, dname, NULL);
+        if (stat (path, &st) == 0 && now - st.st_mtime > CHUNK_STATE_EXPIRE)
+            g_unlink (path);
+        g_free (path);
+    }
+    g_dir_close (dir);
+}
+
+static void
+send_chunk_offset (evhtp_request_t *req, gint64 offset, int code)
+{
+    evbuffer_add_printf (req->buffer_out,
+                         "{\"offset\": %"G_GINT64_FORMAT"}", offset);
+    evhtp_send_reply (req, code);
+}
+
+static void
+free_chunk_recv (ChunkRecv *cr)
+{
+    g_free (cr->upload_id);
+    g_free (cr->state_id);
+    g_free (cr->repo_id);
+    g_free (cr->user);
+    g_free (cr->crypt);
+    seaf_fs_manager_index_stream_free (cr->stream);
+    g_free (cr);
+}
+
+static evhtp_res
+chunk_read_cb (evhtp_request_t *req, evbuf_t *buf, void *arg)
+{
+    ChunkRecv *cr = arg;
+    size_t len = evbuffer_get_length (buf);
+    size_t n;
+    char *data;
+
+    if (cr->error) {
+        evbuffer_drain (buf, len);
+        return EVHTP_RES_OK;
+    }
+
+    if (cr->skip > 0) {
+        n = (cr->skip < (gint64)len) ? (size_t)cr->skip : len;
+        evbuffer_drain (buf, n);
+        cr->skip -= n;
+        len -= n;
+    }
+
+    if (len > 0) {
+        if (cr->offset + (gint64)len > cr->size) {
+            seaf_warning ("[upload chunk] More data than the file size.\n");
+            cr->error = TRUE;
+        } else {
+            data = (char *)evbuffer_pullup (buf, -1);
+            if (seaf_fs_manager_index_stream_write (cr->stream,
+                                                    data, (int)len) < 0)
+                cr->error = TRUE;
+            else
+                cr->offset += len;
+        }
+    }
+
+    evbuffer_drain (buf, evbuffer_get_length (buf));
+
+    if (cr->error) {
+        evhtp_request_pause (req);
+        req->keepalive = 0;
+        evbuffer_add_printf (req->buffer_out, "Failed to receive data\n");
+        evhtp_send_reply (req, EVHTP_RES_SERVERR);
+    }
+
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+chunk_finish_cb (evhtp_request_t *req, void *arg)
+{
+    ChunkRecv *cr = arg;
+
+    /* Keep the data received, unless the file has been added to the repo. */
+    if (cr->file_id[0] != 0)
+        remove_chunk_state (cr);
+    else if (cr->stream && cr->size > 0)
+        save_chunk_state (cr);
+
+    pthread_mutex_lock (&chunk_lock);
+    g_hash_table_remove (active_uploads, cr->state_id);
+    pthread_mutex_unlock (&chunk_lock);
+
+    free_chunk_recv (cr);
+    return EVHTP_RES_OK;
+}
+
+static evhtp_res
+chunk_headers_cb (evhtp_request_t *req, evhtp_headers_t *hdr, void *arg)
+{
+    SearpcClient *rpc_client = NULL;
+    char *token;
+    const char *upload_id, *range;
+    ChunkRecv *cr = NULL;
+    gint64 first = 0, size = 0, offset;
+    int code = EVHTP_RES_BADREQ;
+    char *err_msg = NULL;
+
+    /* GET requests for the offset are handled in chunk_upload_cb(). */
+    if (evhtp_request_get_method (req) == htp_method_GET)
+        return EVHTP_RES_OK;
+
+    token = req->uri->path->file;
+    upload_id = evhtp_kv_find (req->uri->query, "upload_id");
+    range = evhtp_kv_find (hdr, "Content-Range");
+    if (!token || !is_valid_upload_id (upload_id)) {
+        err_msg = "Invalid URL";
+        goto err;
+    }
+    if (!range || parse_content_range (range, &first, &size) < 0) {
+        err_msg = "Invalid Content-Range";
+        goto err;
+    }
+
+    cr = g_new0 (ChunkRecv, 1);
+    cr->upload_id = g_strdup (upload_id);
+    cr->size = size;
+    cr->saved_offset = -1;
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-rpcserver");
+
+    if (check_access_token (rpc_client, token, &cr->repo_id, &cr->user) < 0) {
+        err_msg = "Access denied";
+        code = EVHTP_RES_FORBIDDEN;
+        goto err;
+    }
+    cr->state_id = make_state_id (cr->user, upload_id);
+
+    /* Data received before isn't counted in the usage either. */
+    if (check_quota_for_upload (cr->repo_id, size) < 0) {
+        err_msg = "Out of quota";
+        code = EVHTP_RES_FORBIDDEN;
+        goto err;
+    }
+
+    if (get_repo_crypt (rpc_client, cr->repo_id, cr->user, &cr->crypt) < 0) {
+        err_msg = "Failed to get repo key";
+        goto err;
+    }
+
+    pthread_mutex_lock (&chunk_lock);
+    if (g_hash_table_lookup (active_uploads, cr->state_id)) {
+        pthread_mutex_unlock (&chunk_lock);
+        err_msg = "Upload in progress";
+        code = EVHTP_RES_CONFLICT;
+        goto err;
+    }
+    g_hash_table_insert (active_uploads, g_strdup(cr->state_id), cr);
+    pthread_mutex_unlock (&chunk_lock);
+
+    offset = load_chunk_state (cr, TRUE);
+    if (offset < 0) {
+        pthread_mutex_lock (&chunk_lock);
+        g_hash_table_remove (active_uploads, cr->state_id);
+        pthread_mutex_unlock (&chunk_lock);
+        err_msg = "Invalid upload id";
+        goto err;
+    }
+
+    if (first > offset) {
+        seaf_warning ("[upload chunk] Piece starts at %"G_GINT64_FORMAT
+                      ", but only %"G_GINT64_FORMAT" bytes are received.\n",
+                      first, offset);
+        pthread_mutex_lock (&chunk_lock);
+        g_hash_table_remove (active_uploads, cr->state_id);
+        pthread_mutex_unlock (&chunk_lock);
+        evhtp_request_pause (req);
+        req->keepalive = 0;
+        send_chunk_offset (req, offset, EVHTP_RES_RANGENOTSC);
+        ccnet_rpc_client_free (rpc_client);
+        free_chunk_recv (cr);
+        return EVHTP_RES_OK;
+    }
+
+    cr->offset = offset;
+    cr->skip = offset - first;
+
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_read, chunk_read_cb, cr);
+    evhtp_set_hook (&req->hooks, evhtp_hook_on_request_fini, chunk_finish_cb, cr);
+    req->cbarg = cr;
+
+    ccnet_rpc_client_free (rpc_client);
+    return EVHTP_RES_OK;
+
+err:
+    evhtp_request_pause (req);
+    req->keepalive = 0;
+    if (err_msg)
+        evbuffer_add_printf (req->buffer_out, "%s\n", err_msg);
+    evhtp_send_reply (req, code);
+
+    if (rpc_client)
+        ccnet_rpc_client_free (rpc_client);
+    if (cr)
+        free_chunk_recv (cr);
+    return EVHTP_RES_OK;
+}
+
+static void
+get_chunk_offset (evhtp_request_t *req)
+{
+    SearpcClient *rpc_client;
+    const char *upload_id;
+    ChunkRecv cr;
+    gint64 offset = -1;
+
+    memset (&cr, 0, sizeof(cr));
+    upload_id = evhtp_kv_find (req->uri->query, "upload_id");
+    if (!req->uri->path->file || !is_valid_upload_id (upload_id)) {
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+    cr.upload_id = (char *)upload_id;
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-rpcserver");
+    if (check_access_token (rpc_client, req->uri->path->file,
+                            &cr.repo_id, &cr.user) < 0) {
+        ccnet_rpc_client_free (rpc_client);
+        evhtp_send_reply (req, EVHTP_RES_FORBIDDEN);
+        return;
+    }
+    ccnet_rpc_client_free (rpc_client);
+
+    cr.state_id = make_state_id (cr.user, upload_id);
+    offset = load_chunk_state (&cr, FALSE);
+    if (offset < 0)
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+    else
+        send_chunk_offset (req, offset, EVHTP_RES_OK);
+
+    g_free (cr.state_id);
+    g_free (cr.repo_id);
+    g_free (cr.user);
+}
+
+static int
+add_chunked_file (evhtp_request_t *req, ChunkRecv *cr, GError **error)
+{
+    SearpcClient *rpc_client;
+    const char *target_file, *parent_dir, *filename, *head_id;
+    char *dir = NULL, *name = NULL;
+    char *filenames_json = NULL, *file_ids_json = NULL;
+    GList *list;
+    unsigned char sha1[20];
+    guint64 size;
+    int ret = 0;
+
+    target_file = evhtp_kv_find (req->uri->query, "target_file");
+    parent_dir = evhtp_kv_find (req->uri->query, "parent_dir");
+    filename = evhtp_kv_find (req->uri->query, "filename");
+    head_id = evhtp_kv_find (req->uri->query, "head");
+    if (!target_file && (!parent_dir || !filename)) {
+        g_set_error (error, 0, ERROR_FILENAME, "No file name given");
+        return -1;
+    }
+
+    if (seaf_fs_manager_index_stream_finish (cr->stream, sha1, &size) < 0) {
+        g_set_error (error, 0, ERROR_INTERNAL, "Failed to index file");
+        return -1;
+    }
+    rawdata_to_hex (sha1, cr->file_id, 20);
+
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "seafserv-threaded-rpcserver");
+
+    if (seafile_check_quota (rpc_client, cr->repo_id, NULL) < 0) {
+        g_set_error (error, 0, ERROR_QUOTA, "Out of quota");
+        ret = -1;
+        goto out;
+    }
+
+    if (target_file) {
+        dir = g_path_get_dirname (target_file);
+        name = g_path_get_basename (target_file);
+        ret = seafile_put_file_by_id (rpc_client, cr->repo_id, cr->file_id,
+                                      dir, name, cr->user, head_id, error);
+    } else {
+        list = g_list_prepend (NULL, (char *)filename);
+        filenames_json = string_list_to_json (list);
+        g_list_free (list);
+        list = g_list_prepend (NULL, cr->file_id);
+        file_ids_json = string_list_to_json (list);
+        g_list_free (list);
+        ret = seafile_post_multi_files_by_id (rpc_client, cr->repo_id,
+                                              parent_dir, filenames_json,
+                                              file_ids_json, cr->user, error);
+    }
+
+out:
+    ccnet_rpc_client_free (rpc_client);
+    g_free (dir);
+    g_free (name);
+    g_free (filenames_json);
+    g_free (file_ids_json);
+    return ret;
+}
+
+static void
+chunk_upload_cb (evhtp_request_t *req, void *arg)
+{
+    ChunkRecv *cr = arg;
+    GError *error = NULL;
+
+    if (evhtp_request_get_method (req) == htp_method_GET) {
+        get_chunk_offset (req);
+        return;
+    }
+
+    if (!cr || cr->error)
+        return;
+
+    if (cr->offset < cr->size) {
+        send_chunk_offset (req, cr->offset, EVHTP_RES_OK);
+        return;
+    }
+
+    if (add_chunked_file (req, cr, &error) < 0) {
+        seaf_warning ("[upload chunk] Failed to add file: %s.\n",
+                      error ? error->message : "");
+        evbuffer_add_printf (req->buffer_out, "%s\n",
+                             error ? error->message : "Internal error");
+        g_clear_error (&error);
+        /* The data can be committed again, with a valid file name. */
+        cr->file_id[0] = 0;
+        evhtp_send_reply (req, EVHTP_RES_BADREQ);
+        return;
+    }
+
+    send_chunk_offset (req, cr->offset, EVHTP_RES_OK);
+}
+
 int
 upload_file_init (evhtp_t *htp)
 {
@@ -995,6 +1665,12 @@ upload_file_init (evhtp_t *htp)
         return -1;
     }
 
+    if (g_mkdir_with_parents (CHUNK_STATE_DIR, 0700) < 0) {
+        seaf_warning ("Failed to create dir %s.\n", CHUNK_STATE_DIR);
+        return -1;
+    }
+    remove_stale_chunk_state ();
+
     cb = evhtp_set_regex_cb (htp, "^/upload/.*", upload_cb, NULL);
     /* upload_headers_cb() will be called after evhtp parsed all http headers. */
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
@@ -1002,11 +1678,18 @@ upload_file_init (evhtp_t *htp)
     cb = evhtp_set_regex_cb (htp, "^/update/.*", update_cb, NULL);
     evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, upload_headers_cb, NULL);
 
+    cb = evhtp_set_regex_cb (htp, "^/upload_chunk/.*", chunk_upload_cb, NULL);
+    evhtp_set_hook(&cb->hooks, evhtp_hook_on_headers, chunk_headers_cb, NULL);
+
     evhtp_set_regex_cb (htp, "^/upload_progress.*", upload_progress_cb, NULL);
 
     upload_progress = g_hash_table_new_full (g_str_hash, g_str_equal,
                                              g_free, g_free);
     pthread_mutex_init (&pg_lock, NULL);
 
+    active_uploads = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                            g_free, NULL);
+    pthread_mutex_init (&chunk_lock, NULL);
+
     return 0;
 }
@@ -395,6 +395,16 @@ seafile_gc (GError **error);
 int
 seafile_gc_get_progress (GError **error);
 
+/**
+ * seafile_gc_get_stat:
+ * @name: one of "phase", "elapsed", "marked", "checked", "removed", "rate".
+ *
+ * Returns: the counter of the running GC.
+ *     -1 if GC is not running.
+ */
+gint64
+seafile_gc_get_stat (const char *name, GError **error);
+
 /* -----------------  Task Related --------------  */
 
 /**
@@ -489,6 +499,15 @@ seafile_get_org_user_quota_usage (int org_id, const char *user, GError **error);
 gint64
 seafile_server_repo_size(const char *repo_id, GError **error);
 
+/**
+ * seafile_get_fs_cache_stat:
+ * @name: one of "hits", "misses", "evictions", "objects", "size", "capacity".
+ *
+ * Returns: the counter of the decoded fs object cache.
+ */
+gint64
+seafile_get_fs_cache_stat (const char *name, GError **error);
+
 int
 seafile_repo_set_access_property (const char *repo_id, const char *ap,
                                   GError **error);
@@ -620,6 +639,20 @@ seafile_post_multi_files (const char *repo_id,
                           const char *user,
                           GError **error);
 
+/**
+ * Same as seafile_post_multi_files(), for files which have been indexed
+ * while they were uploaded.
+ *
+ * @file_ids_json: json array of file ids
+ */
+int
+seafile_post_multi_files_by_id (const char *repo_id,
+                                const char *parent_dir,
+                                const char *filenames_json,
+                                const char *file_ids_json,
+                                const char *user,
+                                GError **error);
+
 int
 seafile_post_empty_file (const char *repo_id, const char *parent_dir,
                          const char *new_file_name, const char *user,
@@ -637,6 +670,16 @@ seafile_put_file (const char *repo_id, const char *temp_file_path,
                   const char *user, const char *head_id,
                   GError **error);
 
+/**
+ * Same as seafile_put_file(), for a file which has been indexed
+ * while it was uploaded.
+ */
+int
+seafile_put_file_by_id (const char *repo_id, const char *file_id,
+                        const char *parent_dir, const char *file_name,
+                        const char *user, const char *head_id,
+                        GError **error);
+
 int
 seafile_post_dir (const char *repo_id, const char *parent_dir,
                   const char *new_dir_name, const char *user,
@@ -655,6 +698,15 @@ seafile_del_file (const char *repo_id,
                   const char *user,
                   GError **error);
 
+/**
+ * Apply a batch of file operations in a repo on server, with one commit.
+ * @ops_json: json array of operations, see seaf_repo_manager_batch_ops().
+ * @user: the email of the user who made the changes.
+ */
+int
+seafile_batch_ops (const char *repo_id, const char *ops_json,
+                   const char *user, GError **error);
+
 /**
  * copy a file/directory from a repo to another on server.
  */
@@ -717,6 +769,13 @@ seafile_get_org_user_quota (int org_id, const char *user, GError **error);
 int
 seafile_check_quota (const char *repo_id, GError **error);
 
+/**
+ * Check whether the repo has free space for @delta more bytes.
+ */
+int
+seafile_check_quota_with_delta (const char *repo_id, gint64 delta,
+                                GError **error);
+
 char *
 seafile_get_file_by_path (const char *repo_id, const char *path,
                           GError **error);
@@ -121,6 +121,25 @@ seafile_post_multi_files (SearpcClient *client,
                           const char *user,
                           GError **error);
 
+int
+seafile_post_multi_files_by_id (SearpcClient *client,
+                                const char *repo_id,
+                                const char *parent_dir,
+                                const char *filenames_json,
+                                const char *file_ids_json,
+                                const char *user,
+                                GError **error);
+
+int
+seafile_put_file_by_id (SearpcClient *client,
+                        const char *repo_id,
+                        const char *file_id,
+                        const char *parent_dir,
+                        const char *file_name,
+                        const char *user,
+                        const char *head_id,
+                        GError **error);
+
 int
 seafile_set_user_quota (SearpcClient *client,
                         const char *user,
@@ -145,6 +164,12 @@ seafile_check_quota (SearpcClient *client,
                      const char *repo_id,
                      GError **error);
 
+int
+seafile_check_quota_with_delta (SearpcClient *client,
+                                const char *repo_id,
+                                gint64 delta,
+                                GError **error);
+
 int
 seafile_disable_auto_sync_async (SearpcClient *client,
                                  AsyncCallback callback,
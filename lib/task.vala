@@ -40,6 +40,10 @@ public class Task : Object {
 		set { _dsize = value; }
 	}
 
+	// bytes of objects and blocks before and after wire compression
+	public int64 raw_bytes { get; set; }
+	public int64 wire_bytes { get; set; }
+
 }
 
 public class CloneTask : Object {
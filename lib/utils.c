@@ -488,6 +488,28 @@ ccnet_sha1_equal (const void *v1,
     return 1;
 }
 
+guint
+raw_id_hash (gconstpointer key)
+{
+    guint h;
+
+    /* Ids are SHA1 digests, so any 4 bytes are uniformly distributed. */
+    memcpy (&h, (const unsigned char *)key + 4, sizeof(h));
+    return h;
+}
+
+gboolean
+raw_id_equal (gconstpointer a, gconstpointer b)
+{
+    return (memcmp (a, b, 20) == 0);
+}
+
+int
+raw_id_cmp (const void *a, const void *b)
+{
+    return memcmp (a, b, 20);
+}
+
 #ifndef WIN32
 char* gen_uuid ()
 {
@@ -962,6 +984,63 @@ key_value_list_to_json_v(const char *first, va_list args)
     return data;
 }
 
+gchar *
+string_list_to_json (GList *str_list)
+{
+    JsonNode *root = json_node_new (JSON_NODE_ARRAY);
+    JsonGenerator *generator = json_generator_new ();
+    JsonArray *array = json_array_new ();
+    GList *ptr;
+    gchar *data;
+
+    for (ptr = str_list; ptr; ptr = ptr->next)
+        json_array_add_string_element (array, (const char *)ptr->data);
+
+    json_node_take_array (root, array);
+    json_generator_set_root (generator, root);
+    g_object_set (generator, "pretty", FALSE, NULL);
+
+    data = json_generator_to_data (generator, NULL);
+    json_node_free (root);
+    g_object_unref (generator);
+    return data;
+}
+
+static void
+collect_string_element (JsonArray *array, guint index,
+                        JsonNode *element, gpointer data)
+{
+    GList **str_list = data;
+
+    *str_list = g_list_prepend (*str_list, json_node_dup_string (element));
+}
+
+GList *
+json_to_string_list (const char *json_data)
+{
+    JsonParser *parser = json_parser_new ();
+    JsonNode *root;
+    GList *str_list = NULL;
+    GError *error = NULL;
+
+    json_parser_load_from_data (parser, json_data, strlen(json_data), &error);
+    if (error) {
+        g_warning ("Failed to load string list from json: %s.\n",
+                   error->message);
+        g_error_free (error);
+        g_object_unref (parser);
+        return NULL;
+    }
+
+    root = json_parser_get_root (parser);
+    if (root && JSON_NODE_TYPE (root) == JSON_NODE_ARRAY)
+        json_array_foreach_element (json_node_get_array (root),
+                                    collect_string_element, &str_list);
+
+    g_object_unref (parser);
+    return g_list_reverse (str_list);
+}
+
 /* format char:
      i   integer (gint64)
      s   string (const char *)
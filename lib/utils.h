@@ -106,6 +106,11 @@ int calculate_sha1 (unsigned char *sha1, const char *msg);
 int ccnet_sha1_equal (const void *v1, const void *v2);
 unsigned int ccnet_sha1_hash (const void *v);
 
+/* Hash, equal and compare functions for raw 20-byte SHA1 ids. */
+guint raw_id_hash (gconstpointer key);
+gboolean raw_id_equal (gconstpointer a, gconstpointer b);
+int raw_id_cmp (const void *a, const void *b);
+
 char* gen_uuid ();
 void gen_uuid_inplace (char *buf);
 gboolean is_uuid_valid (const char *uuid_str);
@@ -178,6 +183,15 @@ key_value_list_to_json(const char *first, ...) G_GNUC_NULL_TERMINATED;
 gchar *
 key_value_list_to_json_v(const char *first, va_list args);
 
+/* Convert a list of strings to a json array and back. The order of the
+ * list is kept.
+ */
+gchar *
+string_list_to_json (GList *str_list);
+
+GList *
+json_to_string_list (const char *json_data);
+
 /* format char:
      i   integer (gint64)
      s   string (const char *) or NULL
@@ -15,6 +15,10 @@ typedef struct SchedulerPriv {
 typedef struct RepoSizeJob {
     Scheduler *sched;
     char repo_id[37];
+    /* Recompute from the whole tree instead of the changes since the
+     * last computed head.
+     */
+    gboolean full;
 } RepoSizeJob;
 
 #define SCHEDULER_INTV 10000    /* 10s */
@@ -77,17 +81,31 @@ scheduler_init (Scheduler *scheduler)
     return 0;
 }
 
-void
-schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id)
+static void
+schedule_repo_size_job (Scheduler *scheduler, const char *repo_id,
+                        gboolean full)
 {
     RepoSizeJob *job = g_new0(RepoSizeJob, 1);
 
     job->sched = scheduler;
     memcpy (job->repo_id, repo_id, 37);
+    job->full = full;
 
     g_queue_push_tail (scheduler->priv->repo_size_job_queue, job);
 }
 
+void
+schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id)
+{
+    schedule_repo_size_job (scheduler, repo_id, FALSE);
+}
+
+void
+schedule_repo_size_verification (Scheduler *scheduler, const char *repo_id)
+{
+    schedule_repo_size_job (scheduler, repo_id, TRUE);
+}
+
 static int
 schedule_pulse (void *vscheduler)
 {
@@ -129,14 +147,175 @@ set_repo_size (SeafDB *db, const char *repo_id, const char *head_id, guint64 siz
     return 0;
 }
 
-static char *
-get_cached_head_id (SeafDB *db, const char *repo_id)
+typedef struct CachedSize {
+    char *head_id;
+    gint64 size;
+} CachedSize;
+
+static gboolean
+get_cached_size_cb (SeafDBRow *row, void *data)
+{
+    CachedSize *cached = data;
+
+    cached->head_id = g_strdup (seaf_db_row_get_column_text (row, 0));
+    cached->size = seaf_db_row_get_column_int64 (row, 1);
+
+    /* Only one result. */
+    return FALSE;
+}
+
+static void
+get_cached_size (SeafDB *db, const char *repo_id, CachedSize *cached)
 {
     char sql[256];
 
-    snprintf (sql, sizeof(sql), "SELECT head_id FROM RepoSize WHERE repo_id='%s'",
+    snprintf (sql, sizeof(sql),
+              "SELECT head_id, size FROM RepoSize WHERE repo_id='%s'",
               repo_id);
-    return g_strdup(seaf_db_get_string (db, sql));
+    if (seaf_db_foreach_selected_row (db, sql, get_cached_size_cb, cached) < 0)
+        g_warning ("[scheduler] failed to get cached size of repo %s.\n",
+                   repo_id);
+}
+
+/*
+ * The size of a repo is the total size of the files in its head commit.
+ * It's kept up to date from the changes between the last computed head
+ * and the new one, by comparing the trees and skipping sub-trees with the
+ * same id. The periodic refresh recomputes it from the whole tree.
+ */
+
+static int
+get_tree_size (const char *dir_id, gint64 *size);
+
+static int
+get_dirent_size (SeafDirent *dent, gint64 *size)
+{
+    Seafile *file;
+
+    if (S_ISDIR(dent->mode))
+        return get_tree_size (dent->id, size);
+
+    file = seaf_fs_manager_get_seafile (seaf->fs_mgr, dent->id);
+    if (!file) {
+        g_warning ("[scheduler] failed to get file %s.\n", dent->id);
+        return -1;
+    }
+    *size += file->file_size;
+    seafile_unref (file);
+
+    return 0;
+}
+
+static int
+get_tree_size (const char *dir_id, gint64 *size)
+{
+    SeafDir *dir;
+    GList *ptr;
+    int ret = 0;
+
+    dir = seaf_fs_manager_get_seafdir_shared (seaf->fs_mgr, dir_id);
+    if (!dir) {
+        g_warning ("[scheduler] failed to get dir %s.\n", dir_id);
+        return -1;
+    }
+
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        if (get_dirent_size (ptr->data, size) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    seaf_dir_unref (dir);
+    return ret;
+}
+
+/* Add the size change from @old_id to @new_id to @delta. */
+static int
+diff_tree_size (const char *old_id, const char *new_id, gint64 *delta)
+{
+    SeafDir *old_dir = NULL, *new_dir = NULL;
+    GList *p1, *p2;
+    SeafDirent *d1, *d2;
+    gint64 old_size, new_size;
+    int cmp, ret = 0;
+
+    old_dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr, old_id);
+    new_dir = seaf_fs_manager_get_seafdir_sorted (seaf->fs_mgr, new_id);
+    if (!old_dir || !new_dir) {
+        g_warning ("[scheduler] failed to get dir %s or %s.\n", old_id, new_id);
+        ret = -1;
+        goto out;
+    }
+
+    /* Entries are sorted in descending order. */
+    p1 = old_dir->entries;
+    p2 = new_dir->entries;
+    while (p1 || p2) {
+        d1 = p1 ? p1->data : NULL;
+        d2 = p2 ? p2->data : NULL;
+
+        if (d1 && d2)
+            cmp = strcmp (d1->name, d2->name);
+        else
+            cmp = d1 ? 1 : -1;
+
+        old_size = new_size = 0;
+        if (cmp > 0) {
+            /* Removed. */
+            ret = get_dirent_size (d1, &old_size);
+            p1 = p1->next;
+        } else if (cmp < 0) {
+            /* Added. */
+            ret = get_dirent_size (d2, &new_size);
+            p2 = p2->next;
+        } else {
+            if (d1->mode == d2->mode && strcmp (d1->id, d2->id) == 0) {
+                /* Unchanged. */
+            } else if (S_ISDIR(d1->mode) && S_ISDIR(d2->mode)) {
+                ret = diff_tree_size (d1->id, d2->id, delta);
+            } else {
+                ret = get_dirent_size (d1, &old_size);
+                if (ret == 0)
+                    ret = get_dirent_size (d2, &new_size);
+            }
+            p1 = p1->next;
+            p2 = p2->next;
+        }
+
+        if (ret < 0)
+            break;
+        *delta += new_size - old_size;
+    }
+
+out:
+    seaf_dir_free (old_dir);
+    seaf_dir_free (new_dir);
+    return ret;
+}
+
+/* Compute the size of @head from the size of the last computed head. */
+static int
+compute_size_incrementally (Scheduler *sched, CachedSize *cached,
+                            SeafCommit *head, gint64 *size)
+{
+    SeafCommit *old_head;
+    gint64 delta = 0;
+    int ret;
+
+    old_head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
+                                               cached->head_id);
+    if (!old_head)
+        return -1;
+
+    ret = diff_tree_size (old_head->root_id, head->root_id, &delta);
+    seaf_commit_unref (old_head);
+
+    if (ret < 0 || cached->size + delta < 0)
+        return -1;
+
+    *size = cached->size + delta;
+    return 0;
 }
 
 static void*
@@ -146,11 +325,8 @@ compute_repo_size (void *vjob)
     Scheduler *sched = job->sched;
     SeafRepo *repo = NULL;
     SeafCommit *head = NULL;
-    char *cached_head_id = NULL;
-    BlockList *bl;
-    char *block_id;
-    BlockMetadata *bmd;
-    guint64 size = 0;
+    CachedSize cached = { NULL, 0 };
+    gint64 size = 0;
 
     repo = seaf_repo_manager_get_repo (sched->seaf->repo_mgr, job->repo_id);
     if (!repo) {
@@ -158,8 +334,8 @@ compute_repo_size (void *vjob)
         return vjob;
     }
 
-    cached_head_id = get_cached_head_id (sched->seaf->db, job->repo_id);
-    if (g_strcmp0 (cached_head_id, repo->head->commit_id) == 0)
+    get_cached_size (sched->seaf->db, job->repo_id, &cached);
+    if (!job->full && g_strcmp0 (cached.head_id, repo->head->commit_id) == 0)
         goto out;
 
     head = seaf_commit_manager_get_commit (sched->seaf->commit_mgr,
@@ -170,38 +346,30 @@ compute_repo_size (void *vjob)
         goto out;
     }
 
-    /* Load block list first so that we don't need to count duplicate blocks.
-     * We only calculate the size of the head commit.
-     */
-    bl = block_list_new ();
-    if (seaf_fs_manager_populate_blocklist (seaf->fs_mgr,
-                                            head->root_id,
-                                            bl) < 0) {
-        block_list_free (bl);
-        goto out;
-    }
-
-    int i;
-    for (i = 0; i < bl->n_blocks; ++i) {
-        block_id = g_ptr_array_index (bl->block_ids, i);
-        bmd = seaf_block_manager_stat_block (sched->seaf->block_mgr, block_id);
-        if (bmd) {
-            size += bmd->size;
-            g_free (bmd);
-        }
+    if (job->full || !cached.head_id ||
+        compute_size_incrementally (sched, &cached, head, &size) < 0) {
+        size = 0;
+        if (get_tree_size (head->root_id, &size) < 0)
+            goto out;
+
+        if (job->full &&
+            g_strcmp0 (cached.head_id, repo->head->commit_id) == 0 &&
+            cached.size != size)
+            g_message ("[scheduler] size of repo %s corrected from %"
+                       G_GINT64_FORMAT" to %"G_GINT64_FORMAT".\n",
+                       job->repo_id, cached.size, size);
     }
-    block_list_free (bl);
 
     if (set_repo_size (sched->seaf->db,
                        job->repo_id,
                        repo->head->commit_id,
-                       size) < 0)
+                       (guint64)size) < 0)
         g_warning ("[scheduler] failed to store repo size %s.\n", job->repo_id);
 
 out:
     seaf_repo_unref (repo);
     seaf_commit_unref (head);
-    g_free (cached_head_id);
+    g_free (cached.head_id);
 
     return vjob;
 }
@@ -20,4 +20,8 @@ scheduler_init (Scheduler *scheduler);
 void
 schedule_repo_size_computation (Scheduler *scheduler, const char *repo_id);
 
+/* Recompute the size from the whole tree, to correct any drift. */
+void
+schedule_repo_size_verification (Scheduler *scheduler, const char *repo_id);
+
 #endif
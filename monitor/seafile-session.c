@@ -149,7 +149,7 @@ refresh_all_repo_sizes (void *vsession)
 
     for (ptr = id_list; ptr != NULL; ptr = ptr->next) {
         repo_id = ptr->data;
-        schedule_repo_size_computation (session->scheduler, repo_id);
+        schedule_repo_size_verification (session->scheduler, repo_id);
         g_free (repo_id);
     }
     g_list_free (id_list);
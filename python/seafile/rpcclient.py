@@ -256,6 +256,11 @@ class SeafServerRpcClient(ccnet.RpcClientBase):
         pass
     gc_get_progress = seafile_gc_get_progress
 
+    @searpc_func("int64", ["string"])
+    def seafile_gc_get_stat(name):
+        pass
+    gc_get_stat = seafile_gc_get_stat
+
     # password management
     @searpc_func("int", ["string", "string"])
     def seafile_is_passwd_set(repo_id, user):
@@ -309,6 +314,11 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def seafile_server_repo_size(repo_id):
         pass
     server_repo_size = seafile_server_repo_size
+
+    @searpc_func("int64", ["string"])
+    def seafile_get_fs_cache_stat(name):
+        pass
+    get_fs_cache_stat = seafile_get_fs_cache_stat
     
     @searpc_func("int", ["string", "string"])
     def seafile_repo_set_access_property(repo_id, role):
@@ -355,6 +365,11 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
         pass
     del_file = seafile_del_file 
 
+    @searpc_func("int", ["string", "string", "string"])
+    def seafile_batch_ops(repo_id, ops_json, user):
+        pass
+    batch_ops = seafile_batch_ops
+
     @searpc_func("int", ["string", "string", "string", "string", "string", "string", "string"])
     def seafile_copy_file(src_repo, src_dir, src_filename, dst_repo, dst_dir, dst_filename, user):
         pass
@@ -565,6 +580,10 @@ class SeafServerThreadedRpcClient(ccnet.RpcClientBase):
     def check_quota(repo_id):
         pass
 
+    @searpc_func("int", ["string", "int64"])
+    def check_quota_with_delta(repo_id, delta):
+        pass
+
     # password management
     @searpc_func("int", ["string", "string", "string"])
     def seafile_set_passwd(repo_id, user, passwd):
@@ -3,44 +3,6 @@
 
 #include <ccnet.h>
 #include <searpc-client.h>
-#include <ccnet/ccnetrpc-transport.h>
-
-static SearpcClient *
-create_sync_ccnetrpc_client (const char *config_dir, const char *service)
-{
-    if (!config_dir || !service)
-        return NULL;
-    
-    CcnetClient *sync_client;
-    SearpcClient *rpc_client;
-
-    sync_client = ccnet_client_new ();
-    if ((ccnet_client_load_confdir(sync_client, config_dir)) < 0 ) {
-        return NULL;
-    }
-
-    if (ccnet_client_connect_daemon (sync_client, CCNET_CLIENT_SYNC) < 0)
-    {
-        g_object_unref ((GObject *)sync_client);
-        return NULL;
-    }
-
-    rpc_client = ccnet_create_rpc_client (sync_client, NULL, service);
-
-    return rpc_client;
-}
-
-static void
-free_sync_rpc_client (SearpcClient *rpc_client)
-{
-    CcnetrpcTransportParam *priv = rpc_client->arg;
-    CcnetClient *client = priv->session;
-
-    /* No need to call ccnet_client_disconnect_daemon. It's called in object
-     * finalize function of ccnet client class. */
-    g_object_unref ((GObject *)client);
-    ccnet_rpc_client_free (rpc_client);
-}
 
 static int
 check_repo_owner_quota (CcnetProcessor *processor,
@@ -77,9 +39,9 @@ check_repo_owner_quota (CcnetProcessor *processor,
         return ret;
 
     if (user)
-        usage = get_user_quota_usage (seaf, user);
+        usage = seaf_quota_manager_get_user_usage (seaf->quota_mgr, user);
     else
-        usage = get_org_quota_usage (seaf, org_id);
+        usage = seaf_quota_manager_get_org_usage (seaf->quota_mgr, org_id);
 
     g_debug ("quota is %"G_GINT64_FORMAT", usage is %"G_GINT64_FORMAT"\n",
              quota, usage);
@@ -192,8 +192,9 @@ check_tx (void *vprocessor)
 
     char *repo_id = priv->repo_id;
 
-    rpc_client = create_sync_ccnetrpc_client
-        (seaf->session->config_dir, "ccnet-threaded-rpcserver");
+    rpc_client = ccnet_create_pooled_rpc_client (seaf->client_pool,
+                                                 NULL,
+                                                 "ccnet-threaded-rpcserver");
 
     if (!rpc_client) {
         priv->rsp_code = g_strdup(SC_SERVER_ERROR);
@@ -237,7 +238,7 @@ check_tx (void *vprocessor)
 out:
     g_free (owner);
     if (rpc_client)
-        free_sync_rpc_client (rpc_client);
+        ccnet_rpc_client_free (rpc_client);
     return vprocessor;
 }
 
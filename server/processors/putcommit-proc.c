@@ -155,8 +155,8 @@ send_commit_ids (CcnetProcessor *processor, const char *head)
 static gboolean
 send_commit (CcnetProcessor *processor, char *object_id)
 {
-    char *data;
-    int len;
+    char *data, *json_data;
+    int len, json_len;
     ObjectPack *pack = NULL;
     int pack_size;
 
@@ -166,6 +166,14 @@ send_commit (CcnetProcessor *processor, char *object_id)
         goto fail;
     }
 
+    /* Clients only understand json commits. */
+    json_data = seaf_commit_data_to_json (object_id, data, len, &json_len);
+    if (json_data) {
+        g_free (data);
+        data = json_data;
+        len = json_len;
+    }
+
     pack_size = sizeof(ObjectPack) + len;
     pack = malloc (pack_size);
     memcpy (pack->id, object_id, 41);
@@ -14,6 +14,7 @@
 #include "seafile-session.h"
 #include "putcommit-v2-proc.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "vc-common.h"
 
 typedef struct  {
@@ -25,6 +26,8 @@ typedef struct  {
 
     guint32     reader_id;
     gboolean    registered;
+    /* Commits are sent as ObjectPackZ. */
+    gboolean    compress;
 } SeafilePutcommitProcPriv;
 
 #define GET_PRIV(o)  \
@@ -75,15 +78,23 @@ send_commit (CcnetProcessor *processor,
 {
     ObjectPack *pack = NULL;
     int pack_size;
+    char *json_data;
+    int json_len;
+    USE_PRIV;
+
+    /* Clients only understand json commits. */
+    json_data = seaf_commit_data_to_json (commit_id, data, len, &json_len);
+    if (json_data) {
+        data = json_data;
+        len = json_len;
+    }
 
-    pack_size = sizeof(ObjectPack) + len;
-    pack = malloc (pack_size);
-    memcpy (pack->id, commit_id, 41);
-    memcpy (pack->object, data, len);
+    pack = object_pack_new (commit_id, data, len, priv->compress, &pack_size);
 
     ccnet_processor_send_response (processor, SC_OBJECT, SS_OBJECT,
                                    (char *)pack, pack_size);
     free (pack);
+    g_free (json_data);
 }
 
 static int
@@ -293,6 +304,7 @@ put_commit_start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    priv->compress = wire_compress_requested (&argc, argv);
     if (argc < 2) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -15,11 +15,14 @@
 #include "commit-mgr.h"
 #include "fs-mgr.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "putfs-proc.h"
 
 typedef struct  {
     guint32     reader_id;
     gboolean    registered;
+    /* Objects are sent as ObjectPackZ. */
+    gboolean    compress;
 } PutfsProcPriv;
 
 #define GET_PRIV(o)  \
@@ -75,6 +78,7 @@ start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    priv->compress = wire_compress_requested (&argc, argv);
     if (argc != 1) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -109,6 +113,7 @@ read_done_cb (OSAsyncResult *res, void *cb_data)
     CcnetProcessor *processor = cb_data;
     ObjectPack *pack = NULL;
     int pack_size;
+    USE_PRIV;
 
     if (!res->success) {
         g_warning ("[putfs] Failed to read %s.\n", res->obj_id);
@@ -118,10 +123,8 @@ read_done_cb (OSAsyncResult *res, void *cb_data)
         return;
     }
 
-    pack_size = sizeof(ObjectPack) + res->len;
-    pack = malloc (pack_size);
-    memcpy (pack->id, res->obj_id, 41);
-    memcpy (pack->object, res->data, res->len);
+    pack = object_pack_new (res->obj_id, res->data, res->len,
+                            priv->compress, &pack_size);
 
     if (pack_size <= MAX_OBJ_SEG_SIZE) {
         ccnet_processor_send_response (processor, SC_OBJECT, SS_OBJECT,
@@ -63,6 +63,8 @@ seafile_recvblock_v2_proc_init (SeafileRecvblockV2Proc *processor)
 static int
 block_proc_start (CcnetProcessor *processor, int argc, char **argv)
 {
+    USE_PRIV;
+
     if (verify_session_token (processor, argc, argv) < 0) {
         ccnet_processor_send_response (processor, 
                                        SC_ACCESS_DENIED, SS_ACCESS_DENIED,
@@ -71,7 +73,9 @@ block_proc_start (CcnetProcessor *processor, int argc, char **argv)
         return -1;
     }
     
-    prepare_thread_data(processor, recv_blocks, recv_block_cb);
+    prepare_thread_data(processor,
+                        priv->version == 3 ? recv_blocks_v3 : recv_blocks,
+                        recv_block_cb);
     ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
 
     return 0;
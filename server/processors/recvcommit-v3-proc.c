@@ -14,6 +14,7 @@
 #include "seafile-session.h"
 #include "recvcommit-v3-proc.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "seaf-utils.h"
 
 enum {
@@ -24,6 +25,8 @@ enum {
 typedef struct {
     guint32 writer_id;
     gboolean registered;
+    /* Commits are received as ObjectPackZ. */
+    gboolean compress;
 } RecvcommitPriv;
 
 #define GET_PRIV(o)  \
@@ -76,6 +79,7 @@ recv_commit_start (CcnetProcessor *processor, int argc, char **argv)
     USE_PRIV;
     char *session_token;
 
+    priv->compress = wire_compress_requested (&argc, argv);
     if (argc != 2) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -133,7 +137,16 @@ save_commit (CcnetProcessor *processor, ObjectPack *pack, int len)
 static void
 receive_commit (CcnetProcessor *processor, char *content, int clen)
 {
-    ObjectPack *pack = (ObjectPack *)content;
+    USE_PRIV;
+    ObjectPack *pack, *unpacked = NULL;
+
+    if (priv->compress) {
+        unpacked = object_pack_unpack (content, clen, &clen);
+        if (!unpacked)
+            goto bad;
+        content = (char *)unpacked;
+    }
+    pack = (ObjectPack *)content;
 
     if (clen < sizeof(ObjectPack)) {
         g_warning ("[recvcommit] invalid object id.\n");
@@ -146,9 +159,11 @@ receive_commit (CcnetProcessor *processor, char *content, int clen)
         goto bad;
     }
 
+    g_free (unpacked);
     return;
 
 bad:
+    g_free (unpacked);
     ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
                                    NULL, 0);
     g_warning ("[recvcommit] Failed to write commit object.\n");
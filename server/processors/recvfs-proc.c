@@ -16,6 +16,7 @@
 #include "seafile-session.h"
 #include "fs-mgr.h"
 #include "processors/objecttx-common.h"
+#include "wire-compress.h"
 #include "recvfs-proc.h"
 #include "seaf-utils.h"
 
@@ -39,6 +40,18 @@ typedef struct  {
     char *obj_seg;
     int obj_seg_len;
 
+    /* Objects are received as ObjectPackZ. */
+    gboolean compress;
+
+    /* Push mode, see objecttx-common.h. */
+    gboolean push;
+    gboolean push_done;
+    int      n_pushed;
+    /* Objects received in push mode. */
+    GHashTable *pushed;
+    /* Objects referred to by the pushed dirs and the fs roots. */
+    GHashTable *referred;
+
     gboolean registered;
     guint32  reader_id;
     guint32  writer_id;
@@ -65,6 +78,10 @@ release_resource(CcnetProcessor *processor)
     USE_PRIV;
 
     g_hash_table_destroy (priv->fs_objects);
+    if (priv->pushed)
+        g_hash_table_destroy (priv->pushed);
+    if (priv->referred)
+        g_hash_table_destroy (priv->referred);
 
     string_list_free (priv->fs_roots);
 
@@ -150,6 +167,7 @@ check_seafdir (CcnetProcessor *processor, SeafDir *dir)
     USE_PRIV;
     GList *ptr;
     SeafDirent *dent;
+    GPtrArray *file_ids = g_ptr_array_new ();
 
     for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
         dent = ptr->data;
@@ -169,22 +187,31 @@ check_seafdir (CcnetProcessor *processor, SeafDir *dir)
                            dent->id);
                 goto bad;
             }
+            ++(priv->inspect_objects);
         } else {
             /* For file, we just need to check existence. */
-            if (seaf_obj_store_async_stat (seaf->fs_mgr->obj_store,
-                                           priv->stat_id,
-                                           dent->id) < 0) {
-                g_warning ("[recvfs] Failed to start async stat of %s.\n",
-                           dent->id);
-                goto bad;
-            }
+            g_ptr_array_add (file_ids, dent->id);
         }
-        ++(priv->inspect_objects);
     }
 
+    /* Check all files in this dir with one batched request. */
+    if (file_ids->len > 0) {
+        if (seaf_obj_store_async_stat_batch (seaf->fs_mgr->obj_store,
+                                             priv->stat_id,
+                                             (const char **)file_ids->pdata,
+                                             file_ids->len) < 0) {
+            g_warning ("[recvfs] Failed to start async stat of %u files.\n",
+                       file_ids->len);
+            goto bad;
+        }
+        priv->inspect_objects += file_ids->len;
+    }
+
+    g_ptr_array_free (file_ids, TRUE);
     return 0;
 
 bad:
+    g_ptr_array_free (file_ids, TRUE);
     ccnet_processor_send_response (processor, SC_BAD_OBJECT, SS_BAD_OBJECT,
                                    NULL, 0);
     ccnet_processor_done (processor, FALSE);
@@ -260,7 +287,8 @@ check_end_condition (CcnetProcessor *processor)
     /* Flush periodically. */
     request_object_batch_flush (processor, priv);
 
-    if (priv->pending_objects == 0 && priv->inspect_objects == 0) {
+    if (priv->pending_objects == 0 && priv->inspect_objects == 0 &&
+        (!priv->push || priv->push_done)) {
         seaf_debug ("Recv fs roots end.\n");
         ccnet_processor_send_response (processor, SC_END, SS_END, NULL, 0);
         ccnet_processor_done (processor, TRUE);
@@ -292,6 +320,11 @@ start (CcnetProcessor *processor, int argc, char **argv)
     char *session_token;
     USE_PRIV;
 
+    priv->compress = wire_compress_requested (&argc, argv);
+    if (argc == 2 && strcmp (argv[1], FS_PUSH_ARG) == 0) {
+        priv->push = TRUE;
+        argc = 1;
+    }
     if (argc != 1) {
         ccnet_processor_send_response (processor, SC_BAD_ARGS, SS_BAD_ARGS, NULL, 0);
         ccnet_processor_done (processor, FALSE);
@@ -306,6 +339,12 @@ start (CcnetProcessor *processor, int argc, char **argv)
         processor->state = RECV_ROOT;
         priv->fs_objects = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                   g_free, NULL);
+        if (priv->push) {
+            priv->pushed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, NULL);
+            priv->referred = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+        }
         register_async_io (processor);
         return 0;
     } else {
@@ -329,13 +368,107 @@ save_fs_object (CcnetProcessor *processor, ObjectPack *pack, int len)
                                        len - 41);
 }
 
+/*
+ * Push mode: the pushed objects are saved, and the objects referred to by
+ * the pushed dirs are only checked when all the objects are received.
+ */
+static int
+recv_pushed_object (CcnetProcessor *processor, ObjectPack *pack, int clen)
+{
+    USE_PRIV;
+    uint32_t type;
+    SeafDir *dir;
+    GList *ptr;
+    SeafDirent *dent;
+
+    type = seaf_metadata_type_from_data(pack->object, clen);
+    if (type == SEAF_METADATA_TYPE_DIR) {
+        dir = seaf_dir_from_data (pack->id, pack->object, clen - 41);
+        if (!dir) {
+            g_warning ("Bad directory object %s.\n", pack->id);
+            return -1;
+        }
+        for (ptr = dir->entries; ptr != NULL; ptr = ptr->next) {
+            dent = ptr->data;
+            if (strcmp (dent->id, EMPTY_SHA1) != 0)
+                g_hash_table_replace (priv->referred,
+                                      g_strdup(dent->id), (gpointer)1);
+        }
+        seaf_dir_free (dir);
+    } else if (type != SEAF_METADATA_TYPE_FILE) {
+        g_warning ("Invalid object type.\n");
+        return -1;
+    }
+
+    if (save_fs_object (processor, pack, clen) < 0)
+        return -1;
+
+    g_hash_table_replace (priv->pushed, g_strdup(pack->id), (gpointer)1);
+
+    if (++(priv->n_pushed) % FS_PUSH_BATCH == 0)
+        ccnet_processor_send_response (processor, SC_ACK, SS_ACK, NULL, 0);
+
+    return 0;
+}
+
+/*
+ * Push mode: check that the objects referred to, but not pushed, exist.
+ * These should be in the repo already. Missing ones are asked for.
+ */
+static void
+check_referred_objects (CcnetProcessor *processor)
+{
+    USE_PRIV;
+    GHashTableIter iter;
+    gpointer key, value;
+    GPtrArray *ids = g_ptr_array_new ();
+
+    priv->push_done = TRUE;
+
+    g_hash_table_iter_init (&iter, priv->referred);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        if (!g_hash_table_lookup (priv->pushed, key))
+            g_ptr_array_add (ids, key);
+    }
+
+    seaf_debug ("[recvfs] Pushed %d objects, %u more to check.\n",
+                priv->n_pushed, ids->len);
+
+    if (ids->len > 0) {
+        if (seaf_obj_store_async_stat_batch (seaf->fs_mgr->obj_store,
+                                             priv->stat_id,
+                                             (const char **)ids->pdata,
+                                             ids->len) < 0) {
+            g_warning ("[recvfs] Failed to start async stat of %u objects.\n",
+                       ids->len);
+            g_ptr_array_free (ids, TRUE);
+            ccnet_processor_send_response (processor,
+                                           SC_BAD_OBJECT, SS_BAD_OBJECT,
+                                           NULL, 0);
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        priv->inspect_objects += ids->len;
+    }
+
+    g_ptr_array_free (ids, TRUE);
+}
+
 static int
 recv_fs_object (CcnetProcessor *processor, char *content, int clen)
 {
     USE_PRIV;
-    ObjectPack *pack = (ObjectPack *)content;
+    ObjectPack *pack, *unpacked = NULL;
     uint32_t type;
 
+    if (priv->compress) {
+        unpacked = object_pack_unpack (content, clen, &clen);
+        if (!unpacked)
+            goto bad;
+        content = (char *)unpacked;
+    }
+    pack = (ObjectPack *)content;
+
     if (clen < sizeof(ObjectPack)) {
         g_warning ("invalid object id.\n");
         goto bad;
@@ -343,6 +476,13 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
 
     seaf_debug ("[recvfs] Recv fs object %.8s.\n", pack->id);
 
+    if (priv->push && !priv->push_done) {
+        if (recv_pushed_object (processor, pack, clen) < 0)
+            goto bad;
+        g_free (unpacked);
+        return 0;
+    }
+
     --priv->pending_objects;
 
     type = seaf_metadata_type_from_data(pack->object, clen);
@@ -375,9 +515,11 @@ recv_fs_object (CcnetProcessor *processor, char *content, int clen)
     }
 
     g_hash_table_remove (priv->fs_objects, pack->id);
+    g_free (unpacked);
     return 0;
 
 bad:
+    g_free (unpacked);
     ccnet_processor_send_response (processor, SC_BAD_OBJECT,
                                    SS_BAD_OBJECT, NULL, 0);
     g_warning ("[recvfs] Bad fs object received.\n");
@@ -422,6 +564,18 @@ process_fsroot_list (CcnetProcessor *processor)
 
     request_object_batch_begin (priv);
 
+    if (priv->push) {
+        for (ptr = priv->fs_roots; ptr != NULL; ptr = ptr->next) {
+            object_id = ptr->data;
+            if (strcmp (object_id, EMPTY_SHA1) != 0)
+                g_hash_table_replace (priv->referred,
+                                      g_strdup(object_id), (gpointer)1);
+        }
+        string_list_free (priv->fs_roots);
+        priv->fs_roots = NULL;
+        return;
+    }
+
     for (ptr = priv->fs_roots; ptr != NULL; ptr = ptr->next) {
         object_id = ptr->data;
 
@@ -484,6 +638,8 @@ handle_update (CcnetProcessor *processor,
                char *code, char *code_msg,
                char *content, int clen)
 {
+    USE_PRIV;
+
    switch (processor->state) {
    case RECV_ROOT:
         if (strncmp(code, SC_ROOT, 3) == 0) {
@@ -511,6 +667,9 @@ handle_update (CcnetProcessor *processor,
             process_fs_object_seg (processor);
         } else if (strncmp(code, SC_OBJECT, 3) == 0) {
             recv_fs_object (processor, content, clen);
+        } else if (priv->push && !priv->push_done &&
+                   strncmp(code, SC_END, 3) == 0) {
+            check_referred_objects (processor);
         } else {
             g_warning ("Bad response: %s %s\n", code, code_msg);
             ccnet_processor_send_response (processor,
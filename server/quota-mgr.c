@@ -1,12 +1,70 @@
 /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
 
 #include "common.h"
+
+#include <pthread.h>
+
 #include "log.h"
 
 #include "seafile-session.h"
 #include "seaf-db.h"
 #include "quota-mgr.h"
 
+/* Seconds quotas and usages are cached for. */
+#define QUOTA_CACHE_TTL 30
+
+typedef struct CachedValue {
+    gint64 value;
+    gint64 expire;
+} CachedValue;
+
+struct _SeafQuotaManagerPriv {
+    pthread_mutex_t lock;
+    /* user or org id -> CachedValue */
+    GHashTable *user_quotas;
+    GHashTable *org_quotas;
+    GHashTable *user_usages;
+    GHashTable *org_usages;
+};
+
+static GHashTable *
+cache_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static gboolean
+cache_lookup (SeafQuotaManager *mgr, GHashTable *cache,
+              const char *key, gint64 *value)
+{
+    CachedValue *cached;
+    gboolean ret = FALSE;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    cached = g_hash_table_lookup (cache, key);
+    if (cached && cached->expire > (gint64)time(NULL)) {
+        *value = cached->value;
+        ret = TRUE;
+    }
+    pthread_mutex_unlock (&mgr->priv->lock);
+
+    return ret;
+}
+
+static void
+cache_set (SeafQuotaManager *mgr, GHashTable *cache,
+           const char *key, gint64 value)
+{
+    CachedValue *cached = g_new0 (CachedValue, 1);
+
+    cached->value = value;
+    cached->expire = (gint64)time(NULL) + QUOTA_CACHE_TTL;
+
+    pthread_mutex_lock (&mgr->priv->lock);
+    g_hash_table_replace (cache, g_strdup (key), cached);
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
 static gint64
 get_default_quota (GKeyFile *config)
 {
@@ -30,6 +88,13 @@ seaf_quota_manager_new (struct _SeafileSession *session)
 
     mgr->default_quota = get_default_quota (session->config);
 
+    mgr->priv = g_new0 (struct _SeafQuotaManagerPriv, 1);
+    pthread_mutex_init (&mgr->priv->lock, NULL);
+    mgr->priv->user_quotas = cache_new ();
+    mgr->priv->org_quotas = cache_new ();
+    mgr->priv->user_usages = cache_new ();
+    mgr->priv->org_usages = cache_new ();
+
     return mgr;
 }
 
@@ -67,7 +132,12 @@ seaf_quota_manager_set_user_quota (SeafQuotaManager *mgr,
     snprintf (sql, sizeof(sql),
               "REPLACE INTO UserQuota VALUES ('%s', %"G_GINT64_FORMAT")",
               user, quota);
-    return seaf_db_query (mgr->session->db, sql);
+    if (seaf_db_query (mgr->session->db, sql) < 0)
+        return -1;
+
+    cache_set (mgr, mgr->priv->user_quotas, user,
+               quota > 0 ? quota : mgr->default_quota);
+    return 0;
 }
 
 gint64
@@ -77,6 +147,9 @@ seaf_quota_manager_get_user_quota (SeafQuotaManager *mgr,
     char sql[512];
     gint64 quota;
 
+    if (cache_lookup (mgr, mgr->priv->user_quotas, user, &quota))
+        return quota;
+
     snprintf (sql, sizeof(sql),
               "SELECT quota FROM UserQuota WHERE user='%s'",
               user);
@@ -84,6 +157,7 @@ seaf_quota_manager_get_user_quota (SeafQuotaManager *mgr,
     if (quota <= 0)
         quota = mgr->default_quota;
 
+    cache_set (mgr, mgr->priv->user_quotas, user, quota);
     return quota;
 }
 
@@ -93,11 +167,18 @@ seaf_quota_manager_set_org_quota (SeafQuotaManager *mgr,
                                   gint64 quota)
 {
     char sql[512];
+    char key[16];
 
     snprintf (sql, sizeof(sql),
               "REPLACE INTO OrgQuota VALUES ('%d', %"G_GINT64_FORMAT")",
               org_id, quota);
-    return seaf_db_query (mgr->session->db, sql);
+    if (seaf_db_query (mgr->session->db, sql) < 0)
+        return -1;
+
+    snprintf (key, sizeof(key), "%d", org_id);
+    cache_set (mgr, mgr->priv->org_quotas, key,
+               quota > 0 ? quota : mgr->default_quota);
+    return 0;
 }
 
 gint64
@@ -105,8 +186,13 @@ seaf_quota_manager_get_org_quota (SeafQuotaManager *mgr,
                                   int org_id)
 {
     char sql[512];
+    char key[16];
     gint64 quota;
 
+    snprintf (key, sizeof(key), "%d", org_id);
+    if (cache_lookup (mgr, mgr->priv->org_quotas, key, &quota))
+        return quota;
+
     snprintf (sql, sizeof(sql),
               "SELECT quota FROM OrgQuota WHERE org_id='%d'",
               org_id);
@@ -114,6 +200,7 @@ seaf_quota_manager_get_org_quota (SeafQuotaManager *mgr,
     if (quota <= 0)
         quota = mgr->default_quota;
 
+    cache_set (mgr, mgr->priv->org_quotas, key, quota);
     return quota;
 }
 
@@ -150,9 +237,58 @@ seaf_quota_manager_get_org_user_quota (SeafQuotaManager *mgr,
     return quota;
 }
 
+gint64
+seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user)
+{
+    gint64 usage;
+
+    if (cache_lookup (mgr, mgr->priv->user_usages, user, &usage))
+        return usage;
+
+    usage = get_user_quota_usage (mgr->session, user);
+    if (usage >= 0)
+        cache_set (mgr, mgr->priv->user_usages, user, usage);
+
+    return usage;
+}
+
+gint64
+seaf_quota_manager_get_org_usage (SeafQuotaManager *mgr, int org_id)
+{
+    char key[16];
+    gint64 usage;
+
+    snprintf (key, sizeof(key), "%d", org_id);
+    if (cache_lookup (mgr, mgr->priv->org_usages, key, &usage))
+        return usage;
+
+    usage = get_org_quota_usage (mgr->session, org_id);
+    if (usage >= 0)
+        cache_set (mgr, mgr->priv->org_usages, key, usage);
+
+    return usage;
+}
+
+void
+seaf_quota_manager_reset_usage_cache (SeafQuotaManager *mgr)
+{
+    pthread_mutex_lock (&mgr->priv->lock);
+    g_hash_table_remove_all (mgr->priv->user_usages);
+    g_hash_table_remove_all (mgr->priv->org_usages);
+    pthread_mutex_unlock (&mgr->priv->lock);
+}
+
 int
 seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
                                 const char *repo_id)
+{
+    return seaf_quota_manager_check_quota_with_delta (mgr, repo_id, 0);
+}
+
+int
+seaf_quota_manager_check_quota_with_delta (SeafQuotaManager *mgr,
+                                           const char *repo_id,
+                                           gint64 delta)
 {
     char *user = NULL;
     int org_id;
@@ -178,11 +314,11 @@ seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
         return 0;
 
     if (user)
-        usage = get_user_quota_usage (seaf, user);
+        usage = seaf_quota_manager_get_user_usage (mgr, user);
     else
-        usage = get_org_quota_usage (seaf, org_id);
+        usage = seaf_quota_manager_get_org_usage (mgr, org_id);
 
-    if (usage < 0 || usage >= quota)
+    if (usage < 0 || usage + delta >= quota)
         return -1;
 
     return 0;
@@ -5,10 +5,14 @@
 
 #define INFINITE_QUOTA (gint64)-2
 
+struct _SeafQuotaManagerPriv;
+
 struct _SeafQuotaManager {
     struct _SeafileSession *session;
 
     gint64 default_quota;
+
+    struct _SeafQuotaManagerPriv *priv;
 };
 typedef struct _SeafQuotaManager SeafQuotaManager;
 
@@ -52,6 +56,22 @@ seaf_quota_manager_get_org_user_quota (SeafQuotaManager *mgr,
                                        int org_id,
                                        const char *user);
 
+/*
+ * Cached usage of a personal or business account. Usage is computed
+ * from RepoSize, which is updated by the monitor after each change, so
+ * a cached value is used for a short while.
+ * Returns -1 on error.
+ */
+gint64
+seaf_quota_manager_get_user_usage (SeafQuotaManager *mgr, const char *user);
+
+gint64
+seaf_quota_manager_get_org_usage (SeafQuotaManager *mgr, int org_id);
+
+/* Forget cached usage, after repos are deleted or change owner. */
+void
+seaf_quota_manager_reset_usage_cache (SeafQuotaManager *mgr);
+
 /*
  * Check if @repo_id still has free space for upload.
  */
@@ -59,4 +79,12 @@ int
 seaf_quota_manager_check_quota (SeafQuotaManager *mgr,
                                 const char *repo_id);
 
+/*
+ * Check if @repo_id has free space for @delta more bytes.
+ */
+int
+seaf_quota_manager_check_quota_with_delta (SeafQuotaManager *mgr,
+                                           const char *repo_id,
+                                           gint64 delta);
+
 #endif
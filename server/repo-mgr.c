@@ -395,6 +395,8 @@ seaf_repo_manager_del_repo (SeafRepoManager *mgr,
     if (remove_repo_ondisk (mgr, repo->id) < 0)
         return -1;
 
+    seaf_quota_manager_reset_usage_cache (seaf->quota_mgr);
+
     return 0;
 }
 
@@ -927,6 +929,8 @@ seaf_repo_manager_set_repo_owner (SeafRepoManager *mgr,
     if (seaf_db_query (mgr->seaf->db, sql) < 0)
         return -1;
 
+    seaf_quota_manager_reset_usage_cache (seaf->quota_mgr);
+
     return 0;
 }
 
@@ -1523,6 +1527,8 @@ seaf_repo_manager_set_org_repo (SeafRepoManager *mgr,
     if (seaf_db_query (mgr->seaf->db, sql) < 0)
         return -1;
 
+    seaf_quota_manager_reset_usage_cache (seaf->quota_mgr);
+
     return 0;
 }
 
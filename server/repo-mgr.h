@@ -201,6 +201,19 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
                                     const char *user,
                                     GError **error);
 
+/* Same as seaf_repo_manager_post_multi_files(), but the files have been
+ * indexed, e.g. while they were uploaded. @file_ids_json is a json array
+ * of file ids.
+ */
+int
+seaf_repo_manager_post_multi_files_by_id (SeafRepoManager *mgr,
+                                          const char *repo_id,
+                                          const char *parent_dir,
+                                          const char *filenames_json,
+                                          const char *file_ids_json,
+                                          const char *user,
+                                          GError **error);
+
 int
 seaf_repo_manager_post_empty_file (SeafRepoManager *mgr,
                                    const char *repo_id,
@@ -233,6 +246,16 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
                             const char *head_id,
                             GError **error);
 
+int
+seaf_repo_manager_put_file_by_id (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  const char *file_id,
+                                  const char *parent_dir,
+                                  const char *file_name,
+                                  const char *user,
+                                  const char *head_id,
+                                  GError **error);
+
 int
 seaf_repo_manager_del_file (SeafRepoManager *mgr,
                             const char *repo_id,
@@ -241,6 +264,27 @@ seaf_repo_manager_del_file (SeafRepoManager *mgr,
                             const char *user,
                             GError **error);
 
+/*
+ * Apply a batch of operations and create a single commit.
+ *
+ * @ops_json: json array of operations. Each is an object with "op",
+ *            "parent_dir" and "name", plus:
+ *            "add": "file_id" of an indexed file;
+ *            "mkdir": nothing more;
+ *            "delete": nothing more, missing files are skipped;
+ *            "rename": "new_name";
+ *            "move", "copy": "dst_dir" and an optional "new_name".
+ *
+ * Operations are applied in order, each one sees the result of the
+ * previous ones. Nothing is committed if any of them fails.
+ */
+int
+seaf_repo_manager_batch_ops (SeafRepoManager *mgr,
+                             const char *repo_id,
+                             const char *ops_json,
+                             const char *user,
+                             GError **error);
+
 int
 seaf_repo_manager_copy_file (SeafRepoManager *mgr,
                              const char *src_repo_id,
@@ -193,8 +193,8 @@ check_file_exists (const char *root_id,
     SeafDirent *dent;
     int ret = FALSE;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, root_id,
-                                               parent_dir, NULL);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr, root_id,
+                                                      parent_dir, NULL);
     if (!dir) {
         seaf_warning ("parent_dir %s doesn't exist.\n", parent_dir);
         return FALSE;
@@ -212,7 +212,7 @@ check_file_exists (const char *root_id,
         }
     }
 
-    seaf_dir_free (dir);
+    seaf_dir_unref (dir);
 
     return ret;
 }
@@ -740,47 +740,19 @@ do_post_multi_files (const char *root_id,
     return post_multi_files_recursive(root_id, parent_dir, filenames, id_list);
 }
 
-static void
-convert_file_list (JsonArray *array, guint index, JsonNode *element, gpointer data)
-{
-    GList **files = data;
-
-    *files = g_list_prepend (*files, json_node_dup_string (element));
-}
-
-static GList *
-json_to_file_list (const char *files_json)
-{
-    JsonParser *parser = json_parser_new ();
-    JsonNode *root;
-    JsonArray *array;
-    GList *files = NULL;
-    GError *error = NULL;
-
-    json_parser_load_from_data (parser, files_json, strlen(files_json), &error);
-    if (error) {
-        seaf_warning ("Failed to load file list from json.\n");
-        g_error_free (error);
-        return NULL;
-    }
-
-    root = json_parser_get_root (parser);
-    array = json_node_get_array (root);
-
-    json_array_foreach_element (array, convert_file_list, &files);
-
-    g_object_unref (parser);
-    return files;
-}
-
-int
-seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
-                                    const char *repo_id,
-                                    const char *parent_dir,
-                                    const char *filenames_json,
-                                    const char *paths_json,
-                                    const char *user,
-                                    GError **error)
+/* Exactly one of @paths_json and @file_ids_json is set. Temp files in
+ * @paths_json are indexed here, files in @file_ids_json have been indexed
+ * by the caller.
+ */
+static int
+post_multi_files (SeafRepoManager *mgr,
+                  const char *repo_id,
+                  const char *parent_dir,
+                  const char *filenames_json,
+                  const char *paths_json,
+                  const char *file_ids_json,
+                  const char *user,
+                  GError **error)
 {
     SeafRepo *repo = NULL;
     SeafCommit *head_commit = NULL;
@@ -800,9 +772,13 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
     canon_path = get_canonical_path (parent_dir);
 
     /* Decode file name and tmp file paths from json. */
-    filenames = json_to_file_list (filenames_json);
-    paths = json_to_file_list (paths_json);
-    if (!filenames || !paths) {
+    filenames = json_to_string_list (filenames_json);
+    if (paths_json)
+        paths = json_to_string_list (paths_json);
+    else
+        id_list = json_to_string_list (file_ids_json);
+    if (!filenames || (!paths && !id_list) ||
+        g_list_length (filenames) != g_list_length (paths ? paths : id_list)) {
         seaf_warning ("[post files] Invalid filenames or paths.\n");
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid files");
         ret = -1;
@@ -829,8 +805,19 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
         goto out;
     }
 
+    for (ptr = id_list; ptr; ptr = ptr->next) {
+        if (!seaf_fs_manager_object_exists (seaf->fs_mgr, ptr->data)) {
+            seaf_warning ("[post files] File %s doesn't exist.\n",
+                          (char *)ptr->data);
+            g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                         "Invalid file id");
+            ret = -1;
+            goto out;
+        }
+    }
+
     /* Index tmp files and get file id list. */
-    if (repo->encrypted) {
+    if (paths && repo->encrypted) {
         unsigned char key[16], iv[16];
         if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
                                                      repo_id, user,
@@ -857,7 +844,8 @@ seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
         rawdata_to_hex(sha1, hex, 20);
         id_list = g_list_prepend (id_list, g_strdup(hex));
     }
-    id_list = g_list_reverse (id_list);
+    if (paths)
+        id_list = g_list_reverse (id_list);
 
     /* Add the files to parent dir and commit. */
     root_id = do_post_multi_files (head_commit->root_id, canon_path,
@@ -900,6 +888,32 @@ out:
     return ret;
 }
 
+int
+seaf_repo_manager_post_multi_files (SeafRepoManager *mgr,
+                                    const char *repo_id,
+                                    const char *parent_dir,
+                                    const char *filenames_json,
+                                    const char *paths_json,
+                                    const char *user,
+                                    GError **error)
+{
+    return post_multi_files (mgr, repo_id, parent_dir, filenames_json,
+                             paths_json, NULL, user, error);
+}
+
+int
+seaf_repo_manager_post_multi_files_by_id (SeafRepoManager *mgr,
+                                          const char *repo_id,
+                                          const char *parent_dir,
+                                          const char *filenames_json,
+                                          const char *file_ids_json,
+                                          const char *user,
+                                          GError **error)
+{
+    return post_multi_files (mgr, repo_id, parent_dir, filenames_json,
+                             NULL, file_ids_json, user, error);
+}
+
 static char *
 del_file_recursive(const char *dir_id,
                    const char *to_path,
@@ -1078,8 +1092,9 @@ get_dirent_by_path (SeafRepo *repo,
         goto out;
     }
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, head_commit->root_id,
-                                              path, NULL);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      head_commit->root_id,
+                                                      path, NULL);
     if (!dir) {
         seaf_warning ("dir %s doesn't exist in repo %s.\n", path, repo->id);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS, "Invalid dir");
@@ -1105,7 +1120,7 @@ out:
     if (head_commit)
         seaf_commit_unref (head_commit);
     if (dir)
-        seaf_dir_free (dir);
+        seaf_dir_unref (dir);
 
     return dent;
 }
@@ -1689,6 +1704,617 @@ out:
     return ret;
 }
 
+/*
+ * Batch operations.
+ *
+ * The operations are applied to an in-memory overlay of the tree. A dir is
+ * loaded when it's first walked into, and all dirs on the path to a change
+ * are marked dirty. When the whole batch has been applied, only the dirty
+ * dirs are saved, bottom-up, and a single commit is created. If any
+ * operation fails, nothing is committed.
+ */
+
+typedef struct TreeNode {
+    char        id[41];
+    guint32     mode;
+    /* name -> TreeNode. NULL for files and for dirs not loaded yet. */
+    GHashTable *children;
+    gboolean    dirty;
+} TreeNode;
+
+enum {
+    BATCH_OP_ADD = 0,
+    BATCH_OP_MKDIR,
+    BATCH_OP_DELETE,
+    BATCH_OP_RENAME,
+    BATCH_OP_MOVE,
+    BATCH_OP_COPY,
+    N_BATCH_OPS,
+};
+
+static const char *batch_op_names[N_BATCH_OPS] = {
+    "add", "mkdir", "delete", "rename", "move", "copy",
+};
+
+typedef struct BatchOp {
+    int     type;
+    /* Dirs are canonical, without leading and trailing '/'. */
+    char   *parent_dir;
+    char   *name;
+    char   *new_name;           /* rename, move and copy */
+    char   *dst_dir;            /* move and copy */
+    char   *file_id;            /* add */
+} BatchOp;
+
+static TreeNode *
+tree_node_new (const char *id, guint32 mode)
+{
+    TreeNode *node = g_new0 (TreeNode, 1);
+
+    memcpy (node->id, id, 40);
+    node->id[40] = '\0';
+    node->mode = mode;
+
+    return node;
+}
+
+static void
+tree_node_free (TreeNode *node)
+{
+    if (node->children)
+        g_hash_table_destroy (node->children);
+    g_free (node);
+}
+
+static GHashTable *
+tree_children_new ()
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  g_free, (GDestroyNotify)tree_node_free);
+}
+
+static int
+tree_node_load (TreeNode *node)
+{
+    SeafDir *dir;
+    SeafDirent *dent;
+    GList *ptr;
+
+    if (node->children)
+        return 0;
+
+    dir = seaf_fs_manager_get_seafdir (seaf->fs_mgr, node->id);
+    if (!dir) {
+        seaf_warning ("[batch ops] Failed to load dir %s.\n", node->id);
+        return -1;
+    }
+
+    node->children = tree_children_new ();
+    for (ptr = dir->entries; ptr; ptr = ptr->next) {
+        dent = ptr->data;
+        g_hash_table_insert (node->children, g_strdup (dent->name),
+                             tree_node_new (dent->id, dent->mode));
+    }
+
+    seaf_dir_free (dir);
+    return 0;
+}
+
+/* Copy @node for a copy operation. Clean sub-trees are shared through
+ * their ids, only dirty dirs have to be duplicated.
+ */
+static TreeNode *
+tree_node_copy (TreeNode *node)
+{
+    TreeNode *copy = tree_node_new (node->id, node->mode);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (!node->dirty)
+        return copy;
+
+    copy->dirty = TRUE;
+    copy->children = tree_children_new ();
+    g_hash_table_iter_init (&iter, node->children);
+    while (g_hash_table_iter_next (&iter, &key, &value))
+        g_hash_table_insert (copy->children, g_strdup (key),
+                             tree_node_copy (value));
+
+    return copy;
+}
+
+/* Return the loaded dir node at @path, or NULL if there is no such dir.
+ * If @dirty is TRUE, all dirs on the path are marked dirty.
+ */
+static TreeNode *
+tree_get_dir (TreeNode *root, const char *path, gboolean dirty)
+{
+    char **names, **p;
+    TreeNode *node = root;
+
+    names = g_strsplit (path, "/", -1);
+    for (p = names; ; ++p) {
+        if (tree_node_load (node) < 0) {
+            node = NULL;
+            break;
+        }
+        if (dirty)
+            node->dirty = TRUE;
+
+        if (!*p)
+            break;
+        if (**p == '\0')
+            continue;
+
+        node = g_hash_table_lookup (node->children, *p);
+        if (!node || !S_ISDIR(node->mode)) {
+            node = NULL;
+            break;
+        }
+    }
+    g_strfreev (names);
+
+    return node;
+}
+
+/* Save the dirty dirs under @node, and update the ids in the tree. */
+static int
+tree_node_save (TreeNode *node)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    TreeNode *child;
+    GList *entries = NULL;
+    SeafDir *dir;
+    int ret = 0;
+
+    if (!node->dirty)
+        return 0;
+
+    g_hash_table_iter_init (&iter, node->children);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        child = value;
+        if (S_ISDIR(child->mode) && tree_node_save (child) < 0)
+            ret = -1;
+        entries = g_list_prepend (entries,
+                                  seaf_dirent_new (child->id, child->mode, key));
+    }
+    if (ret < 0) {
+        for (; entries; entries = g_list_delete_link (entries, entries))
+            g_free (entries->data);
+        return -1;
+    }
+
+    entries = g_list_sort (entries, compare_dirents);
+    dir = seaf_dir_new (NULL, entries, 0);
+    if (seaf_dir_save (seaf->fs_mgr, dir) < 0) {
+        seaf_warning ("[batch ops] Failed to save dir %s.\n", dir->dir_id);
+        ret = -1;
+    } else {
+        memcpy (node->id, dir->dir_id, 41);
+        node->dirty = FALSE;
+    }
+    seaf_dir_free (dir);
+
+    return ret;
+}
+
+static void
+batch_op_free (BatchOp *op)
+{
+    g_free (op->parent_dir);
+    g_free (op->name);
+    g_free (op->new_name);
+    g_free (op->dst_dir);
+    g_free (op->file_id);
+    g_free (op);
+}
+
+static void
+batch_ops_free (GList *ops)
+{
+    GList *ptr;
+
+    for (ptr = ops; ptr; ptr = ptr->next)
+        batch_op_free (ptr->data);
+    g_list_free (ops);
+}
+
+static char *
+canon_dir_path (const char *path)
+{
+    char *canon = get_canonical_path (path);
+    char *p = canon;
+    int len;
+
+    while (*p == '/')
+        ++p;
+    memmove (canon, p, strlen(p) + 1);
+
+    len = strlen (canon);
+    while (len > 0 && canon[len - 1] == '/')
+        canon[--len] = '\0';
+
+    return canon;
+}
+
+static gboolean
+is_valid_name (const char *name)
+{
+    return (name && *name != '\0' && strlen(name) < SEAF_DIR_NAME_LEN &&
+            strcmp (name, ".") != 0 && strcmp (name, "..") != 0 &&
+            !should_ignore_file (name, NULL));
+}
+
+static const char *
+get_member (JsonObject *object, const char *member)
+{
+    JsonNode *node;
+
+    if (!json_object_has_member (object, member))
+        return NULL;
+    node = json_object_get_member (object, member);
+    if (JSON_NODE_TYPE(node) != JSON_NODE_VALUE ||
+        json_node_get_value_type (node) != G_TYPE_STRING)
+        return NULL;
+
+    return json_node_get_string (node);
+}
+
+static BatchOp *
+parse_batch_op (JsonNode *node)
+{
+    JsonObject *object;
+    BatchOp *op;
+    const char *type, *parent_dir, *name, *new_name, *dst_dir, *file_id;
+    int i;
+
+    if (JSON_NODE_TYPE(node) != JSON_NODE_OBJECT)
+        return NULL;
+    object = json_node_get_object (node);
+
+    type = get_member (object, "op");
+    parent_dir = get_member (object, "parent_dir");
+    name = get_member (object, "name");
+    new_name = get_member (object, "new_name");
+    dst_dir = get_member (object, "dst_dir");
+    file_id = get_member (object, "file_id");
+
+    if (!type || !parent_dir || !name)
+        return NULL;
+    if (strstr (parent_dir, "//") != NULL ||
+        (dst_dir && strstr (dst_dir, "//") != NULL))
+        return NULL;
+
+    for (i = 0; i < N_BATCH_OPS; ++i)
+        if (strcmp (type, batch_op_names[i]) == 0)
+            break;
+
+    switch (i) {
+    case BATCH_OP_ADD:
+        if (!file_id || strlen(file_id) != 40)
+            return NULL;
+        break;
+    case BATCH_OP_RENAME:
+        if (!new_name)
+            return NULL;
+        break;
+    case BATCH_OP_MOVE:
+    case BATCH_OP_COPY:
+        if (!dst_dir)
+            return NULL;
+        if (!new_name)
+            new_name = name;
+        break;
+    case BATCH_OP_MKDIR:
+    case BATCH_OP_DELETE:
+        break;
+    default:
+        return NULL;
+    }
+
+    op = g_new0 (BatchOp, 1);
+    op->type = i;
+    op->parent_dir = canon_dir_path (parent_dir);
+    op->name = g_strdup (name);
+    op->new_name = g_strdup (new_name);
+    op->dst_dir = dst_dir ? canon_dir_path (dst_dir) : NULL;
+    op->file_id = g_strdup (file_id);
+
+    return op;
+}
+
+static GList *
+json_to_batch_ops (const char *ops_json)
+{
+    JsonParser *parser = json_parser_new ();
+    JsonNode *root;
+    JsonArray *array;
+    GList *ops = NULL;
+    BatchOp *op;
+    GError *error = NULL;
+    guint i;
+
+    json_parser_load_from_data (parser, ops_json, strlen(ops_json), &error);
+    if (error) {
+        seaf_warning ("[batch ops] Failed to load ops from json.\n");
+        g_error_free (error);
+        goto error;
+    }
+
+    root = json_parser_get_root (parser);
+    if (!root || JSON_NODE_TYPE(root) != JSON_NODE_ARRAY)
+        goto error;
+    array = json_node_get_array (root);
+
+    for (i = 0; i < json_array_get_length (array); ++i) {
+        op = parse_batch_op (json_array_get_element (array, i));
+        if (!op) {
+            seaf_warning ("[batch ops] Invalid op at index %u.\n", i);
+            goto error;
+        }
+        ops = g_list_prepend (ops, op);
+    }
+
+    g_object_unref (parser);
+    return g_list_reverse (ops);
+
+error:
+    batch_ops_free (ops);
+    g_object_unref (parser);
+    return NULL;
+}
+
+static void
+batch_op_desc (BatchOp *op, guint32 mode, char *buf, int len)
+{
+    gboolean is_dir = S_ISDIR(mode);
+
+    switch (op->type) {
+    case BATCH_OP_ADD:
+        snprintf (buf, len, "Added \"%s\"", op->name);
+        break;
+    case BATCH_OP_MKDIR:
+        snprintf (buf, len, "Added directory \"%s\"", op->name);
+        break;
+    case BATCH_OP_DELETE:
+        snprintf (buf, len, is_dir ? "Removed directory \"%s\"" : "Deleted \"%s\"",
+                  op->name);
+        break;
+    case BATCH_OP_RENAME:
+        snprintf (buf, len, is_dir ? "Renamed directory \"%s\"" : "Renamed \"%s\"",
+                  op->name);
+        break;
+    case BATCH_OP_MOVE:
+        snprintf (buf, len, is_dir ? "Moved directory \"%s\"" : "Moved \"%s\"",
+                  op->name);
+        break;
+    case BATCH_OP_COPY:
+        snprintf (buf, len, is_dir ? "Added directory \"%s\"" : "Added \"%s\"",
+                  op->new_name);
+        break;
+    }
+}
+
+#define BATCH_OP_FAIL(fmt, ...)                                         \
+    do {                                                                \
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,          \
+                     fmt, ##__VA_ARGS__);                               \
+        return -1;                                                      \
+    } while (0)
+
+/* Remove @name from @dir without freeing the node, which is returned. */
+static TreeNode *
+tree_node_detach (TreeNode *dir, const char *name)
+{
+    gpointer key, value;
+
+    if (!g_hash_table_lookup_extended (dir->children, name, &key, &value))
+        return NULL;
+
+    g_hash_table_steal (dir->children, name);
+    g_free (key);
+    return value;
+}
+
+/*
+ * Apply @op to the tree. Returns 0 if the tree is changed, 1 if there is
+ * nothing to do, or -1 on error. @mode is set to the mode of the entry.
+ */
+static int
+apply_batch_op (TreeNode *root, BatchOp *op, guint32 *mode, GError **error)
+{
+    TreeNode *parent, *dst = NULL, *node;
+    char *src_path;
+    const char *target;
+    gboolean into_self;
+
+    parent = tree_get_dir (root, op->parent_dir, FALSE);
+    if (!parent)
+        BATCH_OP_FAIL ("Directory %s does not exist", op->parent_dir);
+
+    node = g_hash_table_lookup (parent->children, op->name);
+
+    switch (op->type) {
+    case BATCH_OP_ADD:
+    case BATCH_OP_MKDIR:
+        if (!is_valid_name (op->name))
+            BATCH_OP_FAIL ("Invalid filename %s", op->name);
+        if (node)
+            BATCH_OP_FAIL ("file %s already exists", op->name);
+        if (op->type == BATCH_OP_ADD) {
+            if (!seaf_fs_manager_object_exists (seaf->fs_mgr, op->file_id))
+                BATCH_OP_FAIL ("Invalid file id %s", op->file_id);
+            node = tree_node_new (op->file_id, S_IFREG);
+        } else {
+            node = tree_node_new (EMPTY_SHA1, S_IFDIR);
+        }
+        g_hash_table_insert (parent->children, g_strdup (op->name), node);
+        break;
+
+    case BATCH_OP_DELETE:
+        /* Same as del_file, deleting a missing file is not an error. */
+        if (!node)
+            return 1;
+        *mode = node->mode;
+        g_hash_table_remove (parent->children, op->name);
+        break;
+
+    case BATCH_OP_RENAME:
+        if (!node)
+            BATCH_OP_FAIL ("file %s does not exist", op->name);
+        if (strcmp (op->name, op->new_name) == 0)
+            return 1;
+        if (!is_valid_name (op->new_name))
+            BATCH_OP_FAIL ("Invalid filename %s", op->new_name);
+        if (g_hash_table_lookup (parent->children, op->new_name))
+            BATCH_OP_FAIL ("file %s already exists", op->new_name);
+        *mode = node->mode;
+        tree_node_detach (parent, op->name);
+        g_hash_table_insert (parent->children, g_strdup (op->new_name), node);
+        break;
+
+    case BATCH_OP_MOVE:
+    case BATCH_OP_COPY:
+        if (!node)
+            BATCH_OP_FAIL ("file %s does not exist", op->name);
+        if (!is_valid_name (op->new_name))
+            BATCH_OP_FAIL ("Invalid filename %s", op->new_name);
+
+        if (*op->parent_dir == '\0')
+            src_path = g_strdup (op->name);
+        else
+            src_path = g_strconcat (op->parent_dir, "/", op->name, NULL);
+        target = op->dst_dir;
+        into_self = (g_str_has_prefix (target, src_path) &&
+                     (target[strlen(src_path)] == '\0' ||
+                      target[strlen(src_path)] == '/'));
+        g_free (src_path);
+        if (S_ISDIR(node->mode) && into_self)
+            BATCH_OP_FAIL ("Can't move or copy %s into itself", op->name);
+
+        dst = tree_get_dir (root, op->dst_dir, FALSE);
+        if (!dst)
+            BATCH_OP_FAIL ("Directory %s does not exist", op->dst_dir);
+        if (dst == parent && strcmp (op->name, op->new_name) == 0) {
+            if (op->type == BATCH_OP_MOVE)
+                return 1;
+            BATCH_OP_FAIL ("file %s already exists", op->new_name);
+        }
+        if (g_hash_table_lookup (dst->children, op->new_name))
+            BATCH_OP_FAIL ("file %s already exists", op->new_name);
+
+        *mode = node->mode;
+        if (op->type == BATCH_OP_MOVE)
+            tree_node_detach (parent, op->name);
+        else
+            node = tree_node_copy (node);
+        g_hash_table_insert (dst->children, g_strdup (op->new_name), node);
+
+        tree_get_dir (root, op->dst_dir, TRUE);
+        break;
+    }
+
+    if (op->type != BATCH_OP_COPY)
+        tree_get_dir (root, op->parent_dir, TRUE);
+
+    return 0;
+}
+
+int
+seaf_repo_manager_batch_ops (SeafRepoManager *mgr,
+                             const char *repo_id,
+                             const char *ops_json,
+                             const char *user,
+                             GError **error)
+{
+    SeafRepo *repo = NULL;
+    SeafCommit *head_commit = NULL;
+    GList *ops = NULL, *ptr;
+    TreeNode *root = NULL;
+    char desc[PATH_MAX];
+    guint32 mode;
+    guint n_changes = 0;
+    gboolean same_type = TRUE;
+    int first_type = -1;
+    int rc, ret = 0;
+
+    ops = json_to_batch_ops (ops_json);
+    if (!ops) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid operations");
+        return -1;
+    }
+
+    GET_REPO_OR_FAIL(repo, repo_id);
+    GET_COMMIT_OR_FAIL(head_commit, repo->head->commit_id);
+
+    root = tree_node_new (head_commit->root_id, S_IFDIR);
+
+    for (ptr = ops; ptr; ptr = ptr->next) {
+        BatchOp *op = ptr->data;
+
+        mode = S_IFREG;
+        rc = apply_batch_op (root, op, &mode, error);
+        if (rc < 0) {
+            seaf_warning ("[batch ops] Failed to %s %s/%s in repo %.8s.\n",
+                          batch_op_names[op->type], op->parent_dir, op->name,
+                          repo_id);
+            ret = -1;
+            goto out;
+        }
+        if (rc > 0)
+            continue;
+
+        if (n_changes++ == 0) {
+            batch_op_desc (op, mode, desc, sizeof(desc));
+            first_type = op->type;
+        } else if (op->type != first_type) {
+            same_type = FALSE;
+        }
+    }
+
+    if (n_changes == 0)
+        goto out;
+
+    if (tree_node_save (root) < 0) {
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_GENERAL,
+                     "Failed to save dirs");
+        ret = -1;
+        goto out;
+    }
+
+    /* E.g. a file renamed and renamed back. */
+    if (strcmp (root->id, head_commit->root_id) == 0) {
+        n_changes = 0;
+        goto out;
+    }
+
+    if (n_changes > 1) {
+        int len = strlen (desc);
+        snprintf (desc + len, sizeof(desc) - len, " and %u more %s.",
+                  n_changes - 1, same_type ? "files" : "changes");
+    }
+
+    if (gen_new_commit (repo_id, head_commit, root->id,
+                        user, desc, error) < 0)
+        ret = -1;
+
+out:
+    if (repo)
+        seaf_repo_unref (repo);
+    if (head_commit)
+        seaf_commit_unref (head_commit);
+    if (root)
+        tree_node_free (root);
+    batch_ops_free (ops);
+
+    if (ret == 0 && n_changes > 0)
+        update_repo_size (repo_id);
+
+    return ret;
+}
+
 static char *
 put_file_recursive(const char *dir_id,
                    const char *to_path,
@@ -1787,15 +2413,17 @@ do_put_file (const char *root_id,
     return put_file_recursive(root_id, parent_dir, dent);
 }
 
-int
-seaf_repo_manager_put_file (SeafRepoManager *mgr,
-                            const char *repo_id,
-                            const char *temp_file_path,
-                            const char *parent_dir,
-                            const char *file_name,
-                            const char *user,
-                            const char *head_id,
-                            GError **error)
+/* Either @temp_file_path is indexed, or @file_id has been indexed. */
+static int
+put_file (SeafRepoManager *mgr,
+          const char *repo_id,
+          const char *temp_file_path,
+          const char *file_id,
+          const char *parent_dir,
+          const char *file_name,
+          const char *user,
+          const char *head_id,
+          GError **error)
 {
     SeafRepo *repo = NULL;
     SeafCommit *head_commit = NULL;
@@ -1809,7 +2437,7 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     char *old_file_id = NULL, *fullpath = NULL;
     int ret = 0;
 
-    if (access (temp_file_path, R_OK) != 0) {
+    if (temp_file_path && access (temp_file_path, R_OK) != 0) {
         seaf_warning ("[put file] File %s doesn't exist or not readable.\n",
                       temp_file_path);
         g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
@@ -1817,6 +2445,13 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
         return -1;
     }
 
+    if (file_id && !seaf_fs_manager_object_exists (seaf->fs_mgr, file_id)) {
+        seaf_warning ("[put file] File %s doesn't exist.\n", file_id);
+        g_set_error (error, SEAFILE_DOMAIN, SEAF_ERR_BAD_ARGS,
+                     "Invalid file id");
+        return -1;
+    }
+
     GET_REPO_OR_FAIL(repo, repo_id);
     const char *base = head_id ? head_id : repo->head->commit_id;
     GET_COMMIT_OR_FAIL(head_commit, base);
@@ -1843,6 +2478,11 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     FAIL_IF_FILE_NOT_EXISTS(head_commit->root_id, canon_path, file_name, NULL);
 
     /* Write blocks. */
+    if (file_id) {
+        g_strlcpy (hex, file_id, sizeof(hex));
+        goto indexed;
+    }
+
     if (repo->encrypted) {
         unsigned char key[16], iv[16];
         if (seaf_passwd_manager_get_decrypt_key_raw (seaf->passwd_mgr,
@@ -1867,6 +2507,8 @@ seaf_repo_manager_put_file (SeafRepoManager *mgr,
     }
         
     rawdata_to_hex(sha1, hex, 20);
+
+indexed:
     new_dent = seaf_dirent_new (hex, S_IFREG, file_name);
 
     if (!fullpath)
@@ -1916,6 +2558,34 @@ out:
     return ret;
 }
 
+int
+seaf_repo_manager_put_file (SeafRepoManager *mgr,
+                            const char *repo_id,
+                            const char *temp_file_path,
+                            const char *parent_dir,
+                            const char *file_name,
+                            const char *user,
+                            const char *head_id,
+                            GError **error)
+{
+    return put_file (mgr, repo_id, temp_file_path, NULL, parent_dir,
+                     file_name, user, head_id, error);
+}
+
+int
+seaf_repo_manager_put_file_by_id (SeafRepoManager *mgr,
+                                  const char *repo_id,
+                                  const char *file_id,
+                                  const char *parent_dir,
+                                  const char *file_name,
+                                  const char *user,
+                                  const char *head_id,
+                                  GError **error)
+{
+    return put_file (mgr, repo_id, NULL, file_id, parent_dir,
+                     file_name, user, head_id, error);
+}
+
 /* split filename into base and extension */
 static void
 filename_splitext (const char *filename,
@@ -1952,9 +2622,9 @@ revert_file_to_root (const char *root_id,
 
     *skipped = FALSE;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
-                                               root_id,
-                                               "/", error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      root_id,
+                                                      "/", error);
     if (*error) {
         return NULL;
     }
@@ -1997,7 +2667,7 @@ revert_file_to_root (const char *root_id,
 
 out:
     if (dir)
-        seaf_dir_free (dir);
+        seaf_dir_unref (dir);
 
     g_free (basename);
     g_free (ext);
@@ -2025,9 +2695,9 @@ revert_file_to_parent_dir (const char *root_id,
     
     *skipped = FALSE;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
-                                               root_id,
-                                               parent_dir, error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      root_id,
+                                                      parent_dir, error);
     if (*error) {
         return NULL;
     }
@@ -2073,7 +2743,7 @@ do_revert:
 
 out:
     if (dir)
-        seaf_dir_free (dir);
+        seaf_dir_unref (dir);
 
     g_free (basename);
     g_free (ext);
@@ -2089,7 +2759,8 @@ detect_path_exist (const char *root_id,
 {
     SeafDir *dir;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr, root_id, path, error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr, root_id,
+                                                      path, error);
     if (*error) {
         if (g_error_matches(*error, SEAFILE_DOMAIN, SEAF_ERR_PATH_NO_EXIST)) {
             /* path does not exist */
@@ -2101,7 +2772,7 @@ detect_path_exist (const char *root_id,
         }
     }
 
-    seaf_dir_free(dir);
+    seaf_dir_unref (dir);
     return TRUE;
 }
 
@@ -2263,9 +2934,9 @@ revert_dir (const char *root_id,
 
     *skipped = FALSE;
 
-    dir = seaf_fs_manager_get_seafdir_by_path (seaf->fs_mgr,
-                                               root_id,
-                                               parent_dir, error);
+    dir = seaf_fs_manager_get_seafdir_by_path_shared (seaf->fs_mgr,
+                                                      root_id,
+                                                      parent_dir, error);
     if (*error) {
         return NULL;
     }
@@ -2299,7 +2970,7 @@ revert_dir (const char *root_id,
 
 out:
     if (dir)
-        seaf_dir_free (dir);
+        seaf_dir_unref (dir);
 
     g_free (newdent);
 
@@ -156,6 +156,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_server_repo_size",
                                      searpc_signature_int64__string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_get_fs_cache_stat,
+                                     "seafile_get_fs_cache_stat",
+                                     searpc_signature_int64__string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_repo_set_access_property,
                                      "seafile_repo_set_access_property",
@@ -190,6 +195,16 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_put_file",
                     searpc_signature_int__string_string_string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_post_multi_files_by_id,
+                                     "seafile_post_multi_files_by_id",
+                    searpc_signature_int__string_string_string_string_string());
+
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_put_file_by_id,
+                                     "seafile_put_file_by_id",
+                    searpc_signature_int__string_string_string_string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_post_empty_file,
                                      "seafile_post_empty_file",
@@ -205,6 +220,11 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      "seafile_del_file",
                         searpc_signature_int__string_string_string_string());
 
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_batch_ops,
+                                     "seafile_batch_ops",
+                        searpc_signature_int__string_string_string());
+
     searpc_server_register_function ("seafserv-threaded-rpcserver",
                                      seafile_copy_file,
                                      "seafile_copy_file",
@@ -418,6 +438,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_gc_get_progress,
                                      "seafile_gc_get_progress",
                                      searpc_signature_int__void());
+    searpc_server_register_function ("seafserv-rpcserver",
+                                     seafile_gc_get_stat,
+                                     "seafile_gc_get_stat",
+                                     searpc_signature_int64__string());
 
     /* password management */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
@@ -466,6 +490,10 @@ static void start_rpc_service (CcnetClient *client, int cloud_mode)
                                      seafile_check_quota,
                                      "check_quota",
                                      searpc_signature_int__string());
+    searpc_server_register_function ("seafserv-threaded-rpcserver",
+                                     seafile_check_quota_with_delta,
+                                     "check_quota_with_delta",
+                                     searpc_signature_int__string_int64());
 
     /* repo permission */
     searpc_server_register_function ("seafserv-threaded-rpcserver",
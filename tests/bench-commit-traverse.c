@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Time a full seaf_commit_manager_traverse_commit_tree() over a long
+ * history, before and after the binary commit format and commit cache:
+ *
+ *  - json:          json commits, no cache (how commits used to be loaded);
+ *  - json+cache:    json commits, decoded commit cache;
+ *  - binary:        binary commits, no cache;
+ *  - binary+cache:  binary commits, decoded commit cache.
+ *
+ * The same history is saved once in each format, under <dir>/json and
+ * <dir>/binary. Every 10th commit merges a short side branch. Commit
+ * objects are stored one file per object by a minimal object store in
+ * this file, so the numbers are mostly decoding, not I/O.
+ *
+ * The first traversal of each run starts with an empty cache, the
+ * average of the following ones is reported separately.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "seafile-session.h"
+#include "commit-mgr.h"
+
+#define REPO_ID "b1f2ec8a-3bd3-4e5c-9e2f-6a1e4c0d2f17"
+#define ROOT_ID "0123456789abcdef0123456789abcdef01234567"
+#define CREATOR_ID "fedcba9876543210fedcba9876543210fedcba98"
+
+static char *bench_dir;
+static int n_commits = 100000;
+static int cache_size = 256;
+
+/*
+ * Minimal object store, objects are saved as <dir>/<id[:2]>/<id[2:]>.
+ */
+
+struct SeafObjStore {
+    char *obj_dir;
+};
+
+static char *
+obj_path (struct SeafObjStore *store, const char *obj_id)
+{
+    char sub[3];
+
+    memcpy (sub, obj_id, 2);
+    sub[2] = '\0';
+    return g_build_filename (store->obj_dir, sub, obj_id + 2, NULL);
+}
+
+struct SeafObjStore *
+seaf_obj_store_new (struct _SeafileSession *seaf, const char *obj_type)
+{
+    struct SeafObjStore *store = g_new0 (struct SeafObjStore, 1);
+
+    store->obj_dir = g_build_filename (seaf->seaf_dir, obj_type, NULL);
+    return store;
+}
+
+int
+seaf_obj_store_init (struct SeafObjStore *obj_store,
+                     gboolean enable_async,
+                     struct CEventManager *ev_mgr)
+{
+    return g_mkdir_with_parents (obj_store->obj_dir, 0777);
+}
+
+int
+seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
+                         const char *obj_id,
+                         void **data,
+                         int *len)
+{
+    char *path = obj_path (obj_store, obj_id);
+    gsize size;
+    gboolean ret;
+
+    ret = g_file_get_contents (path, (gchar **)data, &size, NULL);
+    g_free (path);
+    if (!ret)
+        return -1;
+
+    *len = (int)size;
+    return 0;
+}
+
+int
+seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
+                          const char *obj_id,
+                          void *data,
+                          int len)
+{
+    char *path = obj_path (obj_store, obj_id);
+    char *dir = g_path_get_dirname (path);
+    int ret = 0;
+
+    if (g_mkdir_with_parents (dir, 0777) < 0 ||
+        !g_file_set_contents (path, data, len, NULL))
+        ret = -1;
+
+    g_free (dir);
+    g_free (path);
+    return ret;
+}
+
+gboolean
+seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
+                           const char *obj_id)
+{
+    char *path = obj_path (obj_store, obj_id);
+    gboolean ret = g_file_test (path, G_FILE_TEST_EXISTS);
+
+    g_free (path);
+    return ret;
+}
+
+void
+seaf_obj_store_delete_obj (struct SeafObjStore *obj_store,
+                           const char *obj_id)
+{
+    char *path = obj_path (obj_store, obj_id);
+
+    g_unlink (path);
+    g_free (path);
+}
+
+static SeafCommitManager *
+open_commit_mgr (const char *format, gboolean binary, int cache_mb)
+{
+    SeafileSession *session = g_new0 (SeafileSession, 1);
+    SeafCommitManager *mgr;
+
+    session->seaf_dir = g_build_filename (bench_dir, format, NULL);
+    session->config = g_key_file_new ();
+    g_key_file_set_boolean (session->config, "commit", "binary_format", binary);
+    g_key_file_set_integer (session->config, "commit", "cache_size", cache_mb);
+
+    mgr = seaf_commit_manager_new (session);
+    if (seaf_commit_manager_init (mgr) < 0) {
+        fprintf (stderr, "Failed to init commit manager in %s.\n",
+                 session->seaf_dir);
+        exit (1);
+    }
+
+    return mgr;
+}
+
+/*
+ * Save the same history to both managers. Returns the head commit id.
+ */
+static char *
+create_history (SeafCommitManager *json_mgr, SeafCommitManager *binary_mgr)
+{
+    SeafCommit *commit, *side;
+    char *head = NULL, *fork_point = NULL;
+    char desc[64];
+    int i;
+
+    for (i = 0; i < n_commits; ++i) {
+        snprintf (desc, sizeof(desc), "Modified \"file-%d.txt\"", i);
+        commit = seaf_commit_new (NULL, REPO_ID, ROOT_ID, "bench",
+                                  CREATOR_ID, desc, 1300000000 + i * 2);
+        commit->parent_id = head;
+        commit->repo_name = g_strdup ("bench");
+        commit->repo_desc = g_strdup ("");
+
+        /* Merge a commit made from the head of 5 commits ago. */
+        if (i % 10 == 9 && fork_point) {
+            snprintf (desc, sizeof(desc), "Side change %d", i);
+            side = seaf_commit_new (NULL, REPO_ID, ROOT_ID, "bench",
+                                    CREATOR_ID, desc, 1300000000 + i * 2 - 1);
+            side->parent_id = g_strdup (fork_point);
+            side->repo_name = g_strdup ("bench");
+            side->repo_desc = g_strdup ("");
+            if (seaf_commit_manager_add_commit (json_mgr, side) < 0 ||
+                seaf_commit_manager_add_commit (binary_mgr, side) < 0)
+                return NULL;
+            commit->second_parent_id = g_strdup (side->commit_id);
+            seaf_commit_unref (side);
+        }
+
+        if (seaf_commit_manager_add_commit (json_mgr, commit) < 0 ||
+            seaf_commit_manager_add_commit (binary_mgr, commit) < 0)
+            return NULL;
+
+        head = g_strdup (commit->commit_id);
+        if (i % 10 == 4) {
+            g_free (fork_point);
+            fork_point = g_strdup (head);
+        }
+        seaf_commit_unref (commit);
+    }
+
+    g_free (fork_point);
+    return head;
+}
+
+static gboolean
+count_commit (SeafCommit *commit, void *data, gboolean *stop)
+{
+    ++*(int *)data;
+    return TRUE;
+}
+
+static double
+traverse_once (SeafCommitManager *mgr, const char *head, int *count)
+{
+    struct timeval start, end;
+
+    *count = 0;
+    gettimeofday (&start, NULL);
+    if (!seaf_commit_manager_traverse_commit_tree (mgr, head,
+                                                   count_commit, count)) {
+        fprintf (stderr, "Traversal failed.\n");
+        exit (1);
+    }
+    gettimeofday (&end, NULL);
+
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+static void
+run (const char *name, const char *format, gboolean binary, int cache_mb,
+     const char *head, int rounds)
+{
+    SeafCommitManager *mgr = open_commit_mgr (format, binary, cache_mb);
+    double first, rest = 0;
+    int count, i;
+
+    first = traverse_once (mgr, head, &count);
+    for (i = 1; i < rounds; ++i)
+        rest += traverse_once (mgr, head, &count);
+
+    printf ("%-14s %8d commits  first %7.3f s", name, count, first);
+    if (rounds > 1)
+        printf ("  then %7.3f s (%.0f commits/s)",
+                rest / (rounds - 1), count * (rounds - 1) / rest);
+    printf ("\n");
+}
+
+int
+main (int argc, char **argv)
+{
+    SeafCommitManager *json_mgr, *binary_mgr;
+    int rounds = 3;
+    char *head;
+    int c;
+
+    while ((c = getopt (argc, argv, "n:r:c:")) != -1) {
+        switch (c) {
+        case 'n':
+            n_commits = atoi (optarg);
+            break;
+        case 'r':
+            rounds = atoi (optarg);
+            break;
+        case 'c':
+            cache_size = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "usage: bench-commit-traverse [-n commits] "
+                     "[-r rounds] [-c cache MB] <dir>\n");
+            return 1;
+        }
+    }
+
+    if (optind >= argc || n_commits <= 0 || rounds <= 0) {
+        fprintf (stderr, "usage: bench-commit-traverse [-n commits] "
+                 "[-r rounds] [-c cache MB] <dir>\n");
+        return 1;
+    }
+    bench_dir = argv[optind];
+
+    g_type_init ();
+
+    /* Commits are only written here, don't keep them in the cache. */
+    json_mgr = open_commit_mgr ("json", FALSE, 0);
+    binary_mgr = open_commit_mgr ("binary", TRUE, 0);
+
+    printf ("Creating a history of %d commits in %s.\n", n_commits, bench_dir);
+    head = create_history (json_mgr, binary_mgr);
+    if (!head) {
+        fprintf (stderr, "Failed to save commits.\n");
+        return 1;
+    }
+
+    printf ("Traversing from %s, %d rounds, cache %d MB.\n",
+            head, rounds, cache_size);
+    run ("json", "json", FALSE, 0, head, rounds);
+    run ("json+cache", "json", FALSE, cache_size, head, rounds);
+    run ("binary", "binary", TRUE, 0, head, rounds);
+    run ("binary+cache", "binary", TRUE, cache_size, head, rounds);
+
+    g_free (head);
+    return 0;
+}
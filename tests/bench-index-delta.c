@@ -0,0 +1,212 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Compare re-indexing a modified file with seaf_fs_manager_index_blocks()
+ * and with seaf_fs_manager_index_blocks_with_base(), which reuses the
+ * blocks of the previous version, on synthetic workloads:
+ *
+ *  - append:    1 MB appended at the end;
+ *  - insert:    100 bytes inserted in the middle;
+ *  - overwrite: three 4 KB ranges overwritten in place.
+ *
+ * A random file is indexed once as the previous version. Each modified
+ * file is then indexed twice: without a base, which writes every block,
+ * and with the previous version as the base. Blocks and fs objects are
+ * stored by tests/fs-test-stubs.c under <dir>. The number of blocks
+ * written and the time taken are reported.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fs-test-stubs.h"
+
+#define APPEND_SIZE (1024 * 1024)
+#define INSERT_SIZE 100
+#define OVERWRITE_SIZE 4096
+#define N_OVERWRITES 3
+
+static char *bench_dir;
+static gint64 file_size = 256 * 1024 * 1024;
+
+static void
+random_fill (char *buf, gint64 len)
+{
+    gint64 i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = (char)random();
+}
+
+/* Returns the size of the modified data in @buf. */
+static gint64
+modify (int workload, char *buf)
+{
+    gint64 mid = file_size / 2;
+    int i;
+
+    switch (workload) {
+    case 0:
+        random_fill (buf + file_size, APPEND_SIZE);
+        return file_size + APPEND_SIZE;
+    case 1:
+        memmove (buf + mid + INSERT_SIZE, buf + mid, file_size - mid);
+        random_fill (buf + mid, INSERT_SIZE);
+        return file_size + INSERT_SIZE;
+    default:
+        for (i = 1; i <= N_OVERWRITES; ++i)
+            random_fill (buf + file_size / (N_OVERWRITES + 1) * i,
+                         OVERWRITE_SIZE);
+        return file_size;
+    }
+}
+
+static double
+now ()
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Index @path with @base_id as the previous version, which may be NULL.
+ * Sets the number of blocks written and returns the time taken,
+ * or -1 on error.
+ */
+static double
+index_file (const char *path, const char *base_id, int *n_written)
+{
+    unsigned char sha1[20];
+    int start_written = fs_test_blocks_written ();
+    double start = now ();
+
+    if (seaf_fs_manager_index_blocks_with_base (seaf->fs_mgr, path, sha1,
+                                                NULL, base_id) < 0)
+        return -1;
+
+    *n_written = fs_test_blocks_written () - start_written;
+    return now () - start;
+}
+
+static int
+run (const char *name, const char *path, const char *base_id)
+{
+    double full_time, reuse_time;
+    int full_written, reuse_written;
+
+    full_time = index_file (path, NULL, &full_written);
+    if (full_time < 0)
+        return -1;
+
+    reuse_time = index_file (path, base_id, &reuse_written);
+    if (reuse_time < 0)
+        return -1;
+
+    printf ("%-10s  all: %5d blocks written %6.2f s"
+            "  reuse: %5d blocks written %6.2f s\n",
+            name, full_written, full_time, reuse_written, reuse_time);
+
+    return 0;
+}
+
+static int
+write_file (const char *path, const char *buf, gint64 len)
+{
+    int fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    gint64 done = 0;
+    ssize_t n;
+
+    if (fd < 0)
+        return -1;
+
+    while (done < len) {
+        n = write (fd, buf + done, MIN (len - done, 1 << 20));
+        if (n <= 0) {
+            close (fd);
+            return -1;
+        }
+        done += n;
+    }
+
+    close (fd);
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    static const char *names[] = { "append", "insert", "overwrite" };
+    unsigned char sha1[20];
+    char base_id[41];
+    char *orig, *buf, *path;
+    gint64 len;
+    int c, i, n_blocks, ret = 0;
+
+    while ((c = getopt (argc, argv, "s:")) != -1) {
+        switch (c) {
+        case 's':
+            file_size = (gint64)atoi (optarg) << 20;
+            break;
+        default:
+            fprintf (stderr, "usage: bench-index-delta [-s file size in MB] <dir>\n");
+            return 1;
+        }
+    }
+
+    if (optind >= argc || file_size <= 0) {
+        fprintf (stderr, "usage: bench-index-delta [-s file size in MB] <dir>\n");
+        return 1;
+    }
+    bench_dir = argv[optind];
+
+    g_type_init ();
+
+    if (g_mkdir_with_parents (bench_dir, 0777) < 0 ||
+        !fs_test_session_new (bench_dir)) {
+        fprintf (stderr, "Failed to set up %s: %s.\n", bench_dir, strerror(errno));
+        return 1;
+    }
+    path = g_build_filename (bench_dir, "file", NULL);
+
+    srandom (7);
+    orig = malloc (file_size + APPEND_SIZE);
+    buf = malloc (file_size + APPEND_SIZE);
+    random_fill (orig, file_size);
+
+    if (write_file (path, orig, file_size) < 0 ||
+        seaf_fs_manager_index_blocks (seaf->fs_mgr, path, sha1, NULL) < 0) {
+        fprintf (stderr, "Failed to index %s.\n", path);
+        return 1;
+    }
+    rawdata_to_hex (sha1, base_id, 20);
+    n_blocks = fs_test_blocks_written ();
+    printf ("Previous version: %" G_GINT64_FORMAT " MB, %d blocks.\n",
+            file_size >> 20, n_blocks);
+
+    for (i = 0; i < G_N_ELEMENTS(names); ++i) {
+        memcpy (buf, orig, file_size);
+        len = modify (i, buf);
+        if (write_file (path, buf, len) < 0 || run (names[i], path, base_id) < 0) {
+            fprintf (stderr, "Failed to index %s.\n", path);
+            ret = 1;
+            break;
+        }
+    }
+
+    g_unlink (path);
+
+    free (orig);
+    free (buf);
+    g_free (path);
+    return ret;
+}
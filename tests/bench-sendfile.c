@@ -0,0 +1,291 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Compare the two ways httpserver sends unencrypted file blocks:
+ *
+ *  - copy: read each block in 64KB pieces and bufferevent_write() them,
+ *    as write_data_cb() does.
+ *  - sendfile: add block files to the output buffer with
+ *    evbuffer_add_file(), as write_data_zero_copy_cb() does.
+ *
+ * Blocks are created in <dir> and sent to a child process over a TCP
+ * loopback connection. Throughput and the CPU time of the sending
+ * process per GB are reported for both modes.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#define BLOCK_SIZE (1024 * 1024)
+#define COPY_BUF_SIZE (64 * 1024)
+#define SENDFILE_QUEUE_SIZE (4 * 1024 * 1024)
+
+static char *block_dir;
+static int n_blocks = 256;
+
+typedef struct SendState {
+    int idx;
+    int fd;
+} SendState;
+
+static void
+block_path (int i, char *path, size_t len)
+{
+    snprintf (path, len, "%s/block-%d", block_dir, i);
+}
+
+static int
+create_blocks ()
+{
+    char path[4096];
+    char *buf = malloc (BLOCK_SIZE);
+    int i, j, fd;
+
+    for (i = 0; i < n_blocks; ++i) {
+        for (j = 0; j < BLOCK_SIZE; ++j)
+            buf[j] = (char)random();
+
+        block_path (i, path, sizeof(path));
+        fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write (fd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
+            fprintf (stderr, "Failed to create %s: %s.\n", path, strerror(errno));
+            free (buf);
+            return -1;
+        }
+        close (fd);
+    }
+
+    free (buf);
+    return 0;
+}
+
+static void
+remove_blocks ()
+{
+    char path[4096];
+    int i;
+
+    for (i = 0; i < n_blocks; ++i) {
+        block_path (i, path, sizeof(path));
+        unlink (path);
+    }
+}
+
+static int
+open_block (int i)
+{
+    char path[4096];
+    int fd;
+
+    block_path (i, path, sizeof(path));
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        fprintf (stderr, "Failed to open %s: %s.\n", path, strerror(errno));
+    return fd;
+}
+
+static void
+copy_write_cb (struct bufferevent *bev, void *ctx)
+{
+    SendState *st = ctx;
+    char buf[COPY_BUF_SIZE];
+    int n;
+
+    while (st->idx < n_blocks) {
+        if (st->fd < 0 && (st->fd = open_block (st->idx)) < 0)
+            goto done;
+
+        n = read (st->fd, buf, sizeof(buf));
+        if (n > 0) {
+            bufferevent_write (bev, buf, n);
+            return;
+        }
+
+        close (st->fd);
+        st->fd = -1;
+        ++(st->idx);
+    }
+
+done:
+    event_base_loopexit (bufferevent_get_base (bev), NULL);
+}
+
+static void
+zero_copy_write_cb (struct bufferevent *bev, void *ctx)
+{
+    SendState *st = ctx;
+    struct evbuffer *output = bufferevent_get_output (bev);
+    int fd;
+
+    while (st->idx < n_blocks &&
+           evbuffer_get_length (output) < SENDFILE_QUEUE_SIZE) {
+        if ((fd = open_block (st->idx)) < 0)
+            break;
+        evbuffer_add_file (output, fd, 0, BLOCK_SIZE);
+        ++(st->idx);
+    }
+
+    if (evbuffer_get_length (output) == 0)
+        event_base_loopexit (bufferevent_get_base (bev), NULL);
+}
+
+static void
+event_cb (struct bufferevent *bev, short events, void *ctx)
+{
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+        fprintf (stderr, "Connection error.\n");
+        event_base_loopexit (bufferevent_get_base (bev), NULL);
+    }
+}
+
+static void
+drain_socket (int sock)
+{
+    char buf[256 * 1024];
+
+    while (read (sock, buf, sizeof(buf)) > 0)
+        ;
+    exit (0);
+}
+
+static double
+tv_to_sec (struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static int
+run (int zero_copy)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int lsock, csock, ssock;
+    pid_t pid;
+    struct event_base *base;
+    struct bufferevent *bev;
+    SendState st = { 0, -1 };
+    struct timeval start, end;
+    struct rusage ru1, ru2;
+    double wall, cpu, gb;
+
+    lsock = socket (AF_INET, SOCK_STREAM, 0);
+    memset (&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (bind (lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen (lsock, 1) < 0 ||
+        getsockname (lsock, (struct sockaddr *)&addr, &addrlen) < 0) {
+        perror ("listen");
+        return -1;
+    }
+
+    fflush (stdout);
+    pid = fork ();
+    if (pid == 0) {
+        close (lsock);
+        csock = socket (AF_INET, SOCK_STREAM, 0);
+        if (connect (csock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+            exit (1);
+        drain_socket (csock);
+    }
+
+    ssock = accept (lsock, NULL, NULL);
+    close (lsock);
+    if (ssock < 0) {
+        perror ("accept");
+        return -1;
+    }
+    evutil_make_socket_nonblocking (ssock);
+
+    base = event_base_new ();
+    bev = bufferevent_socket_new (base, ssock, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb (bev, NULL,
+                       zero_copy ? zero_copy_write_cb : copy_write_cb,
+                       event_cb, &st);
+    bufferevent_enable (bev, EV_WRITE);
+
+    getrusage (RUSAGE_SELF, &ru1);
+    gettimeofday (&start, NULL);
+
+    /* Kick start, like sending out http headers. */
+    bufferevent_write (bev, "HTTP/1.1 200 OK\r\n\r\n", 19);
+    event_base_dispatch (base);
+
+    gettimeofday (&end, NULL);
+    getrusage (RUSAGE_SELF, &ru2);
+
+    bufferevent_free (bev);
+    event_base_free (base);
+    waitpid (pid, NULL, 0);
+
+    wall = tv_to_sec (&end) - tv_to_sec (&start);
+    cpu = (tv_to_sec (&ru2.ru_utime) - tv_to_sec (&ru1.ru_utime)) +
+        (tv_to_sec (&ru2.ru_stime) - tv_to_sec (&ru1.ru_stime));
+    gb = (double)n_blocks * BLOCK_SIZE / (1024.0 * 1024 * 1024);
+
+    printf ("%-8s  %8.1f MB/s  %6.3f cpu sec/GB (user %.3f, sys %.3f)\n",
+            zero_copy ? "sendfile" : "copy",
+            gb * 1024 / wall, cpu / gb,
+            tv_to_sec (&ru2.ru_utime) - tv_to_sec (&ru1.ru_utime),
+            tv_to_sec (&ru2.ru_stime) - tv_to_sec (&ru1.ru_stime));
+
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    int rounds = 3;
+    int c, i;
+
+    while ((c = getopt (argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            n_blocks = atoi (optarg);
+            break;
+        case 'r':
+            rounds = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "usage: bench-sendfile [-n blocks] [-r rounds] <dir>\n");
+            return 1;
+        }
+    }
+
+    if (optind >= argc || n_blocks <= 0) {
+        fprintf (stderr, "usage: bench-sendfile [-n blocks] [-r rounds] <dir>\n");
+        return 1;
+    }
+    block_dir = argv[optind];
+
+    signal (SIGPIPE, SIG_IGN);
+
+    if (create_blocks () < 0)
+        return 1;
+
+    printf ("Sending %d blocks of %d bytes, %d rounds.\n",
+            n_blocks, BLOCK_SIZE, rounds);
+    for (i = 0; i < rounds; ++i) {
+        run (0);
+        run (1);
+    }
+
+    remove_blocks ();
+    return 0;
+}
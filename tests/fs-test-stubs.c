@@ -0,0 +1,272 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "utils.h"
+#include "fs-test-stubs.h"
+
+SeafileSession *seaf;
+
+static char *blocks_dir;
+static gint n_blocks_written;
+
+/*
+ * Object store.
+ */
+
+struct SeafObjStore {
+    char *obj_dir;
+};
+
+static char *
+obj_path (struct SeafObjStore *store, const char *obj_id)
+{
+    char sub[3];
+
+    memcpy (sub, obj_id, 2);
+    sub[2] = '\0';
+    return g_build_filename (store->obj_dir, sub, obj_id + 2, NULL);
+}
+
+struct SeafObjStore *
+seaf_obj_store_new (struct _SeafileSession *seaf, const char *obj_type)
+{
+    struct SeafObjStore *store = g_new0 (struct SeafObjStore, 1);
+
+    store->obj_dir = g_build_filename (seaf->seaf_dir, obj_type, NULL);
+    return store;
+}
+
+int
+seaf_obj_store_init (struct SeafObjStore *obj_store,
+                     gboolean enable_async,
+                     struct CEventManager *ev_mgr)
+{
+    return g_mkdir_with_parents (obj_store->obj_dir, 0777);
+}
+
+int
+seaf_obj_store_read_obj (struct SeafObjStore *obj_store,
+                         const char *obj_id,
+                         void **data,
+                         int *len)
+{
+    char *path = obj_path (obj_store, obj_id);
+    gsize size;
+    gboolean ret;
+
+    ret = g_file_get_contents (path, (gchar **)data, &size, NULL);
+    g_free (path);
+    if (!ret)
+        return -1;
+
+    *len = (int)size;
+    return 0;
+}
+
+int
+seaf_obj_store_write_obj (struct SeafObjStore *obj_store,
+                          const char *obj_id,
+                          void *data,
+                          int len)
+{
+    char *path = obj_path (obj_store, obj_id);
+    char *dir = g_path_get_dirname (path);
+    int ret = 0;
+
+    if (g_mkdir_with_parents (dir, 0777) < 0 ||
+        !g_file_set_contents (path, data, len, NULL))
+        ret = -1;
+
+    g_free (dir);
+    g_free (path);
+    return ret;
+}
+
+gboolean
+seaf_obj_store_obj_exists (struct SeafObjStore *obj_store,
+                           const char *obj_id)
+{
+    char *path = obj_path (obj_store, obj_id);
+    gboolean ret = g_file_test (path, G_FILE_TEST_EXISTS);
+
+    g_free (path);
+    return ret;
+}
+
+/*
+ * Block manager. Blocks are written to a tmp file of their own and
+ * renamed when committed, so chunks can be written from several threads.
+ */
+
+struct _BHandle {
+    char    block_id[41];
+    int     rw_type;
+    int     fd;
+    char   *tmp_path;
+};
+
+static char *
+block_path (const char *block_id)
+{
+    return g_build_filename (blocks_dir, block_id, NULL);
+}
+
+BlockHandle *
+seaf_block_manager_open_block (SeafBlockManager *mgr,
+                               const char *block_id,
+                               int rw_type)
+{
+    BlockHandle *handle = g_new0 (BlockHandle, 1);
+    char *path;
+
+    memcpy (handle->block_id, block_id, 41);
+    handle->rw_type = rw_type;
+
+    if (rw_type == BLOCK_READ) {
+        path = block_path (block_id);
+        handle->fd = g_open (path, O_RDONLY, 0);
+        g_free (path);
+    } else {
+        handle->tmp_path = g_build_filename (blocks_dir, "tmp.XXXXXX", NULL);
+        handle->fd = g_mkstemp (handle->tmp_path);
+    }
+
+    if (handle->fd < 0) {
+        g_free (handle->tmp_path);
+        g_free (handle);
+        return NULL;
+    }
+    return handle;
+}
+
+int
+seaf_block_manager_read_block (SeafBlockManager *mgr,
+                               BlockHandle *handle,
+                               void *buf, int len)
+{
+    return readn (handle->fd, buf, len);
+}
+
+int
+seaf_block_manager_write_block (SeafBlockManager *mgr,
+                                BlockHandle *handle,
+                                const void *buf, int len)
+{
+    return writen (handle->fd, buf, len);
+}
+
+int
+seaf_block_manager_close_block (SeafBlockManager *mgr,
+                                BlockHandle *handle)
+{
+    int ret = 0;
+
+    if (handle->fd >= 0) {
+        ret = close (handle->fd);
+        handle->fd = -1;
+    }
+    return ret;
+}
+
+int
+seaf_block_manager_commit_block (SeafBlockManager *mgr,
+                                 BlockHandle *handle)
+{
+    char *path = block_path (handle->block_id);
+    int ret;
+
+    ret = g_rename (handle->tmp_path, path);
+    g_free (path);
+    if (ret == 0)
+        g_atomic_int_inc (&n_blocks_written);
+    return ret;
+}
+
+void
+seaf_block_manager_block_handle_free (SeafBlockManager *mgr,
+                                      BlockHandle *handle)
+{
+    if (handle->fd >= 0)
+        close (handle->fd);
+    if (handle->tmp_path) {
+        g_unlink (handle->tmp_path);
+        g_free (handle->tmp_path);
+    }
+    g_free (handle);
+}
+
+BlockMetadata *
+seaf_block_manager_stat_block_by_handle (SeafBlockManager *mgr,
+                                         BlockHandle *handle)
+{
+    BlockMetadata *bmd;
+    struct stat st;
+
+    if (fstat (handle->fd, &st) < 0)
+        return NULL;
+
+    bmd = g_new0 (BlockMetadata, 1);
+    memcpy (bmd->id, handle->block_id, 41);
+    bmd->size = (uint32_t) st.st_size;
+    return bmd;
+}
+
+void
+seaf_block_manager_blocks_exist (SeafBlockManager *mgr,
+                                 const char **block_ids,
+                                 int n_blocks,
+                                 gboolean *exists)
+{
+    char *path;
+    int i;
+
+    for (i = 0; i < n_blocks; ++i) {
+        path = block_path (block_ids[i]);
+        exists[i] = g_file_test (path, G_FILE_TEST_EXISTS);
+        g_free (path);
+    }
+}
+
+/* Only used when a checked out file can't be renamed into place. */
+char *
+gen_conflict_path (const char *origin_path, const char *suffix)
+{
+    return g_strconcat (origin_path, " (", suffix, ")", NULL);
+}
+
+SeafileSession *
+fs_test_session_new (const char *dir)
+{
+    seaf = g_new0 (SeafileSession, 1);
+    seaf->seaf_dir = g_strdup (dir);
+
+    blocks_dir = g_build_filename (dir, "blocks", NULL);
+    if (g_mkdir_with_parents (blocks_dir, 0777) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", blocks_dir);
+        return NULL;
+    }
+    seaf->block_mgr = g_new0 (SeafBlockManager, 1);
+    seaf->block_mgr->seaf = seaf;
+
+    seaf->fs_mgr = seaf_fs_manager_new (seaf, dir);
+    if (!seaf->fs_mgr || seaf_fs_manager_init (seaf->fs_mgr) < 0)
+        return NULL;
+
+    return seaf;
+}
+
+int
+fs_test_blocks_written ()
+{
+    return g_atomic_int_get (&n_blocks_written);
+}
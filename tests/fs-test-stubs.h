@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef FS_TEST_STUBS_H
+#define FS_TEST_STUBS_H
+
+#include "seafile-session.h"
+
+/*
+ * Minimal object store and block manager, so that tests and benches can
+ * run the fs manager of common/fs-mgr.c without a full seafile session.
+ * Objects are saved as <dir>/fs/<id[:2]>/<id[2:]>, blocks as
+ * <dir>/blocks/<id>.
+ *
+ * Sets the global seaf, with its fs manager and block manager.
+ * Returns NULL on error.
+ */
+SeafileSession *
+fs_test_session_new (const char *dir);
+
+/* Number of blocks committed so far. */
+int
+fs_test_blocks_written ();
+
+#endif
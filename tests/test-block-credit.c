@@ -0,0 +1,305 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the credit window of the v3 block upload protocol
+ * (common/block-credit.c), which send_blocks_v3() and recv_blocks_v3() in
+ * common/processors/blocktx-common-impl-v2.h and the block dispatching of
+ * daemon/transfer-mgr.c are built on. A sender and a receiver thread
+ * exchange block packets and ack packets over a socket pair, the way the
+ * processors' threads do:
+ *
+ *  - the sender only sends a block when it has a credit, so the receiver
+ *    never gets more blocks than it granted credits for;
+ *  - blocks in flight (sent but not acked) never exceed BLOCK_V3_WINDOW,
+ *    and with a slow receiver the whole window is used;
+ *  - acks come in batches of at most BLOCK_V3_ACK_BATCH, a partial batch
+ *    is sent when the connection goes idle, and every block is acked
+ *    exactly once;
+ *  - ack packets granting more than the window are refused.
+ *
+ * Blocks are queued to the sender the way transfer-mgr.c dispatches them,
+ * at most BLOCK_V3_MAX_QUEUED pending.
+ *
+ * Usage: test-block-credit
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+#include "utils.h"
+#include "block-credit.h"
+
+/* Not a multiple of BLOCK_V3_ACK_BATCH, so the last batch is partial. */
+#define N_BLOCKS 20010
+#define MAX_DATA_SIZE 256
+
+/* Header of the block packets, only the index matters here. */
+typedef struct {
+    uint32_t block_size;
+    uint32_t block_idx;
+} __attribute__((__packed__)) TestBlockPacket;
+
+typedef struct TestRun {
+    int         fds[2];
+    /* Sleep this long every 100 received blocks, in microseconds. */
+    int         recv_delay;
+
+    /* Sender side. */
+    int         max_in_flight;
+    guint8     *acked;
+
+    /* Receiver side. */
+    int         max_batch;
+    int         n_partial_batches;
+    int         n_overruns;
+    int         n_received;
+} TestRun;
+
+static int n_failed;
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "%s:%d: check failed: %s\n",               \
+                     __FILE__, __LINE__, #cond);                        \
+            ++n_failed;                                                 \
+        }                                                               \
+    } while (0)
+
+static gboolean
+data_readable (int fd, gboolean block)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll (&pfd, 1, block ? -1 : 0) > 0;
+}
+
+static int
+send_acks (int fd, GArray *acks, int credits)
+{
+    void *pkt;
+    int len, n;
+
+    pkt = block_ack_packet_new ((uint32_t *)acks->data, acks->len,
+                                credits, &len);
+    n = writen (fd, pkt, len);
+    g_free (pkt);
+
+    g_array_set_size (acks, 0);
+    return n == len ? 0 : -1;
+}
+
+/* The receiving loop of recv_blocks_v3(). */
+static void *
+receiver (void *vrun)
+{
+    TestRun *run = vrun;
+    int fd = run->fds[1];
+    GArray *acks = g_array_new (FALSE, FALSE, sizeof(uint32_t));
+    char data[MAX_DATA_SIZE];
+    TestBlockPacket pkt;
+    uint32_t size;
+    int credits = BLOCK_V3_WINDOW;
+    gboolean idle;
+
+    if (send_acks (fd, acks, BLOCK_V3_WINDOW) < 0)
+        goto out;
+
+    while (run->n_received < N_BLOCKS || acks->len > 0) {
+        idle = !data_readable (fd, acks->len == 0);
+
+        if (!idle) {
+            if (readn (fd, &pkt, sizeof(pkt)) != sizeof(pkt))
+                goto out;
+            size = ntohl (pkt.block_size);
+            if (size > MAX_DATA_SIZE || readn (fd, data, size) != size)
+                goto out;
+
+            if (--credits < 0)
+                ++run->n_overruns;
+            g_array_append_val (acks, pkt.block_idx);
+            if (++run->n_received % 100 == 0 && run->recv_delay > 0)
+                g_usleep (run->recv_delay);
+        }
+
+        if (block_acks_due (acks->len, idle)) {
+            run->max_batch = MAX (run->max_batch, (int)acks->len);
+            if (acks->len < BLOCK_V3_ACK_BATCH)
+                ++run->n_partial_batches;
+            credits += acks->len;
+            if (send_acks (fd, acks, acks->len) < 0)
+                goto out;
+        }
+    }
+
+out:
+    g_array_free (acks, TRUE);
+    return NULL;
+}
+
+/* Returns the credits granted, or -1 on error. */
+static int
+recv_acks (TestRun *run, int fd, int *n_acked)
+{
+    BlockAckPacket pkt;
+    uint32_t ack;
+    uint32_t n_acks, i, idx;
+    int credits;
+
+    if (readn (fd, &pkt, sizeof(pkt)) != sizeof(pkt))
+        return -1;
+
+    credits = block_ack_packet_parse (&pkt, &n_acks);
+    check (credits >= 0);
+    if (credits < 0)
+        return -1;
+
+    for (i = 0; i < n_acks; ++i) {
+        if (readn (fd, &ack, sizeof(ack)) != sizeof(ack))
+            return -1;
+        idx = ntohl (ack);
+        check (idx < N_BLOCKS);
+        if (idx < N_BLOCKS)
+            ++run->acked[idx];
+    }
+    *n_acked += n_acks;
+
+    return credits;
+}
+
+static int
+send_block (int fd, int idx)
+{
+    char buf[sizeof(TestBlockPacket) + MAX_DATA_SIZE];
+    TestBlockPacket *pkt = (TestBlockPacket *)buf;
+    int size = 1 + idx % MAX_DATA_SIZE;
+    int len = sizeof(TestBlockPacket) + size;
+
+    pkt->block_size = htonl ((uint32_t) size);
+    pkt->block_idx = htonl ((uint32_t) idx);
+    memset (buf + sizeof(TestBlockPacket), idx & 0xFF, size);
+
+    if (writen (fd, buf, len) != len)
+        return -1;
+    return 0;
+}
+
+/* The sending loop of send_blocks_v3(), with the dispatching of
+ * transfer-mgr.c. */
+static void
+sender (TestRun *run)
+{
+    int fd = run->fds[0];
+    int credits = 0, n_queued = 0, n_sent = 0, n_acked = 0;
+    int pending, n;
+
+    while (n_acked < N_BLOCKS) {
+        pending = n_queued - n_acked;
+        if (block_queue_refill_due (pending))
+            n_queued = MIN (N_BLOCKS, n_acked + BLOCK_V3_MAX_QUEUED);
+
+        if (data_readable (fd, credits == 0 || n_sent == n_queued)) {
+            if ((n = recv_acks (run, fd, &n_acked)) < 0) {
+                check (0);
+                return;
+            }
+            credits += n;
+        }
+
+        while (credits > 0 && n_sent < n_queued) {
+            if (send_block (fd, n_sent) < 0) {
+                check (0);
+                return;
+            }
+            ++n_sent;
+            --credits;
+            run->max_in_flight = MAX (run->max_in_flight, n_sent - n_acked);
+        }
+    }
+}
+
+static void
+test_window (const char *name, int recv_delay)
+{
+    TestRun run;
+    pthread_t tid;
+    int i, n_bad = 0;
+
+    memset (&run, 0, sizeof(run));
+    run.recv_delay = recv_delay;
+    run.acked = g_new0 (guint8, N_BLOCKS);
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, run.fds) < 0) {
+        check (0);
+        return;
+    }
+
+    pthread_create (&tid, NULL, receiver, &run);
+    sender (&run);
+    pthread_join (tid, NULL);
+
+    for (i = 0; i < N_BLOCKS; ++i)
+        if (run.acked[i] != 1)
+            ++n_bad;
+
+    printf ("%-6s max in flight %d, max ack batch %d, %d partial batches.\n",
+            name, run.max_in_flight, run.max_batch, run.n_partial_batches);
+
+    check (run.n_received == N_BLOCKS);
+    check (run.n_overruns == 0);
+    check (n_bad == 0);
+    check (run.max_in_flight <= BLOCK_V3_WINDOW);
+    check (run.max_batch <= BLOCK_V3_ACK_BATCH);
+    /* The last blocks don't fill a batch and are acked when idle. */
+    check (run.n_partial_batches > 0);
+    if (recv_delay > 0)
+        check (run.max_in_flight == BLOCK_V3_WINDOW);
+
+    close (run.fds[0]);
+    close (run.fds[1]);
+    g_free (run.acked);
+}
+
+static void
+test_bad_acks ()
+{
+    BlockAckPacket pkt;
+    uint32_t n_acks;
+
+    pkt.n_acks = htonl (BLOCK_V3_WINDOW + 1);
+    pkt.credits = htonl (1);
+    check (block_ack_packet_parse (&pkt, &n_acks) < 0);
+
+    pkt.n_acks = htonl (1);
+    pkt.credits = htonl (BLOCK_V3_WINDOW + 1);
+    check (block_ack_packet_parse (&pkt, &n_acks) < 0);
+
+    pkt.credits = htonl ((uint32_t) -1);
+    check (block_ack_packet_parse (&pkt, &n_acks) < 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+    test_bad_acks ();
+    test_window ("fast", 0);
+    test_window ("slow", 2000);
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d checks failed.\n", n_failed);
+        return 1;
+    }
+
+    printf ("Block credit window OK.\n");
+    return 0;
+}
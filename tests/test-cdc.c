@@ -82,13 +82,17 @@ int test_write_chunk (CDCDescriptor *chunk_descr,
     char chksum_str[CHECKSUM_LENGTH *2 + 1];
     int fd_chunk, ret;
 
-    rawdata_to_hex (chunk_descr->checksum, chksum_str, CHECKSUM_LENGTH);
+    /* May be called from several threads. */
+    SHA1 ((unsigned char *)chunk_descr->block_buf, chunk_descr->len, checksum);
+
+    rawdata_to_hex (checksum, chksum_str, CHECKSUM_LENGTH);
     snprintf (filename, NAME_MAX_SZ, "%s/%s", dest_dir, chksum_str);
-    fd_chunk = g_open (filename, O_WRONLY | O_CREAT | O_BINARY, 0644);
+    fd_chunk = g_open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
     if (fd_chunk < 0)
         return -1;    
     
     ret = write (fd_chunk, chunk_descr->block_buf, chunk_descr->len);
+    close (fd_chunk);
     return ret;
 }
 
@@ -96,7 +100,7 @@ int main (int argc, char *argv[])
 {
     char *src_filename = NULL;
     int ret = 0, fd_src;
-    CDCFileDescriptor file_descr;
+    CDCFileDescriptor file_descr, serial_descr;
 
     if (argc < 3) {
         fprintf(stderr, "%s SOURCE DEST \n", argv[0]);
@@ -108,6 +112,7 @@ int main (int argc, char *argv[])
     
     memset (&file_descr, 0, sizeof (file_descr));
     file_descr.write_block = test_write_chunk;
+    file_descr.n_workers = CDC_DEFAULT_WORKERS;
     ret = filename_chunk_cdc (src_filename, &file_descr, NULL, TRUE);
     if (ret == -1) {
         fprintf(stderr, "file chunk failed\n");
@@ -120,6 +125,26 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
+    /* Chunks written by the worker pool must be the same as chunking
+     * in one thread. */
+    memset (&serial_descr, 0, sizeof (serial_descr));
+    serial_descr.write_block = test_write_chunk;
+    serial_descr.n_workers = 1;
+    ret = filename_chunk_cdc (src_filename, &serial_descr, NULL, TRUE);
+    if (ret == -1) {
+        fprintf(stderr, "file chunk failed\n");
+        exit(1);
+    }
+
+    if (serial_descr.block_nr != file_descr.block_nr ||
+        memcmp (serial_descr.blk_sha1s, file_descr.blk_sha1s,
+                file_descr.block_nr * CHECKSUM_LENGTH) != 0 ||
+        memcmp (serial_descr.file_sum, file_descr.file_sum,
+                CHECKSUM_LENGTH) != 0) {
+        fprintf (stderr, "parallel chunking differs from serial chunking.\n");
+        exit(1);
+    }
+
     printf ("test passed.\n");
     return 0;
 }
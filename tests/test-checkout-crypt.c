@@ -0,0 +1,282 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the checkout of encrypted files by
+ * seaf_fs_manager_checkout_file() in common/fs-mgr.c, which decrypts
+ * blocks piece by piece in checkout_block():
+ *
+ *  - files indexed with seaf_fs_manager_index_blocks() into encrypted
+ *    blocks are checked out to the same bytes, for sizes around the
+ *    piece size and the cipher block size, and for files of several
+ *    blocks;
+ *  - checking out a file of multi-MB encrypted blocks keeps the peak
+ *    memory of the process bounded by the piece size, not the block size.
+ *    A block-sized buffer is measured the same way, to show that the
+ *    measurement does see block-sized allocations.
+ *
+ * Blocks and fs objects are stored by tests/fs-test-stubs.c under <dir>.
+ * Peak memory is the growth of ru_maxrss in a forked child, so each
+ * measurement starts from a clean high-water mark.
+ *
+ * Usage: test-checkout-crypt <dir>
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fs-test-stubs.h"
+#include "seafile-crypt.h"
+
+/* Piece size of checkout_block(). */
+#define PIECE_SIZE (64 * 1024)
+
+/* Files are chunked into blocks of 1MB on average, up to 4MB. */
+#define BIG_FILE_SIZE (32 * 1024 * 1024 + 5)
+#define MAX_BLOCK_SIZE (4 * 1024 * 1024)
+
+/* Allowed growth of the peak RSS while checking out, in KB. */
+#define MAX_CHECKOUT_GROWTH 1024
+
+#define PASSWD "this_is_user_passwd"
+
+static SeafileCrypt *test_crypt;
+static char *test_dir;
+
+static char *
+random_data (int len)
+{
+    char *data = g_malloc (len);
+    int i;
+
+    for (i = 0; i < len; ++i)
+        data[i] = (char) g_random_int ();
+    return data;
+}
+
+/*
+ * Index @len bytes of @data as an encrypted file and set @file_id.
+ */
+static int
+index_file (const char *data, int len, char *file_id)
+{
+    char *path = g_build_filename (test_dir, "input", NULL);
+    unsigned char sha1[20];
+    int ret = -1;
+
+    if (!g_file_set_contents (path, data, len, NULL))
+        goto out;
+    if (seaf_fs_manager_index_blocks (seaf->fs_mgr, path, sha1,
+                                      test_crypt) < 0)
+        goto out;
+    rawdata_to_hex (sha1, file_id, 20);
+    ret = 0;
+
+out:
+    g_unlink (path);
+    g_free (path);
+    return ret;
+}
+
+/* Check out @file_id and compare it with @data. */
+static int
+check_file (const char *file_id, const char *data, int len)
+{
+    char *path = g_build_filename (test_dir, "checkout", NULL);
+    char *out = NULL;
+    gsize out_len;
+    int ret = -1;
+
+    if (seaf_fs_manager_checkout_file (seaf->fs_mgr, file_id, path, 0644,
+                                       test_crypt, NULL) < 0) {
+        fprintf (stderr, "Failed to check out %d bytes.\n", len);
+        goto out;
+    }
+
+    if (!g_file_get_contents (path, &out, &out_len, NULL) ||
+        out_len != len || memcmp (out, data, len) != 0) {
+        fprintf (stderr, "Checked out data of %d bytes differs.\n", len);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    g_unlink (path);
+    g_free (path);
+    g_free (out);
+    return ret;
+}
+
+static int
+test_content ()
+{
+    static const int sizes[] = {
+        1, 15, 16, 17,
+        PIECE_SIZE - 17, PIECE_SIZE - 16, PIECE_SIZE - 1,
+        PIECE_SIZE, PIECE_SIZE + 1, PIECE_SIZE + 16,
+        3 * PIECE_SIZE, 1024 * 1024 + 5, 10 * 1024 * 1024 + 5,
+    };
+    char file_id[41];
+    char *data;
+    int i, ret = 0;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); ++i) {
+        data = random_data (sizes[i]);
+        if (index_file (data, sizes[i], file_id) < 0) {
+            fprintf (stderr, "Failed to index %d bytes.\n", sizes[i]);
+            ret = -1;
+        } else if (check_file (file_id, data, sizes[i]) < 0) {
+            ret = -1;
+        }
+        g_free (data);
+    }
+
+    return ret;
+}
+
+static long
+max_rss ()
+{
+    struct rusage usage;
+
+    getrusage (RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/*
+ * Check out @file_id in a child process, or only allocate and touch a
+ * buffer of the largest block size if @file_id is NULL.
+ * Returns the growth of the peak RSS in KB, or -1 on failure.
+ */
+static long
+measure_checkout (const char *file_id)
+{
+    int pipefd[2];
+    long growth = -1;
+    pid_t pid;
+
+    if (pipe (pipefd) < 0)
+        return -1;
+
+    pid = fork ();
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0) {
+        char *path = g_build_filename (test_dir, "checkout", NULL);
+        long start = max_rss ();
+        char *buf;
+
+        close (pipefd[0]);
+
+        if (file_id) {
+            if (seaf_fs_manager_checkout_file (seaf->fs_mgr, file_id, path,
+                                               0644, test_crypt, NULL) < 0)
+                _exit (1);
+            g_unlink (path);
+        } else {
+            buf = g_malloc (MAX_BLOCK_SIZE);
+            memset (buf, 1, MAX_BLOCK_SIZE);
+            g_free (buf);
+        }
+
+        growth = max_rss () - start;
+        if (write (pipefd[1], &growth, sizeof(growth)) != sizeof(growth))
+            _exit (1);
+        _exit (0);
+    }
+
+    close (pipefd[1]);
+    if (read (pipefd[0], &growth, sizeof(growth)) != sizeof(growth))
+        growth = -1;
+    close (pipefd[0]);
+    waitpid (pid, NULL, 0);
+
+    return growth;
+}
+
+static int
+test_peak_memory ()
+{
+    long checkout_growth, buffer_growth;
+    char file_id[41];
+    char *data;
+    int ret = 0;
+
+    data = random_data (BIG_FILE_SIZE);
+    if (index_file (data, BIG_FILE_SIZE, file_id) < 0) {
+        fprintf (stderr, "Failed to index %d bytes.\n", BIG_FILE_SIZE);
+        g_free (data);
+        return -1;
+    }
+    g_free (data);
+
+    /* Don't count decoding the seafile object in the child. */
+    seafile_unref (seaf_fs_manager_get_seafile (seaf->fs_mgr, file_id));
+
+    checkout_growth = measure_checkout (file_id);
+    buffer_growth = measure_checkout (NULL);
+
+    printf ("Peak RSS growth checking out a %d MB encrypted file:\n"
+            "  checkout:             %ld KB\n"
+            "  one %d MB buffer:      %ld KB\n",
+            BIG_FILE_SIZE >> 20, checkout_growth,
+            MAX_BLOCK_SIZE >> 20, buffer_growth);
+
+    if (checkout_growth < 0 || buffer_growth < 0) {
+        fprintf (stderr, "Checkout failed.\n");
+        ret = -1;
+    } else if (buffer_growth < (MAX_BLOCK_SIZE >> 10)) {
+        fprintf (stderr, "A block-sized buffer should show in the peak RSS, "
+                 "it isn't measured correctly.\n");
+        ret = -1;
+    } else if (checkout_growth > MAX_CHECKOUT_GROWTH) {
+        fprintf (stderr, "Checkout used more than %d KB.\n",
+                 MAX_CHECKOUT_GROWTH);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int
+main (int argc, char *argv[])
+{
+    unsigned char key[16], iv[16];
+    int ret = 0;
+
+    if (argc < 2) {
+        fprintf (stderr, "%s <dir>\n", argv[0]);
+        exit (-1);
+    }
+    test_dir = argv[1];
+
+    g_type_init ();
+
+    if (g_mkdir_with_parents (test_dir, 0777) < 0 ||
+        !fs_test_session_new (test_dir)) {
+        fprintf (stderr, "Failed to set up %s.\n", test_dir);
+        exit (-1);
+    }
+
+    seafile_generate_enc_key (PASSWD, strlen(PASSWD), 1, key, iv);
+    test_crypt = seafile_crypt_new (1, key, iv);
+
+    if (test_content () < 0)
+        ret = 1;
+    if (test_peak_memory () < 0)
+        ret = 1;
+
+    g_free (test_crypt);
+
+    if (ret == 0)
+        printf ("Checkout decryption OK.\n");
+    return ret;
+}
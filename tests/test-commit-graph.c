@@ -0,0 +1,258 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the commit graph file:
+ *
+ *  - generation numbers of a linear and a merged history, read back
+ *    after reopening;
+ *  - infinite generations are not written to the file;
+ *  - a record torn by a crash is skipped and the records appended
+ *    after it are still read;
+ *  - a file in unknown format is replaced;
+ *  - records appended through one open graph are seen by another one,
+ *    as with two processes.
+ *
+ * Usage: test-commit-graph <dir>
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "utils.h"
+#include "commit-graph.h"
+
+#define N_COMMITS 100
+
+static char *graph_path;
+static int n_failed;
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "%s:%d: check failed: %s\n",               \
+                     __FILE__, __LINE__, #cond);                        \
+            ++n_failed;                                                 \
+        }                                                               \
+    } while (0)
+
+static void
+make_id (int n, char *id)
+{
+    unsigned char raw[20];
+
+    memset (raw, 0, sizeof(raw));
+    raw[0] = 0xcc;
+    raw[16] = (n >> 24) & 0xFF;
+    raw[17] = (n >> 16) & 0xFF;
+    raw[18] = (n >> 8) & 0xFF;
+    raw[19] = n & 0xFF;
+    rawdata_to_hex (raw, id, 20);
+}
+
+static CommitGraphNode *
+add_commit (CommitGraph *graph, int n, int parent, int second_parent)
+{
+    SeafCommit commit;
+    char parent_id[41], second_parent_id[41];
+
+    memset (&commit, 0, sizeof(commit));
+    make_id (n, commit.commit_id);
+    make_id (n + 1000000, commit.root_id);
+    commit.ctime = 1000 + n;
+    if (parent >= 0) {
+        make_id (parent, parent_id);
+        commit.parent_id = parent_id;
+    }
+    if (second_parent >= 0) {
+        make_id (second_parent, second_parent_id);
+        commit.second_parent_id = second_parent_id;
+    }
+
+    return commit_graph_add (graph, &commit);
+}
+
+static CommitGraphNode *
+lookup (CommitGraph *graph, int n)
+{
+    char id[41];
+
+    make_id (n, id);
+    return commit_graph_lookup (graph, id);
+}
+
+static void
+append_bytes (const void *buf, size_t len)
+{
+    int fd = g_open (graph_path, O_WRONLY | O_APPEND | O_BINARY, 0);
+
+    check (fd >= 0);
+    check (writen (fd, buf, len) == len);
+    close (fd);
+}
+
+static void
+test_generation ()
+{
+    CommitGraph *graph;
+    CommitGraphNode *node;
+    int i;
+
+    g_unlink (graph_path);
+
+    /* 0 <- 1 <- ... <- N-1, and a branch 1 <- N merged into N+1. */
+    graph = commit_graph_open (graph_path);
+    for (i = 0; i < N_COMMITS; ++i)
+        add_commit (graph, i, i - 1, -1);
+    add_commit (graph, N_COMMITS, 1, -1);
+    node = add_commit (graph, N_COMMITS + 1, N_COMMITS - 1, N_COMMITS);
+    check (node->generation == N_COMMITS + 1);
+    commit_graph_unref (graph);
+
+    graph = commit_graph_open (graph_path);
+    check (commit_graph_get_size (graph) == N_COMMITS + 2);
+    for (i = 0; i < N_COMMITS; ++i) {
+        node = lookup (graph, i);
+        check (node != NULL && node->generation == i + 1);
+        check (node != NULL && node->ctime == 1000 + i);
+    }
+    node = lookup (graph, N_COMMITS);
+    check (node != NULL && node->generation == 3);
+    node = lookup (graph, N_COMMITS + 1);
+    check (node != NULL && node->generation == N_COMMITS + 1);
+    commit_graph_unref (graph);
+}
+
+static void
+test_infinity ()
+{
+    CommitGraph *graph;
+    CommitGraphNode *node;
+
+    g_unlink (graph_path);
+
+    /* Parent 1 is missing, the generation of 2 can't be known yet. */
+    graph = commit_graph_open (graph_path);
+    node = add_commit (graph, 2, 1, -1);
+    check (node->generation == COMMIT_GEN_UNKNOWN);
+    commit_graph_set_generation (graph, node, COMMIT_GEN_INFINITY);
+    check (node->generation == COMMIT_GEN_INFINITY);
+    commit_graph_unref (graph);
+
+    graph = commit_graph_open (graph_path);
+    node = lookup (graph, 2);
+    check (node != NULL && node->generation == COMMIT_GEN_UNKNOWN);
+    commit_graph_unref (graph);
+}
+
+static void
+test_torn_record ()
+{
+    CommitGraph *graph;
+    CommitGraphNode *node;
+    char garbage[37];
+
+    g_unlink (graph_path);
+
+    graph = commit_graph_open (graph_path);
+    add_commit (graph, 0, -1, -1);
+    commit_graph_unref (graph);
+
+    /* Part of a record left by a crashed writer. */
+    memset (garbage, 0x5a, sizeof(garbage));
+    append_bytes (garbage, sizeof(garbage));
+
+    graph = commit_graph_open (graph_path);
+    check (commit_graph_get_size (graph) == 1);
+    add_commit (graph, 1, 0, -1);
+    commit_graph_unref (graph);
+
+    graph = commit_graph_open (graph_path);
+    check (commit_graph_get_size (graph) == 2);
+    node = lookup (graph, 1);
+    check (node != NULL && node->generation == 2);
+    commit_graph_unref (graph);
+}
+
+static void
+test_bad_header ()
+{
+    CommitGraph *graph;
+    CommitGraphNode *node;
+    const char *junk = "not a commit graph";
+
+    g_unlink (graph_path);
+    check (g_file_set_contents (graph_path, junk, strlen(junk), NULL));
+
+    graph = commit_graph_open (graph_path);
+    add_commit (graph, 0, -1, -1);
+    commit_graph_unref (graph);
+
+    graph = commit_graph_open (graph_path);
+    node = lookup (graph, 0);
+    check (node != NULL && node->generation == 1);
+    commit_graph_unref (graph);
+}
+
+static void
+test_shared_file ()
+{
+    CommitGraph *g1, *g2;
+    CommitGraphNode *node;
+    int i;
+
+    g_unlink (graph_path);
+
+    g1 = commit_graph_open (graph_path);
+    g2 = commit_graph_open (graph_path);
+
+    /* The parent is looked up first, as the commit manager does,
+     * which reads in the records appended through the other graph.
+     */
+    for (i = 0; i < N_COMMITS; ++i) {
+        if (i > 0)
+            check (lookup ((i % 2) ? g1 : g2, i - 1) != NULL);
+        add_commit ((i % 2) ? g1 : g2, i, i - 1, -1);
+    }
+
+    for (i = 0; i < N_COMMITS; ++i) {
+        node = lookup ((i % 2) ? g2 : g1, i);
+        check (node != NULL && node->generation == i + 1);
+    }
+
+    commit_graph_unref (g1);
+    commit_graph_unref (g2);
+}
+
+int
+main (int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf (stderr, "%s <dir>\n", argv[0]);
+        exit (-1);
+    }
+
+    if (g_mkdir_with_parents (argv[1], 0777) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", argv[1]);
+        exit (-1);
+    }
+    graph_path = g_build_filename (argv[1], "test-graph", NULL);
+
+    test_generation ();
+    test_infinity ();
+    test_torn_record ();
+    test_bad_header ();
+    test_shared_file ();
+
+    g_unlink (graph_path);
+    g_free (graph_path);
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d checks failed.\n", n_failed);
+        return 1;
+    }
+
+    printf ("Commit graph OK.\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the Content-Range handling of chunked uploads
+ * (httpserver/content-range.c):
+ *
+ *  - valid ranges are parsed, malformed ones and ranges outside the file
+ *    are refused;
+ *  - an empty file is accepted with "*" for the range and a size of 0;
+ *  - a piece only continues a saved upload if the file sizes match, and
+ *    an empty file never continues one, so it can't reuse the blocks
+ *    saved for a bigger file.
+ *
+ * Usage: test-content-range
+ */
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "content-range.h"
+
+static int n_failed;
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "%s:%d: check failed: %s\n",               \
+                     __FILE__, __LINE__, #cond);                        \
+            ++n_failed;                                                 \
+        }                                                               \
+    } while (0)
+
+static void
+test_parse ()
+{
+    gint64 first, size;
+
+    check (parse_content_range ("bytes 0-99/1000", &first, &size) == 0);
+    check (first == 0 && size == 1000);
+
+    check (parse_content_range ("bytes 900-999/1000", &first, &size) == 0);
+    check (first == 900 && size == 1000);
+
+    check (parse_content_range ("bytes */0", &first, &size) == 0);
+    check (first == 0 && size == 0);
+
+    check (parse_content_range ("bytes 0-0/0", &first, &size) < 0);
+    check (parse_content_range ("bytes 0-1000/1000", &first, &size) < 0);
+    check (parse_content_range ("bytes 100-99/1000", &first, &size) < 0);
+    check (parse_content_range ("bytes -1-99/1000", &first, &size) < 0);
+    check (parse_content_range ("bytes */1000", &first, &size) < 0);
+    check (parse_content_range ("bytes 0-99/", &first, &size) < 0);
+    check (parse_content_range ("bytes 0-99/1000x", &first, &size) < 0);
+    check (parse_content_range ("items 0-99/1000", &first, &size) < 0);
+}
+
+static void
+test_resume ()
+{
+    check (content_range_can_resume (1000, 1000));
+    check (!content_range_can_resume (1000, 2000));
+    check (!content_range_can_resume (2000, 1000));
+
+    /* An empty file against an upload saved for a bigger file. */
+    check (!content_range_can_resume (1000, 0));
+    check (!content_range_can_resume (0, 0));
+}
+
+int
+main (int argc, char *argv[])
+{
+    test_parse ();
+    test_resume ();
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d checks failed.\n", n_failed);
+        return 1;
+    }
+
+    printf ("Content-Range OK.\n");
+    return 0;
+}
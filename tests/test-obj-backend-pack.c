@@ -0,0 +1,444 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the pack object backend (common/obj-backend-pack.c):
+ *
+ *  - objects written are read back, before and after their pack is
+ *    sealed, and after the dir is opened again;
+ *  - deleted objects are gone, and can be written again;
+ *  - a delete in an active pack is not undone by packs sealed or merged
+ *    after it, before and after the active pack is sealed;
+ *  - repacking keeps all live objects and drops deleted ones;
+ *  - objects written through one backend are seen by another one on
+ *    the same dir, as with two processes;
+ *  - a pack left unsealed by a crashed process, with a torn record at
+ *    its end, is sealed when the dir is opened again.
+ *
+ * Each test uses its own pack dir under <dir>.
+ *
+ * Usage: test-obj-backend-pack <dir>
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "utils.h"
+#include "obj-backend.h"
+
+extern ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gboolean auto_repack);
+
+extern int
+obj_backend_pack_seal (ObjBackend *bend);
+
+extern int
+obj_backend_pack_repack (ObjBackend *bend, int min_packs);
+
+#define N_OBJECTS 1000
+
+static char *test_dir;
+static int n_failed;
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "%s:%d: check failed: %s\n",               \
+                     __FILE__, __LINE__, #cond);                        \
+            ++n_failed;                                                 \
+        }                                                               \
+    } while (0)
+
+static void
+make_id (int n, char *id)
+{
+    unsigned char raw[20];
+    int i;
+
+    for (i = 0; i < 20; ++i)
+        raw[i] = (unsigned char)(n * 37 + i * 101);
+    raw[16] = (n >> 24) & 0xFF;
+    raw[17] = (n >> 16) & 0xFF;
+    raw[18] = (n >> 8) & 0xFF;
+    raw[19] = n & 0xFF;
+    rawdata_to_hex (raw, id, 20);
+}
+
+/* Object @n is (n * 7) % 5000 bytes long, so there are empty objects too. */
+static int
+make_data (int n, char *buf)
+{
+    int len = (n * 7) % 5000, i;
+
+    for (i = 0; i < len; ++i)
+        buf[i] = (char)(n + i);
+    return len;
+}
+
+static char *
+new_pack_dir (const char *name)
+{
+    char *cmd, *dir = g_build_filename (test_dir, name, NULL);
+
+    cmd = g_strdup_printf ("rm -rf %s", dir);
+    if (system (cmd) != 0)
+        fprintf (stderr, "Failed to remove %s.\n", dir);
+    g_free (cmd);
+
+    return dir;
+}
+
+static void
+write_obj (ObjBackend *bend, int n)
+{
+    char id[41], buf[5000];
+    int len;
+
+    make_id (n, id);
+    len = make_data (n, buf);
+    check (bend->write (bend, id, buf, len) == 0);
+}
+
+static void
+delete_obj (ObjBackend *bend, int n)
+{
+    char id[41];
+
+    make_id (n, id);
+    bend->delete (bend, id);
+}
+
+/* Check that object @n exists with the right content, or is gone. */
+static gboolean
+obj_ok (ObjBackend *bend, int n, gboolean exists)
+{
+    char id[41], buf[5000];
+    void *data;
+    int len, expected;
+    gboolean ret;
+
+    make_id (n, id);
+
+    if (!exists)
+        return (!bend->exists (bend, id) &&
+                bend->read (bend, id, &data, &len) < 0);
+
+    expected = make_data (n, buf);
+    if (!bend->exists (bend, id) || bend->read (bend, id, &data, &len) < 0)
+        return FALSE;
+    ret = (len == expected && memcmp (data, buf, len) == 0);
+    g_free (data);
+
+    return ret;
+}
+
+static void
+test_round_trip ()
+{
+    char *dir = new_pack_dir ("round-trip");
+    ObjBackend *bend, *bend2;
+    char ids[N_OBJECTS][41];
+    const char *id_ptrs[N_OBJECTS];
+    gboolean exists[N_OBJECTS];
+    int i, n_exist = 0;
+
+    bend = obj_backend_pack_new (dir, FALSE);
+    check (bend != NULL);
+    if (!bend)
+        goto out;
+
+    for (i = 0; i < N_OBJECTS; ++i)
+        write_obj (bend, i);
+    /* Writing an object again is a no-op. */
+    write_obj (bend, 0);
+
+    for (i = 0; i < N_OBJECTS; ++i)
+        check (obj_ok (bend, i, TRUE));
+    check (obj_ok (bend, N_OBJECTS, FALSE));
+
+    check (obj_backend_pack_seal (bend) == 0);
+    for (i = 0; i < N_OBJECTS; ++i)
+        check (obj_ok (bend, i, TRUE));
+
+    /* Half of the ids don't exist. */
+    for (i = 0; i < N_OBJECTS; ++i) {
+        make_id (i + (i % 2) * N_OBJECTS, ids[i]);
+        id_ptrs[i] = ids[i];
+    }
+    bend->exists_many (bend, id_ptrs, N_OBJECTS, exists);
+    for (i = 0; i < N_OBJECTS; ++i) {
+        check (exists[i] == !(i % 2));
+        if (exists[i])
+            ++n_exist;
+    }
+    check (n_exist == N_OBJECTS / 2);
+
+    bend2 = obj_backend_pack_new (dir, FALSE);
+    check (bend2 != NULL);
+    for (i = 0; bend2 && i < N_OBJECTS; ++i)
+        check (obj_ok (bend2, i, TRUE));
+
+out:
+    g_free (dir);
+}
+
+static void
+test_delete ()
+{
+    char *dir = new_pack_dir ("delete");
+    ObjBackend *bend, *bend2;
+    int i;
+
+    bend = obj_backend_pack_new (dir, FALSE);
+    check (bend != NULL);
+    if (!bend)
+        goto out;
+
+    for (i = 0; i < 100; ++i)
+        write_obj (bend, i);
+    check (obj_backend_pack_seal (bend) == 0);
+
+    /* Delete from a sealed pack and from the active pack. */
+    for (i = 100; i < 200; ++i)
+        write_obj (bend, i);
+    for (i = 0; i < 200; i += 2)
+        delete_obj (bend, i);
+    for (i = 0; i < 200; ++i)
+        check (obj_ok (bend, i, i % 2));
+
+    /* Deleting twice, or a missing object, is a no-op. */
+    delete_obj (bend, 0);
+    delete_obj (bend, 1000);
+
+    /* Deleted objects can be written again. */
+    write_obj (bend, 0);
+    check (obj_ok (bend, 0, TRUE));
+    delete_obj (bend, 0);
+    check (obj_ok (bend, 0, FALSE));
+
+    check (obj_backend_pack_seal (bend) == 0);
+
+    bend2 = obj_backend_pack_new (dir, FALSE);
+    check (bend2 != NULL);
+    for (i = 0; bend2 && i < 200; ++i)
+        check (obj_ok (bend2, i, i % 2));
+
+out:
+    g_free (dir);
+}
+
+/*
+ * Object 0 is deleted in the active pack of @a, which was created before
+ * the packs sealed and merged by @b.
+ */
+static void
+test_delete_then_seal ()
+{
+    char *dir = new_pack_dir ("delete-then-seal");
+    ObjBackend *a, *b, *c;
+
+    a = obj_backend_pack_new (dir, FALSE);
+    b = obj_backend_pack_new (dir, FALSE);
+    check (a != NULL && b != NULL);
+    if (!a || !b)
+        goto out;
+
+    write_obj (a, 0);
+    check (obj_backend_pack_seal (a) == 0);
+    delete_obj (a, 0);
+
+    write_obj (b, 1);
+    check (obj_backend_pack_seal (b) == 0);
+    check (obj_ok (b, 0, FALSE));
+
+    /* The record of object 0 is merged into a newer pack. */
+    check (obj_backend_pack_repack (b, 2) == 0);
+    check (obj_ok (a, 0, FALSE));
+    check (obj_ok (b, 0, FALSE));
+    c = obj_backend_pack_new (dir, FALSE);
+    check (c && obj_ok (c, 0, FALSE));
+
+    /* The tombstone is sealed after the pack with object 0. */
+    check (obj_backend_pack_seal (a) == 0);
+    check (obj_ok (a, 0, FALSE));
+    check (obj_ok (b, 0, FALSE));
+    c = obj_backend_pack_new (dir, FALSE);
+    check (c && obj_ok (c, 0, FALSE));
+
+    /* Now both are merged and dropped. */
+    check (obj_backend_pack_repack (b, 2) == 0);
+    c = obj_backend_pack_new (dir, FALSE);
+    check (c && obj_ok (c, 0, FALSE));
+    check (c && obj_ok (c, 1, TRUE));
+
+    /* And it can be written again. */
+    if (c)
+        write_obj (c, 0);
+    check (obj_ok (a, 0, TRUE));
+    check (c && obj_backend_pack_seal (c) == 0);
+    c = obj_backend_pack_new (dir, FALSE);
+    check (c && obj_ok (c, 0, TRUE));
+
+out:
+    g_free (dir);
+}
+
+static void
+test_repack ()
+{
+    char *dir = new_pack_dir ("repack");
+    ObjBackend *bend, *bend2;
+    int i;
+
+    bend = obj_backend_pack_new (dir, FALSE);
+    check (bend != NULL);
+    if (!bend)
+        goto out;
+
+    /* Several packs, with objects written and deleted in different ones. */
+    for (i = 0; i < N_OBJECTS; ++i) {
+        write_obj (bend, i);
+        if (i % 3 == 0 && i >= 100)
+            delete_obj (bend, i - 100);
+        if (i % 100 == 99)
+            check (obj_backend_pack_seal (bend) == 0);
+    }
+    check (obj_backend_pack_seal (bend) == 0);
+
+    check (obj_backend_pack_repack (bend, 2) == 0);
+    for (i = 0; i < N_OBJECTS; ++i)
+        check (obj_ok (bend, i, !(i < N_OBJECTS - 100 && (i + 100) % 3 == 0)));
+
+    bend2 = obj_backend_pack_new (dir, FALSE);
+    check (bend2 != NULL);
+    for (i = 0; bend2 && i < N_OBJECTS; ++i)
+        check (obj_ok (bend2, i, !(i < N_OBJECTS - 100 && (i + 100) % 3 == 0)));
+
+    /* Nothing left to merge. */
+    check (obj_backend_pack_repack (bend, 2) == 0);
+    for (i = 0; i < N_OBJECTS; ++i)
+        check (obj_ok (bend, i, !(i < N_OBJECTS - 100 && (i + 100) % 3 == 0)));
+
+out:
+    g_free (dir);
+}
+
+static void
+test_shared_dir ()
+{
+    char *dir = new_pack_dir ("shared");
+    ObjBackend *a, *b, *c;
+    int i;
+
+    a = obj_backend_pack_new (dir, FALSE);
+    b = obj_backend_pack_new (dir, FALSE);
+    check (a != NULL && b != NULL);
+    if (!a || !b)
+        goto out;
+
+    for (i = 0; i < 100; ++i) {
+        write_obj ((i % 2) ? a : b, i);
+        check (obj_ok ((i % 2) ? b : a, i, TRUE));
+    }
+
+    check (obj_backend_pack_seal (a) == 0);
+    for (i = 0; i < 100; ++i)
+        check (obj_ok (b, i, TRUE));
+
+    /* Deletes are seen by backends opened later. Others may still read
+     * the object until their packs are refreshed.
+     */
+    delete_obj (b, 1);
+    check (obj_ok (b, 1, FALSE));
+    c = obj_backend_pack_new (dir, FALSE);
+    check (c && obj_ok (c, 1, FALSE));
+
+out:
+    g_free (dir);
+}
+
+static void
+test_crashed_writer ()
+{
+    char *dir = new_pack_dir ("crash");
+    char *path, garbage[20];
+    ObjBackend *bend;
+    GDir *d;
+    const char *name;
+    pid_t pid;
+    int status, fd, i;
+
+    pid = fork ();
+    if (pid == 0) {
+        n_failed = 0;
+        bend = obj_backend_pack_new (dir, FALSE);
+        if (!bend)
+            _exit (1);
+        for (i = 0; i < 100; ++i)
+            write_obj (bend, i);
+        _exit (n_failed > 0);
+    }
+    check (pid > 0 && waitpid (pid, &status, 0) == pid &&
+           WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+    /* Part of a record left at the end of the pack. */
+    memset (garbage, 0x5a, sizeof(garbage));
+    d = g_dir_open (dir, 0, NULL);
+    check (d != NULL);
+    while (d && (name = g_dir_read_name (d)) != NULL) {
+        if (!g_str_has_suffix (name, ".pack"))
+            continue;
+        path = g_build_filename (dir, name, NULL);
+        fd = g_open (path, O_WRONLY | O_APPEND | O_BINARY, 0);
+        check (fd >= 0 && writen (fd, garbage, sizeof(garbage)) == sizeof(garbage));
+        close (fd);
+        g_free (path);
+    }
+    if (d)
+        g_dir_close (d);
+
+    bend = obj_backend_pack_new (dir, FALSE);
+    check (bend != NULL);
+    for (i = 0; bend && i < 100; ++i)
+        check (obj_ok (bend, i, TRUE));
+
+    /* The orphan pack was sealed, objects are added to a new one. */
+    if (bend) {
+        write_obj (bend, 100);
+        check (obj_ok (bend, 100, TRUE));
+    }
+
+    g_free (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf (stderr, "%s <dir>\n", argv[0]);
+        exit (-1);
+    }
+    test_dir = argv[1];
+
+    if (g_mkdir_with_parents (test_dir, 0777) < 0) {
+        fprintf (stderr, "Failed to create %s.\n", test_dir);
+        exit (-1);
+    }
+
+    test_round_trip ();
+    test_delete ();
+    test_delete_then_seal ();
+    test_repack ();
+    test_shared_dir ();
+    test_crashed_writer ();
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d checks failed.\n", n_failed);
+        return 1;
+    }
+
+    printf ("Pack object backend OK.\n");
+    return 0;
+}
@@ -0,0 +1,154 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Tests of the json file lists that httpserver passes to
+ * seafile_post_multi_files_by_id() and that post_multi_files() in
+ * server/repo-op.c decodes, with string_list_to_json() and
+ * json_to_string_list() from lib/utils.c:
+ *
+ *  - several files posted through file_ids_json are decoded with each
+ *    name paired with its own id, the way add_new_entries() walks the
+ *    two lists;
+ *  - the order of the lists is kept, so the names and ids decoded from
+ *    two separate arrays stay aligned;
+ *  - names that need escaping survive the round trip;
+ *  - invalid json gives an empty list.
+ *
+ * Usage: test-post-files-json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "utils.h"
+
+#define N_FILES 10
+
+static int n_failed;
+
+#define check(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "%s:%d: check failed: %s\n",               \
+                     __FILE__, __LINE__, #cond);                        \
+            ++n_failed;                                                 \
+        }                                                               \
+    } while (0)
+
+static char *
+make_name (int n)
+{
+    /* Quotes, backslashes and non-ascii to exercise the escaping. */
+    return g_strdup_printf ("file \"%d\"\\\xc3\xa9.txt", n);
+}
+
+static char *
+make_id (int n)
+{
+    char *name = make_name (n);
+    char *id = g_compute_checksum_for_string (G_CHECKSUM_SHA1, name, -1);
+
+    g_free (name);
+    return id;
+}
+
+static void
+test_pairing ()
+{
+    GList *names = NULL, *ids = NULL, *ptr1, *ptr2;
+    char *names_json, *ids_json, *name, *id;
+    GHashTable *expected;
+    int i, n_pairs = 0;
+
+    expected = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    /* Built the way upload-file.c collects uploaded files. */
+    for (i = 0; i < N_FILES; ++i) {
+        name = make_name (i);
+        id = make_id (i);
+        names = g_list_prepend (names, g_strdup (name));
+        ids = g_list_prepend (ids, g_strdup (id));
+        g_hash_table_insert (expected, name, id);
+    }
+
+    names_json = string_list_to_json (names);
+    ids_json = string_list_to_json (ids);
+    string_list_free (names);
+    string_list_free (ids);
+
+    /* Decoded the way post_multi_files() does for file_ids_json. */
+    names = json_to_string_list (names_json);
+    ids = json_to_string_list (ids_json);
+
+    check (g_list_length (names) == N_FILES);
+    check (g_list_length (ids) == N_FILES);
+
+    for (ptr1 = names, ptr2 = ids; ptr1 && ptr2;
+         ptr1 = ptr1->next, ptr2 = ptr2->next) {
+        id = g_hash_table_lookup (expected, ptr1->data);
+        check (id != NULL);
+        if (id)
+            check (strcmp (id, ptr2->data) == 0);
+        ++n_pairs;
+    }
+    check (n_pairs == N_FILES);
+
+    string_list_free (names);
+    string_list_free (ids);
+    g_free (names_json);
+    g_free (ids_json);
+    g_hash_table_destroy (expected);
+}
+
+static void
+test_order ()
+{
+    GList *list = NULL, *decoded, *ptr;
+    char *json;
+    int i;
+
+    for (i = 0; i < N_FILES; ++i)
+        list = g_list_append (list, g_strdup_printf ("%d", i));
+
+    json = string_list_to_json (list);
+    decoded = json_to_string_list (json);
+
+    check (g_list_length (decoded) == N_FILES);
+    for (ptr = decoded, i = 0; ptr; ptr = ptr->next, ++i)
+        check (atoi (ptr->data) == i);
+
+    string_list_free (list);
+    string_list_free (decoded);
+    g_free (json);
+}
+
+static void
+test_invalid ()
+{
+    check (json_to_string_list ("") == NULL);
+    check (json_to_string_list ("[\"a\", ") == NULL);
+    check (json_to_string_list ("{\"a\": \"b\"}") == NULL);
+    check (json_to_string_list ("[]") == NULL);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_type_init ();
+
+    test_pairing ();
+    test_order ();
+    test_invalid ();
+
+    if (n_failed > 0) {
+        fprintf (stderr, "%d checks failed.\n", n_failed);
+        return 1;
+    }
+
+    printf ("Post files json OK.\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copy objects stored one file per object (<obj_dir>/xx/yyyy...) into
+ * a pack object dir, which can then be used with "name = pack" in the
+ * [commit_object_backend] or [fs_object_backend] section of seafile.conf.
+ *
+ * The source dir is not modified. It can be removed after the config
+ * is switched to the pack dir.
+ */
+
+#include "common.h"
+
+#include <getopt.h>
+
+#include "utils.h"
+#include "obj-backend.h"
+
+extern ObjBackend *
+obj_backend_pack_new (const char *pack_dir, gboolean auto_repack);
+
+extern int
+obj_backend_pack_seal (ObjBackend *bend);
+
+extern int
+obj_backend_pack_repack (ObjBackend *bend, int min_packs);
+
+static const char *short_opts = "hrs:d:";
+static const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "repack", no_argument, NULL, 'r' },
+    { "src", required_argument, NULL, 's' },
+    { "dest", required_argument, NULL, 'd' },
+    { 0, 0, 0, 0 },
+};
+
+static void
+usage ()
+{
+    fprintf (stderr,
+             "usage: seaf-migrate-objects [-r] [-s <object dir>] -d <pack dir>\n"
+             "  -s, --src     object dir in the old layout\n"
+             "  -d, --dest    pack dir to write objects to\n"
+             "  -r, --repack  merge all packs in the pack dir into one\n");
+}
+
+static int
+migrate_objects (const char *src_dir, ObjBackend *bend)
+{
+    GDir *dir1, *dir2;
+    const char *dname1, *dname2;
+    char obj_id[41];
+    char *path, *sub_dir;
+    char *data;
+    gsize len;
+    guint64 n_objects = 0, n_failed = 0;
+    GError *error = NULL;
+
+    dir1 = g_dir_open (src_dir, 0, &error);
+    if (!dir1) {
+        fprintf (stderr, "Failed to open %s: %s.\n", src_dir, error->message);
+        g_clear_error (&error);
+        return -1;
+    }
+
+    while ((dname1 = g_dir_read_name (dir1)) != NULL) {
+        if (strlen (dname1) != 2)
+            continue;
+
+        sub_dir = g_build_filename (src_dir, dname1, NULL);
+        dir2 = g_dir_open (sub_dir, 0, NULL);
+        if (!dir2) {
+            g_free (sub_dir);
+            continue;
+        }
+
+        while ((dname2 = g_dir_read_name (dir2)) != NULL) {
+            if (strlen (dname2) != 38)
+                continue;
+            snprintf (obj_id, sizeof(obj_id), "%s%s", dname1, dname2);
+
+            path = g_build_filename (sub_dir, dname2, NULL);
+            if (!g_file_get_contents (path, &data, &len, &error)) {
+                fprintf (stderr, "Failed to read %s: %s.\n", path, error->message);
+                g_clear_error (&error);
+                g_free (path);
+                ++n_failed;
+                continue;
+            }
+            g_free (path);
+
+            if (bend->write (bend, obj_id, data, (int)len) < 0) {
+                fprintf (stderr, "Failed to write object %s.\n", obj_id);
+                ++n_failed;
+            } else {
+                ++n_objects;
+            }
+            g_free (data);
+
+            if (n_objects % 100000 == 0 && n_objects > 0)
+                printf ("%"G_GUINT64_FORMAT" objects copied.\n", n_objects);
+        }
+
+        g_dir_close (dir2);
+        g_free (sub_dir);
+    }
+    g_dir_close (dir1);
+
+    printf ("%"G_GUINT64_FORMAT" objects copied, %"G_GUINT64_FORMAT" failed.\n",
+            n_objects, n_failed);
+
+    return (n_failed == 0) ? 0 : -1;
+}
+
+int
+main (int argc, char **argv)
+{
+    char *src_dir = NULL, *pack_dir = NULL;
+    gboolean repack = FALSE;
+    ObjBackend *bend;
+    int c, ret = 0;
+
+    while ((c = getopt_long (argc, argv, short_opts,
+                             long_opts, NULL)) != EOF) {
+        switch (c) {
+        case 'h':
+            usage ();
+            exit (0);
+        case 'r':
+            repack = TRUE;
+            break;
+        case 's':
+            src_dir = optarg;
+            break;
+        case 'd':
+            pack_dir = optarg;
+            break;
+        default:
+            usage ();
+            exit (1);
+        }
+    }
+
+    if (!pack_dir || (!src_dir && !repack)) {
+        usage ();
+        exit (1);
+    }
+
+    bend = obj_backend_pack_new (pack_dir, FALSE);
+    if (!bend) {
+        fprintf (stderr, "Failed to open pack dir %s.\n", pack_dir);
+        exit (1);
+    }
+
+    if (src_dir && migrate_objects (src_dir, bend) < 0)
+        ret = 1;
+
+    if (obj_backend_pack_seal (bend) < 0) {
+        fprintf (stderr, "Failed to seal pack.\n");
+        ret = 1;
+    }
+
+    if (repack && obj_backend_pack_repack (bend, 2) < 0) {
+        fprintf (stderr, "Failed to repack.\n");
+        ret = 1;
+    }
+
+    return ret;
+}